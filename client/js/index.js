@@ -1,7 +1,34 @@
 /*
  * Create worker thread for server communication.
  */
-const serverCommunicationWorker = new Worker('./js/ws.worker.js');
+const serverCommunicationWorker = new Worker('./js/ws.worker.js?v=1.0.9');
+
+/*
+ * Alarm register checkbox IDs, LSB first.
+ */
+const alarmFields = [
+  'checkAlarmCapUv',
+  'checkAlarmCapOv',
+  'checkAlarmGpiUv',
+  'checkAlarmGpiOv',
+  'checkAlarmVinUv',
+  'checkAlarmVinOv',
+  'checkAlarmVcapUv',
+  'checkAlarmVcapOv',
+  'checkAlarmVoutUv',
+  'checkAlarmVoutOv',
+  'checkAlarmInputOc',
+  'checkAlarmChargeUc',
+  'checkAlarmDieCold',
+  'checkAlarmDieHot',
+  'checkAlarmEsrHigh',
+  'checkAlarmCapLow'
+];
+
+/*
+ * Rules reported active by the server, by name.
+ */
+const activeRules = new Set();
 
 /*
  * Get uptime string from seconds.
@@ -17,6 +44,29 @@ function uptimeString(seconds) {
   return `${days} Days, ${zeroPad(hours, 2)}:${zeroPad(minutes, 2)}`;
 }
 
+/*
+ * Update alarm indication
+ */
+function UpdateAlarms(alarmStatus) {
+  alarmFields.forEach((id, bit) => {
+    document.getElementById(id).checked = alarmStatus & (1 << bit);
+  });
+}
+
+/*
+ * Update rule indication, the list shows the rules currently active.
+ */
+function UpdateRule(rule) {
+  if (rule.active) {
+    activeRules.add(rule.name);
+  } else {
+    activeRules.delete(rule.name);
+  }
+  document.getElementById('fieldRuleLast').innerText = `${rule.name} ${rule.active ? 'active' : 'cleared'} at ${new Date().toLocaleTimeString()}`;
+  const list = document.getElementById('fieldRulesActive');
+  list.innerText = activeRules.size > 0 ? [...activeRules].join(', ') : 'none';
+}
+
 /*
  * Update user interface
  */
@@ -24,10 +74,12 @@ function UpdateGui(upsStatus) {
   document.getElementById('fieldPowerFailCount').value = upsStatus.powerFailCount.toFixed(0);
   document.getElementById('fieldInputVoltage').value = upsStatus.inputVoltage.toFixed(1);
   document.getElementById('fieldInputCurrent').value = (upsStatus.inputCurrent / 1000).toFixed(3);
-  document.getElementById('fieldInputPower').value = (upsStatus.inputVoltage * (upsStatus.inputCurrent / 1000)).toFixed(1);
+  document.getElementById('fieldInputPower').value = upsStatus.inputPower.toFixed(1);
   document.getElementById('fieldOutputVoltage').value = upsStatus.outputVoltage.toFixed(1);
   document.getElementById('fieldOutputCurrent').value = (upsStatus.outputCurrent / 1000).toFixed(3);
-  document.getElementById('fieldOutputPower').value = (upsStatus.outputVoltage * (upsStatus.outputCurrent / 1000)).toFixed(1);
+  document.getElementById('fieldOutputPower').value = upsStatus.outputPower.toFixed(1);
+  document.getElementById('fieldOutputPowerWindow').innerText =
+    `${upsStatus.outputPowerMin.toFixed(1)} / ${upsStatus.outputPowerAvg.toFixed(1)} / ${upsStatus.outputPowerMax.toFixed(1)} W`;
   document.getElementById('fieldOutputLoad').value = upsStatus.outputLoad;
   document.getElementById('fieldBatteryVoltage').value = upsStatus.batteryVoltage.toFixed(1);
   document.getElementById('fieldBatteryCurrent').value = (upsStatus.batteryCurrent / 1000).toFixed(3);
@@ -37,6 +89,7 @@ function UpdateGui(upsStatus) {
   document.getElementById('fieldCell4Voltage').value = upsStatus.vcap4Voltage.toFixed(1);
   document.getElementById('fieldCapacity').value = (upsStatus.capacity / 1000).toFixed(1);
   document.getElementById('fieldEsr').value = upsStatus.esr;
+  document.getElementById('fieldEndOfLife').innerHTML = upsStatus.endOfLife > 0 ? new Date(upsStatus.endOfLife * 1000).toLocaleDateString() : 'unknown';
   document.getElementById('fieldSoc').value = upsStatus.soc;
   document.getElementById('fieldBoardTemperature').value = upsStatus.ucTemperature;
   document.getElementById('checkDevCharging').checked = upsStatus.deviceStatus & 0x01;
@@ -69,7 +122,14 @@ function UpdateGui(upsStatus) {
   document.getElementById('checkEsrMeasurementFail').checked = upsStatus.monitorStatus & 0x40;
   document.getElementById('checkChargerDisabled').checked = upsStatus.monitorStatus & 0x100;
   document.getElementById('checkChargerEnabled').checked = upsStatus.monitorStatus & 0x200;
+  document.getElementById('fieldInputEnergy').value = upsStatus.inputEnergy.toFixed(3);
+  document.getElementById('fieldOutputEnergy').value = upsStatus.outputEnergy.toFixed(3);
+  document.getElementById('fieldChargeEnergy').value = upsStatus.chargeEnergy.toFixed(3);
+  document.getElementById('fieldDischargeEnergy').value = upsStatus.dischargeEnergy.toFixed(3);
+  document.getElementById('fieldOnBatteryTime').innerHTML = uptimeString(upsStatus.onBatteryTime);
   document.getElementById('fieldUptime').innerHTML = uptimeString(upsStatus.uptime);
+  UpdateAlarms(upsStatus.alarmStatus);
+  document.getElementById('fieldPollInterval').innerText = `${upsStatus.pollInterval} ms (${upsStatus.pollRate})`;
 
   if (upsStatus.remainTime > 0) {
     const date = new Date(0);
@@ -89,6 +149,69 @@ function UpdateGui(upsStatus) {
   }
 }
 
+/*
+ * Fill power event capture list, latest first.
+ */
+function UpdateCaptureList(names) {
+  const select = document.getElementById('selectCapture');
+  select.innerHTML = '';
+  names.reverse().forEach((name) => {
+    const option = document.createElement('option');
+    option.value = name;
+    option.text = name.substring(8, 23);
+    select.add(option);
+  });
+}
+
+/*
+ * Plot a power event capture, voltages over time relative to the trigger.
+ */
+function DrawCapture(capture) {
+  const canvas = document.getElementById('canvasCapture');
+  const ctx = canvas.getContext('2d');
+  const series = [
+    { key: 'inputVoltage', color: '#0d6efd' },
+    { key: 'outputVoltage', color: '#198754' },
+    { key: 'batteryVoltage', color: '#dc3545' },
+    { key: 'vcap1Voltage', color: '#6c757d' },
+    { key: 'vcap2Voltage', color: '#6c757d' },
+    { key: 'vcap3Voltage', color: '#6c757d' },
+    { key: 'vcap4Voltage', color: '#6c757d' }
+  ];
+  canvas.width = canvas.clientWidth;
+  ctx.clearRect(0, 0, canvas.width, canvas.height);
+  const t = capture.time;
+  if (t.length < 2) {
+    return;
+  }
+  let vmax = 0;
+  series.forEach((s) => {
+    vmax = Math.max(vmax, ...capture[s.key]);
+  });
+  const x = (v) => ((v - t[0]) / (t[t.length - 1] - t[0])) * canvas.width;
+  const y = (v) => canvas.height - (v / (vmax * 1.1)) * canvas.height;
+  // Trigger time
+  ctx.strokeStyle = '#ffc107';
+  ctx.beginPath();
+  ctx.moveTo(x(0), 0);
+  ctx.lineTo(x(0), canvas.height);
+  ctx.stroke();
+  series.forEach((s) => {
+    ctx.strokeStyle = s.color;
+    ctx.beginPath();
+    capture[s.key].forEach((v, i) => {
+      if (i === 0) {
+        ctx.moveTo(x(t[i]), y(v));
+      } else {
+        ctx.lineTo(x(t[i]), y(v));
+      }
+    });
+    ctx.stroke();
+  });
+  document.getElementById('fieldCaptureRange').innerText =
+    `${(t[0] / 1000).toFixed(1)} s .. ${(t[t.length - 1] / 1000).toFixed(1)} s, max ${(vmax / 1000).toFixed(2)} V`;
+}
+
 /*
  * Start application as soon as DOM is fully loaded
  */
@@ -98,6 +221,7 @@ document.addEventListener('DOMContentLoaded', () => {
     switch (msg.cmd) {
       case 'connected':
         document.getElementById('connectionSpinner').classList.add('d-none');
+        serverCommunicationWorker.postMessage({ cmd: 'captures', data: null });
         break;
       case 'disconnected':
         document.getElementById('connectionSpinner').classList.remove('d-none');
@@ -105,6 +229,24 @@ document.addEventListener('DOMContentLoaded', () => {
       case 'data':
         UpdateGui(msg.data);
         break;
+      case 'alarm':
+        UpdateAlarms(msg.data.status);
+        break;
+      case 'rule':
+        UpdateRule(msg.data);
+        break;
+      case 'reply':
+        if (msg.data.error !== undefined) {
+          console.warn(`Request ${msg.data.id} failed: ${msg.data.error}`);
+        } else if (msg.request === 'captures') {
+          UpdateCaptureList(msg.data.result);
+        } else if (msg.request === 'capture') {
+          DrawCapture(msg.data.result);
+        }
+        break;
+      case 'captured':
+        serverCommunicationWorker.postMessage({ cmd: 'captures', data: null });
+        break;
       default:
         console.error(`Unknown command: ${msg.cmd}`);
     }
@@ -124,4 +266,21 @@ document.addEventListener('DOMContentLoaded', () => {
       data: null
     });
   });
+
+  document.getElementById('buttonShowCapture').addEventListener('click', () => {
+    const name = document.getElementById('selectCapture').value;
+    if (name !== '') {
+      serverCommunicationWorker.postMessage({
+        cmd: 'capture',
+        data: { name: name }
+      });
+    }
+  });
+
+  document.getElementById('buttonClearAlarms').addEventListener('click', () => {
+    serverCommunicationWorker.postMessage({
+      cmd: 'clearalarms',
+      data: null
+    });
+  });
 });
@@ -2,6 +2,14 @@
  * Websocket for server communication.
  */
 let socket = null;
+let requestId = 0;
+const pendingRequests = new Map();
+// Last status update seen, the server replays missed updates on reconnect
+let lastEpoch = null;
+let lastSeq = null;
+let retries = 0;
+const RECONNECT_MIN_MS = 1000;
+const RECONNECT_MAX_MS = 30000;
 
 const connection = navigator.connection || navigator.mozConnection || null;
 if (connection === null) {
@@ -14,22 +22,44 @@ if (connection === null) {
 function connect() {
   console.info(`Location hostname: ${location.hostname}`);
 
-  socket = new WebSocket(`ws://${location.hostname}:10024`, 'broadcast');
+  const resume = lastSeq !== null ? `/?epoch=${lastEpoch}&since=${lastSeq}` : '';
+  socket = new WebSocket(`ws://${location.hostname}:10024${resume}`, 'broadcast');
   socket.binaryType = 'arraybuffer';
   socket.onmessage = (e) => {
     const msg = JSON.parse(e.data);
     if (msg !== null && typeof msg === 'object') {
-      self.postMessage({ cmd: 'data', data: msg });
+      if (msg.id !== undefined) {
+        // Reply to one of our requests
+        const request = pendingRequests.get(msg.id);
+        pendingRequests.delete(msg.id);
+        self.postMessage({ cmd: 'reply', request: request, data: msg });
+      } else if (msg.capture !== undefined) {
+        self.postMessage({ cmd: 'captured', data: msg.capture });
+      } else if (msg.alarm !== undefined) {
+        self.postMessage({ cmd: 'alarm', data: msg.alarm });
+      } else if (msg.rule !== undefined) {
+        self.postMessage({ cmd: 'rule', data: msg.rule });
+      } else {
+        if (typeof msg.seq === 'number') {
+          lastEpoch = msg.epoch;
+          lastSeq = msg.seq;
+        }
+        self.postMessage({ cmd: 'data', data: msg });
+      }
     }
   };
 
   socket.onclose = () => {
     console.warn('Connection closed.');
     socket = null;
+    pendingRequests.clear();
     self.postMessage({ cmd: 'disconnected', data: null });
+    // Exponential backoff with jitter, so clients do not reconnect all at once after a restart
+    const delay = Math.min(RECONNECT_MAX_MS, RECONNECT_MIN_MS * 2 ** retries);
+    retries = Math.min(retries + 1, 16);
     setTimeout(() => {
       connect();
-    }, 10000);
+    }, delay / 2 + Math.random() * delay / 2);
   };
 
   /*
@@ -37,6 +67,7 @@ function connect() {
    */
   socket.onopen = () => {
     console.info('Connected with websocket port');
+    retries = 0;
     self.postMessage({ cmd: 'connected', data: null });
   };
 }
@@ -48,8 +79,13 @@ self.onmessage = (e) => {
       connect();
       break;
     case 'capesr':
+    case 'clearalarms':
+    case 'captures':
+    case 'capture':
       if (socket !== null && socket.readyState === 1) {
-        socket.send(JSON.stringify({ cmd: msg.cmd }));
+        requestId += 1;
+        pendingRequests.set(requestId, msg.cmd);
+        socket.send(JSON.stringify(Object.assign({ id: requestId, cmd: msg.cmd }, msg.data)));
       }
       break;
     default:
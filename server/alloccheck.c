@@ -0,0 +1,113 @@
+// Part of UPS Server.
+// A websocket server reading data from a Bicker PSZ-1063 uExtension module
+// in combination with a Bicker UPS.
+//
+// Copyright (c) 2023 Michael Wolf <michael@mictronics.de>
+//
+// This file is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// any later version.
+//
+// This file is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifdef UPS_ALLOC_CHECK
+
+#include <libwebsockets.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include "alloccheck.h"
+
+// glibc allocator entry points, the public names are replaced below
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static __thread unsigned int depth = 0;
+static __thread unsigned long allocs = 0;
+static __thread unsigned long windows = 0;
+static __thread bool ignore = false;
+static __thread bool in_log = false; // Inside the log emitter, syslog formats on the heap
+
+void *malloc(size_t size)
+{
+    if (depth > 0 && !in_log)
+    {
+        allocs++;
+    }
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size)
+{
+    if (depth > 0 && !in_log)
+    {
+        allocs++;
+    }
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    if (depth > 0 && !in_log)
+    {
+        allocs++;
+    }
+    return __libc_realloc(ptr, size);
+}
+
+/**
+ * Open a checked window on the calling thread.
+ */
+void alloc_check_begin(void)
+{
+    if (depth++ == 0)
+    {
+        allocs = 0;
+        ignore = false;
+    }
+}
+
+/**
+ * Close a window, abort on allocations past the warmup.
+ */
+void alloc_check_end(const char *name)
+{
+    if (depth == 0 || --depth > 0)
+    {
+        return;
+    }
+    windows++;
+    if (allocs > 0 && !ignore && windows > ALLOC_CHECK_WARMUP)
+    {
+        lwsl_err("Allocation check: %lu allocations in steady state %s update.", allocs, name);
+        abort();
+    }
+}
+
+/**
+ * The current window is not steady state, e.g. the push collector is reconnected.
+ */
+void alloc_check_ignore(void)
+{
+    ignore = true;
+}
+
+/**
+ * Log emitter. Allocations of syslog itself are not counted, the rest of
+ * the window still is.
+ */
+void alloc_check_log(int level, const char *line)
+{
+    in_log = true;
+    lwsl_emit_syslog(level, line);
+    in_log = false;
+}
+
+#endif /* UPS_ALLOC_CHECK */
@@ -0,0 +1,49 @@
+// Part of UPS Server.
+// A websocket server reading data from a Bicker PSZ-1063 uExtension module
+// in combination with a Bicker UPS.
+//
+// Copyright (c) 2023 Michael Wolf <michael@mictronics.de>
+//
+// This file is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// any later version.
+//
+// This file is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef ALLOCCHECK_H
+#define ALLOCCHECK_H
+
+/**
+ * Debug check for heap allocations in the steady state update path.
+ * Built with -DUPS_ALLOC_CHECK ("make alloccheck"), compiled out otherwise.
+ *
+ * malloc, calloc and realloc are counted while a window opened by
+ * alloc_check_begin() is active on the calling thread. Windows may nest,
+ * the outermost alloc_check_end() checks the count. After a warmup any
+ * allocation aborts the server with the window name logged. Allocations
+ * made by syslog while a line is logged are not counted. Windows marked
+ * with alloc_check_ignore(), e.g. reconnecting a collector, are skipped.
+ */
+#ifdef UPS_ALLOC_CHECK
+#define ALLOC_CHECK_WARMUP 16 // Windows per thread allowed to allocate, first use of libc and library state
+
+void alloc_check_begin(void);
+void alloc_check_end(const char *name);
+void alloc_check_ignore(void);
+void alloc_check_log(int level, const char *line);
+#define ALLOC_CHECK_LOG_EMIT alloc_check_log
+#else
+#define alloc_check_begin() ((void)0)
+#define alloc_check_end(name) ((void)(name))
+#define alloc_check_ignore() ((void)0)
+#define ALLOC_CHECK_LOG_EMIT lwsl_emit_syslog
+#endif
+
+#endif /* ALLOCCHECK_H */
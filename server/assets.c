@@ -0,0 +1,415 @@
+// Part of UPS Server.
+// A websocket server reading data from a Bicker PSZ-1063 uExtension module
+// in combination with a Bicker UPS.
+//
+// Copyright (c) 2023 Michael Wolf <michael@mictronics.de>
+//
+// This file is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// any later version.
+//
+// This file is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <libwebsockets.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include <brotli/encode.h>
+#include "assets.h"
+
+#define ASSET_FILE_MAX (4 * 1024 * 1024) // Byte, refuse to cache larger files
+
+static asset_t assets[ASSET_MAX_COUNT];
+static int asset_count = 0;
+
+/**
+ * Known file extensions and their mime type.
+ * Text types are compressed, binary types like images are served as they are.
+ */
+static const struct
+{
+    const char *ext;
+    const char *mime;
+    int compress;
+} mime_types[] = {
+    {".html", "text/html", 1},
+    {".css", "text/css", 1},
+    {".js", "application/javascript", 1},
+    {".json", "application/json", 1},
+    {".svg", "image/svg+xml", 1},
+    {".png", "image/png", 0},
+    {".ico", "image/x-icon", 0},
+    {NULL, "application/octet-stream", 0},
+};
+
+/**
+ * Get mime type index from file name extension.
+ */
+static int get_mime_index(const char *name)
+{
+    const char *ext = strrchr(name, '.');
+    int i = 0;
+    for (; mime_types[i].ext != NULL; i++)
+    {
+        if (ext != NULL && strcasecmp(ext, mime_types[i].ext) == 0)
+        {
+            break;
+        }
+    }
+    return i;
+}
+
+/**
+ * 64 bit FNV-1a hash of the file content used for the strong ETag.
+ */
+static unsigned long long hash_content(const unsigned char *data, size_t len)
+{
+    unsigned long long h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++)
+    {
+        h ^= data[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+/**
+ * Compress with gzip framing so the result is a valid "Content-Encoding: gzip" body.
+ */
+static int compress_gzip(const unsigned char *in, size_t len, asset_variant_t *out)
+{
+    z_stream strm;
+    memset(&strm, 0, sizeof strm);
+    // 15 window bits + 16 selects gzip header instead of zlib
+    if (deflateInit2(&strm, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+        return EXIT_FAILURE;
+    }
+    size_t size = deflateBound(&strm, len);
+    out->data = malloc(size);
+    if (out->data == NULL)
+    {
+        deflateEnd(&strm);
+        return EXIT_FAILURE;
+    }
+    strm.next_in = (unsigned char *)in;
+    strm.avail_in = len;
+    strm.next_out = out->data;
+    strm.avail_out = size;
+    if (deflate(&strm, Z_FINISH) != Z_STREAM_END)
+    {
+        deflateEnd(&strm);
+        free(out->data);
+        out->data = NULL;
+        return EXIT_FAILURE;
+    }
+    out->len = strm.total_out;
+    deflateEnd(&strm);
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Compress with brotli at maximum quality. Done once at startup, so speed is irrelevant.
+ */
+static int compress_brotli(const unsigned char *in, size_t len, asset_variant_t *out)
+{
+    size_t size = BrotliEncoderMaxCompressedSize(len);
+    if (size == 0)
+    {
+        return EXIT_FAILURE;
+    }
+    out->data = malloc(size);
+    if (out->data == NULL)
+    {
+        return EXIT_FAILURE;
+    }
+    if (!BrotliEncoderCompress(BROTLI_MAX_QUALITY, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT,
+                               len, in, &size, out->data))
+    {
+        free(out->data);
+        out->data = NULL;
+        return EXIT_FAILURE;
+    }
+    out->len = size;
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Drop a compressed variant that does not save any bytes.
+ */
+static void drop_if_larger(asset_variant_t *v, size_t identity_len)
+{
+    if (v->data != NULL && v->len >= identity_len)
+    {
+        free(v->data);
+        v->data = NULL;
+        v->len = 0;
+    }
+}
+
+/**
+ * Load a single file into the cache and create its compressed variants.
+ */
+static int load_file(const char *file, const char *path)
+{
+    if (asset_count >= ASSET_MAX_COUNT)
+    {
+        lwsl_warn("Asset cache full, skipping %s", file);
+        return EXIT_FAILURE;
+    }
+    if (strlen(path) >= ASSET_PATH_MAX)
+    {
+        lwsl_warn("Asset path too long, skipping %s", file);
+        return EXIT_FAILURE;
+    }
+
+    FILE *fp = fopen(file, "rb");
+    if (fp == NULL)
+    {
+        lwsl_err("Error opening asset %s: %s", file, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    struct stat st;
+    if (fstat(fileno(fp), &st) == -1 || st.st_size > ASSET_FILE_MAX)
+    {
+        lwsl_warn("Asset %s not cacheable", file);
+        fclose(fp);
+        return EXIT_FAILURE;
+    }
+
+    asset_t *a = &assets[asset_count];
+    memset(a, 0, sizeof(asset_t));
+    asset_variant_t *id = &a->variant[ASSET_ENC_IDENTITY];
+    id->len = (size_t)st.st_size;
+    id->data = malloc(id->len + 1);
+    if (id->data == NULL || fread(id->data, 1, id->len, fp) != id->len)
+    {
+        lwsl_err("Error reading asset %s", file);
+        free(id->data);
+        id->data = NULL;
+        fclose(fp);
+        return EXIT_FAILURE;
+    }
+    fclose(fp);
+
+    strcpy(a->path, path);
+    int m = get_mime_index(file);
+    a->mime = mime_types[m].mime;
+
+    if (mime_types[m].compress)
+    {
+        if (compress_gzip(id->data, id->len, &a->variant[ASSET_ENC_GZIP]) == EXIT_FAILURE)
+        {
+            lwsl_warn("Gzip compression of %s failed", file);
+        }
+        if (compress_brotli(id->data, id->len, &a->variant[ASSET_ENC_BROTLI]) == EXIT_FAILURE)
+        {
+            lwsl_warn("Brotli compression of %s failed", file);
+        }
+        drop_if_larger(&a->variant[ASSET_ENC_GZIP], id->len);
+        drop_if_larger(&a->variant[ASSET_ENC_BROTLI], id->len);
+    }
+
+    // Each representation needs its own strong ETag, the hash is taken from the original content.
+    unsigned long long h = hash_content(id->data, id->len);
+    snprintf(a->variant[ASSET_ENC_IDENTITY].etag, ASSET_ETAG_MAX, "\"%016llx\"", h);
+    snprintf(a->variant[ASSET_ENC_GZIP].etag, ASSET_ETAG_MAX, "\"%016llx-gz\"", h);
+    snprintf(a->variant[ASSET_ENC_BROTLI].etag, ASSET_ETAG_MAX, "\"%016llx-br\"", h);
+
+    asset_count++;
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Walk the client directory recursively.
+ */
+static void load_dir(const char *dir, const char *path, int depth)
+{
+    char file[PATH_MAX];
+    char sub[ASSET_PATH_MAX];
+    struct dirent *de;
+    struct stat st;
+
+    if (depth > 4)
+    {
+        return;
+    }
+    DIR *d = opendir(dir);
+    if (d == NULL)
+    {
+        lwsl_err("Error opening client directory %s: %s", dir, strerror(errno));
+        return;
+    }
+    while ((de = readdir(d)) != NULL)
+    {
+        if (de->d_name[0] == '.')
+        {
+            continue; // Skip hidden files, "." and ".."
+        }
+        snprintf(file, sizeof file, "%s/%s", dir, de->d_name);
+        snprintf(sub, sizeof sub, "%s/%s", path, de->d_name);
+        if (stat(file, &st) == -1)
+        {
+            continue;
+        }
+        if (S_ISDIR(st.st_mode))
+        {
+            load_dir(file, sub, depth + 1);
+        }
+        else if (S_ISREG(st.st_mode))
+        {
+            load_file(file, sub);
+        }
+    }
+    closedir(d);
+}
+
+/**
+ * Load all web client files below root into memory.
+ */
+int assets_load(const char *root)
+{
+    assets_free();
+    load_dir(root, "", 0);
+    if (asset_count == 0)
+    {
+        return EXIT_FAILURE;
+    }
+    size_t total = 0;
+    for (int i = 0; i < asset_count; i++)
+    {
+        for (int e = 0; e < ASSET_ENC_COUNT; e++)
+        {
+            total += assets[i].variant[e].len;
+        }
+    }
+    lwsl_notice("Cached %d client files, %zu bytes.", asset_count, total);
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Release all cached assets.
+ */
+void assets_free(void)
+{
+    for (int i = 0; i < asset_count; i++)
+    {
+        for (int e = 0; e < ASSET_ENC_COUNT; e++)
+        {
+            free(assets[i].variant[e].data);
+        }
+    }
+    memset(assets, 0, sizeof(assets));
+    asset_count = 0;
+}
+
+/**
+ * Find a cached asset by request path. A path ending with '/' maps to its index.html.
+ */
+const asset_t *assets_find(const char *path)
+{
+    char p[ASSET_PATH_MAX];
+    size_t len = strlen(path);
+    if (len == 0 || path[len - 1] == '/')
+    {
+        snprintf(p, sizeof p, "%.*sindex.html", (int)MIN(len, sizeof p - 12), path);
+        path = p;
+    }
+    for (int i = 0; i < asset_count; i++)
+    {
+        if (strcmp(assets[i].path, path) == 0)
+        {
+            return &assets[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Check if an Accept-Encoding header accepts a content coding. A q value of 0 refuses it,
+ * a "*" entry covers codings not listed by name.
+ */
+static bool accepts_encoding(const char *header, const char *name)
+{
+    size_t name_len = strlen(name);
+    int any = 0; // "*" entry, 1 accepted, -1 refused
+    const char *p = header;
+    while (*p != '\0')
+    {
+        p += strspn(p, " \t,");
+        const char *token = p;
+        size_t len = strcspn(p, " \t,;");
+        const char *end = p + strcspn(p, ",");
+        double q = 1.0;
+        // Parameters of the entry, only q is of interest
+        for (p += len; p < end; p++)
+        {
+            if (*p == ';')
+            {
+                p += strspn(p + 1, " \t") + 1;
+                if ((*p == 'q' || *p == 'Q') && p[1] == '=')
+                {
+                    q = strtod(p + 2, NULL);
+                }
+            }
+        }
+        p = end;
+        if (len == name_len && strncasecmp(token, name, len) == 0)
+        {
+            return q > 0;
+        }
+        if (len == 1 && *token == '*')
+        {
+            any = q > 0 ? 1 : -1;
+        }
+    }
+    return any == 1;
+}
+
+/**
+ * Select the smallest representation the client accepts.
+ */
+const asset_variant_t *assets_select(const asset_t *asset, const char *accept_encoding, asset_encoding_t *enc)
+{
+    *enc = ASSET_ENC_IDENTITY;
+    if (accept_encoding != NULL)
+    {
+        if (asset->variant[ASSET_ENC_BROTLI].data != NULL && accepts_encoding(accept_encoding, "br"))
+        {
+            *enc = ASSET_ENC_BROTLI;
+        }
+        else if (asset->variant[ASSET_ENC_GZIP].data != NULL && accepts_encoding(accept_encoding, "gzip"))
+        {
+            *enc = ASSET_ENC_GZIP;
+        }
+    }
+    return &asset->variant[*enc];
+}
+
+/**
+ * Content-Encoding header value of an encoding.
+ */
+const char *assets_encoding_name(asset_encoding_t enc)
+{
+    switch (enc)
+    {
+    case ASSET_ENC_GZIP:
+        return "gzip";
+    case ASSET_ENC_BROTLI:
+        return "br";
+    default:
+        return "identity";
+    }
+}
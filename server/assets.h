@@ -0,0 +1,66 @@
+// Part of UPS Server.
+// A websocket server reading data from a Bicker PSZ-1063 uExtension module
+// in combination with a Bicker UPS.
+//
+// Copyright (c) 2023 Michael Wolf <michael@mictronics.de>
+//
+// This file is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// any later version.
+//
+// This file is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef ASSETS_H
+#define ASSETS_H
+
+#include <stddef.h>
+
+#define ASSET_PATH_MAX 128
+#define ASSET_ETAG_MAX 24
+#define ASSET_MAX_COUNT 64
+
+/**
+ * Content encodings kept in memory for each asset
+ */
+typedef enum
+{
+    ASSET_ENC_IDENTITY = 0,
+    ASSET_ENC_GZIP,
+    ASSET_ENC_BROTLI,
+    ASSET_ENC_COUNT
+} asset_encoding_t;
+
+/**
+ * One encoded representation of an asset
+ */
+typedef struct
+{
+    unsigned char *data; // NULL when this encoding is not available
+    size_t len;
+    char etag[ASSET_ETAG_MAX]; // Strong ETag including quotes
+} asset_variant_t;
+
+/**
+ * Web client file loaded into memory
+ */
+typedef struct
+{
+    char path[ASSET_PATH_MAX]; // Request path, e.g. "/js/index.js"
+    const char *mime;
+    asset_variant_t variant[ASSET_ENC_COUNT];
+} asset_t;
+
+int assets_load(const char *root);
+void assets_free(void);
+const asset_t *assets_find(const char *path);
+const asset_variant_t *assets_select(const asset_t *asset, const char *accept_encoding, asset_encoding_t *enc);
+const char *assets_encoding_name(asset_encoding_t enc);
+
+#endif /* ASSETS_H */
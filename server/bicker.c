@@ -24,23 +24,94 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <string.h>
+#include <time.h>
 #include <sys/ioctl.h>
 #include <termios.h>
 #include <sys/stat.h>
-#include <sys/poll.h>
 #include "bicker.h"
 
+#define NOTUSED(V) ((void)V)
+
 static char serial_name[255] = "";
 static const char *serial_interface = "/dev/ttyUSB0";
 static int baudrate = B38400;
-static char serial_buffer[512];
+static int serial_fd = -1;
+static unsigned char serial_buffer[512];
+static size_t serial_buffer_len = 0;
 static bool has_serial_interface = false; // Indicates serial interface is open and accessible
 static bool has_rw_error = false;         // Indicates an read/write error
 bicker_ups_status_t bicker_ups_status;
-static struct pollfd poll_serial;
 static char bicker_req[5] = {
     BICKER_SOH, BICKER_REQ_LEN, BICKER_CMD_INDEX3, 0, BICKER_EOT};
 
+static struct lws *serial_wsi = NULL; // Serial interface adopted into the event loop
+static struct lws_context *serial_context = NULL;
+static lws_sorted_usec_list_t sul_timeout;
+
+/**
+ * Command queue, one ring buffer per priority.
+ */
+static bicker_cmd_t cmd_queue[CMD_PRIO_COUNT][CMD_QUEUE_SIZE];
+static int cmd_queue_head[CMD_PRIO_COUNT];
+static int cmd_queue_len[CMD_PRIO_COUNT];
+static bicker_cmd_t cmd_current; // Command waiting for response
+static bool cmd_busy = false;
+
+static bicker_status_cb_t status_cb = NULL; // Pending full status poll
+static bicker_status_cb_t check_cb = NULL;  // Pending alarm and power state check
+static unsigned int status_polls = 0;       // Full polls queued, static registers are due at 0
+
+/**
+ * Registers read by status polls, see BICKER_STATUS.
+ */
+static const struct
+{
+    cmd_list_t cmd;
+    char cmd_index;
+    bicker_type_t type;
+    bicker_tier_t tier;
+    void *dest;
+    size_t dest_len;
+} status_steps[] = {
+#define X(member, reg, kind, scale, json, apc, csv, tier) \
+    {reg, REG_INDEX_##reg, (bicker_type_t)REG_TYPE_##reg, tier, &bicker_ups_status.member, sizeof(bicker_ups_status.member)},
+    BICKER_STATUS(X)
+#undef X
+};
+// Step i is field i of BICKER_STATUS, its read time is kept in read_ns[i]
+
+#define STATUS_STEP_COUNT (sizeof(status_steps) / sizeof(status_steps[0]))
+
+/**
+ * Registers readable on request, by name as in cmd_list_t.
+ * START_CAP_ESR_MEASUREMENT is not a read and therefore not listed.
+ */
+static const struct
+{
+    const char *name;
+    cmd_list_t cmd;
+    char cmd_index;
+    bicker_type_t type;
+} registers[] = {
+#define X(name, code, index, type) {#name, name, index, type},
+    BICKER_REGISTERS(X)
+#undef X
+};
+
+#define REGISTER_COUNT (sizeof(registers) / sizeof(registers[0]))
+
+static void cmd_send_next(void);
+
+/**
+ * Monotonic clock in nanoseconds.
+ */
+static uint64_t now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
 /**
  * Set serial interface device name.
  */
@@ -56,21 +127,21 @@ void set_serial_interface(const char *dname)
 }
 
 /**
- * Open serial interface and setup its parameters.
+ * Open serial interface, setup its parameters and adopt it into the event loop of vhost.
  */
-int open_serial(void)
+int open_serial(struct lws_vhost *vhost)
 {
     struct termios tios;
 
-    poll_serial.fd = open(serial_interface, O_RDWR | O_NOCTTY, S_IRUSR | S_IWUSR);
-    if (poll_serial.fd < 0)
+    serial_fd = open(serial_interface, O_RDWR | O_NOCTTY | O_NONBLOCK, S_IRUSR | S_IWUSR);
+    if (serial_fd < 0)
     {
         lwsl_err("Failed to open serial device %s: %s\n",
                  serial_interface, strerror(errno));
         return (EXIT_FAILURE);
     }
 
-    if (tcgetattr(poll_serial.fd, &tios) < 0)
+    if (tcgetattr(serial_fd, &tios) < 0)
     {
         lwsl_err("tcgetattr(%s): %s\n", serial_interface, strerror(errno));
         return (EXIT_FAILURE);
@@ -81,7 +152,7 @@ int open_serial(void)
     tios.c_oflag = 0;
     tios.c_cflag |= CS8 | CREAD | CLOCAL; // 8N1 no handshake
     tios.c_lflag = 0;
-    tios.c_cc[VMIN] = 4; // Read minimum 4 bytes
+    tios.c_cc[VMIN] = 0; // Non-blocking, frames are assembled from RX callbacks
     tios.c_cc[VTIME] = 0;
 
     if (cfsetispeed(&tios, baudrate) < 0)
@@ -98,9 +169,9 @@ int open_serial(void)
         return (EXIT_FAILURE);
     }
 
-    tcflush(poll_serial.fd, TCIFLUSH);
+    tcflush(serial_fd, TCIFLUSH);
 
-    if (tcsetattr(poll_serial.fd, TCSANOW, &tios) < 0)
+    if (tcsetattr(serial_fd, TCSANOW, &tios) < 0)
     {
         lwsl_err("Serial tcsetattr(%s): %s\n",
                  serial_interface, strerror(errno));
@@ -109,7 +180,19 @@ int open_serial(void)
 
     // Kick on handshake and start reception
     int RTSDTR_flag = TIOCM_RTS | TIOCM_DTR;
-    ioctl(poll_serial.fd, TIOCMBIS, &RTSDTR_flag); // Set RTS&DTR pin
+    ioctl(serial_fd, TIOCMBIS, &RTSDTR_flag); // Set RTS&DTR pin
+
+    lws_sock_file_fd_type fd;
+    fd.filefd = serial_fd;
+    serial_wsi = lws_adopt_descriptor_vhost(vhost, LWS_ADOPT_RAW_FILE_DESC, fd, "serial", NULL);
+    if (serial_wsi == NULL)
+    {
+        lwsl_err("Failed to adopt serial device %s\n", serial_interface);
+        close(serial_fd);
+        serial_fd = -1;
+        return (EXIT_FAILURE);
+    }
+    serial_context = lws_get_vhost_context(vhost);
 
     memset(&bicker_ups_status, 0, sizeof(bicker_ups_status));
     has_serial_interface = true;
@@ -119,11 +202,17 @@ int open_serial(void)
 
 /**
  * Close serial interface.
+ * When adopted the descriptor is closed together with the event loop.
  */
 void close_serial(void)
 {
     has_serial_interface = false;
-    close(poll_serial.fd);
+    lws_sul_cancel(&sul_timeout);
+    if (serial_wsi == NULL && serial_fd >= 0)
+    {
+        close(serial_fd);
+    }
+    serial_fd = -1;
 }
 
 /**
@@ -137,152 +226,517 @@ bool is_serial_error()
 }
 
 /**
- * Read from serial interface in non-blocking mode with timeout.
+ * Character of a UPS string, those needing escape are replaced.
+ * Strings are rendered into JSON and reports without escaping.
  */
-static char *read_serial(ssize_t *len)
+static char string_char(char ch)
 {
-    poll_serial.events = POLLIN;
-    if (poll(&poll_serial, 1, SERIAL_TIMEOUT) > 0 && fcntl(poll_serial.fd, F_GETFD) != -1)
+    return (ch < ' ' || ch > '~' || ch == '"' || ch == '\\') ? '?' : ch;
+}
+
+/**
+ * Store response data of a completed command.
+ */
+static void cmd_decode(bicker_cmd_t *c, const bicker_data_t *p)
+{
+    c->value = 0;
+    switch (c->type)
+    {
+    case BICKER_SHORT:
+    case BICKER_BYTE:
+        if (p->size == 4)
+        { // int8_t data
+            c->value = (signed short)p->data[0];
+        }
+        else if (p->size == 5)
+        { // int16_t data
+            c->value = (signed short)(p->data[1] * 256 + p->data[0]);
+        }
+        break;
+    case BICKER_LONG:
+        if (p->size == 7)
+        {
+            c->value = p->data[3];
+            c->value <<= 8;
+            c->value += p->data[2];
+            c->value <<= 8;
+            c->value += p->data[1];
+            c->value <<= 8;
+            c->value += p->data[0];
+        }
+        break;
+    case BICKER_STRING:
+        if (c->dest != NULL && c->dest_len > 0 && p->size > 3)
+        {
+            // Size counts index, command and EOT besides the string
+            size_t n = MIN((size_t)p->size - 3, c->dest_len - 1);
+            char *d = c->dest;
+            for (size_t i = 0; i < n; i++)
+            {
+                d[i] = string_char((char)p->data[i]);
+            }
+            d[n] = '\0';
+        }
+        return;
+    }
+    if (c->dest == NULL)
     {
-        *len = read(poll_serial.fd, serial_buffer, sizeof(serial_buffer) - 1);
-        return serial_buffer;
+        return;
+    }
+    if (c->type == BICKER_BYTE)
+    {
+        *(unsigned char *)c->dest = (unsigned char)c->value;
     }
     else
     {
-        lwsl_err("Error reading from serial interface.\n");
-        has_rw_error = true;
-        *len = -1;
-        return NULL;
+        *(signed int *)c->dest = c->value;
     }
 }
 
 /**
- * Write to serial interface in non-blocking mode with timeout.
+ * Finish the command in progress and start the next one.
  */
-static ssize_t write_serial(const char *buf, size_t len)
+static void cmd_complete(bool ok)
 {
-    poll_serial.events = POLLOUT;
-    if (poll(&poll_serial, 1, SERIAL_TIMEOUT) > 0 && fcntl(poll_serial.fd, F_GETFD) != -1)
+    bicker_cmd_t c = cmd_current;
+    c.done_ns = now_ns();
+    lws_sul_cancel(&sul_timeout);
+    cmd_busy = false;
+    serial_buffer_len = 0;
+    if (c.done != NULL)
     {
-        return write(poll_serial.fd, buf, len);
+        c.done(&c, ok);
     }
-    else
+    cmd_send_next();
+}
+
+/**
+ * No response within serial timeout.
+ */
+static void cmd_timeout(lws_sorted_usec_list_t *sul)
+{
+    NOTUSED(sul);
+    lwsl_err("Error reading from serial interface.\n");
+    has_rw_error = true;
+    cmd_complete(false);
+}
+
+/**
+ * Take the next command by priority. Returns false when the queue is empty.
+ */
+static bool cmd_pop(bicker_cmd_t *c)
+{
+    for (int p = 0; p < CMD_PRIO_COUNT; p++)
+    {
+        if (cmd_queue_len[p] > 0)
+        {
+            *c = cmd_queue[p][cmd_queue_head[p]];
+            cmd_queue_head[p] = (cmd_queue_head[p] + 1) % CMD_QUEUE_SIZE;
+            cmd_queue_len[p]--;
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Send the next queued command unless one is in progress.
+ * On a serial error all queued commands are completed as failed.
+ */
+static void cmd_send_next(void)
+{
+    while (!cmd_busy && cmd_pop(&cmd_current))
+    {
+        if (!has_serial_interface || has_rw_error || serial_wsi == NULL)
+        {
+            if (cmd_current.done != NULL)
+            {
+                cmd_current.done_ns = now_ns();
+                cmd_current.done(&cmd_current, false);
+            }
+            continue;
+        }
+        bicker_req[2] = cmd_current.cmd_index;
+        bicker_req[3] = (char)cmd_current.cmd;
+        serial_buffer_len = 0;
+        if (write(serial_fd, bicker_req, sizeof bicker_req) != (ssize_t)sizeof bicker_req)
+        {
+            lwsl_err("Error writing to serial interface.\n");
+            has_rw_error = true;
+            if (cmd_current.done != NULL)
+            {
+                cmd_current.done_ns = now_ns();
+                cmd_current.done(&cmd_current, false);
+            }
+            continue;
+        }
+        cmd_current.sent_ns = now_ns();
+        cmd_busy = true;
+        lws_sul_schedule(serial_context, 0, &sul_timeout, cmd_timeout, SERIAL_TIMEOUT * LWS_US_PER_MS);
+    }
+}
+
+/**
+ * Read available bytes and complete the command when its response frame is in.
+ */
+static void serial_rx(void)
+{
+    ssize_t len = read(serial_fd, &serial_buffer[serial_buffer_len], sizeof(serial_buffer) - serial_buffer_len);
+    if (len <= 0)
     {
-        lwsl_err("Error writing to serial interface.\n");
+        if (len == 0 || (errno != EAGAIN && errno != EINTR))
+        {
+            lwsl_err("Error reading from serial interface.\n");
+            has_rw_error = true;
+            if (cmd_busy)
+            {
+                cmd_complete(false);
+            }
+        }
+        return;
+    }
+    serial_buffer_len += len;
+    if (!cmd_busy)
+    {
+        serial_buffer_len = 0; // Late response of a timed out command
+        return;
+    }
+
+    for (;;)
+    {
+        // Resync on start of header
+        size_t skip = 0;
+        while (skip < serial_buffer_len && serial_buffer[skip] != BICKER_SOH)
+        {
+            skip++;
+        }
+        if (skip > 0)
+        {
+            memmove(serial_buffer, &serial_buffer[skip], serial_buffer_len - skip);
+            serial_buffer_len -= skip;
+        }
+        if (serial_buffer_len < 2)
+        {
+            return;
+        }
+        // Frame size counts all bytes following the size byte
+        size_t frame_len = (size_t)serial_buffer[1] + 2;
+        if (frame_len > sizeof(serial_buffer))
+        {
+            serial_buffer_len = 0;
+            return;
+        }
+        if (serial_buffer_len < frame_len)
+        {
+            return;
+        }
+        bicker_data_t *p = (bicker_data_t *)serial_buffer;
+        if (frame_len >= 4 && p->cmd_list == cmd_current.cmd)
+        {
+            cmd_decode(&cmd_current, p);
+            if (cmd_current.read_ns != NULL)
+            {
+                *cmd_current.read_ns = now_ns();
+            }
+            cmd_complete(true);
+            return;
+        }
+        // Not ours, drop the frame and keep waiting
+        memmove(serial_buffer, &serial_buffer[frame_len], serial_buffer_len - frame_len);
+        serial_buffer_len -= frame_len;
+    }
+}
+
+/**
+ * Serial interface protocol callback.
+ */
+int callback_serial(struct lws *wsi, enum lws_callback_reasons reason, void *user, void *in, size_t len)
+{
+    NOTUSED(user);
+    NOTUSED(in);
+    NOTUSED(len);
+    NOTUSED(wsi);
+    switch (reason)
+    {
+    case LWS_CALLBACK_RAW_ADOPT_FILE:
+        lwsl_notice("Serial interface %s adopted.", serial_interface);
+        break;
+
+    case LWS_CALLBACK_RAW_RX_FILE:
+        serial_rx();
+        break;
+
+    case LWS_CALLBACK_RAW_CLOSE_FILE:
+        lwsl_notice("Serial interface closed.");
+        serial_wsi = NULL;
         has_rw_error = true;
-        return -1;
+        if (cmd_busy)
+        {
+            cmd_complete(false);
+        }
+        break;
+
+    default:
+        break;
+    }
+    return 0;
+}
+
+/**
+ * Terminate a UPS string within size and replace characters needing escape,
+ * for strings not read through cmd_decode.
+ */
+void bicker_string_clean(char *s, size_t size)
+{
+    s[size - 1] = '\0';
+    for (; *s != '\0'; s++)
+    {
+        *s = string_char(*s);
     }
 }
 
 /**
- * Get integer of 8 or 16 bit size.
+ * Queue a command transaction. The command is sent as soon as the interface is idle
+ * and no command of a higher priority class is waiting.
  */
-static signed short get_sshort(const cmd_list_t cmd, const char cmd_index)
+bool bicker_queue(const bicker_cmd_t *c, cmd_priority_t prio)
 {
-    if (!has_serial_interface || has_rw_error)
-        return 0;
+    if (prio >= CMD_PRIO_COUNT || cmd_queue_len[prio] >= CMD_QUEUE_SIZE)
+    {
+        return false;
+    }
+    int i = (cmd_queue_head[prio] + cmd_queue_len[prio]) % CMD_QUEUE_SIZE;
+    cmd_queue[prio][i] = *c;
+    cmd_queue[prio][i].queued_ns = now_ns();
+    cmd_queue[prio][i].sent_ns = 0;
+    cmd_queue[prio][i].done_ns = 0;
+    cmd_queue_len[prio]++;
+    cmd_send_next();
+    return true;
+}
 
-    ssize_t len = 0;
-    signed short i = 0;
-    bicker_req[2] = cmd_index;
-    bicker_req[3] = (char)cmd;
-    write_serial(bicker_req, sizeof bicker_req);
-    bicker_data_t *p = (bicker_data_t *)read_serial(&len);
-    if (p != NULL && len >= 4 && p->soh == BICKER_SOH && p->cmd_list == cmd)
+/**
+ * Last register of a status poll is in.
+ */
+static void status_done(const bicker_cmd_t *c, bool ok)
+{
+    NOTUSED(c);
+    bicker_status_cb_t cb = status_cb;
+    status_cb = NULL;
+    if (cb != NULL)
     {
-        if (p->size == 4)
-        { // int8_t data
-            i = (signed short)p->data[0];
+        cb(&bicker_ups_status, ok && !has_rw_error);
+    }
+}
+
+/**
+ * Check if a status register is read by a poll.
+ */
+static bool step_due(bicker_tier_t t, bool full, bool with_static)
+{
+    return t == TIER_CHECK || (full && t == TIER_FULL) || (with_static && t == TIER_STATIC);
+}
+
+/**
+ * Queue the status register reads of the given tiers at the given priority,
+ * done is attached to the last one. Returns false when the queue has no room.
+ */
+static bool queue_steps(bool full, bool with_static, cmd_priority_t prio, void (*done)(const bicker_cmd_t *, bool))
+{
+    size_t last = STATUS_STEP_COUNT;
+    size_t count = 0;
+    for (size_t i = 0; i < STATUS_STEP_COUNT; i++)
+    {
+        if (step_due(status_steps[i].tier, full, with_static))
+        {
+            last = i;
+            count++;
         }
-        else if (p->size == 5)
-        { // int16_t data
-            i = (signed short)(p->data[1] * 256 + p->data[0]);
+    }
+    if (count == 0 || cmd_queue_len[prio] + count > CMD_QUEUE_SIZE)
+    {
+        return false;
+    }
+    for (size_t i = 0; i <= last; i++)
+    {
+        if (step_due(status_steps[i].tier, full, with_static))
+        {
+            bicker_cmd_t c = {
+                .cmd = status_steps[i].cmd,
+                .cmd_index = status_steps[i].cmd_index,
+                .type = status_steps[i].type,
+                .dest = status_steps[i].dest,
+                .dest_len = status_steps[i].dest_len,
+                .read_ns = &bicker_ups_status.read_ns[i],
+                .done = (i == last) ? done : NULL,
+            };
+            bicker_queue(&c, prio);
+        }
+    }
+    return true;
+}
+
+/**
+ * Check if count commands fit into the low priority queue with room left for the
+ * next full status poll. Keeps extra low priority reads from starving the polling.
+ */
+bool bicker_queue_spare(size_t count)
+{
+    size_t reserve = 0;
+    if (status_cb == NULL)
+    {
+        // No poll queued yet, keep room for the next one
+        for (size_t i = 0; i < STATUS_STEP_COUNT; i++)
+        {
+            reserve += step_due(status_steps[i].tier, true, status_polls == 0) ? 1 : 0;
         }
     }
-    return i;
+    return (size_t)cmd_queue_len[CMD_PRIO_LOW] + count + reserve <= CMD_QUEUE_SIZE;
 }
 
 /**
- * Get integer of 32 bit size.
+ * Queue a read of all status registers. cb is called when the last one is in.
+ * Static registers like the firmware version are read only every BICKER_STATIC_POLLS.
+ * Returns false while a previous poll is still in progress.
  */
-static signed int get_sint(const cmd_list_t cmd, const char cmd_index)
+bool bicker_poll_status(bicker_status_cb_t cb)
 {
-    if (!has_serial_interface || has_rw_error)
-        return 0;
+    if (status_cb != NULL)
+    {
+        return false;
+    }
+    // Set before queueing, the callback runs at once on a serial error
+    status_cb = cb;
+    if (!queue_steps(true, status_polls == 0, CMD_PRIO_LOW, status_done))
+    {
+        status_cb = NULL;
+        return false;
+    }
+    status_polls = (status_polls + 1) % BICKER_STATIC_POLLS;
+    return true;
+}
 
-    ssize_t len = 0;
-    signed int i = 0;
-    bicker_req[2] = cmd_index;
-    bicker_req[3] = (char)cmd;
-    write_serial(bicker_req, sizeof bicker_req);
-    bicker_data_t *p = (bicker_data_t *)read_serial(&len);
-    if (p != NULL && len >= 4 && p->soh == BICKER_SOH && p->cmd_list == cmd)
+/**
+ * Alarm register and device status are in.
+ */
+static void check_done(const bicker_cmd_t *c, bool ok)
+{
+    NOTUSED(c);
+    bicker_status_cb_t cb = check_cb;
+    check_cb = NULL;
+    if (cb != NULL)
     {
-        if (p->size == 7)
+        cb(&bicker_ups_status, ok && !has_rw_error);
+    }
+}
+
+/**
+ * Queue a read of alarm register and device status ahead of regular polling.
+ * Used to catch alarms and power state changes between full status polls.
+ */
+bool bicker_poll_check(bicker_status_cb_t cb)
+{
+    if (check_cb != NULL)
+    {
+        return false;
+    }
+    check_cb = cb;
+    if (!queue_steps(false, false, CMD_PRIO_HIGH, check_done))
+    {
+        check_cb = NULL;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Prepare a register read by name, e.g. "GET_SOC". Returns false on unknown name.
+ */
+bool bicker_register_by_name(const char *name, bicker_cmd_t *c)
+{
+    for (size_t i = 0; name != NULL && i < REGISTER_COUNT; i++)
+    {
+        if (strcmp(registers[i].name, name) == 0)
         {
-            i = p->data[3];
-            i <<= 8;
-            i += p->data[2];
-            i <<= 8;
-            i += p->data[1];
-            i <<= 8;
-            i += p->data[0];
+            return bicker_register_by_code(registers[i].cmd, c);
         }
     }
-    return i;
+    return false;
 }
 
 /**
- * Get string from UPS.
+ * Prepare a register read by command code. Returns false on unknown code.
  */
-static void get_string(cmd_list_t cmd, char *dest, ssize_t buflen)
+bool bicker_register_by_code(int code, bicker_cmd_t *c)
 {
-    if (!has_serial_interface || has_rw_error)
-        return;
+    for (size_t i = 0; i < REGISTER_COUNT; i++)
+    {
+        if ((int)registers[i].cmd == code)
+        {
+            memset(c, 0, sizeof(bicker_cmd_t));
+            c->cmd = registers[i].cmd;
+            c->cmd_index = registers[i].cmd_index;
+            c->type = registers[i].type;
+            return true;
+        }
+    }
+    return false;
+}
 
-    ssize_t len = 0;
-    bicker_req[2] = BICKER_CMD_INDEX1;
-    bicker_req[3] = (char)cmd;
-    write_serial(bicker_req, sizeof bicker_req);
-    bicker_data_t *p = (bicker_data_t *)read_serial(&len);
-    if (p != NULL && len >= 7 && p->soh == BICKER_SOH && p->cmd_list == cmd)
+/**
+ * Register name of a command code.
+ */
+const char *bicker_register_name(cmd_list_t cmd)
+{
+    for (size_t i = 0; i < REGISTER_COUNT; i++)
     {
-        if (p->size < buflen)
+        if (registers[i].cmd == cmd)
         {
-            buflen = p->size;
+            return registers[i].name;
         }
-        memcpy(dest, p->data, buflen);
-        return;
     }
+    return "UNKNOWN";
 }
 
+/**
+ * Last known UPS status.
+ */
 bicker_ups_status_t *get_ups_status()
 {
-    bicker_ups_status.input_voltage = (signed int)get_sshort(GET_INPUT_VOLTAGE1, BICKER_CMD_INDEX1);
-    bicker_ups_status.input_current = (signed int)get_sshort(GET_INPUT_CURRENT1, BICKER_CMD_INDEX1);
-    bicker_ups_status.output_voltage = (signed int)get_sshort(GET_OUTPUT_VOLTAGE1, BICKER_CMD_INDEX1);
-    bicker_ups_status.output_current = (signed int)get_sshort(GET_OUTPUT_CURRENT1, BICKER_CMD_INDEX1);
-    bicker_ups_status.battery_current = (signed int)get_sshort(GET_BATTERY_CURRENT, BICKER_CMD_INDEX1);
-    bicker_ups_status.battery_voltage = (signed int)get_sshort(GET_BATTERY_VOLTAGE, BICKER_CMD_INDEX1);
-    bicker_ups_status.vcap_voltage.cap1 = (signed int)get_sshort(GET_VCAP1_VOLTAGE, BICKER_CMD_INDEX3);
-    bicker_ups_status.vcap_voltage.cap2 = (signed int)get_sshort(GET_VCAP2_VOLTAGE, BICKER_CMD_INDEX3);
-    bicker_ups_status.vcap_voltage.cap3 = (signed int)get_sshort(GET_VCAP3_VOLTAGE, BICKER_CMD_INDEX3);
-    bicker_ups_status.vcap_voltage.cap4 = (signed int)get_sshort(GET_VCAP4_VOLTAGE, BICKER_CMD_INDEX3);
-    bicker_ups_status.capacity = get_sint(GET_CAPACITY, BICKER_CMD_INDEX3);
-    bicker_ups_status.esr = (signed int)get_sshort(GET_ESR, BICKER_CMD_INDEX3);
-    bicker_ups_status.charge_status.value = (signed int)get_sshort(GET_CHARGE_STATUS_REGISTER, BICKER_CMD_INDEX3);
-    bicker_ups_status.monitor_status.value = (signed int)get_sshort(GET_MONITOR_STATUS_REGISTER, BICKER_CMD_INDEX3);
-    bicker_ups_status.device_status.value = (unsigned char)get_sshort(GET_DEVICE_STATUS, BICKER_CMD_INDEX1);
-    bicker_ups_status.soc = (signed int)get_sshort(GET_SOC, BICKER_CMD_INDEX1);
-    bicker_ups_status.uc_temperature = (signed int)get_sshort(GET_LTC3350_TEMPERATURE, BICKER_CMD_INDEX1);
-    get_string(GET_BATTERY_TYPE, bicker_ups_status.battery_type, sizeof bicker_ups_status.battery_type);
-    get_string(GET_FIRMWARE, bicker_ups_status.firmware, sizeof bicker_ups_status.firmware);
-    get_string(GET_SERIES, bicker_ups_status.series, sizeof bicker_ups_status.series);
-    get_string(GET_HARDWARE_REVISION, bicker_ups_status.hw_revision, sizeof bicker_ups_status.hw_revision);
     return &bicker_ups_status;
 }
 
-void start_cap_esr_measurement()
+/**
+ * Prepare a one-shot pass-through command of index 3, including those not readable like
+ * START_CAP_ESR_MEASUREMENT.
+ */
+void bicker_command(cmd_list_t cmd, bicker_cmd_t *c)
+{
+    memset(c, 0, sizeof(bicker_cmd_t));
+    c->cmd = cmd;
+    c->cmd_index = BICKER_CMD_INDEX3;
+    c->type = BICKER_SHORT;
+}
+
+/**
+ * Queue a one-shot pass-through command of index 3.
+ * The same command pending twice has no additional effect and is dropped.
+ */
+bool queue_command(cmd_list_t cmd, cmd_priority_t prio)
 {
-    get_sshort(START_CAP_ESR_MEASUREMENT, BICKER_CMD_INDEX3);
+    if (prio >= CMD_PRIO_COUNT)
+    {
+        return false;
+    }
+    for (int i = 0; i < cmd_queue_len[prio]; i++)
+    {
+        if (cmd_queue[prio][(cmd_queue_head[prio] + i) % CMD_QUEUE_SIZE].cmd == cmd)
+        {
+            return true;
+        }
+    }
+    bicker_cmd_t c;
+    bicker_command(cmd, &c);
+    c.dest = (cmd == GET_MASK_ALARMS) ? &bicker_ups_status.alarm_mask : NULL;
+    return bicker_queue(&c, prio);
 }
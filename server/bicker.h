@@ -21,6 +21,10 @@
 #define BICKER_H
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <libwebsockets.h>
+#include "registers.h"
 
 #define SERIAL_TIMEOUT 3000 // ms
 
@@ -29,74 +33,84 @@
 #define BICKER_CMD_INDEX3 0x03
 #define BICKER_CMD_INDEX1 0x01
 #define BICKER_REQ_LEN 0x03
+#define CMD_QUEUE_SIZE 32 // Pending commands per priority
+#define BICKER_STATIC_POLLS 60 // Full polls between reads of static registers
+#define BICKER_STATUS_COUNT_X(...) +1
+#define BICKER_STATUS_COUNT (0 BICKER_STATUS(BICKER_STATUS_COUNT_X)) // Fields read by status polls
 
 /**
- * Know commands for UPSIC-1205 + PSZ1063
- *
- * See LTC3350 datasheet, page 32.
- * Command index 3 is a pass-through read of those registers.
+ * Know commands for UPSIC-1205 + PSZ1063, see registers.h
  */
 typedef enum
 {
-    GET_CLEAR_ALARMS = 0x00,            // cmd index 0x03
-    GET_MASK_ALARMS = 0x01,             // cmd index 0x03
-    GET_MASK_MONITORING_STATUS = 0x02,  // cmd index 0x03
-    GET_CAP_ESR_PERIOD = 0x04,          // cmd index 0x03
-    GET_VCAP_REF_DAC = 0x05,            // cmd index 0x03
-    GET_VSHUNT = 0x06,                  // cmd index 0x03
-    GET_CAP_UV_ALARM_LEVEL = 0x07,      // cmd index 0x03
-    GET_CAP_OV_ALARM_LEVEL = 0x08,      // cmd index 0x03
-    GET_GPI_UV_ALARM_LEVEL = 0x09,      // cmd index 0x03
-    GET_GPI_OV_ALARM_LEVEL = 0x0A,      // cmd index 0x03
-    GET_VIN_UV_ALARM_LEVEL = 0x0B,      // cmd index 0x03
-    GET_VIN_OV_ALARM_LEVEL = 0x0C,      // cmd index 0x03
-    GET_VCAP_UV_ALARM_LEVEL = 0x0D,     // cmd index 0x03
-    GET_VCAP_OV_ALARM_LEVEL = 0x0E,     // cmd index 0x03
-    GET_VOUT_UV_ALARM_LEVEL = 0x0F,     // cmd index 0x03
-    GET_VOUT_OV_ALARM_LEVEL = 0x10,     // cmd index 0x03
-    GET_INPUT_OC_ALARM_LEVEL = 0x11,    // cmd index 0x03
-    GET_CHARGE_UC_ALARM_LEVEL = 0x12,   // cmd index 0x03
-    GET_DIE_COLD_ALARM_LEVEL = 0x13,    // cmd index 0x03
-    GET_DIE_HOT_ALARM_LEVEL = 0x14,     // cmd index 0x03
-    GET_ESR_HIGH_ALARM_LEVEL = 0x15,    // cmd index 0x03
-    GET_CAP_LOW_ALARM_LEVEL = 0x16,     // cmd index 0x03
-    GET_CONTROL_REG = 0x17,             // cmd index 0x03
-    GET_NUMBER_OF_CAPACITORS = 0x1A,    // cmd index 0x03
-    GET_CHARGE_STATUS_REGISTER = 0X1B,  // cmd index 0x03
-    GET_MONITOR_STATUS_REGISTER = 0X1C, // cmd index 0x03
-    GET_MONITOR_ALARM_REGISTER = 0X1D,  // cmd index 0x03
-    GET_CAPACITY = 0X1E,                // cmd index 0x03
-    GET_ESR = 0X1F,                     // cmd index 0x03
-    GET_VCAP1_VOLTAGE = 0x20,           // cmd index 0x03
-    GET_VCAP2_VOLTAGE = 0x21,           // cmd index 0x03
-    GET_VCAP3_VOLTAGE = 0x22,           // cmd index 0x03
-    GET_VCAP4_VOLTAGE = 0x23,           // cmd index 0x03
-    GET_GPI_PIN_VOLTAGE = 0x24,         // cmd index 0x03
-    GET_INPUT_VOLTAGE = 0x25,           // cmd index 0x03
-    GET_CAP_STACK_VOLTAGE = 0x26,       // cmd index 0x03
-    GET_OUTPUT_VOLTAGE = 0x27,          // cmd index 0x03
-    GET_INPUT_CURRENT = 0x28,           // cmd index 0x03
-    GET_CHARGE_CURRENT = 0x29,          // cmd index 0x03
-    GET_CHARGER_TEMPERATURE = 0x2A,     // cmd index 0x03
-    START_CAP_ESR_MEASUREMENT = 0x31,   // cmd index 0x03
-    GET_DEVICE_STATUS = 0x40,           // cmd index 0x01
-    GET_INPUT_VOLTAGE1 = 0x41,          // cmd index 0x01
-    GET_INPUT_CURRENT1 = 0x42,          // cmd index 0x01
-    GET_OUTPUT_VOLTAGE1 = 0x43,         // cmd index 0x01
-    GET_OUTPUT_CURRENT1 = 0x44,         // cmd index 0x01
-    GET_BATTERY_VOLTAGE = 0x45,         // cmd index 0x01
-    GET_BATTERY_CURRENT = 0x46,         // cmd index 0x01
-    GET_SOC = 0x47,                     // cmd index 0x01
-    GET_BATTERY_TEMPERATURE = 0x4A,     // cmd index 0x01
-    GET_MANUFACTURER = 0x60,            // cmd index 0x01
-    GET_SERIAL = 0x61,                  // cmd index 0x01
-    GET_SERIES = 0x62,                  // cmd index 0x01
-    GET_FIRMWARE = 0x63,                // cmd index 0x01
-    GET_BATTERY_TYPE = 0x64,            // cmd index 0x01
-    GET_LTC3350_TEMPERATURE = 0x66,     // cmd index 0x01
-    GET_HARDWARE_REVISION = 0x67,       // cmd index 0x01
+#define X(name, code, index, type) name = code,
+    BICKER_REGISTERS(X)
+#undef X
+    START_CAP_ESR_MEASUREMENT = 0x31, // cmd index 0x03
 } cmd_list_t;
 
+/**
+ * Priority class of queued commands, lower value is sent first
+ */
+typedef enum
+{
+    CMD_PRIO_HIGH = 0, // Alarm and power state checks
+    CMD_PRIO_NORMAL,   // User commands
+    CMD_PRIO_LOW,      // Regular status polling
+    CMD_PRIO_COUNT
+} cmd_priority_t;
+
+/**
+ * Response data type of a command
+ */
+typedef enum
+{
+    BICKER_SHORT, // int8_t or int16_t into signed int
+    BICKER_BYTE,  // int8_t into unsigned char
+    BICKER_LONG,  // int32_t into signed int
+    BICKER_STRING // char array of dest_len
+} bicker_type_t;
+
+/**
+ * Command index and response type per register, REG_INDEX_GET_SOC etc.
+ */
+enum
+{
+#define X(name, code, index, type) REG_INDEX_##name = index, REG_TYPE_##name = type,
+    BICKER_REGISTERS(X)
+#undef X
+};
+
+/**
+ * When a status register is read
+ */
+typedef enum
+{
+    TIER_FULL,   // Every full status poll
+    TIER_CHECK,  // Every full poll and every alarm and power state check
+    TIER_STATIC, // First full poll, then every BICKER_STATIC_POLLS
+    TIER_REQUEST // Not polled, read on request only
+} bicker_tier_t;
+
+/**
+ * Serial command transaction
+ */
+typedef struct bicker_cmd
+{
+    cmd_list_t cmd;
+    char cmd_index;
+    bicker_type_t type;
+    void *dest;      // Response destination, may be NULL
+    size_t dest_len; // String destination size
+    signed int value; // Numeric response
+    uint64_t *read_ns; // Set to the monotonic response time, may be NULL
+    void (*done)(const struct bicker_cmd *c, bool ok); // Completion, may be NULL
+    void *user;
+    uint64_t queued_ns; // CLOCK_MONOTONIC when queued, sent and completed
+    uint64_t sent_ns;   // 0 if never sent
+    uint64_t done_ns;
+} bicker_cmd_t;
+
 /**
  * Data frame
  */
@@ -246,27 +260,44 @@ typedef struct
     signed int input_current;
     signed int output_current;
     signed int charge_current;
+    signed int cap_stack_voltage;
     signed int battery_voltage;
     signed int battery_current;
     signed int capacity;
     signed int esr;
     signed int soc;
     signed int uc_temperature;
+    signed int battery_temperature;
     bicker_vcap_t vcap_voltage;
     bicker_charge_status_t charge_status;
     bicker_monitor_status_t monitor_status;
     bicker_device_status_t device_status;
+    bicker_alarm_status_t alarm_status;
+    signed int alarm_mask; // Alarms enabled in device, read by GET_MASK_ALARMS
     char battery_type[20];
     char series[20];
     char firmware[20];
     char hw_revision[20];
+    uint64_t read_ns[BICKER_STATUS_COUNT]; // CLOCK_MONOTONIC read time per BICKER_STATUS field, 0 if never read
 } bicker_ups_status_t;
 
+typedef void (*bicker_status_cb_t)(bicker_ups_status_t *ups, bool ok);
+
 void close_serial(void);
-int open_serial(void);
+int open_serial(struct lws_vhost *vhost);
 void set_serial_interface(const char *dname);
 bool is_serial_error();
+bool bicker_queue(const bicker_cmd_t *c, cmd_priority_t prio);
+bool bicker_queue_spare(size_t count);
+void bicker_string_clean(char *s, size_t size);
+bool bicker_poll_status(bicker_status_cb_t cb);
+bool bicker_poll_check(bicker_status_cb_t cb);
+bool bicker_register_by_name(const char *name, bicker_cmd_t *c);
+bool bicker_register_by_code(int code, bicker_cmd_t *c);
+const char *bicker_register_name(cmd_list_t cmd);
 bicker_ups_status_t *get_ups_status();
-void start_cap_esr_measurement();
+void bicker_command(cmd_list_t cmd, bicker_cmd_t *c);
+bool queue_command(cmd_list_t cmd, cmd_priority_t prio);
+int callback_serial(struct lws *wsi, enum lws_callback_reasons reason, void *user, void *in, size_t len);
 
 #endif /* BICKER_H */
\ No newline at end of file
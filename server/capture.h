@@ -0,0 +1,64 @@
+// Part of UPS Server.
+// A websocket server reading data from a Bicker PSZ-1063 uExtension module
+// in combination with a Bicker UPS.
+//
+// Copyright (c) 2023 Michael Wolf <michael@mictronics.de>
+//
+// This file is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// any later version.
+//
+// This file is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdint.h>
+
+/**
+ * Power event capture file, written by the flight recorder.
+ *
+ * A header followed by count samples, all little endian as written by the server.
+ * Sample times are milliseconds relative to the trigger, pre-trigger samples are negative.
+ */
+#define CAPTURE_MAGIC 0x52535055 // "UPSR"
+#define CAPTURE_VERSION 1
+
+#define CAPTURE_SRC_POLL 0  // Sample from a regular status poll
+#define CAPTURE_SRC_BURST 1 // Sample from burst sampling after the trigger
+
+typedef struct __attribute__((__packed__))
+{
+    uint32_t magic;
+    uint16_t version;
+    uint16_t sample_size;   // Byte, sizeof(capture_sample_t)
+    int64_t trigger_time;   // Unix time in milliseconds
+    uint32_t count;         // Samples following the header
+    uint32_t trigger_index; // First sample at or after the trigger
+    uint8_t device_before;  // Device status before the trigger
+    uint8_t device_after;   // Device status that triggered
+    uint8_t power_fail;     // Bit 0 charge status, bit 1 monitor status power fail
+    uint8_t reserved;
+} capture_header_t;
+
+typedef struct __attribute__((__packed__))
+{
+    int32_t time;            // ms relative to trigger
+    int16_t input_voltage;   // mV
+    int16_t output_voltage;  // mV
+    int16_t battery_voltage; // mV
+    int16_t vcap[4];         // mV
+    int16_t input_current;   // mA
+    int16_t output_current;  // mA
+    uint8_t device_status;
+    uint8_t source; // CAPTURE_SRC_POLL or CAPTURE_SRC_BURST
+} capture_sample_t;
+
+#endif /* CAPTURE_H */
@@ -0,0 +1,99 @@
+// Part of UPS Server.
+// A websocket server reading data from a Bicker PSZ-1063 uExtension module
+// in combination with a Bicker UPS.
+//
+// Copyright (c) 2023 Michael Wolf <michael@mictronics.de>
+//
+// This file is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// any later version.
+//
+// This file is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <string.h>
+#include "energy.h"
+
+// Event loop only
+static energy_t counters;
+static uint64_t last_ns = 0; // Previous poll, 0 before the first one
+static bool last_on_battery = false;
+
+/**
+ * Output power statistics of the running window.
+ */
+static struct
+{
+    double seconds;
+    double ws; // Watt seconds
+    double min_w;
+    double max_w;
+    bool done; // A window was completed, counters hold its result
+} window;
+
+/**
+ * Continue counting from a checkpoint.
+ */
+void energy_restore(const energy_t *e)
+{
+    counters = *e;
+    window.done = true;
+}
+
+/**
+ * Integrate power since the previous poll with the trapezoidal rule.
+ */
+void energy_update(const bicker_ups_status_t *ups, const ups_settings_t *cfg, uint64_t mono_ns, energy_t *out)
+{
+    energy_t prev = counters;
+    counters.input_w = (ups->input_voltage / 1000.0) * (ups->input_current / 1000.0);
+    counters.output_w = (ups->output_voltage / 1000.0) * (ups->output_current / 1000.0);
+    counters.battery_w = (ups->battery_voltage / 1000.0) * (ups->battery_current / 1000.0);
+    counters.load_pct = (int)(((double)ups->output_current / (double)cfg->max_amps) * 100.0);
+    bool on_battery = !ups->device_status.reg.is_power_present;
+
+    if (last_ns != 0 && mono_ns > last_ns && mono_ns - last_ns <= ENERGY_GAP_MAX_NS)
+    {
+        double dt = (double)(mono_ns - last_ns) / 1e9;
+        double h = dt / 3600.0;
+        double out_w = (prev.output_w + counters.output_w) / 2.0;
+        double batt_w = (prev.battery_w + counters.battery_w) / 2.0;
+        counters.input_wh += (prev.input_w + counters.input_w) / 2.0 * h;
+        counters.output_wh += out_w * h;
+        if (batt_w > 0.0)
+            counters.charge_wh += batt_w * h;
+        else
+            counters.discharge_wh -= batt_w * h;
+        if (on_battery || last_on_battery)
+            counters.on_battery_sec += dt;
+
+        if (window.seconds == 0.0)
+            window.min_w = window.max_w = prev.output_w;
+        if (counters.output_w < window.min_w)
+            window.min_w = counters.output_w;
+        if (counters.output_w > window.max_w)
+            window.max_w = counters.output_w;
+        window.seconds += dt;
+        window.ws += out_w * dt;
+        if (!window.done || window.seconds >= cfg->power_window_sec)
+        {
+            counters.window_min_w = window.min_w;
+            counters.window_max_w = window.max_w;
+            counters.window_avg_w = window.ws / window.seconds;
+        }
+        if (window.seconds >= cfg->power_window_sec)
+        {
+            memset(&window, 0, sizeof window);
+            window.done = true;
+        }
+    }
+    last_ns = mono_ns;
+    last_on_battery = on_battery;
+    *out = counters;
+}
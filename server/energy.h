@@ -0,0 +1,52 @@
+// Part of UPS Server.
+// A websocket server reading data from a Bicker PSZ-1063 uExtension module
+// in combination with a Bicker UPS.
+//
+// Copyright (c) 2023 Michael Wolf <michael@mictronics.de>
+//
+// This file is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// any later version.
+//
+// This file is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef ENERGY_H
+#define ENERGY_H
+
+#include <stdint.h>
+#include "bicker.h"
+#include "settings.h"
+
+#define ENERGY_GAP_MAX_NS (60ULL * 1000000000ULL) // Longer poll gaps are not integrated
+
+/**
+ * Power of the latest full status poll and energy integrated over all polls.
+ * Counters only increase and are kept over restarts by the state file.
+ */
+typedef struct
+{
+    double input_w;   // Instantaneous power
+    double output_w;
+    double battery_w; // Positive while charging
+    int load_pct;     // Output current of the rated maximum
+    double input_wh;  // Monotonic counters
+    double output_wh;
+    double charge_wh;
+    double discharge_wh;
+    double on_battery_sec;
+    double window_min_w; // Output power over the last completed window
+    double window_max_w;
+    double window_avg_w;
+} energy_t;
+
+void energy_restore(const energy_t *e);
+void energy_update(const bicker_ups_status_t *ups, const ups_settings_t *cfg, uint64_t mono_ns, energy_t *out);
+
+#endif /* ENERGY_H */
@@ -0,0 +1,270 @@
+// Part of UPS Server.
+// A websocket server reading data from a Bicker PSZ-1063 uExtension module
+// in combination with a Bicker UPS.
+//
+// Copyright (c) 2023 Michael Wolf <michael@mictronics.de>
+//
+// This file is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// any later version.
+//
+// This file is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <libwebsockets.h>
+#include <json-c/json.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <math.h>
+#include "health.h"
+
+// Event loop only
+static char trend_path[PATH_MAX] = "";
+static health_record_t records[HEALTH_RECORDS_MAX]; // Latest measurements
+static int records_head = 0;                        // Next entry written
+static int records_len = 0;
+static health_summary_t summary;
+static bool was_measuring = false;
+static bool pending = false;  // Measurement finished, results are read by the next poll
+static time_t last_start = 0; // Scheduled measurement started
+
+/**
+ * Running sums of the least squares fits, time in days since the first measurement.
+ */
+static struct
+{
+    int64_t t0;
+    int32_t capacity_ref; // First measurement, reference for the end of life limits
+    int32_t esr_ref;
+    double n, t, tt, c, tc, e, te;
+} fit;
+
+/**
+ * Add a measurement to the ring and the fit.
+ */
+static void record_add(const health_record_t *r)
+{
+    if (fit.n == 0)
+    {
+        fit.t0 = r->time;
+        fit.capacity_ref = r->capacity;
+        fit.esr_ref = r->esr;
+    }
+    double t = (double)(r->time - fit.t0) / 86400.0;
+    fit.n += 1;
+    fit.t += t;
+    fit.tt += t * t;
+    fit.c += r->capacity;
+    fit.tc += t * r->capacity;
+    fit.e += r->esr;
+    fit.te += t * r->esr;
+
+    records[records_head] = *r;
+    records_head = (records_head + 1) % HEALTH_RECORDS_MAX;
+    if (records_len < HEALTH_RECORDS_MAX)
+    {
+        records_len++;
+    }
+    summary.count++;
+    summary.last = (time_t)r->time;
+}
+
+/**
+ * Update slopes and the predicted end of life, the earlier of capacity
+ * falling below or ESR rising above its limit relative to the first measurement.
+ */
+static void predict(const ups_settings_t *cfg)
+{
+    double d = fit.n * fit.tt - fit.t * fit.t;
+    summary.end_of_life = 0;
+    if (fit.n < HEALTH_FIT_MIN || d < 1e-9)
+    {
+        summary.capacity_slope = 0.0;
+        summary.esr_slope = 0.0;
+        return;
+    }
+    double cs = (fit.n * fit.tc - fit.t * fit.c) / d;
+    double ci = (fit.c - cs * fit.t) / fit.n;
+    double es = (fit.n * fit.te - fit.t * fit.e) / d;
+    double ei = (fit.e - es * fit.t) / fit.n;
+    double eol = INFINITY; // Days since the first measurement
+    if (cs < 0.0)
+    {
+        eol = fmin(eol, (fit.capacity_ref * cfg->health_eol_capacity / 100.0 - ci) / cs);
+    }
+    if (es > 0.0)
+    {
+        eol = fmin(eol, (fit.esr_ref * cfg->health_eol_esr / 100.0 - ei) / es);
+    }
+    summary.capacity_slope = cs;
+    summary.esr_slope = es;
+    if (isfinite(eol) && eol < 36500.0)
+    {
+        summary.end_of_life = (time_t)(fit.t0 + (int64_t)(eol * 86400.0));
+    }
+}
+
+/**
+ * Load the recorded measurements.
+ */
+void health_init(const ups_settings_t *cfg)
+{
+    health_record_t buf[64];
+    ssize_t n;
+
+    strcpy(trend_path, cfg->health_path);
+    if (trend_path[0] == '\0')
+    {
+        return;
+    }
+    int fd = open(trend_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        if (errno != ENOENT)
+            lwsl_warn("Error opening health trend %s: %s", trend_path, strerror(errno));
+        return;
+    }
+    while ((n = read(fd, buf, sizeof buf)) >= (ssize_t)sizeof(health_record_t))
+    {
+        for (size_t i = 0; i < (size_t)n / sizeof(health_record_t); i++)
+        {
+            if (buf[i].time > 0 && buf[i].time >= (int64_t)summary.last)
+            {
+                record_add(&buf[i]);
+            }
+        }
+    }
+    close(fd);
+    predict(cfg);
+    if (summary.count > 0)
+    {
+        lwsl_notice("Loaded %u capacitance/ESR measurements.", summary.count);
+    }
+}
+
+/**
+ * Append a completed measurement to the trend file.
+ */
+static void record_save(const health_record_t *r)
+{
+    if (trend_path[0] == '\0')
+    {
+        return;
+    }
+    int fd = open(trend_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0 || write(fd, r, sizeof(health_record_t)) != (ssize_t)sizeof(health_record_t))
+    {
+        lwsl_err("Error writing health trend %s: %s", trend_path, strerror(errno));
+    }
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+}
+
+/**
+ * Conditions allowing a measurement: on line power, charged and nothing running.
+ */
+static bool is_quiet(const bicker_ups_status_t *ups)
+{
+    return ups->device_status.reg.is_power_present && !ups->device_status.reg.is_shutdown_set &&
+           !ups->device_status.reg.is_discharging && ups->soc >= 90 && !ups->monitor_status.reg.is_esr_measuring;
+}
+
+/**
+ * Record finished measurements and check the schedule, called for every full status poll.
+ * Returns true when a scheduled measurement is due now.
+ */
+bool health_update(const bicker_ups_status_t *ups, const ups_settings_t *cfg, time_t now)
+{
+    bool measuring = ups->monitor_status.reg.is_esr_measuring;
+    if (pending)
+    {
+        pending = false;
+        health_record_t r = {.time = (int64_t)now, .capacity = ups->capacity, .esr = ups->esr};
+        if (r.capacity > 0 && r.esr > 0)
+        {
+            record_add(&r);
+            record_save(&r);
+            lwsl_notice("Capacitance/ESR measurement recorded, capacity %d, ESR %d.", r.capacity, r.esr);
+        }
+    }
+    if (was_measuring && !measuring)
+    {
+        if (ups->monitor_status.reg.is_capacity_complete && ups->monitor_status.reg.is_esr_complete &&
+            !ups->monitor_status.reg.is_last_cap_fail && !ups->monitor_status.reg.is_last_esr_fail)
+        {
+            pending = true;
+        }
+        else
+        {
+            lwsl_warn("Capacitance/ESR measurement failed.");
+        }
+    }
+    was_measuring = measuring;
+    predict(cfg);
+
+    if (!cfg->health_schedule)
+    {
+        return false;
+    }
+    struct tm t;
+    localtime_r(&now, &t);
+    int since = t.tm_hour * 60 + t.tm_min - (int)cfg->health_time_min;
+    if (since < 0)
+    {
+        since += 24 * 60;
+    }
+    time_t window = (time_t)cfg->health_window_min * 60;
+    time_t interval = (time_t)cfg->health_interval_days * 86400;
+    if (since >= (int)cfg->health_window_min || now - last_start < window ||
+        (summary.last != 0 && now - summary.last < interval - window) || !is_quiet(ups))
+    {
+        return false;
+    }
+    last_start = now;
+    return true;
+}
+
+/**
+ * Latest fit, for status updates and metrics.
+ */
+const health_summary_t *health_summary(void)
+{
+    return &summary;
+}
+
+/**
+ * Recorded measurements as column arrays and the fit.
+ */
+json_object *health_query(void)
+{
+    json_object *jtime = json_object_new_array();
+    json_object *jcap = json_object_new_array();
+    json_object *jesr = json_object_new_array();
+    for (int k = records_len; k > 0; k--)
+    {
+        const health_record_t *r = &records[(records_head + HEALTH_RECORDS_MAX - k) % HEALTH_RECORDS_MAX];
+        json_object_array_add(jtime, json_object_new_int64(r->time));
+        json_object_array_add(jcap, json_object_new_int(r->capacity));
+        json_object_array_add(jesr, json_object_new_int(r->esr));
+    }
+    json_object *jroot = json_object_new_object();
+    json_object_object_add(jroot, "time", jtime);
+    json_object_object_add(jroot, "capacity", jcap);
+    json_object_object_add(jroot, "esr", jesr);
+    json_object_object_add(jroot, "capacitySlope", json_object_new_double(summary.capacity_slope));
+    json_object_object_add(jroot, "esrSlope", json_object_new_double(summary.esr_slope));
+    json_object_object_add(jroot, "endOfLife", json_object_new_int64((int64_t)summary.end_of_life));
+    return jroot;
+}
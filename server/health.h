@@ -0,0 +1,60 @@
+// Part of UPS Server.
+// A websocket server reading data from a Bicker PSZ-1063 uExtension module
+// in combination with a Bicker UPS.
+//
+// Copyright (c) 2023 Michael Wolf <michael@mictronics.de>
+//
+// This file is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// any later version.
+//
+// This file is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef HEALTH_H
+#define HEALTH_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <json-c/json.h>
+#include "bicker.h"
+#include "settings.h"
+
+#define HEALTH_RECORDS_MAX 520 // Measurements kept for queries, ten years weekly
+#define HEALTH_FIT_MIN 3       // Measurements needed for a prediction
+
+/**
+ * Completed capacitance/ESR measurement as stored in the trend file.
+ */
+typedef struct __attribute__((__packed__))
+{
+    int64_t time;     // Unix time
+    int32_t capacity; // GET_CAPACITY register value
+    int32_t esr;      // GET_ESR register value
+} health_record_t;
+
+/**
+ * Degradation fit over all recorded measurements.
+ */
+typedef struct
+{
+    unsigned int count;    // Measurements recorded
+    time_t last;           // Last measurement, 0 if none
+    double capacity_slope; // Change per day
+    double esr_slope;      // Change per day
+    time_t end_of_life;    // Predicted, 0 if unknown
+} health_summary_t;
+
+void health_init(const ups_settings_t *cfg);
+bool health_update(const bicker_ups_status_t *ups, const ups_settings_t *cfg, time_t now);
+const health_summary_t *health_summary(void);
+json_object *health_query(void);
+
+#endif /* HEALTH_H */
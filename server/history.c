@@ -0,0 +1,117 @@
+// Part of UPS Server.
+// A websocket server reading data from a Bicker PSZ-1063 uExtension module
+// in combination with a Bicker UPS.
+//
+// Copyright (c) 2023 Michael Wolf <michael@mictronics.de>
+//
+// This file is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// any later version.
+//
+// This file is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <libwebsockets.h>
+#include <json-c/json.h>
+#include <string.h>
+#include "history.h"
+
+static history_t local;
+static history_t *h = &local;
+
+/**
+ * Keep the history in external memory, e.g. the mapped state file.
+ * With keep the samples already in mem are restored, otherwise mem takes the current ones.
+ */
+void history_attach(history_t *mem, bool keep)
+{
+    if (!keep || mem->head < 0 || mem->head >= HISTORY_SIZE || mem->len < 0 || mem->len > HISTORY_SIZE)
+    {
+        memcpy(mem, h, sizeof(history_t));
+    }
+    h = mem;
+}
+
+/**
+ * Store a status sample. At most one sample per second is kept, fast polling overwrites the latest.
+ */
+void history_add(const bicker_ups_status_t *ups, time_t now)
+{
+    int i = h->head;
+    if (h->len > 0 && h->entry[(h->head + HISTORY_SIZE - 1) % HISTORY_SIZE].time == now)
+    {
+        i = (h->head + HISTORY_SIZE - 1) % HISTORY_SIZE;
+    }
+    else
+    {
+        h->head = (h->head + 1) % HISTORY_SIZE;
+        if (h->len < HISTORY_SIZE)
+        {
+            h->len++;
+        }
+    }
+    history_entry_t *e = &h->entry[i];
+    e->time = now;
+    e->input_voltage = ups->input_voltage;
+    e->output_voltage = ups->output_voltage;
+    e->battery_voltage = ups->battery_voltage;
+    e->output_current = ups->output_current;
+    e->battery_current = ups->battery_current;
+    e->soc = ups->soc;
+    e->device_status = ups->device_status.value;
+}
+
+/**
+ * Samples newer than since, the latest count at most, as column arrays.
+ */
+json_object *history_query(time_t since, int count)
+{
+    if (count <= 0 || count > HISTORY_REPLY_MAX)
+    {
+        count = HISTORY_REPLY_MAX;
+    }
+    // Walk back from the latest sample to find the first one to report
+    int n = 0;
+    while (n < h->len && n < count &&
+           h->entry[(h->head + HISTORY_SIZE - 1 - n) % HISTORY_SIZE].time > since)
+    {
+        n++;
+    }
+
+    json_object *jtime = json_object_new_array();
+    json_object *jinv = json_object_new_array();
+    json_object *joutv = json_object_new_array();
+    json_object *jbattv = json_object_new_array();
+    json_object *jouta = json_object_new_array();
+    json_object *jbatta = json_object_new_array();
+    json_object *jsoc = json_object_new_array();
+    json_object *jdev = json_object_new_array();
+    for (int k = n; k > 0; k--)
+    {
+        const history_entry_t *e = &h->entry[(h->head + HISTORY_SIZE - k) % HISTORY_SIZE];
+        json_object_array_add(jtime, json_object_new_int64((int64_t)e->time));
+        json_object_array_add(jinv, json_object_new_int(e->input_voltage));
+        json_object_array_add(joutv, json_object_new_int(e->output_voltage));
+        json_object_array_add(jbattv, json_object_new_int(e->battery_voltage));
+        json_object_array_add(jouta, json_object_new_int(e->output_current));
+        json_object_array_add(jbatta, json_object_new_int(e->battery_current));
+        json_object_array_add(jsoc, json_object_new_int(e->soc));
+        json_object_array_add(jdev, json_object_new_int(e->device_status));
+    }
+    json_object *jroot = json_object_new_object();
+    json_object_object_add(jroot, "time", jtime);
+    json_object_object_add(jroot, "inputVoltage", jinv);
+    json_object_object_add(jroot, "outputVoltage", joutv);
+    json_object_object_add(jroot, "batteryVoltage", jbattv);
+    json_object_object_add(jroot, "outputCurrent", jouta);
+    json_object_object_add(jroot, "batteryCurrent", jbatta);
+    json_object_object_add(jroot, "soc", jsoc);
+    json_object_object_add(jroot, "deviceStatus", jdev);
+    return jroot;
+}
@@ -0,0 +1,59 @@
+// Part of UPS Server.
+// A websocket server reading data from a Bicker PSZ-1063 uExtension module
+// in combination with a Bicker UPS.
+//
+// Copyright (c) 2023 Michael Wolf <michael@mictronics.de>
+//
+// This file is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// any later version.
+//
+// This file is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <time.h>
+#include <json-c/json.h>
+#include "bicker.h"
+
+#define HISTORY_SIZE 3600      // Entries, one hour at one entry per second
+#define HISTORY_REPLY_MAX 600 // Entries per query reply
+
+/**
+ * UPS status sample kept in history
+ */
+typedef struct
+{
+    time_t time;
+    signed int input_voltage;   // mV
+    signed int output_voltage;  // mV
+    signed int battery_voltage; // mV
+    signed int output_current;  // mA
+    signed int battery_current; // mA
+    signed int soc;             // %
+    unsigned char device_status;
+} history_entry_t;
+
+/**
+ * Ring of samples, kept in the state file when one is mapped.
+ */
+typedef struct
+{
+    int head; // Next entry written
+    int len;
+    history_entry_t entry[HISTORY_SIZE];
+} history_t;
+
+void history_attach(history_t *mem, bool keep);
+void history_add(const bicker_ups_status_t *ups, time_t now);
+json_object *history_query(time_t since, int count);
+
+#endif /* HISTORY_H */
@@ -0,0 +1,176 @@
+// Part of UPS Server.
+// A websocket server reading data from a Bicker PSZ-1063 uExtension module
+// in combination with a Bicker UPS.
+//
+// Copyright (c) 2023 Michael Wolf <michael@mictronics.de>
+//
+// This file is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// any later version.
+//
+// This file is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <libwebsockets.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "metrics.h"
+
+// Event loop only, the sink runs inline and scrapes are served by the loop
+static ups_snapshot_t latest;      // Latest status update, settings not referenced
+static bool dirty = false;         // latest not rendered yet
+static char metrics[METRICS_SIZE]; // UPS part of the exposition, rendered on the first scrape after an update
+static size_t metrics_len = 0;
+
+/**
+ * Append one gauge with help and type line.
+ */
+static int gauge(char *buf, size_t size, const char *name, const char *help, double value)
+{
+    return snprintf(buf, size, "# HELP %s %s\n# TYPE %s gauge\n%s %.15g\n", name, help, name, name, value);
+}
+
+/**
+ * Append one counter with help and type line.
+ */
+static int counter(char *buf, size_t size, const char *name, const char *help, double value)
+{
+    return snprintf(buf, size, "# HELP %s %s\n# TYPE %s counter\n%s %.3f\n", name, help, name, name, value);
+}
+
+/**
+ * Format the Prometheus text exposition of the latest snapshot.
+ */
+static void metrics_render(void)
+{
+    char *buf = metrics;
+    const ups_snapshot_t *snap = &latest;
+    const bicker_ups_status_t *ups = &snap->ups;
+    size_t n = 0;
+
+#define GAUGE(name, help, value)                                                   \
+    if (n < sizeof metrics)                                                        \
+    {                                                                              \
+        n += gauge(&buf[n], sizeof metrics - n, "ups_" name, help, (double)(value)); \
+    }
+    GAUGE("input_voltage_volts", "Input voltage.", ups->input_voltage / 1000.0);
+    GAUGE("output_voltage_volts", "Output voltage.", ups->output_voltage / 1000.0);
+    GAUGE("battery_voltage_volts", "Battery voltage.", ups->battery_voltage / 1000.0);
+    GAUGE("input_current_amps", "Input current.", ups->input_current / 1000.0);
+    GAUGE("output_current_amps", "Output current.", ups->output_current / 1000.0);
+    GAUGE("input_power_watts", "Input power.", snap->energy.input_w);
+    GAUGE("output_power_watts", "Output power.", snap->energy.output_w);
+    GAUGE("battery_power_watts", "Battery power, positive while charging.", snap->energy.battery_w);
+    GAUGE("load_percent", "Output current of the rated maximum.", snap->energy.load_pct);
+    GAUGE("output_power_min_watts", "Minimum output power over the last window.", snap->energy.window_min_w);
+    GAUGE("output_power_max_watts", "Maximum output power over the last window.", snap->energy.window_max_w);
+    GAUGE("output_power_avg_watts", "Average output power over the last window.", snap->energy.window_avg_w);
+    GAUGE("battery_current_amps", "Battery current.", ups->battery_current / 1000.0);
+    GAUGE("state_of_charge_percent", "Battery state of charge.", ups->soc);
+    GAUGE("temperature_celsius", "Controller temperature.", ups->uc_temperature);
+    GAUGE("remain_seconds", "Estimated remaining backup time.", snap->remain);
+    GAUGE("power_present", "Input power present.", ups->device_status.reg.is_power_present ? 1 : 0);
+    GAUGE("power_fail_count", "Power fails since service start.", snap->power_fail_count);
+    GAUGE("poll_interval_seconds", "Full status update interval.", snap->poll_interval / 1000.0);
+    GAUGE("last_update_timestamp_seconds", "Time of the last full status update.", snap->time);
+    GAUGE("capacity", "Last capacitance measurement, register value.", ups->capacity);
+    GAUGE("esr", "Last ESR measurement, register value.", ups->esr);
+    GAUGE("health_measurements", "Capacitance/ESR measurements recorded.", snap->health.count);
+    GAUGE("health_last_timestamp_seconds", "Time of the last recorded measurement.", snap->health.last);
+    GAUGE("capacity_slope_per_day", "Fitted capacitance change per day.", snap->health.capacity_slope);
+    GAUGE("esr_slope_per_day", "Fitted ESR change per day.", snap->health.esr_slope);
+    GAUGE("end_of_life_timestamp_seconds", "Predicted capacitor end of life, 0 if unknown.", snap->health.end_of_life);
+#define COUNTER(name, help, value)                                                      \
+    if (n < sizeof metrics)                                                             \
+    {                                                                                   \
+        n += counter(&buf[n], sizeof metrics - n, "ups_" name, help, (double)(value)); \
+    }
+    COUNTER("input_energy_wh_total", "Input energy.", snap->energy.input_wh);
+    COUNTER("output_energy_wh_total", "Output energy.", snap->energy.output_wh);
+    COUNTER("battery_charge_energy_wh_total", "Energy charged into the battery.", snap->energy.charge_wh);
+    COUNTER("battery_discharge_energy_wh_total", "Energy discharged from the battery.", snap->energy.discharge_wh);
+    COUNTER("on_battery_seconds_total", "Time on battery.", snap->energy.on_battery_sec);
+#undef COUNTER
+#undef GAUGE
+    metrics_len = MIN(n, sizeof metrics - 1);
+}
+
+/**
+ * Keep the latest snapshot for the next scrape.
+ */
+static void metrics_consume(const sink_item_t *item)
+{
+    latest = item->snapshot;
+    latest.cfg = NULL; // Not used for the exposition
+    dirty = true;
+}
+
+static sink_t metrics_sink = {
+    .name = "metrics",
+    .threaded = false,
+    .snapshots = true,
+    .consume = metrics_consume,
+};
+
+/**
+ * Register the metrics sink.
+ */
+int metrics_init(void)
+{
+    return sink_register(&metrics_sink);
+}
+
+/**
+ * Get a copy of the current exposition including the sink counters.
+ * Returns NULL before the first update, the caller frees the copy.
+ */
+char *metrics_get(size_t *len)
+{
+    sink_stats_t stats[SINK_MAX];
+    int count = sinks_stats(stats, SINK_MAX);
+    size_t size = METRICS_SIZE + (size_t)count * 512;
+    char *buf = malloc(size);
+    if (buf == NULL)
+    {
+        return NULL;
+    }
+
+    if (dirty)
+    {
+        metrics_render();
+        dirty = false;
+    }
+    size_t n = metrics_len;
+    memcpy(buf, metrics, n);
+    if (n == 0)
+    {
+        free(buf);
+        return NULL;
+    }
+
+    n += snprintf(&buf[n], size - n, "# HELP ups_sink_published_total Items published to an output sink.\n"
+                                     "# TYPE ups_sink_published_total counter\n");
+    for (int i = 0; i < count; i++)
+        n += snprintf(&buf[n], size - n, "ups_sink_published_total{sink=\"%s\"} %lu\n", stats[i].name, stats[i].published);
+    n += snprintf(&buf[n], size - n, "# HELP ups_sink_dropped_total Items dropped by a full sink queue.\n"
+                                     "# TYPE ups_sink_dropped_total counter\n");
+    for (int i = 0; i < count; i++)
+        n += snprintf(&buf[n], size - n, "ups_sink_dropped_total{sink=\"%s\"} %lu\n", stats[i].name, stats[i].dropped);
+    n += snprintf(&buf[n], size - n, "# HELP ups_sink_queued Items waiting in a sink queue.\n"
+                                     "# TYPE ups_sink_queued gauge\n");
+    for (int i = 0; i < count; i++)
+        n += snprintf(&buf[n], size - n, "ups_sink_queued{sink=\"%s\"} %u\n", stats[i].name, stats[i].queued);
+    n += snprintf(&buf[n], size - n, "# HELP ups_sink_lag_seconds Publish to processing delay of the last item.\n"
+                                     "# TYPE ups_sink_lag_seconds gauge\n");
+    for (int i = 0; i < count; i++)
+        n += snprintf(&buf[n], size - n, "ups_sink_lag_seconds{sink=\"%s\"} %g\n", stats[i].name, stats[i].lag_ms / 1000.0);
+    *len = MIN(n, size - 1);
+    return buf;
+}
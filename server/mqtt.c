@@ -0,0 +1,284 @@
+// Part of UPS Server.
+// A websocket server reading data from a Bicker PSZ-1063 uExtension module
+// in combination with a Bicker UPS.
+//
+// Copyright (c) 2023 Michael Wolf <michael@mictronics.de>
+//
+// This file is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// any later version.
+//
+// This file is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <libwebsockets.h>
+#include <mosquitto.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "mqtt.h"
+#include "sinks.h"
+#include "status.h"
+
+#define NOTUSED(V) ((void)V)
+
+/**
+ * Last value published per status field, only changes are sent.
+ */
+typedef struct
+{
+    char value[MQTT_VALUE_MAX];
+} mqtt_field_t;
+
+static struct mosquitto *mosq = NULL;
+static mqtt_event_text_cb_t event_text_cb = NULL;
+static ups_settings_t conn; // Connection settings copied at start
+
+// Written by the libmosquitto network thread
+static pthread_mutex_t lock_mqtt = PTHREAD_MUTEX_INITIALIZER;
+static bool connected = false;
+static bool resync = false; // Publish all fields with the next batch
+
+// Sink thread only
+static bool started = false; // Initial connect done, libmosquitto reconnects from here on
+static unsigned int connect_delay = 0;
+static struct timespec connect_time;
+static struct timespec batch_time;
+static mqtt_field_t fields[STATUS_FIELD_COUNT];
+static status_frame_t frame; // Rendered in place each batch
+
+/**
+ * Milliseconds since a monotonic time.
+ */
+static long since_ms(const struct timespec *t)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - t->tv_sec) * 1000 + (now.tv_nsec - t->tv_nsec) / 1000000;
+}
+
+/**
+ * Publish below the configured topic prefix.
+ */
+static void publish(const char *sub, const char *payload, int qos, bool retain)
+{
+    char topic[sizeof conn.mqtt_topic + 40];
+    snprintf(topic, sizeof topic, "%s/%s", conn.mqtt_topic, sub);
+    int rc = mosquitto_publish(mosq, NULL, topic, (int)strlen(payload), payload, qos, retain);
+    if (rc != MOSQ_ERR_SUCCESS)
+    {
+        lwsl_info("MQTT publish %s failed: %s", topic, mosquitto_strerror(rc));
+    }
+}
+
+/**
+ * Connection established, libmosquitto network thread.
+ */
+static void on_connect(struct mosquitto *m, void *obj, int rc, int flags)
+{
+    NOTUSED(obj);
+    if (rc != 0)
+    {
+        lwsl_warn("MQTT connection refused: %s", mosquitto_connack_string(rc));
+        return;
+    }
+    lwsl_notice("MQTT connected to %s:%d%s.", conn.mqtt_host, conn.mqtt_port, (flags & 1) ? ", session resumed" : "");
+    pthread_mutex_lock(&lock_mqtt);
+    connected = true;
+    // Retained values may be gone when the broker restarted
+    resync = true;
+    pthread_mutex_unlock(&lock_mqtt);
+    char topic[sizeof conn.mqtt_topic + 8];
+    snprintf(topic, sizeof topic, "%s/status", conn.mqtt_topic);
+    mosquitto_publish(m, NULL, topic, 6, "online", 1, true);
+}
+
+/**
+ * Connection closed or lost, libmosquitto network thread.
+ */
+static void on_disconnect(struct mosquitto *m, void *obj, int rc)
+{
+    NOTUSED(m);
+    NOTUSED(obj);
+    pthread_mutex_lock(&lock_mqtt);
+    connected = false;
+    pthread_mutex_unlock(&lock_mqtt);
+    if (rc != 0)
+    {
+        lwsl_warn("MQTT connection lost, reconnecting.");
+    }
+}
+
+/**
+ * First connection to the broker. Blocks the sink thread only, retried with backoff until it succeeds.
+ */
+static void mqtt_connect(void)
+{
+    mosquitto_property *props = NULL;
+
+    if (connect_delay > 0 && since_ms(&connect_time) < (long)connect_delay * 1000)
+    {
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &connect_time);
+    if (conn.mqtt_version == 5)
+    {
+        // Without expiry an MQTT 5 broker drops the session on disconnect
+        mosquitto_property_add_int32(&props, MQTT_PROP_SESSION_EXPIRY_INTERVAL, MQTT_SESSION_EXPIRY);
+    }
+    int rc = mosquitto_connect_bind_v5(mosq, conn.mqtt_host, conn.mqtt_port, conn.mqtt_keepalive, NULL, props);
+    mosquitto_property_free_all(&props);
+    if (rc != MOSQ_ERR_SUCCESS)
+    {
+        connect_delay = connect_delay == 0 ? 1 : MIN(connect_delay * 2, 60U);
+        lwsl_warn("MQTT connect to %s:%d failed: %s, retry in %u s.", conn.mqtt_host, conn.mqtt_port,
+                  mosquitto_strerror(rc), connect_delay);
+        return;
+    }
+    rc = mosquitto_loop_start(mosq);
+    if (rc != MOSQ_ERR_SUCCESS)
+    {
+        lwsl_err("MQTT network thread failed: %s", mosquitto_strerror(rc));
+        mosquitto_disconnect(mosq);
+        return;
+    }
+    started = true;
+}
+
+/**
+ * Publish the status fields changed since the last batch.
+ */
+static void mqtt_publish_status(const ups_snapshot_t *snap)
+{
+    pthread_mutex_lock(&lock_mqtt);
+    bool online = connected;
+    bool all = resync;
+    resync = false;
+    pthread_mutex_unlock(&lock_mqtt);
+
+    // Retained state is sent again in full after reconnecting, nothing is queued while offline
+    if (!online || (!all && since_ms(&batch_time) < (long)snap->cfg->mqtt_interval_ms))
+    {
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &batch_time);
+
+    status_render(snap, &frame);
+    for (int i = 0; i < STATUS_FIELD_COUNT; i++)
+    {
+        char value[STATUS_VALUE_MAX];
+        const char *v = STATUS_VALUE(&frame, i);
+        int len = frame.len[i];
+        if (status_types[i] == STATUS_META)
+        {
+            continue; // Change of every sample, topics hold the latest value only
+        }
+        if (status_types[i] == STATUS_STRING && len >= 2)
+        {
+            v++; // Payload without JSON quotes
+            len -= 2;
+        }
+        snprintf(value, sizeof value, "%.*s", len, v);
+        mqtt_field_t *f = &fields[i];
+        if (!all && strncmp(f->value, value, MQTT_VALUE_MAX - 1) == 0)
+        {
+            continue;
+        }
+        snprintf(f->value, sizeof f->value, "%s", value);
+        publish(status_fields[i], value, 0, true);
+    }
+}
+
+/**
+ * MQTT sink thread.
+ */
+static void mqtt_consume(const sink_item_t *item)
+{
+    char text[SINK_DETAIL_MAX + 32];
+
+    if (!started)
+    {
+        mqtt_connect();
+    }
+    if (item->type == SINK_ITEM_SNAPSHOT)
+    {
+        mqtt_publish_status(&item->snapshot);
+    }
+    else if (started)
+    {
+        // QoS 1 events are held by libmosquitto while the broker is unreachable
+        event_text_cb(item->event.event, item->event.detail, text, sizeof text);
+        publish("event", text, 1, false);
+    }
+}
+
+static sink_t mqtt_sink = {
+    .name = "mqtt",
+    .threaded = true,
+    .snapshots = true,
+    .events = true,
+    .allocates = true, // libmosquitto allocates per message
+    .consume = mqtt_consume,
+};
+
+/**
+ * Create the MQTT client and register its sink. Does nothing when disabled.
+ */
+int mqtt_init(const ups_settings_t *cfg, mqtt_event_text_cb_t event_text)
+{
+    char topic[sizeof cfg->mqtt_topic + 8];
+
+    if (!cfg->mqtt_enable)
+    {
+        return EXIT_SUCCESS;
+    }
+    conn = *cfg;
+    event_text_cb = event_text;
+    mosquitto_lib_init();
+    // Persistent session, QoS 1 messages in flight are delivered after reconnecting
+    mosq = mosquitto_new(conn.mqtt_client_id, false, NULL);
+    if (mosq == NULL)
+    {
+        lwsl_err("MQTT client init failed.");
+        mosquitto_lib_cleanup();
+        return EXIT_FAILURE;
+    }
+    mosquitto_int_option(mosq, MOSQ_OPT_PROTOCOL_VERSION, conn.mqtt_version == 5 ? MQTT_PROTOCOL_V5 : MQTT_PROTOCOL_V311);
+    if (conn.mqtt_user[0] != '\0')
+    {
+        mosquitto_username_pw_set(mosq, conn.mqtt_user, conn.mqtt_password[0] != '\0' ? conn.mqtt_password : NULL);
+    }
+    snprintf(topic, sizeof topic, "%s/status", conn.mqtt_topic);
+    mosquitto_will_set(mosq, topic, 7, "offline", 1, true);
+    mosquitto_reconnect_delay_set(mosq, 1, 60, true);
+    mosquitto_connect_flags_callback_set(mosq, on_connect);
+    mosquitto_disconnect_callback_set(mosq, on_disconnect);
+    return sink_register(&mqtt_sink);
+}
+
+/**
+ * Announce offline and disconnect, after the sinks are stopped.
+ */
+void mqtt_stop(void)
+{
+    if (mosq == NULL)
+    {
+        return;
+    }
+    if (started)
+    {
+        publish("status", "offline", 1, true);
+        mosquitto_disconnect(mosq);
+        mosquitto_loop_stop(mosq, false);
+    }
+    mosquitto_destroy(mosq);
+    mosq = NULL;
+    mosquitto_lib_cleanup();
+}
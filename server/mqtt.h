@@ -0,0 +1,36 @@
+// Part of UPS Server.
+// A websocket server reading data from a Bicker PSZ-1063 uExtension module
+// in combination with a Bicker UPS.
+//
+// Copyright (c) 2023 Michael Wolf <michael@mictronics.de>
+//
+// This file is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// any later version.
+//
+// This file is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef MQTT_H
+#define MQTT_H
+
+#include "settings.h"
+
+#define MQTT_VALUE_MAX 64
+#define MQTT_SESSION_EXPIRY 3600 // seconds, MQTT 5 session kept by the broker while offline
+
+/**
+ * Text of an event published to the event topic.
+ */
+typedef void (*mqtt_event_text_cb_t)(int event, const char *detail, char *buf, size_t size);
+
+int mqtt_init(const ups_settings_t *cfg, mqtt_event_text_cb_t event_text);
+void mqtt_stop(void);
+
+#endif /* MQTT_H */
@@ -0,0 +1,426 @@
+// Part of UPS Server.
+// A websocket server reading data from a Bicker PSZ-1063 uExtension module
+// in combination with a Bicker UPS.
+//
+// Copyright (c) 2023 Michael Wolf <michael@mictronics.de>
+//
+// This file is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// any later version.
+//
+// This file is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <libwebsockets.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include "push.h"
+#include "sinks.h"
+#include "status.h"
+#include "alloccheck.h"
+
+// Sink thread only
+static ups_settings_t conn; // Connection settings copied at start
+static char hostname[64];
+static int sock = -1;
+static unsigned int retry_delay = 0; // seconds
+static struct timespec retry_time;
+static char batch[PUSH_BATCH_MAX];
+static size_t batch_len = 0;
+static struct timespec batch_time; // First line in batch
+static long spool_pos = 0;         // Spool replayed up to here
+static bool spool_full = false;
+static bool spool_pending = true; // Spool may hold data, a left over one is checked after start
+static status_frame_t frame; // Rendered in place per snapshot
+
+/**
+ * Milliseconds since a monotonic time.
+ */
+static long since_ms(const struct timespec *t)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - t->tv_sec) * 1000 + (now.tv_nsec - t->tv_nsec) / 1000000;
+}
+
+/**
+ * Close the collector connection and wait longer before the next attempt.
+ */
+static void push_close(void)
+{
+    if (sock >= 0)
+    {
+        close(sock);
+        sock = -1;
+    }
+    retry_delay = retry_delay == 0 ? 1 : MIN(retry_delay * 2, (unsigned int)PUSH_RETRY_MAX);
+    clock_gettime(CLOCK_MONOTONIC, &retry_time);
+}
+
+/**
+ * Open the collector connection unless waiting for the next attempt.
+ * UDP sockets are connected as well, so an unreachable collector is reported by send().
+ */
+static bool push_connect(void)
+{
+    struct addrinfo hints, *res, *ai;
+    char port[8];
+    struct timeval tv = {.tv_sec = 2, .tv_usec = 0};
+
+    if (sock >= 0)
+    {
+        return true;
+    }
+    if (retry_delay > 0 && since_ms(&retry_time) < (long)retry_delay * 1000)
+    {
+        return false;
+    }
+    alloc_check_ignore(); // Resolving allocates, reconnecting is not steady state
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = conn.push_tcp ? SOCK_STREAM : SOCK_DGRAM;
+    snprintf(port, sizeof port, "%d", conn.push_port);
+    int rc = getaddrinfo(conn.push_host, port, &hints, &res);
+    if (rc != 0)
+    {
+        lwsl_warn("Push collector %s not resolved: %s", conn.push_host, gai_strerror(rc));
+        push_close();
+        return false;
+    }
+    for (ai = res; ai != NULL; ai = ai->ai_next)
+    {
+        sock = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (sock < 0)
+        {
+            continue;
+        }
+        setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof tv);
+        if (connect(sock, ai->ai_addr, ai->ai_addrlen) == 0)
+        {
+            break;
+        }
+        close(sock);
+        sock = -1;
+    }
+    freeaddrinfo(res);
+    if (sock < 0)
+    {
+        lwsl_warn("Push collector %s:%d unreachable: %s", conn.push_host, conn.push_port, strerror(errno));
+        push_close();
+        return false;
+    }
+    if (retry_delay > 0)
+    {
+        lwsl_notice("Push collector %s:%d reachable.", conn.push_host, conn.push_port);
+    }
+    retry_delay = 0;
+    return true;
+}
+
+/**
+ * Send a batch of complete lines. Returns false when it was not delivered.
+ */
+static bool push_send(const char *buf, size_t len)
+{
+    if (!push_connect())
+    {
+        return false;
+    }
+    while (len > 0)
+    {
+        ssize_t n = send(sock, buf, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            lwsl_warn("Push to %s:%d failed: %s", conn.push_host, conn.push_port, strerror(errno));
+            push_close();
+            return false;
+        }
+        // A datagram is sent as a whole
+        buf += n;
+        len -= (size_t)n;
+    }
+    return true;
+}
+
+/**
+ * Keep an undelivered batch on disk. Newer data is dropped when the spool is full.
+ */
+static void spool_append(const char *buf, size_t len)
+{
+    struct stat st;
+    if (conn.push_spool_max == 0)
+    {
+        return;
+    }
+    if (stat(conn.push_spool, &st) == 0 && (size_t)st.st_size + len > (size_t)conn.push_spool_max * 1024)
+    {
+        if (!spool_full)
+        {
+            lwsl_warn("Push spool %s full, dropping updates.", conn.push_spool);
+            spool_full = true;
+        }
+        return;
+    }
+    alloc_check_ignore(); // Collector unreachable
+    FILE *fp = fopen(conn.push_spool, "a");
+    if (fp == NULL)
+    {
+        lwsl_err("Error writing push spool %s: %s", conn.push_spool, strerror(errno));
+        return;
+    }
+    fwrite(buf, 1, len, fp);
+    fclose(fp);
+    spool_pending = true;
+}
+
+/**
+ * Resend spooled batches once the collector is reachable, a few per flush.
+ * The spool is removed when everything was delivered.
+ */
+static void spool_replay(void)
+{
+    char buf[PUSH_BATCH_MAX];
+
+    if (conn.push_spool_max == 0 || sock < 0 || !spool_pending)
+    {
+        return;
+    }
+    alloc_check_ignore();
+    FILE *fp = fopen(conn.push_spool, "r");
+    if (fp == NULL)
+    {
+        spool_pending = errno != ENOENT;
+        return;
+    }
+    if (fseek(fp, spool_pos, SEEK_SET) != 0)
+    {
+        fclose(fp);
+        return;
+    }
+    size_t chunk = MIN((size_t)conn.push_batch_size, sizeof buf);
+    for (int i = 0; i < PUSH_REPLAY_CHUNKS; i++)
+    {
+        size_t n = fread(buf, 1, chunk, fp);
+        if (n == 0)
+        {
+            // All delivered
+            fclose(fp);
+            unlink(conn.push_spool);
+            spool_pos = 0;
+            spool_full = false;
+            spool_pending = false;
+            lwsl_notice("Push spool delivered.");
+            return;
+        }
+        // Resend complete lines only, the rest follows with the next chunk
+        size_t end = n;
+        while (end > 0 && buf[end - 1] != '\n')
+        {
+            end--;
+        }
+        if (end == 0)
+        {
+            end = n; // Line longer than a chunk
+        }
+        if (!push_send(buf, end))
+        {
+            break;
+        }
+        spool_pos += (long)end;
+        fseek(fp, spool_pos, SEEK_SET);
+    }
+    fclose(fp);
+}
+
+/**
+ * Send the current batch, spool it when that fails.
+ */
+static void push_flush(void)
+{
+    if (batch_len == 0)
+    {
+        return;
+    }
+    if (!push_send(batch, batch_len))
+    {
+        spool_append(batch, batch_len);
+    }
+    batch_len = 0;
+    spool_replay();
+}
+
+/**
+ * Add one update to the batch. The batch is sent when it is full or old enough.
+ */
+static void push_append(const char *line, size_t len)
+{
+    if (batch_len > 0 && batch_len + len > conn.push_batch_size)
+    {
+        push_flush();
+    }
+    if (batch_len == 0)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &batch_time);
+    }
+    len = MIN(len, sizeof batch - batch_len);
+    memcpy(&batch[batch_len], line, len);
+    batch_len += len;
+    if (batch_len >= conn.push_batch_size || since_ms(&batch_time) >= (long)conn.push_interval_ms)
+    {
+        push_flush();
+    }
+}
+
+/**
+ * Format the numeric status fields, one line in line protocol or one line per field in Graphite plaintext.
+ */
+static size_t format_status(const ups_snapshot_t *snap, char *buf, size_t size)
+{
+    size_t n = 0;
+    bool first = true;
+
+    if (!conn.push_graphite)
+    {
+        n += snprintf(buf, size, "%s,host=%s ", conn.push_prefix, hostname);
+    }
+    status_render(snap, &frame);
+    for (int i = 0; i < STATUS_FIELD_COUNT; i++)
+    {
+        if (status_types[i] == STATUS_STRING || status_types[i] == STATUS_META || frame.len[i] == 0)
+        {
+            continue; // Text is static and not a metric, the line carries the timestamp
+        }
+        // Integers are marked in line protocol, they would be stored as float otherwise
+        const char *mark = (!conn.push_graphite && status_types[i] == STATUS_INTEGER) ? "i" : "";
+        if (n >= size)
+        {
+            break;
+        }
+        if (conn.push_graphite)
+        {
+            n += snprintf(&buf[n], size - n, "%s.%s %.*s %" PRIu64 "\n", conn.push_prefix, status_fields[i],
+                          frame.len[i], STATUS_VALUE(&frame, i), (uint64_t)(snap->time_ns / 1000000000ULL));
+        }
+        else
+        {
+            n += snprintf(&buf[n], size - n, "%s%s=%.*s%s", first ? "" : ",", status_fields[i],
+                          frame.len[i], STATUS_VALUE(&frame, i), mark);
+        }
+        first = false;
+    }
+    if (!conn.push_graphite && n < size)
+    {
+        n += snprintf(&buf[n], size - n, " %" PRIu64 "\n", snap->time_ns);
+    }
+    return MIN(n, size - 1);
+}
+
+/**
+ * Format an event for line protocol, Graphite has no text values.
+ */
+static size_t format_event(const sink_event_t *ev, char *buf, size_t size)
+{
+    char text[SINK_DETAIL_MAX * 2];
+    size_t t = 0;
+    for (const char *p = ev->detail; *p != '\0' && t < sizeof text - 2; p++)
+    {
+        if (*p == '"' || *p == '\\')
+        {
+            text[t++] = '\\';
+        }
+        text[t++] = *p;
+    }
+    text[t] = '\0';
+    int n = snprintf(buf, size, "%s_event,host=%s event=%di,detail=\"%s\" %" PRIu64 "\n", conn.push_prefix, hostname,
+                     ev->event, text, (uint64_t)(ev->time * 1000000000LL));
+    return MIN((size_t)n, size - 1);
+}
+
+/**
+ * Push sink thread.
+ */
+static void push_consume(const sink_item_t *item)
+{
+    char line[PUSH_LINE_MAX];
+    size_t len;
+
+    if (item->type == SINK_ITEM_SNAPSHOT)
+    {
+        len = format_status(&item->snapshot, line, sizeof line);
+    }
+    else if (!conn.push_graphite)
+    {
+        len = format_event(&item->event, line, sizeof line);
+    }
+    else
+    {
+        return;
+    }
+    push_append(line, len);
+}
+
+static sink_t push_sink = {
+    .name = "push",
+    .threaded = true,
+    .snapshots = true,
+    .events = true,
+    .consume = push_consume,
+};
+
+/**
+ * Register the push exporter sink. Does nothing when disabled.
+ */
+int push_init(const ups_settings_t *cfg)
+{
+    if (!cfg->push_enable)
+    {
+        return EXIT_SUCCESS;
+    }
+    conn = *cfg;
+    conn.push_batch_size = MIN(conn.push_batch_size, (unsigned int)PUSH_BATCH_MAX);
+    gethostname(hostname, sizeof hostname);
+    hostname[sizeof hostname - 1] = '\0';
+    // Tag values must not contain unescaped separators
+    for (char *p = hostname; *p != '\0'; p++)
+    {
+        if (*p == ' ' || *p == ',' || *p == '=')
+        {
+            *p = '_';
+        }
+    }
+    return sink_register(&push_sink);
+}
+
+/**
+ * Send or spool what is left, after the sinks are stopped.
+ */
+void push_stop(void)
+{
+    if (!conn.push_enable)
+    {
+        return;
+    }
+    push_flush();
+    if (sock >= 0)
+    {
+        close(sock);
+        sock = -1;
+    }
+}
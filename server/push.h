@@ -0,0 +1,33 @@
+// Part of UPS Server.
+// A websocket server reading data from a Bicker PSZ-1063 uExtension module
+// in combination with a Bicker UPS.
+//
+// Copyright (c) 2023 Michael Wolf <michael@mictronics.de>
+//
+// This file is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// any later version.
+//
+// This file is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef PUSH_H
+#define PUSH_H
+
+#include "settings.h"
+
+#define PUSH_BATCH_MAX 65536 // Byte
+#define PUSH_LINE_MAX 2048   // Byte, one update in either format
+#define PUSH_RETRY_MAX 60    // seconds, longest delay between connection attempts
+#define PUSH_REPLAY_CHUNKS 16 // Spooled batches resent per flush
+
+int push_init(const ups_settings_t *cfg);
+void push_stop(void);
+
+#endif /* PUSH_H */
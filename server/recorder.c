@@ -0,0 +1,628 @@
+// Part of UPS Server.
+// A websocket server reading data from a Bicker PSZ-1063 uExtension module
+// in combination with a Bicker UPS.
+//
+// Copyright (c) 2023 Michael Wolf <michael@mictronics.de>
+//
+// This file is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// any later version.
+//
+// This file is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <libwebsockets.h>
+#include <json-c/json.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <dirent.h>
+#include <pthread.h>
+#include "recorder.h"
+
+#define RECORDER_NAME_MAX 64
+#define RECORDER_LIST_MAX 256
+#define RECORDER_POLL_MS 50 // Writer completion check
+#define NOTUSED(V) ((void)V)
+
+/**
+ * Ring buffer entry, the monotonic time is converted to trigger relative time on save.
+ */
+typedef struct
+{
+    int64_t mono; // ms
+    capture_sample_t s;
+} ring_sample_t;
+
+/**
+ * Capture handed to the writer thread. Owned by the thread while pending.
+ */
+typedef enum
+{
+    WRITER_IDLE,
+    WRITER_PENDING,
+    WRITER_DONE
+} writer_state_t;
+
+static struct
+{
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool running;
+    bool stop;
+    writer_state_t state;
+    bool ok;
+    char name[RECORDER_NAME_MAX];
+    char file[PATH_MAX + RECORDER_NAME_MAX];
+    capture_header_t hdr;
+    capture_sample_t samples[RECORDER_RING_SIZE];
+} writer = {.lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER};
+
+static struct lws_context *rec_context = NULL;
+static lws_sorted_usec_list_t sul_writer;
+
+static ring_sample_t ring[RECORDER_RING_SIZE];
+static int ring_head = 0; // Next entry written
+static int ring_len = 0;
+
+static recorder_saved_cb_t saved_cb = NULL;
+static bool rec_enable = false;
+static int64_t pre_ms = 0;
+static int64_t window_ms = 0;
+static char rec_dir[PATH_MAX];
+
+static bool state_known = false; // Edge detection needs a previous state
+static unsigned char last_device = 0;
+static unsigned char last_power_fail = 0;
+
+static bool capturing = false;
+static int64_t trigger_mono = 0;
+static int64_t trigger_real = 0;
+static int64_t capture_end = 0;
+static int capture_count = 0; // Entries added since trigger
+static unsigned char device_before = 0;
+static unsigned char device_after = 0;
+static unsigned char trigger_power_fail = 0;
+
+static bicker_ups_status_t burst; // Burst sample destination
+static bool burst_running = false;
+
+/**
+ * Burst sample registers, cap voltages and the power path at maximum serial rate.
+ */
+static const struct
+{
+    cmd_list_t cmd;
+    char cmd_index;
+    bicker_type_t type;
+    void *dest;
+} burst_steps[] = {
+    {GET_DEVICE_STATUS, BICKER_CMD_INDEX1, BICKER_BYTE, &burst.device_status.value},
+    {GET_INPUT_VOLTAGE1, BICKER_CMD_INDEX1, BICKER_SHORT, &burst.input_voltage},
+    {GET_OUTPUT_VOLTAGE1, BICKER_CMD_INDEX1, BICKER_SHORT, &burst.output_voltage},
+    {GET_INPUT_CURRENT1, BICKER_CMD_INDEX1, BICKER_SHORT, &burst.input_current},
+    {GET_OUTPUT_CURRENT1, BICKER_CMD_INDEX1, BICKER_SHORT, &burst.output_current},
+    {GET_BATTERY_VOLTAGE, BICKER_CMD_INDEX1, BICKER_SHORT, &burst.battery_voltage},
+    {GET_VCAP1_VOLTAGE, BICKER_CMD_INDEX3, BICKER_SHORT, &burst.vcap_voltage.cap1},
+    {GET_VCAP2_VOLTAGE, BICKER_CMD_INDEX3, BICKER_SHORT, &burst.vcap_voltage.cap2},
+    {GET_VCAP3_VOLTAGE, BICKER_CMD_INDEX3, BICKER_SHORT, &burst.vcap_voltage.cap3},
+    {GET_VCAP4_VOLTAGE, BICKER_CMD_INDEX3, BICKER_SHORT, &burst.vcap_voltage.cap4},
+};
+
+#define BURST_STEP_COUNT (sizeof(burst_steps) / sizeof(burst_steps[0]))
+
+static void burst_start(void);
+
+/**
+ * Milliseconds of a clock.
+ */
+static int64_t clock_ms(clockid_t clk)
+{
+    struct timespec ts;
+    clock_gettime(clk, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Limit a value to the int16 range of a sample.
+ */
+static int16_t clamp16(signed int v)
+{
+    return v > INT16_MAX ? INT16_MAX : (v < INT16_MIN ? INT16_MIN : (int16_t)v);
+}
+
+/**
+ * Take new configuration, applied to the next capture.
+ */
+static void recorder_configure(const ups_settings_t *cfg)
+{
+    rec_enable = cfg->recorder_enable;
+    pre_ms = (int64_t)cfg->recorder_pre_sec * 1000;
+    window_ms = (int64_t)cfg->recorder_window_sec * 1000;
+    if (!capturing)
+    {
+        strcpy(rec_dir, cfg->recorder_path);
+    }
+}
+
+/**
+ * Add a sample to the ring.
+ */
+static void ring_add(const bicker_ups_status_t *ups, uint8_t source)
+{
+    ring_sample_t *r = &ring[ring_head];
+    r->mono = clock_ms(CLOCK_MONOTONIC);
+    r->s.time = 0;
+    r->s.input_voltage = clamp16(ups->input_voltage);
+    r->s.output_voltage = clamp16(ups->output_voltage);
+    r->s.battery_voltage = clamp16(ups->battery_voltage);
+    r->s.vcap[0] = clamp16(ups->vcap_voltage.cap1);
+    r->s.vcap[1] = clamp16(ups->vcap_voltage.cap2);
+    r->s.vcap[2] = clamp16(ups->vcap_voltage.cap3);
+    r->s.vcap[3] = clamp16(ups->vcap_voltage.cap4);
+    r->s.input_current = clamp16(ups->input_current);
+    r->s.output_current = clamp16(ups->output_current);
+    r->s.device_status = ups->device_status.value;
+    r->s.source = source;
+    ring_head = (ring_head + 1) % RECORDER_RING_SIZE;
+    if (ring_len < RECORDER_RING_SIZE)
+    {
+        ring_len++;
+    }
+    if (capturing)
+    {
+        capture_count++;
+    }
+}
+
+/**
+ * Write a handed over capture to its file.
+ */
+static bool capture_write(void)
+{
+    FILE *fp = fopen(writer.file, "wb");
+    if (fp == NULL)
+    {
+        lwsl_err("Error writing capture %s: %s", writer.file, strerror(errno));
+        return false;
+    }
+    fwrite(&writer.hdr, sizeof writer.hdr, 1, fp);
+    fwrite(writer.samples, sizeof(capture_sample_t), writer.hdr.count, fp);
+    if (fclose(fp) != 0)
+    {
+        lwsl_err("Error writing capture %s: %s", writer.file, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Capture writer thread, keeps file I/O off the event loop.
+ */
+static void *writer_thread(void *arg)
+{
+    NOTUSED(arg);
+    pthread_mutex_lock(&writer.lock);
+    for (;;)
+    {
+        while (writer.state != WRITER_PENDING && !writer.stop)
+        {
+            pthread_cond_wait(&writer.cond, &writer.lock);
+        }
+        if (writer.state != WRITER_PENDING)
+        {
+            break; // Stopped with nothing left to write
+        }
+        pthread_mutex_unlock(&writer.lock);
+        bool ok = capture_write();
+        pthread_mutex_lock(&writer.lock);
+        writer.ok = ok;
+        writer.state = WRITER_DONE;
+    }
+    pthread_mutex_unlock(&writer.lock);
+    return NULL;
+}
+
+/**
+ * Report a finished capture on the event loop.
+ */
+static void writer_poll(lws_sorted_usec_list_t *sul)
+{
+    char name[RECORDER_NAME_MAX];
+    pthread_mutex_lock(&writer.lock);
+    writer_state_t state = writer.state;
+    bool ok = writer.ok;
+    uint32_t n = writer.hdr.count;
+    if (state == WRITER_DONE)
+    {
+        strcpy(name, writer.name);
+        writer.state = WRITER_IDLE;
+    }
+    pthread_mutex_unlock(&writer.lock);
+    if (state != WRITER_DONE)
+    {
+        lws_sul_schedule(rec_context, 0, sul, writer_poll, RECORDER_POLL_MS * LWS_US_PER_MS);
+        return;
+    }
+    if (!ok)
+    {
+        return;
+    }
+    lwsl_notice("Power event captured, %u samples in %s.", n, name);
+    if (saved_cb != NULL)
+    {
+        saved_cb(name);
+    }
+}
+
+/**
+ * Hand the capture window from the ring to the writer thread.
+ */
+static void capture_save(void)
+{
+    struct tm tm;
+    time_t t = (time_t)(trigger_real / 1000);
+
+    capturing = false;
+    pthread_mutex_lock(&writer.lock);
+    if (writer.state != WRITER_IDLE)
+    {
+        pthread_mutex_unlock(&writer.lock);
+        lwsl_warn("Previous capture still being written, capture dropped.");
+        return;
+    }
+    pthread_mutex_unlock(&writer.lock);
+
+    // Idle writer does not touch the buffer, fill it without the lock
+    localtime_r(&t, &tm);
+    strftime(writer.name, sizeof writer.name, "capture-%Y%m%d-%H%M%S.bin", &tm);
+    snprintf(writer.file, sizeof writer.file, "%s/%s", rec_dir, writer.name);
+
+    capture_header_t *hdr = &writer.hdr;
+    memset(hdr, 0, sizeof *hdr);
+    hdr->magic = CAPTURE_MAGIC;
+    hdr->version = CAPTURE_VERSION;
+    hdr->sample_size = sizeof(capture_sample_t);
+    hdr->trigger_time = trigger_real;
+    hdr->device_before = device_before;
+    hdr->device_after = device_after;
+    hdr->power_fail = trigger_power_fail;
+
+    // Oldest entry within the pre-trigger time comes first
+    int first = (ring_head + RECORDER_RING_SIZE - ring_len) % RECORDER_RING_SIZE;
+    int n = ring_len;
+    while (n > 0 && ring[first].mono < trigger_mono - pre_ms)
+    {
+        first = (first + 1) % RECORDER_RING_SIZE;
+        n--;
+    }
+    for (int i = 0; i < n; i++)
+    {
+        const ring_sample_t *r = &ring[(first + i) % RECORDER_RING_SIZE];
+        if (r->mono < trigger_mono)
+        {
+            hdr->trigger_index++;
+        }
+        writer.samples[i] = r->s;
+        writer.samples[i].time = (int32_t)(r->mono - trigger_mono);
+    }
+    hdr->count = n;
+
+    if (!writer.running)
+    {
+        // No writer thread, write inline
+        writer.ok = capture_write();
+        writer.state = WRITER_DONE;
+        writer_poll(&sul_writer);
+        return;
+    }
+    pthread_mutex_lock(&writer.lock);
+    writer.state = WRITER_PENDING;
+    pthread_cond_signal(&writer.cond);
+    pthread_mutex_unlock(&writer.lock);
+    lws_sul_schedule(rec_context, 0, &sul_writer, writer_poll, RECORDER_POLL_MS * LWS_US_PER_MS);
+}
+
+/**
+ * Start a capture on a power state edge, or extend the running one.
+ */
+static void trigger(unsigned char device, unsigned char power_fail)
+{
+    int64_t now = clock_ms(CLOCK_MONOTONIC);
+    if (capturing)
+    {
+        capture_end = now + window_ms;
+        return;
+    }
+    if (!rec_enable)
+    {
+        return;
+    }
+    capturing = true;
+    capture_count = 0;
+    trigger_mono = now;
+    trigger_real = clock_ms(CLOCK_REALTIME);
+    capture_end = now + window_ms;
+    device_before = last_device;
+    device_after = device;
+    trigger_power_fail = power_fail;
+    lwsl_notice("Power event, burst sampling for %lld ms.", (long long)window_ms);
+    burst_start();
+}
+
+/**
+ * Detect device status and power fail edges.
+ */
+static void edge_check(unsigned char device, unsigned char power_fail)
+{
+    if (state_known && (device != last_device || power_fail != last_power_fail))
+    {
+        trigger(device, power_fail);
+    }
+    last_device = device;
+    last_power_fail = power_fail;
+    state_known = true;
+}
+
+/**
+ * End the capture when its window passed or the ring would overwrite the pre-trigger samples.
+ */
+static bool capture_due(void)
+{
+    return capturing && (clock_ms(CLOCK_MONOTONIC) >= capture_end || capture_count >= RECORDER_RING_SIZE / 2);
+}
+
+/**
+ * Last register of a burst sample is in.
+ */
+static void burst_done(const bicker_cmd_t *c, bool ok)
+{
+    NOTUSED(c);
+    burst_running = false;
+    if (!ok)
+    {
+        return; // Serial error, regular polling handles it
+    }
+    edge_check(burst.device_status.value, last_power_fail);
+    ring_add(&burst, CAPTURE_SRC_BURST);
+    if (capture_due())
+    {
+        capture_save();
+    }
+    else if (capturing)
+    {
+        burst_start();
+    }
+}
+
+/**
+ * Queue one burst sample. Queued with regular polling, which is served in turn.
+ * The whole burst is queued or nothing, it waits while the queue has no room
+ * for it and the next poll. Resumed after the next poll or check.
+ */
+static void burst_start(void)
+{
+    if (burst_running || !bicker_queue_spare(BURST_STEP_COUNT))
+    {
+        return;
+    }
+    burst_running = true;
+    for (size_t i = 0; i < BURST_STEP_COUNT; i++)
+    {
+        bicker_cmd_t c = {
+            .cmd = burst_steps[i].cmd,
+            .cmd_index = burst_steps[i].cmd_index,
+            .type = burst_steps[i].type,
+            .dest = burst_steps[i].dest,
+            .done = (i == BURST_STEP_COUNT - 1) ? burst_done : NULL,
+        };
+        bicker_queue(&c, CMD_PRIO_LOW);
+    }
+}
+
+/**
+ * Set the callback for saved captures and start the writer thread.
+ */
+void recorder_init(struct lws_context *ctx, recorder_saved_cb_t cb)
+{
+    rec_context = ctx;
+    saved_cb = cb;
+    memset(ring, 0, sizeof(ring));
+    ring_head = 0;
+    ring_len = 0;
+    state_known = false;
+    capturing = false;
+    writer.stop = false;
+    writer.state = WRITER_IDLE;
+    writer.running = pthread_create(&writer.thread, NULL, writer_thread, NULL) == 0;
+    if (!writer.running)
+    {
+        lwsl_err("Failed to start capture writer, writing inline.");
+    }
+}
+
+/**
+ * Stop the writer thread, a pending capture is written first.
+ */
+void recorder_stop(void)
+{
+    lws_sul_cancel(&sul_writer);
+    if (!writer.running)
+    {
+        return;
+    }
+    pthread_mutex_lock(&writer.lock);
+    writer.stop = true;
+    pthread_cond_signal(&writer.cond);
+    pthread_mutex_unlock(&writer.lock);
+    pthread_join(writer.thread, NULL);
+    writer.running = false;
+}
+
+/**
+ * Full status poll is in, keep it for pre-trigger history.
+ */
+void recorder_sample(const bicker_ups_status_t *ups, const ups_settings_t *cfg)
+{
+    recorder_configure(cfg);
+    unsigned char power_fail = (ups->charge_status.reg.is_power_fail ? 1 : 0) |
+                               (ups->monitor_status.reg.is_power_fail ? 2 : 0);
+    edge_check(ups->device_status.value, power_fail);
+    ring_add(ups, CAPTURE_SRC_POLL);
+    if (capture_due())
+    {
+        capture_save();
+    }
+    else if (capturing)
+    {
+        burst_start();
+    }
+}
+
+/**
+ * Device status check between polls, triggers only.
+ */
+void recorder_check(const bicker_ups_status_t *ups, const ups_settings_t *cfg)
+{
+    recorder_configure(cfg);
+    edge_check(ups->device_status.value, last_power_fail);
+    if (capturing)
+    {
+        burst_start();
+    }
+}
+
+/**
+ * Compare names for sorting.
+ */
+static int name_cmp(const void *a, const void *b)
+{
+    return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+/**
+ * Check a capture file name, no paths allowed.
+ */
+static bool valid_name(const char *name)
+{
+    size_t len = name != NULL ? strlen(name) : 0;
+    return len > 12 && len < RECORDER_NAME_MAX && strncmp(name, "capture-", 8) == 0 &&
+           strcmp(&name[len - 4], ".bin") == 0 && strchr(name, '/') == NULL;
+}
+
+/**
+ * Names of saved captures, oldest first.
+ */
+json_object *recorder_list(const ups_settings_t *cfg)
+{
+    char *names[RECORDER_LIST_MAX];
+    int n = 0;
+    struct dirent *de;
+    json_object *jarr = json_object_new_array();
+    DIR *d = opendir(cfg->recorder_path);
+    if (d == NULL)
+    {
+        return jarr;
+    }
+    while ((de = readdir(d)) != NULL && n < RECORDER_LIST_MAX)
+    {
+        if (valid_name(de->d_name) && (names[n] = strdup(de->d_name)) != NULL)
+        {
+            n++;
+        }
+    }
+    closedir(d);
+    qsort(names, n, sizeof(char *), name_cmp);
+    for (int i = 0; i < n; i++)
+    {
+        json_object_array_add(jarr, json_object_new_string(names[i]));
+        free(names[i]);
+    }
+    return jarr;
+}
+
+/**
+ * Load a saved capture as column arrays. Returns NULL when not readable.
+ */
+json_object *recorder_load(const ups_settings_t *cfg, const char *name)
+{
+    char file[PATH_MAX + RECORDER_NAME_MAX];
+    capture_header_t hdr;
+    capture_sample_t s;
+
+    if (!valid_name(name))
+    {
+        return NULL;
+    }
+    snprintf(file, sizeof file, "%s/%s", cfg->recorder_path, name);
+    FILE *fp = fopen(file, "rb");
+    if (fp == NULL)
+    {
+        return NULL;
+    }
+    if (fread(&hdr, sizeof hdr, 1, fp) != 1 || hdr.magic != CAPTURE_MAGIC || hdr.version != CAPTURE_VERSION ||
+        hdr.sample_size != sizeof(capture_sample_t) || hdr.count > RECORDER_RING_SIZE)
+    {
+        fclose(fp);
+        return NULL;
+    }
+
+    json_object *jtime = json_object_new_array();
+    json_object *jinv = json_object_new_array();
+    json_object *joutv = json_object_new_array();
+    json_object *jbattv = json_object_new_array();
+    json_object *jvcap[4];
+    json_object *jina = json_object_new_array();
+    json_object *jouta = json_object_new_array();
+    json_object *jdev = json_object_new_array();
+    json_object *jsrc = json_object_new_array();
+    for (int k = 0; k < 4; k++)
+    {
+        jvcap[k] = json_object_new_array();
+    }
+    for (uint32_t i = 0; i < hdr.count && fread(&s, sizeof s, 1, fp) == 1; i++)
+    {
+        json_object_array_add(jtime, json_object_new_int(s.time));
+        json_object_array_add(jinv, json_object_new_int(s.input_voltage));
+        json_object_array_add(joutv, json_object_new_int(s.output_voltage));
+        json_object_array_add(jbattv, json_object_new_int(s.battery_voltage));
+        for (int k = 0; k < 4; k++)
+        {
+            json_object_array_add(jvcap[k], json_object_new_int(s.vcap[k]));
+        }
+        json_object_array_add(jina, json_object_new_int(s.input_current));
+        json_object_array_add(jouta, json_object_new_int(s.output_current));
+        json_object_array_add(jdev, json_object_new_int(s.device_status));
+        json_object_array_add(jsrc, json_object_new_int(s.source));
+    }
+    fclose(fp);
+
+    json_object *jroot = json_object_new_object();
+    json_object_object_add(jroot, "name", json_object_new_string(name));
+    json_object_object_add(jroot, "triggerTime", json_object_new_int64(hdr.trigger_time));
+    json_object_object_add(jroot, "triggerIndex", json_object_new_int((int)hdr.trigger_index));
+    json_object_object_add(jroot, "deviceBefore", json_object_new_int(hdr.device_before));
+    json_object_object_add(jroot, "deviceAfter", json_object_new_int(hdr.device_after));
+    json_object_object_add(jroot, "time", jtime);
+    json_object_object_add(jroot, "inputVoltage", jinv);
+    json_object_object_add(jroot, "outputVoltage", joutv);
+    json_object_object_add(jroot, "batteryVoltage", jbattv);
+    json_object_object_add(jroot, "vcap1Voltage", jvcap[0]);
+    json_object_object_add(jroot, "vcap2Voltage", jvcap[1]);
+    json_object_object_add(jroot, "vcap3Voltage", jvcap[2]);
+    json_object_object_add(jroot, "vcap4Voltage", jvcap[3]);
+    json_object_object_add(jroot, "inputCurrent", jina);
+    json_object_object_add(jroot, "outputCurrent", jouta);
+    json_object_object_add(jroot, "deviceStatus", jdev);
+    json_object_object_add(jroot, "source", jsrc);
+    return jroot;
+}
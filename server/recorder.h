@@ -0,0 +1,41 @@
+// Part of UPS Server.
+// A websocket server reading data from a Bicker PSZ-1063 uExtension module
+// in combination with a Bicker UPS.
+//
+// Copyright (c) 2023 Michael Wolf <michael@mictronics.de>
+//
+// This file is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// any later version.
+//
+// This file is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef RECORDER_H
+#define RECORDER_H
+
+#include <stdbool.h>
+#include <json-c/json.h>
+#include <libwebsockets.h>
+#include "bicker.h"
+#include "settings.h"
+#include "capture.h"
+
+#define RECORDER_RING_SIZE 4096 // Samples, pre-trigger history and capture window
+
+typedef void (*recorder_saved_cb_t)(const char *name);
+
+void recorder_init(struct lws_context *ctx, recorder_saved_cb_t cb);
+void recorder_stop(void);
+void recorder_sample(const bicker_ups_status_t *ups, const ups_settings_t *cfg);
+void recorder_check(const bicker_ups_status_t *ups, const ups_settings_t *cfg);
+json_object *recorder_list(const ups_settings_t *cfg);
+json_object *recorder_load(const ups_settings_t *cfg, const char *name);
+
+#endif /* RECORDER_H */
@@ -0,0 +1,191 @@
+// Part of UPS Server.
+// A websocket server reading data from a Bicker PSZ-1063 uExtension module
+// in combination with a Bicker UPS.
+//
+// Copyright (c) 2023 Michael Wolf <michael@mictronics.de>
+//
+// This file is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// any later version.
+//
+// This file is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef REGISTERS_H
+#define REGISTERS_H
+
+/**
+ * Registers of UPSIC-1205 + PSZ1063, X(name, code, cmd index, response type)
+ *
+ * See LTC3350 datasheet, page 32.
+ * Command index 3 is a pass-through read of those registers.
+ * Generates cmd_list_t and the register names for reads on request.
+ */
+#define BICKER_REGISTERS(X) \
+    X(GET_CLEAR_ALARMS, 0x00, BICKER_CMD_INDEX3, BICKER_SHORT) \
+    X(GET_MASK_ALARMS, 0x01, BICKER_CMD_INDEX3, BICKER_SHORT) \
+    X(GET_MASK_MONITORING_STATUS, 0x02, BICKER_CMD_INDEX3, BICKER_SHORT) \
+    X(GET_CAP_ESR_PERIOD, 0x04, BICKER_CMD_INDEX3, BICKER_SHORT) \
+    X(GET_VCAP_REF_DAC, 0x05, BICKER_CMD_INDEX3, BICKER_SHORT) \
+    X(GET_VSHUNT, 0x06, BICKER_CMD_INDEX3, BICKER_SHORT) \
+    X(GET_CAP_UV_ALARM_LEVEL, 0x07, BICKER_CMD_INDEX3, BICKER_SHORT) \
+    X(GET_CAP_OV_ALARM_LEVEL, 0x08, BICKER_CMD_INDEX3, BICKER_SHORT) \
+    X(GET_GPI_UV_ALARM_LEVEL, 0x09, BICKER_CMD_INDEX3, BICKER_SHORT) \
+    X(GET_GPI_OV_ALARM_LEVEL, 0x0A, BICKER_CMD_INDEX3, BICKER_SHORT) \
+    X(GET_VIN_UV_ALARM_LEVEL, 0x0B, BICKER_CMD_INDEX3, BICKER_SHORT) \
+    X(GET_VIN_OV_ALARM_LEVEL, 0x0C, BICKER_CMD_INDEX3, BICKER_SHORT) \
+    X(GET_VCAP_UV_ALARM_LEVEL, 0x0D, BICKER_CMD_INDEX3, BICKER_SHORT) \
+    X(GET_VCAP_OV_ALARM_LEVEL, 0x0E, BICKER_CMD_INDEX3, BICKER_SHORT) \
+    X(GET_VOUT_UV_ALARM_LEVEL, 0x0F, BICKER_CMD_INDEX3, BICKER_SHORT) \
+    X(GET_VOUT_OV_ALARM_LEVEL, 0x10, BICKER_CMD_INDEX3, BICKER_SHORT) \
+    X(GET_INPUT_OC_ALARM_LEVEL, 0x11, BICKER_CMD_INDEX3, BICKER_SHORT) \
+    X(GET_CHARGE_UC_ALARM_LEVEL, 0x12, BICKER_CMD_INDEX3, BICKER_SHORT) \
+    X(GET_DIE_COLD_ALARM_LEVEL, 0x13, BICKER_CMD_INDEX3, BICKER_SHORT) \
+    X(GET_DIE_HOT_ALARM_LEVEL, 0x14, BICKER_CMD_INDEX3, BICKER_SHORT) \
+    X(GET_ESR_HIGH_ALARM_LEVEL, 0x15, BICKER_CMD_INDEX3, BICKER_SHORT) \
+    X(GET_CAP_LOW_ALARM_LEVEL, 0x16, BICKER_CMD_INDEX3, BICKER_SHORT) \
+    X(GET_CONTROL_REG, 0x17, BICKER_CMD_INDEX3, BICKER_SHORT) \
+    X(GET_NUMBER_OF_CAPACITORS, 0x1A, BICKER_CMD_INDEX3, BICKER_SHORT) \
+    X(GET_CHARGE_STATUS_REGISTER, 0x1B, BICKER_CMD_INDEX3, BICKER_SHORT) \
+    X(GET_MONITOR_STATUS_REGISTER, 0x1C, BICKER_CMD_INDEX3, BICKER_SHORT) \
+    X(GET_MONITOR_ALARM_REGISTER, 0x1D, BICKER_CMD_INDEX3, BICKER_SHORT) \
+    X(GET_CAPACITY, 0x1E, BICKER_CMD_INDEX3, BICKER_LONG) \
+    X(GET_ESR, 0x1F, BICKER_CMD_INDEX3, BICKER_SHORT) \
+    X(GET_VCAP1_VOLTAGE, 0x20, BICKER_CMD_INDEX3, BICKER_SHORT) \
+    X(GET_VCAP2_VOLTAGE, 0x21, BICKER_CMD_INDEX3, BICKER_SHORT) \
+    X(GET_VCAP3_VOLTAGE, 0x22, BICKER_CMD_INDEX3, BICKER_SHORT) \
+    X(GET_VCAP4_VOLTAGE, 0x23, BICKER_CMD_INDEX3, BICKER_SHORT) \
+    X(GET_GPI_PIN_VOLTAGE, 0x24, BICKER_CMD_INDEX3, BICKER_SHORT) \
+    X(GET_INPUT_VOLTAGE, 0x25, BICKER_CMD_INDEX3, BICKER_SHORT) \
+    X(GET_CAP_STACK_VOLTAGE, 0x26, BICKER_CMD_INDEX3, BICKER_SHORT) \
+    X(GET_OUTPUT_VOLTAGE, 0x27, BICKER_CMD_INDEX3, BICKER_SHORT) \
+    X(GET_INPUT_CURRENT, 0x28, BICKER_CMD_INDEX3, BICKER_SHORT) \
+    X(GET_CHARGE_CURRENT, 0x29, BICKER_CMD_INDEX3, BICKER_SHORT) \
+    X(GET_CHARGER_TEMPERATURE, 0x2A, BICKER_CMD_INDEX3, BICKER_SHORT) \
+    X(GET_DEVICE_STATUS, 0x40, BICKER_CMD_INDEX1, BICKER_BYTE) \
+    X(GET_INPUT_VOLTAGE1, 0x41, BICKER_CMD_INDEX1, BICKER_SHORT) \
+    X(GET_INPUT_CURRENT1, 0x42, BICKER_CMD_INDEX1, BICKER_SHORT) \
+    X(GET_OUTPUT_VOLTAGE1, 0x43, BICKER_CMD_INDEX1, BICKER_SHORT) \
+    X(GET_OUTPUT_CURRENT1, 0x44, BICKER_CMD_INDEX1, BICKER_SHORT) \
+    X(GET_BATTERY_VOLTAGE, 0x45, BICKER_CMD_INDEX1, BICKER_SHORT) \
+    X(GET_BATTERY_CURRENT, 0x46, BICKER_CMD_INDEX1, BICKER_SHORT) \
+    X(GET_SOC, 0x47, BICKER_CMD_INDEX1, BICKER_SHORT) \
+    X(GET_BATTERY_TEMPERATURE, 0x4A, BICKER_CMD_INDEX1, BICKER_SHORT) \
+    X(GET_MANUFACTURER, 0x60, BICKER_CMD_INDEX1, BICKER_STRING) \
+    X(GET_SERIAL, 0x61, BICKER_CMD_INDEX1, BICKER_STRING) \
+    X(GET_SERIES, 0x62, BICKER_CMD_INDEX1, BICKER_STRING) \
+    X(GET_FIRMWARE, 0x63, BICKER_CMD_INDEX1, BICKER_STRING) \
+    X(GET_BATTERY_TYPE, 0x64, BICKER_CMD_INDEX1, BICKER_STRING) \
+    X(GET_LTC3350_TEMPERATURE, 0x66, BICKER_CMD_INDEX1, BICKER_SHORT) \
+    X(GET_HARDWARE_REVISION, 0x67, BICKER_CMD_INDEX1, BICKER_STRING)
+
+/**
+ * UPS status fields, X(member, register, kind, scale, json, apc, csv, tier)
+ *
+ * member   Field in bicker_ups_status_t
+ * register Command from BICKER_REGISTERS, gives command index and response type
+ * kind     Value formatting, see REG_JSON_, REG_NUM_, REG_APC_ and REG_CSV_ below
+ * scale    Raw value per unit, e.g. 1000 for mV read as volts
+ * json     Key in status updates
+ * apc      Label in the APC status report, "" if not reported
+ * csv      Column in the CSV log, "" if not logged
+ * tier     When the register is read, see bicker_tier_t
+ *
+ * The order is the order of the serial reads and the status fields. The APC report and the
+ * CSV log take the fields in ranges of this order, see REG_FIELD_, keeping their layout of
+ * earlier versions. New fields are added after the ranges used there.
+ */
+#define BICKER_STATUS(X) \
+    X(input_voltage, GET_INPUT_VOLTAGE1, VOLT, 1000, "inputVoltage", "LINEV", "IN_V", TIER_FULL) \
+    X(input_current, GET_INPUT_CURRENT1, AMP, 1000, "inputCurrent", "LINEA", "IN_A", TIER_FULL) \
+    X(output_voltage, GET_OUTPUT_VOLTAGE1, VOLT, 1000, "outputVoltage", "OUTPUTV", "OUT_V", TIER_FULL) \
+    X(output_current, GET_OUTPUT_CURRENT1, AMP, 1000, "outputCurrent", "OUTPUTA", "OUT_A", TIER_FULL) \
+    X(battery_voltage, GET_BATTERY_VOLTAGE, VOLT, 1000, "batteryVoltage", "BATTV", "BATT_V", TIER_FULL) \
+    X(battery_current, GET_BATTERY_CURRENT, AMP, 1000, "batteryCurrent", "BATTA", "BATT_A", TIER_FULL) \
+    X(soc, GET_SOC, PCT, 1, "soc", "BCHARGE", "SOC", TIER_FULL) \
+    X(vcap_voltage.cap1, GET_VCAP1_VOLTAGE, VOLT, 1000, "vcap1Voltage", "", "VCAP1", TIER_FULL) \
+    X(vcap_voltage.cap2, GET_VCAP2_VOLTAGE, VOLT, 1000, "vcap2Voltage", "", "VCAP2", TIER_FULL) \
+    X(vcap_voltage.cap3, GET_VCAP3_VOLTAGE, VOLT, 1000, "vcap3Voltage", "", "VCAP3", TIER_FULL) \
+    X(vcap_voltage.cap4, GET_VCAP4_VOLTAGE, VOLT, 1000, "vcap4Voltage", "", "VCAP4", TIER_FULL) \
+    X(uc_temperature, GET_LTC3350_TEMPERATURE, TEMP, 1, "ucTemperature", "ITEMP", "TEMP", TIER_FULL) \
+    X(charge_current, GET_CHARGE_CURRENT, AMP, 1000, "chargeCurrent", "", "CHG_A", TIER_FULL) \
+    X(cap_stack_voltage, GET_CAP_STACK_VOLTAGE, VOLT, 1000, "capStackVoltage", "", "VSTACK", TIER_FULL) \
+    X(battery_temperature, GET_BATTERY_TEMPERATURE, TEMP, 1, "batteryTemperature", "", "BATT_TEMP", TIER_FULL) \
+    X(capacity, GET_CAPACITY, INT, 1, "capacity", "", "", TIER_FULL) \
+    X(esr, GET_ESR, INT, 1, "esr", "", "", TIER_FULL) \
+    X(alarm_status.value, GET_MONITOR_ALARM_REGISTER, HEX16, 1, "alarmStatus", "", "", TIER_CHECK) \
+    X(device_status.value, GET_DEVICE_STATUS, HEX8, 1, "deviceStatus", "STATFLAG", "", TIER_CHECK) \
+    X(charge_status.value, GET_CHARGE_STATUS_REGISTER, HEX16, 1, "chargeStatus", "REG2", "", TIER_FULL) \
+    X(monitor_status.value, GET_MONITOR_STATUS_REGISTER, HEX16, 1, "monitorStatus", "REG3", "", TIER_FULL) \
+    X(alarm_mask, GET_MASK_ALARMS, HEX16, 1, "alarmMask", "", "", TIER_REQUEST) \
+    X(series, GET_SERIES, STR, 1, "series", "UPSNAME", "", TIER_STATIC) \
+    X(battery_type, GET_BATTERY_TYPE, STR, 1, "batteryType", "MODEL", "", TIER_STATIC) \
+    X(firmware, GET_FIRMWARE, STR, 1, "firmware", "FIRMWARE", "", TIER_STATIC) \
+    X(hw_revision, GET_HARDWARE_REVISION, STR, 1, "hwRevision", "", "", TIER_STATIC)
+
+/**
+ * Position of a status field in BICKER_STATUS, by register.
+ */
+enum
+{
+#define X(member, reg, kind, scale, json, apc, csv, tier) REG_FIELD_##reg,
+    BICKER_STATUS(X)
+#undef X
+};
+
+/**
+ * Value formatting by kind, expanded per field at compile time.
+ * Currents are sent in mA to websocket clients. Strings are sanitized when read.
+ */
+#define REG_JSON_VOLT(v, scale) "%.3f", (double)(v) / (scale)
+#define REG_JSON_AMP(v, scale) "%d", (int)(v)
+#define REG_JSON_PCT(v, scale) "%d", (int)(v)
+#define REG_JSON_TEMP(v, scale) "%d", (int)(v)
+#define REG_JSON_INT(v, scale) "%d", (int)(v)
+#define REG_JSON_HEX8(v, scale) "%d", (int)(v)
+#define REG_JSON_HEX16(v, scale) "%d", (int)(v)
+#define REG_JSON_STR(v, scale) "\"%s\"", (v)
+
+#define REG_TYPE_JSON_VOLT STATUS_NUMBER
+#define REG_TYPE_JSON_AMP STATUS_INTEGER
+#define REG_TYPE_JSON_PCT STATUS_INTEGER
+#define REG_TYPE_JSON_TEMP STATUS_INTEGER
+#define REG_TYPE_JSON_INT STATUS_INTEGER
+#define REG_TYPE_JSON_HEX8 STATUS_INTEGER
+#define REG_TYPE_JSON_HEX16 STATUS_INTEGER
+#define REG_TYPE_JSON_STR STATUS_STRING
+
+#define REG_NUM_VOLT(v, scale) ((double)(v) / (scale))
+#define REG_NUM_AMP(v, scale) ((double)(v))
+#define REG_NUM_PCT(v, scale) ((double)(v))
+#define REG_NUM_TEMP(v, scale) ((double)(v))
+#define REG_NUM_INT(v, scale) ((double)(v))
+#define REG_NUM_HEX8(v, scale) ((double)(v))
+#define REG_NUM_HEX16(v, scale) ((double)(v))
+#define REG_NUM_STR(v, scale) NAN
+
+#define REG_APC_VOLT(v, scale) "%.1f Volts", (double)(v) / (scale)
+#define REG_APC_AMP(v, scale) "%.3f Amps", (double)(v) / (scale)
+#define REG_APC_PCT(v, scale) "%d Percent", (int)(v)
+#define REG_APC_TEMP(v, scale) "%d C", (int)(v)
+#define REG_APC_INT(v, scale) "%d", (int)(v)
+#define REG_APC_HEX8(v, scale) "0x%02X", (unsigned int)(v)
+#define REG_APC_HEX16(v, scale) "0x%04X", (unsigned int)(v) & 0xFFFF
+#define REG_APC_STR(v, scale) "%.20s", (v)
+
+#define REG_CSV_VOLT(v, scale) "%0.1f", (double)(v) / (scale)
+#define REG_CSV_AMP(v, scale) "%0.3f", (double)(v) / (scale)
+#define REG_CSV_PCT(v, scale) "%d", (int)(v)
+#define REG_CSV_TEMP(v, scale) "%d", (int)(v)
+#define REG_CSV_INT(v, scale) "%d", (int)(v)
+#define REG_CSV_HEX8(v, scale) "0x%02X", (unsigned int)(v)
+#define REG_CSV_HEX16(v, scale) "0x%04X", (unsigned int)(v) & 0xFFFF
+#define REG_CSV_STR(v, scale) "%s", (v)
+
+#endif /* REGISTERS_H */
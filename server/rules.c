@@ -0,0 +1,462 @@
+// Part of UPS Server.
+// A websocket server reading data from a Bicker PSZ-1063 uExtension module
+// in combination with a Bicker UPS.
+//
+// Copyright (c) 2023 Michael Wolf <michael@mictronics.de>
+//
+// This file is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// any later version.
+//
+// This file is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <libwebsockets.h>
+#include <math.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/wait.h>
+#include "rules.h"
+#include "status.h"
+
+/**
+ * Run time state of one rule, event loop only.
+ */
+struct rule_state
+{
+    char name[RULE_NAME_MAX]; // Carries the state over a reload
+    bool active;
+    unsigned int actions; // Taken on activation, cleared with these after a reload changed them
+    bool cond;            // Terms held on the last evaluation
+    uint64_t since_ns;    // Terms differ from active since, 0 if not
+    pid_t pid;            // Running script, 0 if none
+};
+
+static struct rule_state state[RULES_MAX];
+static unsigned int generation = 0; // Table the state belongs to
+static double last[STATUS_FIELD_COUNT];
+static unsigned int compiled = 0; // Tables compiled, settings are parsed on reload only
+
+static const struct
+{
+    const char *text;
+    rule_op_t op;
+} rule_ops[] = {
+    {">", RULE_GT}, {">=", RULE_GE}, {"<", RULE_LT}, {"<=", RULE_LE},
+    {"==", RULE_EQ}, {"!=", RULE_NE}, {"&", RULE_BITS}};
+
+static const struct
+{
+    const char *text;
+    unsigned int action;
+} rule_action_names[] = {
+    {"event", RULE_ACTION_EVENT}, {"notify", RULE_ACTION_NOTIFY},
+    {"script", RULE_ACTION_SCRIPT}, {"shutdown", RULE_ACTION_SHUTDOWN}};
+
+/**
+ * Compile one condition. Returns false when it can not be evaluated.
+ */
+static bool compile_term(const char *rule, const config_setting_t *e, rule_term_t *term)
+{
+    const char *field = NULL;
+    const char *op = ">";
+    double hysteresis = 0.0;
+    int field_index = -1;
+
+    memset(term, 0, sizeof(rule_term_t));
+    if (!config_setting_lookup_string(e, "field", &field) || field == NULL)
+    {
+        lwsl_warn("Rule %s: condition without field.", rule);
+        return false;
+    }
+    for (int i = 0; i < STATUS_FIELD_COUNT; i++)
+    {
+        if (strcmp(status_fields[i], field) == 0)
+        {
+            field_index = i;
+            break;
+        }
+    }
+    if (field_index < 0 || status_types[field_index] == STATUS_STRING || status_types[field_index] == STATUS_META)
+    {
+        lwsl_warn("Rule %s: %s is not a numeric status field.", rule, field);
+        return false;
+    }
+    term->field = (unsigned short)field_index;
+
+    config_setting_lookup_string(e, "op", &op);
+    term->op = 0xFF;
+    for (size_t i = 0; op != NULL && i < sizeof rule_ops / sizeof rule_ops[0]; i++)
+    {
+        if (strcmp(rule_ops[i].text, op) == 0)
+        {
+            term->op = (unsigned char)rule_ops[i].op;
+        }
+    }
+    if (term->op == 0xFF)
+    {
+        lwsl_warn("Rule %s: unknown operator %s.", rule, op ? op : "");
+        return false;
+    }
+
+    // Integer values are accepted for any field
+    const config_setting_t *v = config_setting_get_member(e, "value");
+    if (v == NULL)
+    {
+        lwsl_warn("Rule %s: condition on %s without value.", rule, field);
+        return false;
+    }
+    term->value = config_setting_type(v) == CONFIG_TYPE_FLOAT ? config_setting_get_float(v)
+                                                              : (double)config_setting_get_int64(v);
+    const config_setting_t *h = config_setting_get_member(e, "hysteresis");
+    if (h != NULL)
+    {
+        hysteresis = config_setting_type(h) == CONFIG_TYPE_FLOAT ? config_setting_get_float(h)
+                                                                 : (double)config_setting_get_int64(h);
+    }
+    term->hysteresis = fabs(hysteresis);
+    return true;
+}
+
+/**
+ * Compile one rule and its conditions into the table. Returns false when the rule is unusable.
+ */
+static bool compile_rule(const config_setting_t *e, int index, rule_table_t *t)
+{
+    rule_t *r = &t->rule[t->count];
+    const char *buf = NULL;
+    int val = 0;
+
+    memset(r, 0, sizeof(rule_t));
+    snprintf(r->name, sizeof r->name, "rule%d", index + 1);
+    if (config_setting_lookup_string(e, "name", &buf) && buf != NULL)
+    {
+        snprintf(r->name, sizeof r->name, "%s", buf);
+    }
+    if (config_setting_lookup_int(e, "hold", &val) && val > 0)
+        r->hold_sec = (unsigned int)val;
+    if (config_setting_lookup_int(e, "release", &val) && val > 0)
+        r->release_sec = (unsigned int)val;
+    if (config_setting_lookup_string(e, "script", &buf) && buf != NULL)
+    {
+        if (strlen(buf) >= sizeof r->script)
+        {
+            lwsl_warn("Rule %s: script command too long.", r->name);
+            return false;
+        }
+        strcpy(r->script, buf);
+    }
+
+    r->actions = RULE_ACTION_EVENT;
+    const config_setting_t *actions = config_setting_get_member(e, "actions");
+    if (actions != NULL)
+    {
+        r->actions = 0;
+        for (int i = 0; i < config_setting_length(actions); i++)
+        {
+            size_t a = 0;
+            buf = config_setting_get_string_elem(actions, i);
+            while (buf != NULL && a < sizeof rule_action_names / sizeof rule_action_names[0] &&
+                   strcmp(rule_action_names[a].text, buf) != 0)
+            {
+                a++;
+            }
+            if (buf == NULL || a == sizeof rule_action_names / sizeof rule_action_names[0])
+            {
+                lwsl_warn("Rule %s: unknown action %s ignored.", r->name, buf ? buf : "");
+                continue;
+            }
+            r->actions |= rule_action_names[a].action;
+        }
+    }
+    if ((r->actions & RULE_ACTION_SCRIPT) && r->script[0] == '\0')
+    {
+        lwsl_warn("Rule %s: script action without script.", r->name);
+        r->actions &= ~RULE_ACTION_SCRIPT;
+    }
+
+    const config_setting_t *when = config_setting_get_member(e, "when");
+    if (when == NULL || config_setting_length(when) == 0)
+    {
+        lwsl_warn("Rule %s without conditions, skipped.", r->name);
+        return false;
+    }
+    r->first = (unsigned short)t->term_count;
+    for (int i = 0; i < config_setting_length(when); i++)
+    {
+        if (t->term_count == RULE_TERMS_MAX)
+        {
+            lwsl_warn("More than %d rule conditions, rule %s skipped.", RULE_TERMS_MAX, r->name);
+            t->term_count = r->first;
+            return false;
+        }
+        rule_term_t *term = &t->term[t->term_count];
+        if (!compile_term(r->name, config_setting_get_elem(when, i), term))
+        {
+            lwsl_warn("Rule %s skipped.", r->name);
+            t->term_count = r->first;
+            return false;
+        }
+        r->fields |= (uint64_t)1 << term->field;
+        t->term_count++;
+    }
+    r->count = (unsigned short)(t->term_count - r->first);
+    return true;
+}
+
+/**
+ * Compile the rules list of the configuration into a flat evaluation table.
+ * Invalid rules are reported and left out.
+ */
+void rules_compile(const config_setting_t *list, rule_table_t *t)
+{
+    memset(t, 0, sizeof(rule_table_t));
+    t->generation = ++compiled;
+    for (int i = 0; list != NULL && i < config_setting_length(list); i++)
+    {
+        if (t->count == RULES_MAX)
+        {
+            lwsl_warn("More than %d rules, rest ignored.", RULES_MAX);
+            break;
+        }
+        if (compile_rule(config_setting_get_elem(list, i), i, t))
+        {
+            t->fields |= t->rule[t->count].fields;
+            t->count++;
+        }
+    }
+}
+
+/**
+ * Test one condition. The threshold moves back by the hysteresis while the rule is active.
+ */
+static bool term_holds(const rule_term_t *term, double v, bool active)
+{
+    double h = active ? term->hysteresis : 0.0;
+    if (isnan(v))
+    {
+        return false;
+    }
+    switch ((rule_op_t)term->op)
+    {
+    case RULE_GT:
+        return v > term->value - h;
+    case RULE_GE:
+        return v >= term->value - h;
+    case RULE_LT:
+        return v < term->value + h;
+    case RULE_LE:
+        return v <= term->value + h;
+    case RULE_EQ:
+        return v == term->value;
+    case RULE_NE:
+        return v != term->value;
+    case RULE_BITS:
+        return ((uint64_t)v & (uint64_t)term->value) != 0;
+    }
+    return false;
+}
+
+/**
+ * Start a command with /bin/sh -c without waiting for it. envp adds to PATH,
+ * may be NULL. Returns the process id, 0 when it could not be started.
+ */
+pid_t spawn_command(const char *command, const char *const *envp)
+{
+    char *argv[] = {"/bin/sh", "-c", (char *)command, NULL};
+    char *env[8] = {"PATH=/usr/local/sbin:/usr/local/bin:/usr/sbin:/usr/bin:/sbin:/bin"};
+    posix_spawnattr_t attr;
+    sigset_t none, all;
+    pid_t pid = 0;
+
+    for (int i = 0; envp != NULL && envp[i] != NULL && i < 6; i++)
+    {
+        env[i + 1] = (char *)envp[i];
+    }
+    // Signals handled by the server are blocked, the command gets the defaults
+    sigemptyset(&none);
+    sigfillset(&all);
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setsigmask(&attr, &none);
+    posix_spawnattr_setsigdefault(&attr, &all);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+    int err = posix_spawn(&pid, argv[0], NULL, &attr, argv, env);
+    posix_spawnattr_destroy(&attr);
+    if (err != 0)
+    {
+        lwsl_err("%s not started, %s.", command, strerror(err));
+        return 0;
+    }
+    return pid;
+}
+
+/**
+ * Run the rule script without waiting for it. A script still running from
+ * the previous change is not started again.
+ */
+static void run_script(const rule_t *r, struct rule_state *s)
+{
+    char env_rule[RULE_NAME_MAX + 16];
+    char env_state[32];
+    const char *envp[] = {env_rule, env_state, NULL};
+
+    if (s->pid > 0)
+    {
+        lwsl_warn("Rule %s: script still running, not started.", r->name);
+        return;
+    }
+    snprintf(env_rule, sizeof env_rule, "UPS_RULE=%s", r->name);
+    snprintf(env_state, sizeof env_state, "UPS_RULE_STATE=%s", s->active ? "active" : "clear");
+    s->pid = spawn_command(r->script, envp);
+}
+
+/**
+ * Collect finished scripts.
+ */
+static void reap_scripts(void)
+{
+    int status;
+    for (int i = 0; i < RULES_MAX; i++)
+    {
+        if (state[i].pid > 0 && waitpid(state[i].pid, &status, WNOHANG) == state[i].pid)
+        {
+            if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            {
+                lwsl_warn("Rule %s: script failed.", state[i].name);
+            }
+            state[i].pid = 0;
+        }
+    }
+}
+
+/**
+ * Clear an active rule the reload removed or changed the actions of.
+ * Delivered with the actions taken on activation, scripts are not run again.
+ */
+static void state_clear(struct rule_state *s, rule_action_cb_t action)
+{
+    rule_t r = {.actions = s->actions & ~RULE_ACTION_SCRIPT};
+    strcpy(r.name, s->name);
+    s->active = false;
+    lwsl_notice("Rule %s cleared by reload.", r.name);
+    action(&r, false);
+}
+
+/**
+ * Take over the state of rules kept by name after the table changed.
+ */
+static void state_rebind(const rule_table_t *t, rule_action_cb_t action)
+{
+    struct rule_state old[RULES_MAX];
+    memcpy(old, state, sizeof state);
+    memset(state, 0, sizeof state);
+    for (int i = 0; i < t->count; i++)
+    {
+        strcpy(state[i].name, t->rule[i].name);
+        for (int j = 0; j < RULES_MAX; j++)
+        {
+            if (old[j].name[0] != '\0' && strcmp(old[j].name, t->rule[i].name) == 0)
+            {
+                state[i] = old[j];
+                old[j].name[0] = '\0';
+                break;
+            }
+        }
+        if (state[i].active && state[i].actions != t->rule[i].actions)
+        {
+            state_clear(&state[i], action); // Activated again with the new actions
+        }
+        // Conditions may have changed, evaluated again from scratch
+        state[i].cond = state[i].active;
+        state[i].since_ns = 0;
+    }
+    for (int j = 0; j < RULES_MAX; j++)
+    {
+        if (old[j].name[0] != '\0' && old[j].active)
+        {
+            state_clear(&old[j], action);
+        }
+    }
+    // Scripts of removed rules are still collected from the unused slots
+    for (int j = 0, k = t->count; j < RULES_MAX && k < RULES_MAX; j++)
+    {
+        if (old[j].name[0] != '\0' && old[j].pid > 0)
+        {
+            state[k].pid = old[j].pid;
+            strcpy(state[k++].name, old[j].name);
+        }
+    }
+    generation = t->generation;
+}
+
+/**
+ * Evaluate the rules on a new status. values holds every status field as
+ * number, NaN where it has none, see status_values().
+ *
+ * Only rules with a changed field or a running hold or release time are
+ * evaluated, a large rule set costs little while the status is steady.
+ */
+void rules_evaluate(const rule_table_t *t, const double *values, uint64_t mono_ns, rule_action_cb_t action)
+{
+    uint64_t changed = 0;
+
+    if (t->generation != generation)
+    {
+        state_rebind(t, action);
+        changed = t->fields;
+    }
+    reap_scripts();
+    for (int i = 0; i < STATUS_FIELD_COUNT; i++)
+    {
+        if ((t->fields & ((uint64_t)1 << i)) && memcmp(&values[i], &last[i], sizeof(double)) != 0)
+        {
+            changed |= (uint64_t)1 << i;
+            last[i] = values[i];
+        }
+    }
+
+    for (int i = 0; i < t->count; i++)
+    {
+        const rule_t *r = &t->rule[i];
+        struct rule_state *s = &state[i];
+        if (r->fields & changed)
+        {
+            s->cond = true;
+            for (int k = r->first; k < r->first + r->count && s->cond; k++)
+            {
+                s->cond = term_holds(&t->term[k], values[t->term[k].field], s->active);
+            }
+        }
+        if (s->cond == s->active)
+        {
+            s->since_ns = 0;
+            continue;
+        }
+        if (s->since_ns == 0)
+        {
+            s->since_ns = mono_ns;
+        }
+        uint64_t wait = (uint64_t)(s->active ? r->release_sec : r->hold_sec) * 1000000000ULL;
+        if (mono_ns - s->since_ns < wait)
+        {
+            continue;
+        }
+        s->active = s->cond;
+        s->actions = r->actions;
+        s->since_ns = 0;
+        lwsl_notice("Rule %s %s.", r->name, s->active ? "active" : "cleared");
+        if (r->actions & RULE_ACTION_SCRIPT)
+        {
+            run_script(r, s);
+        }
+        action(r, s->active);
+    }
+}
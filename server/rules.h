@@ -0,0 +1,98 @@
+// Part of UPS Server.
+// A websocket server reading data from a Bicker PSZ-1063 uExtension module
+// in combination with a Bicker UPS.
+//
+// Copyright (c) 2023 Michael Wolf <michael@mictronics.de>
+//
+// This file is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// any later version.
+//
+// This file is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef RULES_H
+#define RULES_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <libconfig.h>
+
+#define RULES_MAX 32        // Rules in the configuration
+#define RULE_TERMS_MAX 128  // Conditions of all rules together
+#define RULE_NAME_MAX 32
+#define RULE_SCRIPT_MAX 256
+
+// Actions taken when a rule becomes active or clears
+#define RULE_ACTION_EVENT 0x01    // Event log entry
+#define RULE_ACTION_NOTIFY 0x02   // Message to websocket clients
+#define RULE_ACTION_SCRIPT 0x04   // Run the rule script
+#define RULE_ACTION_SHUTDOWN 0x08 // System shutdown, cancelled when the rule clears with line power present
+
+/**
+ * Comparison of a status field with the rule value
+ */
+typedef enum
+{
+    RULE_GT,
+    RULE_GE,
+    RULE_LT,
+    RULE_LE,
+    RULE_EQ,
+    RULE_NE,
+    RULE_BITS // Any bit of the value set
+} rule_op_t;
+
+/**
+ * One condition, compiled to a status field index.
+ */
+typedef struct
+{
+    double value;
+    double hysteresis; // Threshold moves back by this much while the rule is active
+    unsigned short field;
+    unsigned char op;
+} rule_term_t;
+
+/**
+ * One rule, all of its terms must hold.
+ */
+typedef struct
+{
+    char name[RULE_NAME_MAX];
+    char script[RULE_SCRIPT_MAX];
+    uint64_t fields;          // Status fields used by the terms, bit per status_fields[] entry
+    unsigned int hold_sec;    // Time the terms must hold before the rule is active
+    unsigned int release_sec; // Time the terms must fail before the rule clears
+    unsigned int actions;     // RULE_ACTION_* bits
+    unsigned short first;     // Range in rule_table_t.term
+    unsigned short count;
+} rule_t;
+
+/**
+ * Flat evaluation table compiled from the configuration.
+ */
+typedef struct
+{
+    unsigned int generation; // Changes with every compiled table
+    int count;
+    int term_count;
+    uint64_t fields; // Status fields used by any rule
+    rule_t rule[RULES_MAX];
+    rule_term_t term[RULE_TERMS_MAX];
+} rule_table_t;
+
+typedef void (*rule_action_cb_t)(const rule_t *rule, bool active);
+
+void rules_compile(const config_setting_t *list, rule_table_t *t);
+pid_t spawn_command(const char *command, const char *const *envp);
+void rules_evaluate(const rule_table_t *t, const double *values, uint64_t mono_ns, rule_action_cb_t action);
+
+#endif /* RULES_H */
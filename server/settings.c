@@ -0,0 +1,509 @@
+// Part of UPS Server.
+// A websocket server reading data from a Bicker PSZ-1063 uExtension module
+// in combination with a Bicker UPS.
+//
+// Copyright (c) 2023 Michael Wolf <michael@mictronics.de>
+//
+// This file is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// any later version.
+//
+// This file is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <libwebsockets.h>
+#include <libconfig.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "settings.h"
+
+static pthread_mutex_t lock_settings = PTHREAD_MUTEX_INITIALIZER;
+static ups_settings_t *current = NULL; // Holds one reference while published
+
+/**
+ * Copy a string setting into a fixed size snapshot field.
+ */
+static void lookup_string(const config_t *cfg, const char *path, char *dest, size_t size)
+{
+    const char *buf = NULL;
+    if (config_lookup_string(cfg, path, &buf) && buf != NULL)
+    {
+        strncpy(dest, buf, size);
+        dest[size - 1] = '\0';
+    }
+}
+
+/**
+ * Look up a poll interval and keep it within sane limits.
+ */
+static void lookup_interval(const config_t *cfg, const char *path, unsigned int *dest, unsigned int min, unsigned int max)
+{
+    int val = 0;
+    if (config_lookup_int(cfg, path, &val))
+    {
+        if (val < (int)min)
+            val = min;
+        if (val > (int)max)
+            val = max;
+        *dest = (unsigned int)val;
+    }
+}
+
+/**
+ * Parse one entry of the listeners list. Returns false when the entry is unusable.
+ */
+static bool parse_listener(const config_setting_t *e, listener_t *l)
+{
+    const char *buf = NULL;
+    int val = 0;
+
+    memset(l, 0, sizeof(listener_t));
+    l->protocols = LISTEN_ALL;
+    l->mode = 0660;
+    if (config_setting_lookup_string(e, "unix", &buf) && buf != NULL)
+    {
+        if (strlen(buf) >= sizeof l->iface)
+        {
+            lwsl_warn("Listener socket path %s too long, skipped.", buf);
+            return false;
+        }
+        strcpy(l->iface, buf);
+        l->unix_socket = true;
+        if (config_setting_lookup_string(e, "mode", &buf) && buf != NULL)
+        {
+            l->mode = strtoul(buf, NULL, 8) & 0777;
+        }
+    }
+    else
+    {
+        strcpy(l->iface, "127.0.0.1");
+        if (config_setting_lookup_string(e, "ip", &buf) && buf != NULL)
+        {
+            strncpy(l->iface, buf, sizeof l->iface);
+            l->iface[sizeof l->iface - 1] = '\0';
+        }
+        if (!config_setting_lookup_int(e, "port", &l->port) || l->port <= 0 || l->port > 65535)
+        {
+            lwsl_warn("Listener on %s without valid port, skipped.", l->iface);
+            return false;
+        }
+    }
+    if (config_setting_lookup_bool(e, "readOnly", &val))
+    {
+        l->read_only = val;
+    }
+    config_setting_t *p = config_setting_get_member(e, "protocols");
+    if (p != NULL)
+    {
+        l->protocols = 0;
+        for (int i = 0; i < config_setting_length(p); i++)
+        {
+            buf = config_setting_get_string_elem(p, i);
+            if (buf == NULL)
+                continue;
+            if (strcmp(buf, "http") == 0)
+                l->protocols |= LISTEN_HTTP;
+            else if (strcmp(buf, "websocket") == 0)
+                l->protocols |= LISTEN_WS;
+            else if (strcmp(buf, "nis") == 0)
+                l->protocols |= LISTEN_NIS;
+            else
+                lwsl_warn("Unknown listener protocol %s ignored.", buf);
+        }
+    }
+    return true;
+}
+
+/**
+ * Parse and validate the configuration file into a new snapshot.
+ * Returns NULL when the file can not be read.
+ */
+static ups_settings_t *settings_parse(const char *file)
+{
+    config_t cfg;
+    int val = 0;
+
+    ups_settings_t *s = calloc(1, sizeof(ups_settings_t));
+    if (s == NULL)
+    {
+        return NULL;
+    }
+    // Defaults if not set in config
+    strcpy(s->iface, "127.0.0.1");
+    s->port = 10024;
+    s->uid = -1;
+    s->gid = -1;
+    strcpy(s->serial, "/dev/ttyUSB0");
+    strcpy(s->client_path, "/opt/ups-server/client");
+    strcpy(s->event_file, "/var/lib/ups-server/event.log");
+    strcpy(s->state_file, "/var/lib/ups-server/state.bin");
+    s->shutdown_delay = 1;        // Default 1 second
+    s->shutdown_soc_percent = 25; // Default 25% state of charge shutdown
+    s->shutdown_by_time = true;
+    strcpy(s->shutdown_command, "shutdown --poweroff now");
+    s->power_window_sec = 300;
+    s->poll_fast_ms = 250;
+    s->poll_normal_ms = 1000;
+    s->poll_slow_ms = 5000;
+    s->poll_steady_sec = 300;
+    s->poll_check_ms = 100;
+    s->poll_slow_check_ms = 500;
+    s->poll_fast_on_battery = true;
+    s->poll_fast_on_charging = true;
+    s->poll_fast_on_measurement = true;
+    s->recorder_enable = true;
+    strcpy(s->recorder_path, "/var/lib/ups-server");
+    s->recorder_pre_sec = 10;
+    s->recorder_window_sec = 5;
+    s->health_time_min = 3 * 60;
+    s->health_window_min = 60;
+    s->health_interval_days = 7;
+    s->health_eol_capacity = 80;
+    s->health_eol_esr = 200;
+    strcpy(s->health_path, "/var/lib/ups-server/health.dat");
+    strcpy(s->mqtt_host, "localhost");
+    s->mqtt_port = 1883;
+    s->mqtt_version = 3;
+    strcpy(s->mqtt_client_id, "ups-server");
+    strcpy(s->mqtt_topic, "ups");
+    s->mqtt_keepalive = 30;
+    s->mqtt_interval_ms = 1000;
+    strcpy(s->push_host, "localhost");
+    s->push_port = 8089;
+    strcpy(s->push_prefix, "ups");
+    s->push_interval_ms = 1000;
+    s->push_batch_size = 1400;
+    strcpy(s->push_spool, "/var/lib/ups-server/push.spool");
+    s->push_spool_max = 1024;
+
+    config_init(&cfg);
+    if (!config_read_file(&cfg, file))
+    {
+        lwsl_err("Error reading configuration: %s:%d - %s", config_error_file(&cfg),
+                 config_error_line(&cfg), config_error_text(&cfg));
+        config_destroy(&cfg);
+        free(s);
+        return NULL;
+    }
+
+    if (config_lookup(&cfg, "server") != NULL)
+    {
+        lookup_string(&cfg, "server.ip", s->iface, sizeof s->iface);
+        config_lookup_int(&cfg, "server.port", &s->port);
+        config_lookup_int(&cfg, "server.user", &s->uid);
+        config_lookup_int(&cfg, "server.group", &s->gid);
+        config_lookup_bool(&cfg, "server.daemonize", &s->daemonize);
+        lookup_string(&cfg, "server.serial", s->serial, sizeof s->serial);
+        lookup_string(&cfg, "server.clientPath", s->client_path, sizeof s->client_path);
+        lookup_string(&cfg, "server.eventLog", s->event_file, sizeof s->event_file);
+        lookup_string(&cfg, "server.stateFile", s->state_file, sizeof s->state_file);
+        if (config_lookup_bool(&cfg, "server.logToFile", &val))
+            s->log_file_enable = val;
+        if (config_lookup_int(&cfg, "server.shutdownDelay", &val))
+            s->shutdown_delay = val < 0 ? 0 : (unsigned int)val;
+        config_lookup_int(&cfg, "server.shutdownSocPercent", &s->shutdown_soc_percent);
+        if (config_lookup_bool(&cfg, "server.shutdownByTime", &val))
+            s->shutdown_by_time = val;
+        if (config_lookup_bool(&cfg, "server.shutdownBySoc", &val))
+            s->shutdown_by_soc = val;
+        lookup_string(&cfg, "server.shutdownCommand", s->shutdown_command, sizeof s->shutdown_command);
+        if (s->shutdown_soc_percent < 0)
+            s->shutdown_soc_percent = 25;
+        if (s->shutdown_soc_percent > 100)
+            s->shutdown_soc_percent = 100;
+        if (s->shutdown_by_time == false && s->shutdown_by_soc == false)
+        {
+            s->shutdown_by_time = true;
+            lwsl_err("Configuration mismatch. Shutdown by time enabled.");
+        }
+    }
+    else
+    {
+        lwsl_err("Server settings not found in configuration file.");
+    }
+
+    if (config_lookup(&cfg, "ups") != NULL)
+    {
+        config_lookup_float(&cfg, "ups.inputVoltage", &s->nominal_input_voltage);
+        config_lookup_float(&cfg, "ups.batteryVoltage", &s->nominal_battery_voltage);
+        config_lookup_int(&cfg, "ups.powerReturnPercent", &s->power_return_percent);
+        config_lookup_int(&cfg, "ups.maxBackupTime", &s->max_backup_time);
+        config_lookup_int(&cfg, "ups.wakeupDelay", &s->wakeup_delay);
+        config_lookup_int(&cfg, "ups.maxAmps", &s->max_amps);
+        config_lookup_int(&cfg, "ups.alarmMask", &s->alarm_mask);
+        lookup_interval(&cfg, "ups.powerWindow", &s->power_window_sec, 1, 86400);
+        s->nominal_ouput_power = s->nominal_input_voltage * s->max_amps;
+    }
+    else
+    {
+        lwsl_err("UPS settings not found in configuration file.");
+    }
+
+    if (config_lookup(&cfg, "poll") != NULL)
+    {
+        lookup_interval(&cfg, "poll.fastInterval", &s->poll_fast_ms, 50, 60000);
+        lookup_interval(&cfg, "poll.normalInterval", &s->poll_normal_ms, 50, 60000);
+        lookup_interval(&cfg, "poll.slowInterval", &s->poll_slow_ms, 50, 60000);
+        lookup_interval(&cfg, "poll.steadyAfter", &s->poll_steady_sec, 0, 86400);
+        lookup_interval(&cfg, "poll.checkInterval", &s->poll_check_ms, 20, 10000);
+        lookup_interval(&cfg, "poll.slowCheckInterval", &s->poll_slow_check_ms, 20, 10000);
+        if (config_lookup_bool(&cfg, "poll.fastOnBattery", &val))
+            s->poll_fast_on_battery = val;
+        if (config_lookup_bool(&cfg, "poll.fastOnCharging", &val))
+            s->poll_fast_on_charging = val;
+        if (config_lookup_bool(&cfg, "poll.fastOnMeasurement", &val))
+            s->poll_fast_on_measurement = val;
+        if (s->poll_fast_ms > s->poll_normal_ms || s->poll_normal_ms > s->poll_slow_ms)
+        {
+            lwsl_warn("Poll intervals not ascending fast < normal < slow.");
+        }
+    }
+
+    if (config_lookup(&cfg, "recorder") != NULL)
+    {
+        if (config_lookup_bool(&cfg, "recorder.enable", &val))
+            s->recorder_enable = val;
+        lookup_string(&cfg, "recorder.path", s->recorder_path, sizeof s->recorder_path);
+        lookup_interval(&cfg, "recorder.preTrigger", &s->recorder_pre_sec, 0, 600);
+        lookup_interval(&cfg, "recorder.window", &s->recorder_window_sec, 1, 60);
+    }
+
+    if (config_lookup(&cfg, "health") != NULL)
+    {
+        const char *buf = NULL;
+        unsigned int h, m;
+        if (config_lookup_bool(&cfg, "health.schedule", &val))
+            s->health_schedule = val;
+        if (config_lookup_string(&cfg, "health.time", &buf) && buf != NULL)
+        {
+            if (sscanf(buf, "%u:%u", &h, &m) == 2 && h < 24 && m < 60)
+                s->health_time_min = h * 60 + m;
+            else
+                lwsl_warn("Invalid health measurement time %s, using 03:00.", buf);
+        }
+        lookup_interval(&cfg, "health.window", &s->health_window_min, 1, 720);
+        lookup_interval(&cfg, "health.intervalDays", &s->health_interval_days, 1, 365);
+        lookup_string(&cfg, "health.path", s->health_path, sizeof s->health_path);
+        config_lookup_int(&cfg, "health.endOfLifeCapacity", &s->health_eol_capacity);
+        config_lookup_int(&cfg, "health.endOfLifeEsr", &s->health_eol_esr);
+    }
+
+    if (config_lookup(&cfg, "mqtt") != NULL)
+    {
+        if (config_lookup_bool(&cfg, "mqtt.enable", &val))
+            s->mqtt_enable = val;
+        lookup_string(&cfg, "mqtt.host", s->mqtt_host, sizeof s->mqtt_host);
+        config_lookup_int(&cfg, "mqtt.port", &s->mqtt_port);
+        config_lookup_int(&cfg, "mqtt.version", &s->mqtt_version);
+        lookup_string(&cfg, "mqtt.clientId", s->mqtt_client_id, sizeof s->mqtt_client_id);
+        lookup_string(&cfg, "mqtt.user", s->mqtt_user, sizeof s->mqtt_user);
+        lookup_string(&cfg, "mqtt.password", s->mqtt_password, sizeof s->mqtt_password);
+        lookup_string(&cfg, "mqtt.topic", s->mqtt_topic, sizeof s->mqtt_topic);
+        config_lookup_int(&cfg, "mqtt.keepalive", &s->mqtt_keepalive);
+        lookup_interval(&cfg, "mqtt.interval", &s->mqtt_interval_ms, 0, 60000);
+        if (s->mqtt_version != 3 && s->mqtt_version != 5)
+        {
+            lwsl_warn("MQTT version %d not supported, using 3.1.1.", s->mqtt_version);
+            s->mqtt_version = 3;
+        }
+        if (s->mqtt_keepalive < 5)
+            s->mqtt_keepalive = 5;
+    }
+
+    if (config_lookup(&cfg, "push") != NULL)
+    {
+        const char *buf = NULL;
+        if (config_lookup_bool(&cfg, "push.enable", &val))
+            s->push_enable = val;
+        if (config_lookup_string(&cfg, "push.format", &buf) && buf != NULL)
+        {
+            if (strcmp(buf, "graphite") == 0)
+                s->push_graphite = true;
+            else if (strcmp(buf, "influx") != 0)
+                lwsl_warn("Unknown push format %s, using influx.", buf);
+        }
+        if (config_lookup_string(&cfg, "push.transport", &buf) && buf != NULL)
+        {
+            if (strcmp(buf, "tcp") == 0)
+                s->push_tcp = true;
+            else if (strcmp(buf, "udp") != 0)
+                lwsl_warn("Unknown push transport %s, using udp.", buf);
+        }
+        lookup_string(&cfg, "push.host", s->push_host, sizeof s->push_host);
+        config_lookup_int(&cfg, "push.port", &s->push_port);
+        lookup_string(&cfg, "push.prefix", s->push_prefix, sizeof s->push_prefix);
+        lookup_interval(&cfg, "push.interval", &s->push_interval_ms, 0, 60000);
+        lookup_interval(&cfg, "push.batchSize", &s->push_batch_size, 256, 65536);
+        lookup_string(&cfg, "push.spool", s->push_spool, sizeof s->push_spool);
+        lookup_interval(&cfg, "push.spoolMax", &s->push_spool_max, 0, 1048576);
+    }
+
+    rules_compile(config_lookup(&cfg, "rules"), &s->rules);
+
+    // The server.ip listener always serves everything with full access.
+    listener_t *l = &s->listeners[0];
+    strncpy(l->iface, s->iface, sizeof l->iface);
+    l->port = s->port;
+    l->protocols = LISTEN_ALL;
+    s->listener_count = 1;
+    const config_setting_t *list = config_lookup(&cfg, "listeners");
+    if (list != NULL)
+    {
+        for (int i = 0; i < config_setting_length(list); i++)
+        {
+            if (s->listener_count == LISTENERS_MAX)
+            {
+                lwsl_warn("More than %d listeners, rest ignored.", LISTENERS_MAX);
+                break;
+            }
+            if (parse_listener(config_setting_get_elem(list, i), &s->listeners[s->listener_count]))
+            {
+                s->listener_count++;
+            }
+            else
+            {
+                memset(&s->listeners[s->listener_count], 0, sizeof(listener_t));
+            }
+        }
+    }
+
+    if (s->max_amps < 1)
+    {
+        s->max_amps = 5000;
+        lwsl_warn("UPS maximum current rating not found. Set to 5 amps.");
+    }
+    else
+    {
+        s->max_amps *= 1000;
+    }
+
+    config_destroy(&cfg);
+    return s;
+}
+
+/**
+ * Drop one reference, free snapshot when unused. Call with lock_settings held.
+ */
+static void put_locked(ups_settings_t *s)
+{
+    if (s != NULL && --s->refs == 0)
+    {
+        free(s);
+    }
+}
+
+/**
+ * Read the configuration file on startup.
+ */
+int settings_init(const char *file)
+{
+    ups_settings_t *s = settings_parse(file);
+    if (s == NULL)
+    {
+        return EXIT_FAILURE;
+    }
+    s->refs = 1;
+    pthread_mutex_lock(&lock_settings);
+    put_locked(current);
+    current = s;
+    pthread_mutex_unlock(&lock_settings);
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Re-read the configuration file and publish a new snapshot.
+ * The current snapshot remains active when the file is invalid.
+ */
+int settings_reload(const char *file)
+{
+    ups_settings_t *s = settings_parse(file);
+    if (s == NULL)
+    {
+        lwsl_err("Configuration reload failed, keeping current settings.");
+        return EXIT_FAILURE;
+    }
+    s->refs = 1;
+
+    pthread_mutex_lock(&lock_settings);
+    ups_settings_t *old = current;
+    if (old != NULL)
+    {
+        // Settings bound at startup can not change while running.
+        if (strcmp(old->iface, s->iface) != 0 || old->port != s->port ||
+            old->uid != s->uid || old->gid != s->gid || old->daemonize != s->daemonize ||
+            strcmp(old->serial, s->serial) != 0 || strcmp(old->client_path, s->client_path) != 0 ||
+            strcmp(old->state_file, s->state_file) != 0 ||
+            old->listener_count != s->listener_count ||
+            memcmp(old->listeners, s->listeners, sizeof s->listeners) != 0)
+        {
+            lwsl_warn("Changed listen, user, serial, client or state settings require a restart.");
+        }
+        strcpy(s->iface, old->iface);
+        s->port = old->port;
+        s->uid = old->uid;
+        s->gid = old->gid;
+        s->daemonize = old->daemonize;
+        strcpy(s->serial, old->serial);
+        strcpy(s->client_path, old->client_path);
+        strcpy(s->state_file, old->state_file);
+        memcpy(s->listeners, old->listeners, sizeof s->listeners);
+        s->listener_count = old->listener_count;
+    }
+    current = s;
+    put_locked(old);
+    pthread_mutex_unlock(&lock_settings);
+    lwsl_warn("Configuration reloaded.");
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Get a reference to the current settings snapshot.
+ */
+const ups_settings_t *settings_acquire(void)
+{
+    pthread_mutex_lock(&lock_settings);
+    ups_settings_t *s = current;
+    s->refs++;
+    pthread_mutex_unlock(&lock_settings);
+    return s;
+}
+
+/**
+ * Take another reference to a snapshot already referenced.
+ */
+const ups_settings_t *settings_ref(const ups_settings_t *s)
+{
+    pthread_mutex_lock(&lock_settings);
+    ((ups_settings_t *)s)->refs++;
+    pthread_mutex_unlock(&lock_settings);
+    return s;
+}
+
+/**
+ * Release a snapshot reference taken by settings_acquire() or settings_ref().
+ */
+void settings_release(const ups_settings_t *s)
+{
+    pthread_mutex_lock(&lock_settings);
+    put_locked((ups_settings_t *)s);
+    pthread_mutex_unlock(&lock_settings);
+}
+
+/**
+ * Release the published snapshot on exit.
+ */
+void settings_destroy(void)
+{
+    pthread_mutex_lock(&lock_settings);
+    put_locked(current);
+    current = NULL;
+    pthread_mutex_unlock(&lock_settings);
+}
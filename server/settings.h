@@ -0,0 +1,144 @@
+// Part of UPS Server.
+// A websocket server reading data from a Bicker PSZ-1063 uExtension module
+// in combination with a Bicker UPS.
+//
+// Copyright (c) 2023 Michael Wolf <michael@mictronics.de>
+//
+// This file is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// any later version.
+//
+// This file is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef SETTINGS_H
+#define SETTINGS_H
+
+#include <stdbool.h>
+#include <limits.h>
+#include "rules.h"
+
+#define LISTENERS_MAX 5 // The server.ip listener and four more
+
+// Services offered by a listener
+#define LISTEN_HTTP 0x01 // Web client, metrics and JSON over HTTP
+#define LISTEN_WS 0x02   // Websocket status and requests
+#define LISTEN_NIS 0x04  // apcupsd NIS raw protocol
+#define LISTEN_ALL (LISTEN_HTTP | LISTEN_WS | LISTEN_NIS)
+
+/**
+ * One listening socket. All listeners share the event loop and status snapshot.
+ */
+typedef struct
+{
+    char iface[108]; // IP address, or socket path when unix_socket is set
+    int port;
+    bool unix_socket;
+    unsigned int mode;      // Unix socket file permissions
+    unsigned int protocols; // LISTEN_* bits
+    bool read_only;         // Refuse requests that write to the UPS
+} listener_t;
+
+/**
+ * Immutable snapshot of the configuration file.
+ *
+ * A snapshot is never modified after it has been published. Readers take a
+ * reference with settings_acquire() once per cycle and drop it with
+ * settings_release(), a reload swaps in a new snapshot without waiting for them.
+ */
+typedef struct
+{
+    // Settings below require a restart, changes are reported but ignored on reload.
+    char iface[64];
+    int port;
+    int uid;
+    int gid;
+    int daemonize;
+    char serial[255];
+    char client_path[PATH_MAX];
+    char state_file[PATH_MAX];           // Warm start state, empty when disabled
+    listener_t listeners[LISTENERS_MAX]; // First one is server.ip and server.port
+    int listener_count;
+
+    // Settings below are picked up on reload.
+    bool log_file_enable;
+    char event_file[PATH_MAX];
+    unsigned int shutdown_delay; // seconds
+    int shutdown_soc_percent;
+    bool shutdown_by_time;
+    bool shutdown_by_soc;
+    char shutdown_command[256]; // Run through the shell when the shutdown is due
+    double nominal_input_voltage;
+    double nominal_battery_voltage;
+    int nominal_ouput_power;
+    int power_return_percent;
+    int max_backup_time;
+    int wakeup_delay;
+    int max_amps; // milliamps
+    int alarm_mask; // Alarm register bits excluded from notification
+    unsigned int power_window_sec; // Output power min, max and average window
+    unsigned int poll_fast_ms;       // Full update interval on battery, charging or measuring
+    unsigned int poll_normal_ms;     // Full update interval otherwise
+    unsigned int poll_slow_ms;       // Full update interval when steady online
+    unsigned int poll_steady_sec;    // Unchanged state time before slow polling
+    unsigned int poll_check_ms;      // Alarm and power state check between full updates
+    unsigned int poll_slow_check_ms; // Same when polling slow
+    bool poll_fast_on_battery;
+    bool poll_fast_on_charging;
+    bool poll_fast_on_measurement;
+    bool recorder_enable;              // Capture power events
+    char recorder_path[PATH_MAX];      // Capture files directory
+    unsigned int recorder_pre_sec;     // History kept before the trigger
+    unsigned int recorder_window_sec;  // Burst sampling after the trigger
+    bool health_schedule;              // Start capacitance/ESR measurements by schedule
+    unsigned int health_time_min;      // Scheduled time, minutes after midnight local time
+    unsigned int health_window_min;    // Time after the scheduled one to wait for quiet conditions
+    unsigned int health_interval_days; // Days between scheduled measurements
+    int health_eol_capacity;           // End of life below this percentage of the first capacity
+    int health_eol_esr;                // End of life above this percentage of the first ESR
+    unsigned int mqtt_interval_ms;     // Minimum time between MQTT publish batches
+    rule_table_t rules;                // Compiled rules, evaluated on every status update
+
+    // Capacitor health trend file, read once at startup.
+    char health_path[PATH_MAX];
+
+    // MQTT connection, read once when the client is started.
+    bool mqtt_enable;
+    char mqtt_host[256];
+    int mqtt_port;
+    int mqtt_version; // MQTT protocol 3 (3.1.1) or 5
+    char mqtt_client_id[64];
+    char mqtt_user[64];
+    char mqtt_password[64];
+    char mqtt_topic[128]; // Topic prefix
+    int mqtt_keepalive;   // seconds
+
+    // Push exporter, read once when the exporter is started.
+    bool push_enable;
+    bool push_graphite; // Graphite plaintext instead of InfluxDB line protocol
+    bool push_tcp;      // TCP instead of UDP
+    char push_host[256];
+    int push_port;
+    char push_prefix[64];             // Influx measurement or Graphite path prefix
+    unsigned int push_interval_ms;    // Batch time
+    unsigned int push_batch_size;     // Batch bytes
+    char push_spool[PATH_MAX];        // Kept while the collector is unreachable
+    unsigned int push_spool_max;      // Spool limit, KiB
+
+    unsigned int refs; // Owned by settings.c
+} ups_settings_t;
+
+int settings_init(const char *file);
+int settings_reload(const char *file);
+const ups_settings_t *settings_acquire(void);
+const ups_settings_t *settings_ref(const ups_settings_t *s);
+void settings_release(const ups_settings_t *s);
+void settings_destroy(void);
+
+#endif /* SETTINGS_H */
@@ -0,0 +1,311 @@
+// Part of UPS Server.
+// A websocket server reading data from a Bicker PSZ-1063 uExtension module
+// in combination with a Bicker UPS.
+//
+// Copyright (c) 2023 Michael Wolf <michael@mictronics.de>
+//
+// This file is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// any later version.
+//
+// This file is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <libwebsockets.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sinks.h"
+#include "alloccheck.h"
+
+static sink_t *sinks[SINK_MAX];
+static int sink_count = 0;
+static bool sinks_running = false;
+
+/**
+ * Milliseconds since a monotonic time.
+ */
+static unsigned int lag_ms(const struct timespec *since)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long ms = (now.tv_sec - since->tv_sec) * 1000 + (now.tv_nsec - since->tv_nsec) / 1000000;
+    return ms > 0 ? (unsigned int)ms : 0;
+}
+
+/**
+ * Drop the settings reference of a consumed or dropped item.
+ */
+static void item_release(sink_item_t *item)
+{
+    if (item->type == SINK_ITEM_SNAPSHOT && item->snapshot.cfg != NULL)
+    {
+        settings_release(item->snapshot.cfg);
+        item->snapshot.cfg = NULL;
+    }
+}
+
+/**
+ * Update counters after an item was consumed. Call with sink lock held.
+ */
+static void stats_consumed(sink_t *s, unsigned int lag)
+{
+    s->stats.processed++;
+    s->stats.lag_ms = lag;
+    if (lag > s->stats.max_lag_ms)
+    {
+        s->stats.max_lag_ms = lag;
+    }
+}
+
+/**
+ * Worker thread of a threaded sink. Drains its queue before it exits.
+ */
+static void *sink_thread(void *arg)
+{
+    sink_t *s = (sink_t *)arg;
+    sink_item_t item;
+
+    pthread_mutex_lock(&s->lock);
+    for (;;)
+    {
+        while (s->len == 0 && s->running)
+        {
+            pthread_cond_wait(&s->cond, &s->lock);
+        }
+        if (s->len == 0)
+        {
+            break;
+        }
+        item = s->queue[s->head];
+        s->head = (s->head + 1) % SINK_QUEUE_SIZE;
+        s->len--;
+        s->busy = true;
+        pthread_mutex_unlock(&s->lock);
+
+        unsigned int lag = lag_ms(&item.queued);
+        // Events are not steady state, neither are sinks using allocating libraries
+        bool check = item.type == SINK_ITEM_SNAPSHOT && !s->allocates;
+        if (check)
+        {
+            alloc_check_begin();
+        }
+        s->consume(&item);
+        if (check)
+        {
+            alloc_check_end(s->name);
+        }
+        item_release(&item);
+
+        pthread_mutex_lock(&s->lock);
+        s->busy = false;
+        stats_consumed(s, lag);
+        pthread_cond_broadcast(&s->idle);
+    }
+    pthread_mutex_unlock(&s->lock);
+    return NULL;
+}
+
+/**
+ * Queue an item to one sink. The reference of a snapshot is taken per sink.
+ */
+static void sink_push(sink_t *s, const sink_item_t *item)
+{
+    if (!s->threaded || !sinks_running)
+    {
+        // Inline, or threads not running yet/anymore
+        s->consume(item);
+        pthread_mutex_lock(&s->lock);
+        s->stats.published++;
+        stats_consumed(s, 0);
+        pthread_mutex_unlock(&s->lock);
+        return;
+    }
+    pthread_mutex_lock(&s->lock);
+    s->stats.published++;
+    if (s->len >= SINK_QUEUE_SIZE)
+    {
+        // Keep the latest state, drop the oldest item
+        item_release(&s->queue[s->head]);
+        s->head = (s->head + 1) % SINK_QUEUE_SIZE;
+        s->len--;
+        s->stats.dropped++;
+    }
+    sink_item_t *q = &s->queue[(s->head + s->len) % SINK_QUEUE_SIZE];
+    *q = *item;
+    if (q->type == SINK_ITEM_SNAPSHOT && q->snapshot.cfg != NULL)
+    {
+        q->snapshot.cfg = settings_ref(q->snapshot.cfg);
+    }
+    s->len++;
+    pthread_cond_signal(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+}
+
+/**
+ * Add a sink, before sinks_start().
+ */
+int sink_register(sink_t *s)
+{
+    if (sink_count >= SINK_MAX || sinks_running)
+    {
+        return EXIT_FAILURE;
+    }
+    s->head = 0;
+    s->len = 0;
+    s->busy = false;
+    memset(&s->stats, 0, sizeof(sink_stats_t));
+    s->stats.name = s->name;
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->cond, NULL);
+    pthread_cond_init(&s->idle, NULL);
+    sinks[sink_count++] = s;
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Start the worker threads of all threaded sinks.
+ */
+int sinks_start(void)
+{
+    for (int i = 0; i < sink_count; i++)
+    {
+        sink_t *s = sinks[i];
+        if (!s->threaded)
+        {
+            continue;
+        }
+        s->running = true;
+        if (pthread_create(&s->thread, NULL, sink_thread, s) != 0)
+        {
+            lwsl_err("Failed to start %s sink.", s->name);
+            s->running = false;
+            s->threaded = false; // Consume inline instead
+        }
+    }
+    sinks_running = true;
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Stop all worker threads after their queues are drained.
+ */
+void sinks_stop(void)
+{
+    if (!sinks_running)
+    {
+        return;
+    }
+    for (int i = 0; i < sink_count; i++)
+    {
+        sink_t *s = sinks[i];
+        if (!s->threaded || !s->running)
+        {
+            continue;
+        }
+        pthread_mutex_lock(&s->lock);
+        s->running = false;
+        pthread_cond_signal(&s->cond);
+        pthread_mutex_unlock(&s->lock);
+        pthread_join(s->thread, NULL);
+    }
+    sinks_running = false;
+}
+
+/**
+ * Publish a UPS snapshot to all sinks wanting snapshots.
+ * A stale snapshot only goes to sinks serving the latest status, not to recording ones.
+ */
+void sinks_publish_snapshot(const ups_snapshot_t *snap)
+{
+    sink_item_t item;
+    item.type = SINK_ITEM_SNAPSHOT;
+    clock_gettime(CLOCK_MONOTONIC, &item.queued);
+    item.snapshot = *snap;
+    for (int i = 0; i < sink_count; i++)
+    {
+        if (sinks[i]->snapshots && (!snap->stale || sinks[i]->stale))
+        {
+            sink_push(sinks[i], &item);
+        }
+    }
+}
+
+/**
+ * Publish an event to all sinks wanting events.
+ */
+void sinks_publish_event(int event, const char *detail)
+{
+    sink_item_t item;
+    item.type = SINK_ITEM_EVENT;
+    clock_gettime(CLOCK_MONOTONIC, &item.queued);
+    item.event.event = event;
+    item.event.time = time(NULL);
+    item.event.detail[0] = '\0';
+    if (detail != NULL)
+    {
+        strncpy(item.event.detail, detail, SINK_DETAIL_MAX);
+        item.event.detail[SINK_DETAIL_MAX - 1] = '\0';
+    }
+    for (int i = 0; i < sink_count; i++)
+    {
+        if (sinks[i]->events)
+        {
+            sink_push(sinks[i], &item);
+        }
+    }
+}
+
+/**
+ * Wait until all threaded sinks processed their queues. Returns false on timeout.
+ */
+bool sinks_flush(unsigned int timeout_ms)
+{
+    struct timespec deadline;
+    bool ok = true;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+    for (int i = 0; i < sink_count && sinks_running; i++)
+    {
+        sink_t *s = sinks[i];
+        if (!s->threaded || !s->running)
+        {
+            continue;
+        }
+        pthread_mutex_lock(&s->lock);
+        while ((s->len > 0 || s->busy) && ok)
+        {
+            ok = pthread_cond_timedwait(&s->idle, &s->lock, &deadline) == 0;
+        }
+        pthread_mutex_unlock(&s->lock);
+    }
+    return ok;
+}
+
+/**
+ * Copy the counters of all sinks. Returns the number of sinks copied.
+ */
+int sinks_stats(sink_stats_t *out, int max)
+{
+    int n = 0;
+    for (; n < sink_count && n < max; n++)
+    {
+        sink_t *s = sinks[n];
+        pthread_mutex_lock(&s->lock);
+        out[n] = s->stats;
+        out[n].queued = s->len;
+        pthread_mutex_unlock(&s->lock);
+    }
+    return n;
+}
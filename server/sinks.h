@@ -0,0 +1,133 @@
+// Part of UPS Server.
+// A websocket server reading data from a Bicker PSZ-1063 uExtension module
+// in combination with a Bicker UPS.
+//
+// Copyright (c) 2023 Michael Wolf <michael@mictronics.de>
+//
+// This file is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// any later version.
+//
+// This file is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef SINKS_H
+#define SINKS_H
+
+#include <stdbool.h>
+#include <pthread.h>
+#include <time.h>
+#include "bicker.h"
+#include "settings.h"
+#include "health.h"
+#include "energy.h"
+
+#define SINK_QUEUE_SIZE 64 // Items waiting per sink
+#define SINK_MAX 8
+#define SINK_DETAIL_MAX 128
+
+/**
+ * UPS state published once per full status poll.
+ */
+typedef struct
+{
+    bicker_ups_status_t ups;
+    const ups_settings_t *cfg; // Reference held while queued
+    uint64_t epoch;   // Service start, seq restarts with a new epoch
+    uint64_t seq;     // Increments with every snapshot, a gap shows a lost one
+    time_t time;
+    uint64_t time_ns; // Wall clock when the poll started, nanoseconds
+    uint64_t mono_ns; // CLOCK_MONOTONIC when the poll started, nanoseconds
+    double remain; // seconds, estimated on battery
+    unsigned int power_fail_count;
+    const char *poll_rate;
+    unsigned int poll_interval; // ms
+    uint64_t uptime;            // System uptime in seconds
+    bool stale;                 // Restored from the state file, not polled yet
+    health_summary_t health;    // Capacitor degradation fit
+    energy_t energy;            // Power and energy counters
+} ups_snapshot_t;
+
+/**
+ * Logged event.
+ */
+typedef struct
+{
+    int event;
+    char detail[SINK_DETAIL_MAX]; // Empty if none
+    time_t time;
+} sink_event_t;
+
+typedef enum
+{
+    SINK_ITEM_SNAPSHOT,
+    SINK_ITEM_EVENT,
+} sink_item_type_t;
+
+typedef struct
+{
+    sink_item_type_t type;
+    struct timespec queued; // Monotonic publish time
+    union
+    {
+        ups_snapshot_t snapshot;
+        sink_event_t event;
+    };
+} sink_item_t;
+
+/**
+ * Counters of a sink.
+ */
+typedef struct
+{
+    const char *name;
+    unsigned long published;
+    unsigned long processed;
+    unsigned long dropped;
+    unsigned int queued;
+    unsigned int lag_ms;     // Publish to processing start of the last item
+    unsigned int max_lag_ms;
+} sink_stats_t;
+
+/**
+ * Output sink. Threaded sinks consume on their own worker thread from a bounded queue,
+ * the oldest item is dropped when it is full. Inline sinks consume in the publishing thread.
+ */
+typedef struct sink
+{
+    const char *name;
+    bool threaded;
+    bool snapshots; // Wants snapshots
+    bool events;    // Wants events
+    bool allocates; // Allocates per item, skipped by the allocation check
+    bool stale;     // Wants snapshots restored at startup, before the first poll
+    void (*consume)(const sink_item_t *item);
+
+    // Owned by sinks.c
+    sink_item_t queue[SINK_QUEUE_SIZE];
+    int head;
+    int len;
+    bool busy;
+    bool running;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_cond_t idle;
+    sink_stats_t stats;
+} sink_t;
+
+int sink_register(sink_t *s);
+int sinks_start(void);
+void sinks_stop(void);
+void sinks_publish_snapshot(const ups_snapshot_t *snap);
+void sinks_publish_event(int event, const char *detail);
+bool sinks_flush(unsigned int timeout_ms);
+int sinks_stats(sink_stats_t *out, int max);
+
+#endif /* SINKS_H */
@@ -0,0 +1,162 @@
+// Part of UPS Server.
+// A websocket server reading data from a Bicker PSZ-1063 uExtension module
+// in combination with a Bicker UPS.
+//
+// Copyright (c) 2023 Michael Wolf <michael@mictronics.de>
+//
+// This file is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// any later version.
+//
+// This file is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <libwebsockets.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "state.h"
+#include "history.h"
+
+/**
+ * State file layout. A checkpoint is consistent when both generations match,
+ * a crash while writing leaves them different.
+ */
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size; // sizeof(state_file_t), changes with the register table
+    uint32_t gen_begin;
+    bicker_ups_status_t ups;
+    uint64_t time_ns;
+    double remain;
+    unsigned int power_fail_count;
+    unsigned int poll_interval;
+    energy_t energy;
+    uint32_t gen_end;
+    history_t history;
+} state_file_t;
+
+static state_file_t *state = NULL;
+
+/**
+ * Map the state file, created when missing or not matching this build.
+ * Returns true with the last checkpoint in snap, ups, time and counters only.
+ * History is kept in the file from now on.
+ */
+bool state_open(const char *path, ups_snapshot_t *snap)
+{
+    struct stat st;
+    bool valid = false;
+
+    if (path[0] == '\0')
+    {
+        return false;
+    }
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0640);
+    if (fd < 0)
+    {
+        lwsl_warn("Error opening state file %s: %s", path, strerror(errno));
+        return false;
+    }
+    if (fstat(fd, &st) == -1 || (st.st_size != sizeof(state_file_t) && ftruncate(fd, sizeof(state_file_t)) == -1))
+    {
+        lwsl_warn("Error sizing state file %s: %s", path, strerror(errno));
+        close(fd);
+        return false;
+    }
+    void *mem = mmap(NULL, sizeof(state_file_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED)
+    {
+        lwsl_warn("Error mapping state file %s: %s", path, strerror(errno));
+        return false;
+    }
+    state = mem;
+
+    if (st.st_size == sizeof(state_file_t) && state->magic == STATE_MAGIC && state->version == STATE_VERSION &&
+        state->size == sizeof(state_file_t) && state->gen_begin == state->gen_end && state->gen_end != 0)
+    {
+        valid = true;
+        memset(snap, 0, sizeof(ups_snapshot_t));
+        snap->ups = state->ups;
+        // Monotonic read times of the previous run are meaningless now
+        memset(snap->ups.read_ns, 0, sizeof snap->ups.read_ns);
+        // Not checked by the magic and generation, cleaned as when read from the UPS
+        bicker_string_clean(snap->ups.series, sizeof snap->ups.series);
+        bicker_string_clean(snap->ups.battery_type, sizeof snap->ups.battery_type);
+        bicker_string_clean(snap->ups.firmware, sizeof snap->ups.firmware);
+        bicker_string_clean(snap->ups.hw_revision, sizeof snap->ups.hw_revision);
+        snap->time_ns = state->time_ns;
+        snap->time = (time_t)(state->time_ns / 1000000000ULL);
+        snap->remain = state->remain;
+        snap->power_fail_count = state->power_fail_count;
+        snap->poll_interval = state->poll_interval;
+        snap->energy = state->energy;
+        lwsl_notice("State restored from %s.", path);
+    }
+    else
+    {
+        memset(state, 0, sizeof(state_file_t));
+        state->magic = STATE_MAGIC;
+        state->version = STATE_VERSION;
+        state->size = sizeof(state_file_t);
+    }
+    history_attach(&state->history, valid);
+    return valid;
+}
+
+/**
+ * Checkpoint a snapshot. Only memory writes, the kernel writes the pages back.
+ */
+void state_checkpoint(const ups_snapshot_t *snap)
+{
+    if (state == NULL)
+    {
+        return;
+    }
+    uint32_t gen = state->gen_end + 1;
+    if (gen == 0)
+    {
+        gen = 1;
+    }
+    state->gen_begin = gen;
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    state->ups = snap->ups;
+    state->time_ns = snap->time_ns;
+    state->remain = snap->remain;
+    state->power_fail_count = snap->power_fail_count;
+    state->poll_interval = snap->poll_interval;
+    state->energy = snap->energy;
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    state->gen_end = gen;
+}
+
+/**
+ * Write back and unmap the state file. History returns to memory.
+ */
+void state_close(void)
+{
+    if (state == NULL)
+    {
+        return;
+    }
+    static history_t detached;
+    memcpy(&detached, &state->history, sizeof(history_t));
+    history_attach(&detached, true);
+    msync(state, sizeof(state_file_t), MS_SYNC);
+    munmap(state, sizeof(state_file_t));
+    state = NULL;
+}
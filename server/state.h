@@ -0,0 +1,38 @@
+// Part of UPS Server.
+// A websocket server reading data from a Bicker PSZ-1063 uExtension module
+// in combination with a Bicker UPS.
+//
+// Copyright (c) 2023 Michael Wolf <michael@mictronics.de>
+//
+// This file is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// any later version.
+//
+// This file is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef STATE_H
+#define STATE_H
+
+#include <stdbool.h>
+#include "sinks.h"
+
+#define STATE_MAGIC 0x53505555 // "UUPS"
+#define STATE_VERSION 2
+
+/**
+ * Warm start state, checkpointed to a memory mapped file on every full status poll.
+ * Energy counters continue from the checkpoint.
+ * Restored on startup and served as stale status until the first poll finished.
+ */
+bool state_open(const char *path, ups_snapshot_t *snap);
+void state_checkpoint(const ups_snapshot_t *snap);
+void state_close(void);
+
+#endif /* STATE_H */
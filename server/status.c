@@ -0,0 +1,219 @@
+// Part of UPS Server.
+// A websocket server reading data from a Bicker PSZ-1063 uExtension module
+// in combination with a Bicker UPS.
+//
+// Copyright (c) 2023 Michael Wolf <michael@mictronics.de>
+//
+// This file is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// any later version.
+//
+// This file is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <math.h>
+#include "status.h"
+
+/**
+ * Status fields clients can subscribe to, registers first.
+ */
+const char *const status_fields[STATUS_FIELD_COUNT] = {
+#define X(member, reg, kind, scale, json, apc, csv, tier) json,
+    BICKER_STATUS(X)
+#undef X
+    "outputLoad", "remainTime", "powerFailCount", "pollRate", "pollInterval", "uptime",
+    "seq", "sampleTime", "monoTime", "readTimes", "epoch", "stale",
+    "endOfLife", "inputPower", "outputPower", "inputEnergy", "outputEnergy", "chargeEnergy", "dischargeEnergy",
+    "onBatteryTime", "outputPowerMin", "outputPowerMax", "outputPowerAvg"};
+
+const status_type_t status_types[STATUS_FIELD_COUNT] = {
+#define X(member, reg, kind, scale, json, apc, csv, tier) REG_TYPE_JSON_##kind,
+    BICKER_STATUS(X)
+#undef X
+    STATUS_INTEGER, STATUS_NUMBER, STATUS_INTEGER, STATUS_STRING, STATUS_INTEGER, STATUS_INTEGER,
+    STATUS_META, STATUS_META, STATUS_META, STATUS_META, STATUS_META, STATUS_META,
+    STATUS_INTEGER, STATUS_NUMBER, STATUS_NUMBER, STATUS_NUMBER, STATUS_NUMBER, STATUS_NUMBER, STATUS_NUMBER,
+    STATUS_INTEGER, STATUS_NUMBER, STATUS_NUMBER, STATUS_NUMBER};
+
+/**
+ * Append formatted text, the buffer stays terminated.
+ */
+void text_printf(text_buf_t *t, const char *fmt, ...)
+{
+    va_list ap;
+    if (t->len + 1 >= t->size)
+    {
+        return;
+    }
+    va_start(ap, fmt);
+    int n = vsnprintf(&t->buf[t->len], t->size - t->len, fmt, ap);
+    va_end(ap);
+    if (n > 0)
+    {
+        t->len = (t->len + (size_t)n < t->size) ? t->len + (size_t)n : t->size - 1;
+    }
+}
+
+/**
+ * Render one field value into the frame text.
+ */
+static void put(status_frame_t *f, int i, const char *fmt, ...) __attribute__((format(printf, 3, 4)));
+static void put(status_frame_t *f, int i, const char *fmt, ...)
+{
+    va_list ap;
+    size_t room = sizeof f->text - f->used;
+    va_start(ap, fmt);
+    int n = vsnprintf(&f->text[f->used], room, fmt, ap);
+    va_end(ap);
+    f->off[i] = (unsigned short)f->used;
+    f->len[i] = 0;
+    if (n > 0 && (size_t)n < room)
+    {
+        f->len[i] = (unsigned short)n;
+        f->used += (size_t)n;
+    }
+}
+
+/**
+ * Render all fields of a snapshot as JSON values.
+ * Safe to call from any sink thread with its own frame.
+ */
+void status_render(const ups_snapshot_t *snap, status_frame_t *f)
+{
+    const bicker_ups_status_t *ups = &snap->ups;
+    const energy_t *e = &snap->energy;
+    char reads[BICKER_STATUS_COUNT * 24 + 2];
+    text_buf_t t = {reads, sizeof reads, 0};
+    int i = 0;
+
+    f->used = 0;
+#define X(member, reg, kind, scale, json, apc, csv, tier) put(f, i++, REG_JSON_##kind(ups->member, scale));
+    BICKER_STATUS(X)
+#undef X
+    put(f, i++, "%d", e->load_pct);
+    put(f, i++, "%.1f", isfinite(snap->remain) ? snap->remain : 0.0); // JSON has no inf or nan
+    put(f, i++, "%u", snap->power_fail_count);
+    put(f, i++, "\"%s\"", snap->poll_rate);
+    put(f, i++, "%u", snap->poll_interval);
+    put(f, i++, "%" PRIu64, snap->uptime);
+    put(f, i++, "%" PRIu64, snap->seq);
+    put(f, i++, "%" PRIu64, snap->time_ns / UINT64_C(1000000));
+    put(f, i++, "%" PRIu64, snap->mono_ns / UINT64_C(1000));
+    // Read time of each register field relative to monoTime in microseconds,
+    // negative for fields from an earlier poll, null if never read
+    for (int r = 0; r < BICKER_STATUS_COUNT; r++)
+    {
+        if (ups->read_ns[r] == 0)
+        {
+            text_printf(&t, "%snull", r > 0 ? "," : "[");
+        }
+        else
+        {
+            text_printf(&t, "%s%" PRId64, r > 0 ? "," : "[",
+                        ((int64_t)ups->read_ns[r] - (int64_t)snap->mono_ns) / 1000);
+        }
+    }
+    text_printf(&t, "]");
+    put(f, i++, "%s", reads);
+    put(f, i++, "%" PRIu64, snap->epoch);
+    put(f, i++, "%s", snap->stale ? "true" : "false");
+    put(f, i++, "%" PRId64, (int64_t)snap->health.end_of_life);
+    put(f, i++, "%.1f", e->input_w);
+    put(f, i++, "%.1f", e->output_w);
+    put(f, i++, "%.3f", e->input_wh);
+    put(f, i++, "%.3f", e->output_wh);
+    put(f, i++, "%.3f", e->charge_wh);
+    put(f, i++, "%.3f", e->discharge_wh);
+    put(f, i++, "%.0f", e->on_battery_sec);
+    put(f, i++, "%.1f", e->window_min_w);
+    put(f, i++, "%.1f", e->window_max_w);
+    put(f, i++, "%.1f", e->window_avg_w);
+}
+
+/**
+ * Encode the selected fields, bit per status_fields[] entry, as JSON object.
+ * Returns the length, buf is not terminated.
+ */
+size_t status_encode(const status_frame_t *f, uint64_t fields, char *buf, size_t size)
+{
+    size_t n = 0;
+    bool first = true;
+
+    if (size < 2)
+    {
+        return 0;
+    }
+    buf[n++] = '{';
+    for (int i = 0; i < STATUS_FIELD_COUNT; i++)
+    {
+        if (!(fields & ((uint64_t)1 << i)) || f->len[i] == 0)
+        {
+            continue;
+        }
+        size_t klen = strlen(status_fields[i]);
+        if (n + klen + f->len[i] + 5 > size)
+        {
+            break;
+        }
+        if (!first)
+        {
+            buf[n++] = ',';
+        }
+        buf[n++] = '"';
+        memcpy(&buf[n], status_fields[i], klen);
+        n += klen;
+        buf[n++] = '"';
+        buf[n++] = ':';
+        memcpy(&buf[n], STATUS_VALUE(f, i), f->len[i]);
+        n += f->len[i];
+        first = false;
+    }
+    buf[n++] = '}';
+    return n;
+}
+
+/**
+ * All fields of a snapshot as numbers in the units sent to clients,
+ * NaN for strings and meta fields. v holds STATUS_FIELD_COUNT values.
+ */
+void status_values(const ups_snapshot_t *snap, double *v)
+{
+    const bicker_ups_status_t *ups = &snap->ups;
+    const energy_t *e = &snap->energy;
+    int i = 0;
+
+#define X(member, reg, kind, scale, json, apc, csv, tier) v[i++] = REG_NUM_##kind(ups->member, scale);
+    BICKER_STATUS(X)
+#undef X
+    v[i++] = e->load_pct;
+    v[i++] = isfinite(snap->remain) ? snap->remain : 0.0;
+    v[i++] = snap->power_fail_count;
+    v[i++] = NAN;
+    v[i++] = snap->poll_interval;
+    v[i++] = (double)snap->uptime;
+    while (i <= STATUS_FIELD_STALE)
+    {
+        v[i++] = NAN;
+    }
+    v[i++] = (double)snap->health.end_of_life;
+    v[i++] = e->input_w;
+    v[i++] = e->output_w;
+    v[i++] = e->input_wh;
+    v[i++] = e->output_wh;
+    v[i++] = e->charge_wh;
+    v[i++] = e->discharge_wh;
+    v[i++] = e->on_battery_sec;
+    v[i++] = e->window_min_w;
+    v[i++] = e->window_max_w;
+    v[i++] = e->window_avg_w;
+}
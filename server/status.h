@@ -0,0 +1,82 @@
+// Part of UPS Server.
+// A websocket server reading data from a Bicker PSZ-1063 uExtension module
+// in combination with a Bicker UPS.
+//
+// Copyright (c) 2023 Michael Wolf <michael@mictronics.de>
+//
+// This file is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// any later version.
+//
+// This file is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef STATUS_H
+#define STATUS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "sinks.h"
+
+#define STATUS_DERIVED_COUNT 23 // Fields not read from a register, e.g. outputLoad
+#define STATUS_FIELD_COUNT (BICKER_STATUS_COUNT + STATUS_DERIVED_COUNT)
+#define STATUS_FIELD_SEQ (BICKER_STATUS_COUNT + 6)
+#define STATUS_FIELD_EPOCH (BICKER_STATUS_COUNT + 10)
+#define STATUS_FIELD_STALE (BICKER_STATUS_COUNT + 11)
+#define STATUS_VALUE_MAX 48   // JSON text of one scalar value
+#define STATUS_TEXT_MAX 2048  // JSON text of all values
+#define STATUS_FRAME_MAX 4096 // JSON text of a status update with all fields
+
+// Rules, subscriptions and STATUS_FIELDS_ALL hold a bit per field
+_Static_assert(STATUS_FIELD_COUNT <= 64, "Status fields exceed the uint64_t field masks");
+
+/**
+ * JSON type of a status field
+ */
+typedef enum
+{
+    STATUS_NUMBER,
+    STATUS_INTEGER,
+    STATUS_STRING,
+    STATUS_META // Sequence, timestamps and read times, not a measurement
+} status_type_t;
+
+/**
+ * Status fields of one snapshot rendered as JSON values.
+ * Fixed size, rendered without heap allocation. A field that did not fit has length 0.
+ */
+typedef struct
+{
+    char text[STATUS_TEXT_MAX];
+    unsigned short off[STATUS_FIELD_COUNT];
+    unsigned short len[STATUS_FIELD_COUNT];
+    size_t used;
+} status_frame_t;
+
+#define STATUS_VALUE(f, i) (&(f)->text[(f)->off[i]]) // JSON text of field i, not terminated
+
+/**
+ * Text appended into a fixed buffer, truncated when full.
+ */
+typedef struct
+{
+    char *buf;
+    size_t size;
+    size_t len;
+} text_buf_t;
+
+extern const char *const status_fields[STATUS_FIELD_COUNT];
+extern const status_type_t status_types[STATUS_FIELD_COUNT];
+
+void status_render(const ups_snapshot_t *snap, status_frame_t *f);
+void status_values(const ups_snapshot_t *snap, double *v);
+size_t status_encode(const status_frame_t *f, uint64_t fields, char *buf, size_t size);
+void text_printf(text_buf_t *t, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+#endif /* STATUS_H */
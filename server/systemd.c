@@ -0,0 +1,155 @@
+// Part of UPS Server.
+// A websocket server reading data from a Bicker PSZ-1063 uExtension module
+// in combination with a Bicker UPS.
+//
+// Copyright (c) 2023 Michael Wolf <michael@mictronics.de>
+//
+// This file is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// any later version.
+//
+// This file is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <libwebsockets.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "systemd.h"
+
+static int notify_fd = -1;
+static struct sockaddr_un notify_addr;
+static socklen_t notify_addr_len;
+static uint64_t watchdog_ns = 0; // Half the service watchdog interval, 0 when disabled
+static uint64_t watchdog_last = 0;
+
+/**
+ * Number of listening sockets passed by socket activation, 0 without.
+ * The environment is cleared so it is not inherited by child processes.
+ */
+int systemd_listen_fds(void)
+{
+    const char *pid = getenv("LISTEN_PID");
+    const char *fds = getenv("LISTEN_FDS");
+    int n = 0;
+    if (pid != NULL && fds != NULL && strtol(pid, NULL, 10) == (long)getpid())
+    {
+        n = (int)strtol(fds, NULL, 10);
+        if (n < 0)
+            n = 0;
+    }
+    unsetenv("LISTEN_PID");
+    unsetenv("LISTEN_FDS");
+    unsetenv("LISTEN_FDNAMES");
+    for (int i = 0; i < n; i++)
+    {
+        fcntl(SYSTEMD_LISTEN_FDS_START + i, F_SETFD, FD_CLOEXEC);
+    }
+    return n;
+}
+
+/**
+ * Open the notification socket and read the watchdog interval.
+ */
+void systemd_notify_init(void)
+{
+    const char *path = getenv("NOTIFY_SOCKET");
+    if (path == NULL || (path[0] != '/' && path[0] != '@') || strlen(path) >= sizeof notify_addr.sun_path)
+    {
+        return;
+    }
+    memset(&notify_addr, 0, sizeof notify_addr);
+    notify_addr.sun_family = AF_UNIX;
+    strcpy(notify_addr.sun_path, path);
+    notify_addr_len = offsetof(struct sockaddr_un, sun_path) + strlen(path);
+    if (path[0] == '@')
+    {
+        notify_addr.sun_path[0] = '\0'; // Abstract namespace, not NUL terminated
+    }
+    else
+    {
+        notify_addr_len++;
+    }
+    notify_fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (notify_fd < 0)
+    {
+        lwsl_warn("Failed to open systemd notification socket: %s", strerror(errno));
+        return;
+    }
+
+    const char *pid = getenv("WATCHDOG_PID");
+    const char *usec = getenv("WATCHDOG_USEC");
+    if (usec != NULL && (pid == NULL || strtol(pid, NULL, 10) == (long)getpid()))
+    {
+        watchdog_ns = strtoull(usec, NULL, 10) * 500ULL;
+    }
+}
+
+/**
+ * Send a state like "READY=1" to the service manager.
+ */
+void systemd_notify(const char *state)
+{
+    if (notify_fd < 0)
+    {
+        return;
+    }
+    if (sendto(notify_fd, state, strlen(state), MSG_NOSIGNAL,
+               (const struct sockaddr *)&notify_addr, notify_addr_len) < 0)
+    {
+        lwsl_warn("systemd notification failed: %s", strerror(errno));
+    }
+}
+
+/**
+ * Keep the service watchdog alive. Called for each UPS update and state check,
+ * sent at most twice per watchdog interval.
+ */
+void systemd_watchdog(void)
+{
+    struct timespec now;
+    if (watchdog_ns == 0)
+    {
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    uint64_t ns = (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+    if (ns - watchdog_last >= watchdog_ns)
+    {
+        watchdog_last = ns;
+        systemd_notify("WATCHDOG=1");
+    }
+}
+
+/**
+ * Longest time between watchdog calls that still keeps the service alive,
+ * in milliseconds. 0 when the watchdog is disabled.
+ */
+unsigned int systemd_watchdog_ms(void)
+{
+    return (unsigned int)(watchdog_ns / 2000000ULL);
+}
+
+/**
+ * Close the notification socket.
+ */
+void systemd_notify_close(void)
+{
+    if (notify_fd >= 0)
+    {
+        close(notify_fd);
+        notify_fd = -1;
+    }
+}
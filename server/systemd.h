@@ -0,0 +1,41 @@
+// Part of UPS Server.
+// A websocket server reading data from a Bicker PSZ-1063 uExtension module
+// in combination with a Bicker UPS.
+//
+// Copyright (c) 2023 Michael Wolf <michael@mictronics.de>
+//
+// This file is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// any later version.
+//
+// This file is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef SYSTEMD_H
+#define SYSTEMD_H
+
+#include <stdint.h>
+
+/**
+ * Minimal systemd service integration without libsystemd.
+ *
+ * Listening sockets passed by socket activation start at descriptor 3.
+ * Notifications are datagrams to $NOTIFY_SOCKET and silently dropped when
+ * not started by systemd.
+ */
+#define SYSTEMD_LISTEN_FDS_START 3
+
+int systemd_listen_fds(void);
+void systemd_notify_init(void);
+void systemd_notify(const char *state);
+void systemd_watchdog(void);
+unsigned int systemd_watchdog_ms(void);
+void systemd_notify_close(void);
+
+#endif /* SYSTEMD_H */
@@ -18,14 +18,11 @@
 // along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
 #include <libwebsockets.h>
-#include <libconfig.h>
 #include <json-c/json.h>
-#include <pthread.h>
 #include <string.h>
 #include <getopt.h>
 #include <syslog.h>
-#include <linux/socket.h>
-#include <linux/un.h>
+#include <sys/socket.h>
 #include <sys/reboot.h>
 #include <sys/ioctl.h>
 #include <time.h>
@@ -34,57 +31,107 @@
 #include <ctype.h>
 #include <errno.h>
 #include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 #include <sys/sysinfo.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include <libgen.h>
 #include <math.h>
 #include "help.h"
 #include "bicker.h"
+#include "assets.h"
+#include "settings.h"
+#include "history.h"
+#include "recorder.h"
+#include "sinks.h"
+#include "metrics.h"
+#include "status.h"
+#include "mqtt.h"
+#include "systemd.h"
+#include "state.h"
+#include "health.h"
+#include "push.h"
+#include "alloccheck.h"
 
 #define NOTUSED(V) ((void)V)
 #define WSBUFFERSIZE 1024 // Byte
-#define UPDATE_TIME_SEC 1 // seconds, Websocket update
+#define HTTP_CHUNK_SIZE 4096 // Byte, asset body chunk per writeable callback
+#define ASSET_MAX_AGE_VERSIONED 31536000 // seconds, one year for assets requested with ?v=
+#define RPC_QUEUE_SIZE 16    // Replies and events waiting per client
+#define RPC_CMDS_MAX 16      // UPS commands in progress, all clients
+#define RPC_CLIENT_CMDS 4    // UPS commands in progress per client
+#define RPC_REQUEST_MAX 1024 // Byte
+#define WS_SHAPES_MAX 12     // Distinct status subscriptions
+#define WS_REPLAY_SIZE 120   // Status updates kept for reconnecting clients
+#define SHUTDOWN_FLUSH_MS 200 // Output sinks flush after the shutdown command started
+#define SHUTDOWN_WAIT_MS 100  // Check for the shutdown command to return
 
 static int num_clients = 0;
 static char config_file[PATH_MAX] = "/etc/default/ups-server.cfg";
-static char event_file[PATH_MAX] = "/var/lib/ups-server/event.log";
 static int syslog_options = LOG_PID | LOG_PERROR;
-static config_t cfg;
+static int config_watch_fd = -1;
+static int signal_fd = -1;
 
 #ifndef LWS_NO_DAEMONIZE
 static int daemonize = 0;
 #endif
 static struct lws_context *context;
 static struct lws_context_creation_info info;
-static unsigned char wsbuffer[WSBUFFERSIZE];
-static unsigned char *pwsbuffer = wsbuffer;
-static int wsbuffer_len = 0;
-pthread_mutex_t lock_established_conns = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t lock_apc_status = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t lock_ups_status = PTHREAD_MUTEX_INITIALIZER;
-pthread_t ups_thread;
-pthread_t shutdown_thread;
-static unsigned int shutdown_delay = 1; // Default 1 second if not set in config
-static int shutdown_soc_percent = 25;   // Default 25% state of charge shutdown
 static unsigned int power_fail_count = 0;
-static bool shutdown_by_time = true;
-static bool shutdown_by_soc = false;
 static bool shutdown_override = false;
-static bool ups_thread_exit = false;
-static bool cmd_cap_esr_measurement = false;
-static bool log_file_enable = false;
+static bool server_exit = false;
+static bool service_ready = false; // First UPS status published
+static signed int alarm_last = 0; // Alarm bits reported last
 
-#define APC_RECORD_COUNT 29
+#define APC_COUNT_X(member, reg, kind, scale, json, apc, csv, tier) +(sizeof(apc) > 1)
+#define APC_RECORD_COUNT (21 BICKER_STATUS(APC_COUNT_X)) // Fixed records and register records
+#define APC_REPORT_SIZE 2048
+#define CSV_LINE_MAX 1024 // Header or one record
+static ups_snapshot_t apc_snap = {0}; // Latest status update, holds a settings reference
+static bool apc_dirty = false;        // apc_snap not rendered into apcstr yet
 static size_t apcstr_size = 0;
-static char *apcstr = NULL;
-static char *apcline = NULL;
-static double nominal_input_voltage = 0.0;
-static double nominal_battery_voltage = 0.0;
-static int nominal_ouput_power = 0;
-static int power_return_percent = 0;
-static int max_backup_time = 0;
-static int wakeup_delay = 0;
-static int max_amps = 0;
+static char apcstr[APC_REPORT_SIZE]; // Report rendered on the first request after an update
 static char hostname[256];
 
+/*
+ * Everything below runs in the single event loop thread, driven by these timers.
+ */
+static lws_sorted_usec_list_t sul_poll;     // Next full UPS status poll
+static lws_sorted_usec_list_t sul_check;    // Next alarm and power state check
+static lws_sorted_usec_list_t sul_shutdown; // Pending system shutdown
+static lws_sorted_usec_list_t sul_shutdown_wait; // Shutdown command running
+static bool shutdown_pending = false;
+static pid_t shutdown_pid = 0; // Running shutdown command
+static int shutdown_rules = 0; // Active rules requesting shutdown, power return does not cancel it
+static bool was_power_present = false;
+static struct timespec power_fail_time; // Monotonic, clock steps do not change the estimate
+static int start_soc = 100, old_soc = 100;
+static double remain = 0.0;
+static struct timespec steady_since; // Monotonic
+static unsigned char last_device_status = 0;
+static unsigned char check_device_status = 0; // Device status of the last full poll
+static unsigned int poll_interval = 1000;     // ms, current full poll interval
+static unsigned int check_interval = 100;     // ms, current check interval
+static int alarm_cfg_mask = 0;
+static struct timespec cycle_start;
+static struct timespec sample_time; // Wall clock of cycle_start
+static uint64_t snapshot_seq = 0;   // Snapshots published
+static uint64_t service_epoch = 0;  // Service start time, identifies the seq range
+
+/**
+ * UPS update rate
+ */
+typedef enum
+{
+    POLL_FAST,
+    POLL_NORMAL,
+    POLL_SLOW,
+} poll_rate_t;
+
+static const char *poll_rate_names[] = {"fast", "normal", "slow"};
+
 typedef enum
 {
     EVENT_SERVICE_START,
@@ -92,15 +139,44 @@ typedef enum
     EVENT_POWER_FAIL,
     EVENT_POWER_GOOD,
     EVENT_SHUTDOWN,
+    EVENT_ALARM_SET,
+    EVENT_ALARM_CLEAR,
+    EVENT_CAPTURE,
+    EVENT_RULE,
 } event_t;
 
+/**
+ * LTC3350 alarm register bit names, LSB first.
+ */
+static const char *alarm_names[16] = {
+    "Capacitor under voltage",
+    "Capacitor over voltage",
+    "GPI under voltage",
+    "GPI over voltage",
+    "VIN under voltage",
+    "VIN over voltage",
+    "VCAP under voltage",
+    "VCAP over voltage",
+    "VOUT under voltage",
+    "VOUT over voltage",
+    "Input over current",
+    "Charge under current",
+    "Die temperature cold",
+    "Die temperature hot",
+    "ESR high",
+    "Capacitance low",
+};
+
 /**
  * HTTP protocol and server mount.
+ * Only used as fallback when the client files could not be cached in memory.
+ * The origin is set from clientPath at startup.
  */
-static const struct lws_http_mount mount = {
+static char mount_origin[PATH_MAX];
+static struct lws_http_mount mount = {
     .mount_next = NULL,
     .mountpoint = "/",
-    .origin = "/opt/ups-server/client",
+    .origin = mount_origin,
     .def = "index.html",
     .protocol = NULL,
     .cgienv = NULL,
@@ -117,35 +193,92 @@ static const struct lws_http_mount mount = {
     .basic_auth_login_file = NULL,
 };
 
+/**
+ * One of these is created for each HTTP request served from the asset cache
+ * and for each raw connection requesting the APC status report.
+ */
+struct http_pss
+{
+    const asset_variant_t *body;
+    size_t sent;
+    asset_variant_t dyn; // Generated body like /metrics, freed when sent
+    char apcstr[APC_REPORT_SIZE]; // Report copy, stays consistent while being sent
+    size_t apclen;
+    size_t apcpos;
+    unsigned char line[LWS_PRE + 2 + 255]; // NIS line in transmission
+    size_t linelen;
+};
+
 /**
  * One of these is created for each client connecting.
+ * Replies and events are queued per client, status updates are shared by all clients.
  */
 struct ws_pss
 {
     struct ws_pss *pss_list;
     struct lws *wsi;
-    char publishing; // nonzero: peer is publishing to us
+    int shape;                         // Status subscription, -1 when not subscribed
+    bool on_change;                    // Send only when subscribed fields changed
+    unsigned int min_interval;         // ms between status updates, 0 for every update
+    unsigned int sent;                 // Shape seq or version sent last
+    uint64_t replay;                   // Next status update replayed, 0 when not replaying
+    bool read_only;                    // Connected through a read only listener
+    struct timespec sent_time;
+    int cmds;                          // UPS commands in progress
+    unsigned char *tx[RPC_QUEUE_SIZE]; // Allocated with LWS_PRE in front
+    size_t tx_len[RPC_QUEUE_SIZE];
+    int tx_head;
+    int tx_count;
+    unsigned int tx_dropped; // Messages dropped since the queue filled, 0 when not stalled
+};
+
+/**
+ * UPS command requested by a client, completed asynchronously.
+ */
+struct rpc_cmd
+{
+    bool used;
+    struct ws_pss *pss; // NULL when the caller disconnected meanwhile
+    json_object *id;
+    char str[64]; // String register response
 };
 
 /**
- *  One of these is created for each vhost our protocol is used with.
+ * Status update for one field set, encoded once per update
+ * and shared by all clients subscribed to the same fields.
  */
-struct ws_vhd
+struct ws_shape
 {
-    struct lws_context *context;
-    struct lws_vhost *vhost;
-    const struct lws_protocols *protocol;
-    struct ws_pss *pss_list; // linked-list of live pss
-    int len;
-    char buf[LWS_SEND_BUFFER_PRE_PADDING + 100];
-    char apcstr[1024];
+    uint64_t fields; // Bit per status_fields[] entry
+    int refs;        // Clients subscribed
+    unsigned char *buf; // LWS_PRE + STATUS_FRAME_MAX, kept for the next client
+    size_t len;         // 0 until encoded
+    unsigned int seq;     // Status update encoded last
+    unsigned int version; // Increments when the encoded content changed
 };
 
+#define STATUS_FIELDS_ALL (((uint64_t)1 << STATUS_FIELD_COUNT) - 1)
+
+static struct ws_pss *ws_clients = NULL; // linked-list of live pss
+static unsigned int ws_seq = 0;          // Increments with every status update
+static ups_snapshot_t ws_ring[WS_REPLAY_SIZE]; // Latest status updates by seq, hold a settings reference
+static uint64_t ws_ring_last = 0;              // Seq of the latest update, 0 for none
+static status_frame_t ws_frame;                // Latest update rendered when a shape is encoded
+static unsigned int ws_frame_seq = 0;          // Status update rendered into ws_frame
+static status_frame_t ws_replay_frame;         // Update replayed last, shared by replaying clients
+static uint64_t ws_replay_seq = 0;
+static struct ws_shape ws_shapes[WS_SHAPES_MAX];
+static struct rpc_cmd rpc_cmds[RPC_CMDS_MAX];
+
 static void event_log(event_t ev);
+static void event_log_detail(event_t ev, const char *detail);
+static void apc_render(void);
 static int callback_raw(struct lws *wsi, enum lws_callback_reasons reason,
                         void *user, void *in, size_t len);
 static int callback_broadcast(struct lws *wsi, enum lws_callback_reasons reason,
                               void *user, void *in, size_t len);
+static int callback_control(struct lws *wsi, enum lws_callback_reasons reason,
+                            void *user, void *in, size_t len);
 static error_t parse_opt(int key, char *arg, struct argp_state *state);
 const char *argp_program_version = "UPS Server v1.0.5";
 const char args_doc[] = "";
@@ -176,631 +309,2007 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state)
 }
 
 /**
- * Handle requests from client.
+ * Milliseconds since a monotonic start time.
  */
-static void handle_client_request(void *in, size_t len)
+static long elapsed_ms(const struct timespec *start)
 {
-    NOTUSED(len);
-    json_object *jroot = json_tokener_parse(in);
-    json_object *jval;
-    json_object_object_get_ex(jroot, "cmd", &jval);
-    const char *p = json_object_get_string(jval);
-    // Start cap/esr measurement
-    if (strcmp(p, "capesr") == 0)
-    {
-        pthread_mutex_lock(&lock_ups_status);
-        cmd_cap_esr_measurement = true;
-        pthread_mutex_unlock(&lock_ups_status);
-    }
-    json_object_put(jroot);
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000 + (now.tv_nsec - start->tv_nsec) / 1000000;
 }
 
 /**
- * Websocket protocol definition.
- */
-static struct lws_protocols protocols[] = {
-    {"http", callback_raw, 0, 0, 0, NULL, 0},
-    {"broadcast", callback_broadcast, sizeof(struct ws_pss), WSBUFFERSIZE, 0, NULL, 0},
-    {NULL, NULL, 0, 0, 0, NULL, 0} /* terminator */
-};
-
-/**
- * Callback that is serving the APC status report with the raw fallback protocol.
+ * Queue a message to one client. Returns false when its queue is full.
  */
-static int callback_raw(struct lws *wsi, enum lws_callback_reasons reason, void *user, void *in, size_t len)
+static bool ws_send(struct ws_pss *pss, json_object *jobj)
 {
-    struct ws_vhd *vhd = (struct ws_vhd *)lws_protocol_vh_priv_get(lws_get_vhost(wsi), lws_get_protocol(wsi));
-    switch (reason)
+    size_t len = 0;
+    if (pss->tx_count >= RPC_QUEUE_SIZE)
     {
-    case LWS_CALLBACK_PROTOCOL_INIT:
-        vhd = lws_protocol_vh_priv_zalloc(lws_get_vhost(wsi),
-                                          lws_get_protocol(wsi),
-                                          sizeof(struct ws_vhd));
-        vhd->context = lws_get_context(wsi);
-        vhd->protocol = lws_get_protocol(wsi);
-        vhd->vhost = lws_get_vhost(wsi);
-        break;
-    /*
-     * RAW protocol handler for APC status report
-     */
-    case LWS_CALLBACK_RAW_ADOPT:
-        lwsl_notice("Connecting raw socket.");
-        break;
-
-    case LWS_CALLBACK_RAW_CLOSE:
-        pthread_mutex_unlock(&lock_apc_status);
-        lwsl_notice("Closing raw socket.");
-        break;
-
-    case LWS_CALLBACK_RAW_RX:
-        // React only on apcaccess status request
-        if (len != 8 || memcmp(in, "\x00\x06status", 8) != 0)
+        // Logged once per stall, the count is reported when the queue drained
+        if (pss->tx_dropped++ == 0)
         {
-            return lws_raw_transaction_completed(wsi);
-        }
-        // Prevent APC status report update as long as transmission is in progress.
-        pthread_mutex_lock(&lock_apc_status);
-        // Create temporary copy of status string since strtok is modifing the source one.
-        // Otherwise consecutive apcaccess request will read only first line of report between updates.
-        memcpy(vhd->apcstr, apcstr, MIN(apcstr_size, sizeof(vhd->apcstr)));
-        // NIS protocol requires line by line transfer.
-        apcline = strtok(vhd->apcstr, ";");
-        if (apcline != NULL)
-        {
-            // NIS protocol first two bytes (uint16_t) are the length of the following line.
-            vhd->len = strlen(apcline);
-            vhd->buf[LWS_SEND_BUFFER_PRE_PADDING] = 0;
-            vhd->buf[LWS_SEND_BUFFER_PRE_PADDING + 1] = vhd->len; // Set line length
-            // Copy line content
-            memcpy(&vhd->buf[LWS_SEND_BUFFER_PRE_PADDING + 2], apcline, vhd->len);
-            vhd->len += 2; // uint16_t + line length
+            lwsl_warn("Client queue full, dropping messages.");
         }
-        // Request first transmission callback
-        lws_callback_on_writable(wsi);
-        break;
+        return false;
+    }
+    const char *p = json_object_to_json_string_length(jobj, JSON_C_TO_STRING_PLAIN, &len);
+    unsigned char *buf = malloc(LWS_PRE + len);
+    if (buf == NULL)
+    {
+        return false;
+    }
+    memcpy(&buf[LWS_PRE], p, len);
+    int i = (pss->tx_head + pss->tx_count) % RPC_QUEUE_SIZE;
+    pss->tx[i] = buf;
+    pss->tx_len[i] = len;
+    pss->tx_count++;
+    lws_callback_on_writable(pss->wsi);
+    return true;
+}
 
-    case LWS_CALLBACK_RAW_WRITEABLE:
-        // Send APC status report line
-        if (lws_write(wsi, (unsigned char *)&vhd->buf[LWS_SEND_BUFFER_PRE_PADDING], (unsigned int)vhd->len, LWS_WRITE_RAW | LWS_WRITE_NO_FIN) == -1)
-        {
-            return lws_raw_transaction_completed(wsi);
-        }
-        // Get next APC report line
-        apcline = strtok(NULL, ";");
-        if (apcline != NULL)
-        {
-            // See above.
-            vhd->len = strlen(apcline);
-            vhd->buf[LWS_SEND_BUFFER_PRE_PADDING] = 0;
-            vhd->buf[LWS_SEND_BUFFER_PRE_PADDING + 1] = vhd->len;
-            memcpy(&vhd->buf[LWS_SEND_BUFFER_PRE_PADDING + 2], apcline, vhd->len);
-            vhd->len += 2;
-            // Request next transmission callback
-            lws_callback_on_writable(wsi);
-        }
-        else
+/**
+ * Queue an event to all subscribed clients.
+ */
+static void ws_send_all(json_object *jobj)
+{
+    lws_start_foreach_llp(struct ws_pss **, ppss, ws_clients)
+    {
+        if ((*ppss)->shape >= 0)
         {
-            // No more lines in APC status report. Send zero length to close connection.
-            vhd->buf[LWS_SEND_BUFFER_PRE_PADDING] = 0;
-            vhd->buf[LWS_SEND_BUFFER_PRE_PADDING + 1] = 0;
-            vhd->len = 2;
-            // Request next transmission callback
-            lws_callback_on_writable(wsi);
-            // Close connection server side
-            return lws_raw_transaction_completed(wsi);
+            ws_send(*ppss, jobj);
         }
-        break;
-
-    default:
-        break;
     }
+    lws_end_foreach_llp(ppss, pss_list);
+}
 
-    return lws_callback_http_dummy(wsi, reason, user, in, len);
+/**
+ * Encode the latest status with the fields of a shape.
+ * The version only changes when the encoded content differs from the previous update.
+ */
+static void ws_shape_encode(struct ws_shape *sh)
+{
+    char tmp[STATUS_FRAME_MAX];
+    if (ws_seq == 0)
+    {
+        return;
+    }
+    if (ws_frame_seq != ws_seq)
+    {
+        // Rendered once per update, shared by all shapes
+        status_render(&ws_ring[ws_ring_last % WS_REPLAY_SIZE], &ws_frame);
+        ws_frame_seq = ws_seq;
+    }
+    size_t len = status_encode(&ws_frame, sh->fields, tmp, sizeof tmp);
+    sh->seq = ws_seq;
+    if (len != sh->len || memcmp(&sh->buf[LWS_PRE], tmp, len) != 0)
+    {
+        memcpy(&sh->buf[LWS_PRE], tmp, len);
+        sh->len = len;
+        sh->version++;
+    }
 }
 
 /**
- * Callback that is serving the web socket protocol.
+ * Take a reference to the shape of a field set, shared with other clients if present.
+ * Returns -1 when all shapes are in use.
  */
-static int callback_broadcast(struct lws *wsi, enum lws_callback_reasons reason,
-                              void *user, void *in, size_t len)
+static int ws_shape_get(uint64_t fields)
 {
-    struct ws_pss *pss = (struct ws_pss *)user;
-    struct ws_vhd *vhd = (struct ws_vhd *)lws_protocol_vh_priv_get(lws_get_vhost(wsi), lws_get_protocol(wsi));
-    switch (reason)
+    int free_slot = -1;
+    for (int i = 0; i < WS_SHAPES_MAX; i++)
     {
-    case LWS_CALLBACK_FILTER_NETWORK_CONNECTION:
-        if (num_clients > 10)
+        if (ws_shapes[i].refs > 0 && ws_shapes[i].fields == fields)
         {
-            lwsl_warn("10 clients already connected. New connection rejected...");
-            return -1;
+            ws_shapes[i].refs++;
+            return i;
         }
-        break;
-    case LWS_CALLBACK_PROTOCOL_INIT:
-        vhd = lws_protocol_vh_priv_zalloc(lws_get_vhost(wsi),
-                                          lws_get_protocol(wsi),
-                                          sizeof(struct ws_vhd));
-        vhd->context = lws_get_context(wsi);
-        vhd->protocol = lws_get_protocol(wsi);
-        vhd->vhost = lws_get_vhost(wsi);
-        break;
-
-    case LWS_CALLBACK_PROTOCOL_DESTROY:
-        break;
-
-    case LWS_CALLBACK_ESTABLISHED:
-        ++num_clients;
-        lwsl_notice("Client connected.");
-        pss->wsi = wsi;
-        if (lws_hdr_copy(wsi, vhd->buf, sizeof(vhd->buf), WSI_TOKEN_GET_URI) > 0)
-            pss->publishing = !strcmp(vhd->buf, "/publisher");
-        if (!pss->publishing)
-            /* add subscribers to the list of live pss held in the vhd */
-            lws_ll_fwd_insert(pss, pss_list, vhd->pss_list);
-        break;
-
-    case LWS_CALLBACK_CLOSED:
-    case LWS_CALLBACK_WSI_DESTROY:
-        --num_clients;
-        lwsl_notice("Client disconnected.");
-        /* remove our closing pss from the list of live pss */
-        lws_ll_fwd_remove(struct ws_pss, pss_list,
-                          pss, vhd->pss_list);
-        break;
-
-    case LWS_CALLBACK_SERVER_WRITEABLE:
-        if (pss->publishing)
-            break;
-        /* notice we allowed for LWS_PRE in the payload already */
-        vhd->len = lws_write(wsi, &pwsbuffer[LWS_SEND_BUFFER_PRE_PADDING], wsbuffer_len, LWS_WRITE_TEXT);
-        if (vhd->len < (int)wsbuffer_len)
+        if (ws_shapes[i].refs == 0 && free_slot < 0)
+        {
+            free_slot = i;
+        }
+    }
+    if (free_slot >= 0)
+    {
+        struct ws_shape *sh = &ws_shapes[free_slot];
+        unsigned char *buf = sh->buf;
+        if (buf == NULL && (buf = malloc(LWS_PRE + STATUS_FRAME_MAX)) == NULL)
         {
-            lwsl_err("Error writing to websocket");
             return -1;
         }
-        break;
-
-    case LWS_CALLBACK_RECEIVE:
-        /*
-         * For test, our policy is ignore publishing when there are
-         * no subscribers connected.
-         */
-        if (!vhd->pss_list)
-            break;
-
-        if (len <= 0)
-            break;
-        pthread_mutex_lock(&lock_established_conns);
-        /* Reply empty json object on unknown request */
-        memcpy(&pwsbuffer[LWS_SEND_BUFFER_PRE_PADDING], "\"{}\"", 4);
-        wsbuffer_len = 4;
-        handle_client_request(in, len);
-        pthread_mutex_unlock(&lock_established_conns);
-
-        /*
-         * let every subscriber know we want to write something
-         * on them as soon as they are ready
-         */
-        lws_start_foreach_llp(struct ws_pss **, ppss, vhd->pss_list)
-        {
-            if (!(*ppss)->publishing)
-                lws_callback_on_writable((*ppss)->wsi);
-        }
-        lws_end_foreach_llp(ppss, pss_list);
-        break;
+        memset(sh, 0, sizeof(struct ws_shape));
+        sh->buf = buf;
+        sh->fields = fields;
+        sh->refs = 1;
+        ws_shape_encode(sh);
+    }
+    return free_slot;
+}
 
-    default:
-        break;
+/**
+ * Drop a shape reference of a client.
+ */
+static void ws_shape_put(struct ws_pss *pss)
+{
+    if (pss->shape >= 0)
+    {
+        ws_shapes[pss->shape].refs--;
+        pss->shape = -1;
     }
+}
 
-    return 0;
+/**
+ * Identifies the update a client gets next, compared to what it was sent last.
+ */
+static unsigned int ws_update_id(const struct ws_pss *pss)
+{
+    const struct ws_shape *sh = &ws_shapes[pss->shape];
+    return pss->on_change ? sh->version : sh->seq;
 }
 
 /**
- * Incoming signal handler. Close server nice and clean.
+ * Check for a status update the client did not get yet.
  */
-static void sighandler(int sig)
+static bool ws_update_pending(const struct ws_pss *pss)
 {
-    NOTUSED(sig);
-    // Stop UPS read thread
-    ups_thread_exit = true;
-    pthread_join(ups_thread, NULL);
-    pthread_join(shutdown_thread, NULL);
-    // Cleanup
-    pthread_mutex_unlock(&lock_established_conns);
-    pthread_mutex_destroy(&lock_established_conns);
-    pthread_mutex_unlock(&lock_apc_status);
-    pthread_mutex_destroy(&lock_apc_status);
-    pthread_mutex_unlock(&lock_ups_status);
-    pthread_mutex_destroy(&lock_ups_status);
-    lws_cancel_service(context);
-    lws_context_destroy(context);
-    config_destroy(&cfg);
-    event_log(EVENT_SERVICE_STOP);
-    exit(EXIT_SUCCESS);
+    return pss->shape >= 0 && ws_shapes[pss->shape].len > 0 && pss->sent != ws_update_id(pss);
 }
 
 /**
- * Thread to initiate system shutdown in case of input power fail.
- * Will be cancelled when input power returns while delay is pending.
+ * Publish the latest status update in ws_ring.
+ * Each distinct subscription is encoded once and shared by its clients,
+ * nothing is rendered without subscribers.
  */
-static void *shutdown_handler(void *arg)
+static void ws_publish(void)
 {
-    NOTUSED(arg);
-    lwsl_warn("Initiating shutdown.");
-    pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
-    pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
-    // Wait shutdown time but not when we are low on charge
-    if (shutdown_by_time == true)
+    ws_seq++;
+    for (int i = 0; i < WS_SHAPES_MAX; i++)
     {
-        if (shutdown_override == false)
+        if (ws_shapes[i].refs > 0)
         {
-            sleep(shutdown_delay); // sleep is a point of cancellation
+            ws_shape_encode(&ws_shapes[i]);
         }
-        else
+    }
+    lws_start_foreach_llp(struct ws_pss **, ppss, ws_clients)
+    {
+        if (ws_update_pending(*ppss))
         {
-            lwsl_warn("Immediate low on charge shutdown.");
+            lws_callback_on_writable((*ppss)->wsi);
         }
     }
-    // Should not get here when cancelled
-    event_log(EVENT_SHUTDOWN);
-    lwsl_warn("System shutdown...");
-    system("shutdown --poweroff now");
-    // Stop this service
-    ups_thread_exit = true;
-    pthread_exit(NULL);
+    lws_end_foreach_llp(ppss, pss_list);
 }
 
 /**
- * Create apcupsd compatible status report in memory.
+ * Subscribe a client to a field set. Without fields all are sent.
  */
-static void apc_update_status(bicker_ups_status_t *ups)
+static const char *ws_subscribe(struct ws_pss *pss, json_object *jfields, double max_rate, bool on_change)
 {
-    // Free previous APC report memory if any
-    if (apcstr != NULL)
+    uint64_t fields = 0;
+    if (jfields != NULL && json_object_is_type(jfields, json_type_array))
+    {
+        for (size_t i = 0; i < json_object_array_length(jfields); i++)
+        {
+            const char *name = json_object_get_string(json_object_array_get_idx(jfields, i));
+            size_t f = 0;
+            while (f < STATUS_FIELD_COUNT && (name == NULL || strcmp(status_fields[f], name) != 0))
+            {
+                f++;
+            }
+            if (f == STATUS_FIELD_COUNT)
+            {
+                return "unknown field";
+            }
+            fields |= (uint64_t)1 << f;
+        }
+    }
+    if (fields == 0)
     {
-        free(apcstr);
+        fields = STATUS_FIELDS_ALL;
     }
-    // Open new report file in memory
-    FILE *apcout = open_memstream(&apcstr, &apcstr_size);
-    if (apcout == NULL)
+    if (!on_change)
     {
-        lwsl_warn("Creating APC status stream failed.");
-        return;
+        // Numbered so gaps show and the client can resume, on change content would always differ
+        fields |= ((uint64_t)1 << STATUS_FIELD_SEQ) | ((uint64_t)1 << STATUS_FIELD_EPOCH);
     }
+    // Restored status is marked, it changes once with the first poll
+    fields |= (uint64_t)1 << STATUS_FIELD_STALE;
+    ws_shape_put(pss);
+    pss->replay = 0;
+    pss->shape = ws_shape_get(fields);
+    if (pss->shape < 0)
+    {
+        return "too many subscriptions";
+    }
+    pss->on_change = on_change;
+    pss->min_interval = max_rate > 0.0 ? (unsigned int)(1000.0 / max_rate) : 0;
+    // Send the current state right away
+    pss->sent = ws_update_id(pss) - 1;
+    memset(&pss->sent_time, 0, sizeof pss->sent_time);
+    lws_callback_on_writable(pss->wsi);
+    return NULL;
+}
 
-    char tstr[50];
-    time_t now = time(NULL);
-    struct tm *t = localtime(&now);
-    strftime(tstr, sizeof tstr, "%F %T %z", t);
+/**
+ * Oldest status update kept for replay.
+ */
+static uint64_t ws_ring_first(void)
+{
+    return ws_ring_last >= WS_REPLAY_SIZE ? ws_ring_last - WS_REPLAY_SIZE + 1 : 1;
+}
 
-    /* ';' is a delimiter used in raw socket callback to separate lines.
-     * We send the line including the line break.
-     */
-    // Create dummy header, file size yet unknown.
-    fprintf(apcout, "APC      : 001,%03u,0000\n;", APC_RECORD_COUNT);
-    fprintf(apcout, "DATE     : %.50s\n;", tstr);
-    fprintf(apcout, "HOSTNAME : %s\n;", hostname);
-    fprintf(apcout, "UPSNAME  : %.20s\n;", ups->series);
-    fprintf(apcout, "MODEL    : %.20s\n;", ups->battery_type);
-    fprintf(apcout, "FIRMWARE : %.20s\n;", ups->firmware);
-    fprintf(apcout, "CABLE    : Ethernet Link\n;");
-    fprintf(apcout, "DRIVER   : NETWORKS UPS Driver\n;");
-    fprintf(apcout, "STATUS   : ");
-    if (ups->device_status.reg.is_charging)
+/**
+ * Resume a subscribed client after the update it got last.
+ * Returns false when the updates in between are not kept anymore, the client
+ * then gets the latest update only.
+ */
+static bool ws_resume(struct ws_pss *pss, uint64_t epoch, uint64_t since)
+{
+    if (pss->shape < 0 || ws_ring_last == 0 || epoch != service_epoch ||
+        since > ws_ring_last || since + 1 < ws_ring_first())
     {
-        fprintf(apcout, "ONLINE\n;");
+        return false;
     }
-    else if (ups->device_status.reg.is_discharging)
+    if (since == ws_ring_last)
     {
-        fprintf(apcout, "ONBATT\n;");
+        pss->sent = ws_update_id(pss); // Nothing missed
+        return true;
     }
-    else
+    pss->replay = since + 1;
+    lws_callback_on_writable(pss->wsi);
+    return true;
+}
+
+/**
+ * Send the next replayed update with the fields of the client.
+ * The live update is due again when the replay caught up.
+ */
+static int ws_replay_next(struct ws_pss *pss)
+{
+    unsigned char buf[LWS_PRE + STATUS_FRAME_MAX];
+    if (pss->replay < ws_ring_first())
     {
-        fprintf(apcout, "OFFLINE\n;");
+        pss->replay = ws_ring_first(); // Overwritten while replaying
     }
-    fprintf(apcout, "LINEFAIL : ");
-    if (ups->device_status.reg.is_power_present)
+    const ups_snapshot_t *snap = &ws_ring[pss->replay % WS_REPLAY_SIZE];
+    if (ws_replay_seq != snap->seq)
     {
-        fprintf(apcout, "No\n;");
+        status_render(snap, &ws_replay_frame);
+        ws_replay_seq = snap->seq;
     }
-    else
-    {
-        fprintf(apcout, "Yes\n;");
-    }
-    fprintf(apcout, "LINEV    : %.1f Volts\n;", ups->input_voltage / 1000.0);
-    fprintf(apcout, "LINEA    : %.3f Amps\n;", ups->input_current / 1000.0);
-    fprintf(apcout, "OUTPUTV  : %.1f Volts\n;", ups->output_voltage / 1000.0);
-    fprintf(apcout, "OUTPUTA  : %.3f Amps\n;", ups->output_current / 1000.0);
-    fprintf(apcout, "LOADPCT  : %u Percent\n;", (int)(((double)ups->output_current / (double)max_amps) * 100.0));
-    fprintf(apcout, "BATTV    : %.1f Volts\n;", ups->battery_voltage / 1000.0);
-    fprintf(apcout, "BATTA    : %.3f Amps\n;", ups->battery_current / 1000.0);
-    fprintf(apcout, "BCHARGE  : %u Percent\n;", ups->soc);
-    fprintf(apcout, "ITEMP    : %d C\n;", ups->uc_temperature);
-    fprintf(apcout, "DSHUTD   : %u Seconds\n;", shutdown_delay);
-    fprintf(apcout, "DWAKE    : %u Seconds\n;", wakeup_delay);
-    fprintf(apcout, "MAXTIME  : %u Seconds\n;", max_backup_time);
-    fprintf(apcout, "RETPCT   : %u Percent\n;", power_return_percent);
-    fprintf(apcout, "STATFLAG : 0x%02X\n;", ups->device_status.value);
-    fprintf(apcout, "REG2     : 0x%04X\n;", ups->charge_status.value);
-    fprintf(apcout, "REG3     : 0x%04X\n;", ups->monitor_status.value);
-    fprintf(apcout, "NOMINV   : %.1f Volts\n;", nominal_input_voltage);
-    fprintf(apcout, "NOMBATTV : %.1f Volts\n;", nominal_battery_voltage);
-    fprintf(apcout, "NOMPOWER : %u Watts\n;", nominal_ouput_power);
-    fprintf(apcout, "ENDAPC   : %.50s\n;", tstr);
-    fflush(apcout);           // Update apcstr and apcstr_size
-    long end = ftell(apcout); // Backup end of file
-    rewind(apcout);           // Return to file start
-    // Overwrite file header with current file size
-    fprintf(apcout, "APC      : 001,%03u,%04lu\n;", APC_RECORD_COUNT, apcstr_size);
-    fseek(apcout, end, SEEK_SET); // Restore end of file
-    fclose(apcout);               // File content remains until apcstr is freed
-}
-
-static void log_to_file(bicker_ups_status_t *ups)
-{
-    char path[FILENAME_MAX];
-    struct stat st = {0};
-    time_t now = time(NULL);
-    struct tm *t = localtime(&now);
-    FILE *fp;
-    bool exists = true;
-
-    // Create file by flight and top number
-    snprintf(path, FILENAME_MAX, "/var/tmp/ups-server_%02u%02u%04u.csv",
-             t->tm_mday,
-             t->tm_mon + 1,
-             1900 + t->tm_year);
-    if (stat(path, &st) == -1)
+    size_t len = status_encode(&ws_replay_frame, ws_shapes[pss->shape].fields, (char *)&buf[LWS_PRE], STATUS_FRAME_MAX);
+    if (lws_write(pss->wsi, &buf[LWS_PRE], len, LWS_WRITE_TEXT) < (int)len)
     {
-        exists = false;
+        return -1;
     }
-    fp = fopen(path, "a");
-    if (fp != NULL)
+    if (++pss->replay > ws_ring_last)
     {
-        if (exists == false)
-        { // Add header
-            fputs("TIME;IN_V;IN_A;IN_W;OUT_V;OUT_A;OUT_W;LOAD;BATT_V;BATT_A;SOC;VCAP1;VCAP2;VCAP3;VCAP4;TEMP\n", fp);
-        }
-        fprintf(fp, "%lu;%0.1f;%0.3f;%0.1f;%0.1f;%0.3f;%0.1f;%u;%0.1f;%0.3f;%u;%0.1f;%0.1f;%0.1f;%0.1f;%u\n",
-                now,
-                ups->input_voltage / 1000.0,
-                ups->input_current / 1000.0,
-                (ups->input_voltage / 1000.0) * (ups->input_current / 1000.0),
-                ups->output_voltage / 1000.0,
-                ups->output_current / 1000.0,
-                (ups->output_voltage / 1000.0) * (ups->output_current / 1000.0),
-                (int)(((double)ups->output_current / (double)max_amps) * 100.0),
-                ups->battery_voltage / 1000.0,
-                ups->battery_current / 1000.0,
-                ups->soc,
-                ups->vcap_voltage.cap1 / 1000.0,
-                ups->vcap_voltage.cap2 / 1000.0,
-                ups->vcap_voltage.cap3 / 1000.0,
-                ups->vcap_voltage.cap4 / 1000.0,
-                ups->uc_temperature);
+        pss->replay = 0;
+        pss->sent = ws_update_id(pss);
+        clock_gettime(CLOCK_MONOTONIC, &pss->sent_time);
     }
-    else
+    return 0;
+}
+
+/**
+ * Send a reply to the caller only. Takes ownership of result.
+ */
+static void rpc_reply(struct ws_pss *pss, json_object *id, json_object *result)
+{
+    json_object *jroot = json_object_new_object();
+    json_object_object_add(jroot, "id", json_object_get(id));
+    json_object_object_add(jroot, "result", result);
+    ws_send(pss, jroot);
+    json_object_put(jroot);
+}
+
+/**
+ * Send an error reply to the caller only.
+ */
+static void rpc_error(struct ws_pss *pss, json_object *id, const char *msg)
+{
+    json_object *jroot = json_object_new_object();
+    json_object_object_add(jroot, "id", json_object_get(id));
+    json_object_object_add(jroot, "error", json_object_new_string(msg));
+    ws_send(pss, jroot);
+    json_object_put(jroot);
+}
+
+/**
+ * UPS command requested by a client completed.
+ * The result carries the time waiting in the queue and the serial round trip in milliseconds.
+ */
+static void rpc_cmd_done(const bicker_cmd_t *c, bool ok)
+{
+    struct rpc_cmd *r = (struct rpc_cmd *)c->user;
+    if (r->pss != NULL)
     {
-        lwsl_err("Error creating log file: %s\n", strerror(errno));
+        r->pss->cmds--;
+        if (ok)
+        {
+            json_object *jres = json_object_new_object();
+            json_object_object_add(jres, "reg", json_object_new_string(
+                c->cmd == START_CAP_ESR_MEASUREMENT ? "START_CAP_ESR_MEASUREMENT" : bicker_register_name(c->cmd)));
+            if (c->type == BICKER_STRING)
+            {
+                json_object_object_add(jres, "value", json_object_new_string(r->str));
+            }
+            else
+            {
+                json_object_object_add(jres, "value", json_object_new_int(c->value));
+            }
+            json_object_object_add(jres, "queueMs", json_object_new_double((double)(c->sent_ns - c->queued_ns) / 1e6));
+            json_object_object_add(jres, "serialMs", json_object_new_double((double)(c->done_ns - c->sent_ns) / 1e6));
+            rpc_reply(r->pss, r->id, jres);
+        }
+        else
+        {
+            rpc_error(r->pss, r->id, "serial error");
+        }
     }
-    fclose(fp);
+    json_object_put(r->id);
+    memset(r, 0, sizeof(struct rpc_cmd));
 }
 
 /**
- * Log event to file.
+ * Queue a UPS command for a client at user priority. The reply is sent on completion.
  */
-static void event_log(event_t ev)
+static void rpc_cmd(struct ws_pss *pss, json_object *id, bicker_cmd_t *c)
 {
-    FILE *fp;
-    time_t now = time(NULL);
-    struct tm *t = localtime(&now);
-    char st[20];
-    fp = fopen(event_file, "a");
-    if (fp != NULL)
+    struct rpc_cmd *r = NULL;
+    for (int i = 0; i < RPC_CMDS_MAX && pss->cmds < RPC_CLIENT_CMDS; i++)
     {
-        strftime(st, sizeof(st), "%F %T", t);
-        switch (ev)
+        if (!rpc_cmds[i].used)
         {
-        case EVENT_SERVICE_START:
-            fprintf(fp, "%s\tService start.\n", st);
-            break;
-        case EVENT_SERVICE_STOP:
-            fprintf(fp, "%s\tService stop.\n", st);
-            break;
-        case EVENT_POWER_FAIL:
-            fprintf(fp, "%s\tPower fail.\n", st);
-            break;
-        case EVENT_POWER_GOOD:
-            fprintf(fp, "%s\tPower good.\n", st);
-            break;
-        default:
-            fprintf(fp, "%s\tUnknown event.\n", st);
+            r = &rpc_cmds[i];
             break;
         }
-        fclose(fp);
     }
-    else
+    if (r == NULL)
     {
-        lwsl_err("Error writing event log file: %s\n", strerror(errno));
+        rpc_error(pss, id, "busy");
+        return;
+    }
+    r->used = true;
+    r->pss = pss;
+    r->id = json_object_get(id);
+    c->dest = c->type == BICKER_STRING ? r->str : NULL;
+    c->dest_len = sizeof r->str;
+    c->done = rpc_cmd_done;
+    c->user = r;
+    if (!bicker_queue(c, CMD_PRIO_NORMAL))
+    {
+        json_object_put(r->id);
+        memset(r, 0, sizeof(struct rpc_cmd));
+        rpc_error(pss, id, "busy");
+        return;
     }
+    pss->cmds++;
 }
 
 /**
- * Bicker UPS read thread.
+ * Queue a register read by name or command code.
  */
-static void *ups_read_handler(void *arg)
+static void rpc_read(struct ws_pss *pss, json_object *id, json_object *jreg)
 {
-    NOTUSED(arg);
-    lwsl_notice("UPS read thread started.");
-    if (open_serial() == EXIT_FAILURE)
+    bicker_cmd_t c;
+    bool known = false;
+    if (json_object_is_type(jreg, json_type_string))
     {
-        lwsl_err("Serial device init failed\n");
-        ups_thread_exit = true;
-    };
-
-    gethostname(hostname, sizeof hostname);
+        known = bicker_register_by_name(json_object_get_string(jreg), &c);
+    }
+    else if (json_object_is_type(jreg, json_type_int))
+    {
+        known = bicker_register_by_code(json_object_get_int(jreg), &c);
+    }
+    if (!known)
+    {
+        rpc_error(pss, id, "unknown register");
+        return;
+    }
+    rpc_cmd(pss, id, &c);
+}
 
-    bool was_power_present = false;
-    bool shutdown_pending = false;
-    time_t t = time(NULL);
-    int start_soc = 100, old_soc = 100;
-    double remain = 0.0;
-    struct sysinfo s_info;
-    uint64_t uptime = 0;
+/**
+ * Handle a request from client, {"id":..,"cmd":"..",..}.
+ * Replies go to the caller only, requests never block the event loop.
+ */
+static void handle_client_request(struct ws_pss *pss, const char *in, size_t len)
+{
+    json_tokener *tok = json_tokener_new();
+    json_object *jroot = tok != NULL ? json_tokener_parse_ex(tok, in, (int)len) : NULL;
+    json_object *jid = NULL;
+    json_object *jval = NULL;
+    if (tok != NULL)
+    {
+        json_tokener_free(tok);
+    }
+    if (jroot == NULL || !json_object_is_type(jroot, json_type_object))
+    {
+        rpc_error(pss, NULL, "parse error");
+        json_object_put(jroot);
+        return;
+    }
+    json_object_object_get_ex(jroot, "id", &jid);
+    if (!json_object_object_get_ex(jroot, "cmd", &jval) || !json_object_is_type(jval, json_type_string))
+    {
+        rpc_error(pss, jid, "missing cmd");
+        json_object_put(jroot);
+        return;
+    }
+    const char *p = json_object_get_string(jval);
+    // Requests writing to the UPS, reading registers may clear latched alarms too
+    if (pss->read_only && (strcmp(p, "capesr") == 0 || strcmp(p, "clearalarms") == 0 || strcmp(p, "read") == 0))
+    {
+        rpc_error(pss, jid, "read only");
+    }
+    // Start cap/esr measurement
+    else if (strcmp(p, "capesr") == 0)
+    {
+        bicker_cmd_t c;
+        if (get_ups_status()->monitor_status.reg.is_esr_measuring)
+        {
+            rpc_error(pss, jid, "measuring");
+        }
+        else
+        {
+            bicker_command(START_CAP_ESR_MEASUREMENT, &c);
+            rpc_cmd(pss, jid, &c);
+        }
+    }
+    // Clear latched alarms and refresh the alarm mask
+    else if (strcmp(p, "clearalarms") == 0)
+    {
+        bicker_cmd_t c;
+        bicker_command(GET_CLEAR_ALARMS, &c);
+        rpc_cmd(pss, jid, &c);
+        queue_command(GET_MASK_ALARMS, CMD_PRIO_NORMAL);
+    }
+    // Read any register, {"cmd":"read","reg":"GET_SOC"} or {"cmd":"read","reg":71}
+    else if (strcmp(p, "read") == 0)
+    {
+        json_object_object_get_ex(jroot, "reg", &jval);
+        rpc_read(pss, jid, jval);
+    }
+    // Status history, {"cmd":"history","since":<unix time>,"count":<entries>}
+    else if (strcmp(p, "history") == 0)
+    {
+        time_t since = 0;
+        int count = 0;
+        if (json_object_object_get_ex(jroot, "since", &jval))
+            since = (time_t)json_object_get_int64(jval);
+        if (json_object_object_get_ex(jroot, "count", &jval))
+            count = json_object_get_int(jval);
+        rpc_reply(pss, jid, history_query(since, count));
+    }
+    // Capacitance/ESR measurements and their degradation fit
+    else if (strcmp(p, "health") == 0)
+    {
+        rpc_reply(pss, jid, health_query());
+    }
+    // Status updates, {"cmd":"subscribe","fields":["soc",..],"maxRate":<Hz>,"onChange":true}
+    // Resumed after a seen update with "epoch":<epoch>,"since":<seq>, the reply tells whether it was kept
+    else if (strcmp(p, "subscribe") == 0)
+    {
+        json_object *jfields = NULL;
+        double max_rate = 0.0;
+        bool on_change = false;
+        json_object_object_get_ex(jroot, "fields", &jfields);
+        if (json_object_object_get_ex(jroot, "maxRate", &jval))
+            max_rate = json_object_get_double(jval);
+        if (json_object_object_get_ex(jroot, "onChange", &jval))
+            on_change = json_object_get_boolean(jval);
+        const char *err = ws_subscribe(pss, jfields, max_rate, on_change);
+        if (err != NULL)
+            rpc_error(pss, jid, err);
+        else if (json_object_object_get_ex(jroot, "since", &jval))
+        {
+            json_object *jepoch = NULL;
+            json_object_object_get_ex(jroot, "epoch", &jepoch);
+            rpc_reply(pss, jid, json_object_new_boolean(ws_resume(pss, (uint64_t)json_object_get_int64(jepoch),
+                                                                  (uint64_t)json_object_get_int64(jval))));
+        }
+        else
+            rpc_reply(pss, jid, json_object_new_boolean(true));
+    }
+    // Saved power event captures, {"cmd":"captures"} and {"cmd":"capture","name":".."}
+    else if (strcmp(p, "captures") == 0 || strcmp(p, "capture") == 0)
+    {
+        const ups_settings_t *cfg = settings_acquire();
+        if (strcmp(p, "captures") == 0)
+        {
+            rpc_reply(pss, jid, recorder_list(cfg));
+        }
+        else
+        {
+            json_object *jcap = NULL;
+            if (json_object_object_get_ex(jroot, "name", &jval))
+                jcap = recorder_load(cfg, json_object_get_string(jval));
+            if (jcap != NULL)
+                rpc_reply(pss, jid, jcap);
+            else
+                rpc_error(pss, jid, "unknown capture");
+        }
+        settings_release(cfg);
+    }
+    // Output sink counters, {"cmd":"sinks"}
+    else if (strcmp(p, "sinks") == 0)
+    {
+        sink_stats_t stats[SINK_MAX];
+        int n = sinks_stats(stats, SINK_MAX);
+        json_object *jarr = json_object_new_array();
+        for (int i = 0; i < n; i++)
+        {
+            json_object *js = json_object_new_object();
+            json_object_object_add(js, "name", json_object_new_string(stats[i].name));
+            json_object_object_add(js, "published", json_object_new_uint64(stats[i].published));
+            json_object_object_add(js, "processed", json_object_new_uint64(stats[i].processed));
+            json_object_object_add(js, "dropped", json_object_new_uint64(stats[i].dropped));
+            json_object_object_add(js, "queued", json_object_new_int(stats[i].queued));
+            json_object_object_add(js, "lag", json_object_new_int(stats[i].lag_ms));
+            json_object_object_add(js, "maxLag", json_object_new_int(stats[i].max_lag_ms));
+            json_object_array_add(jarr, js);
+        }
+        rpc_reply(pss, jid, jarr);
+    }
+    else if (strcmp(p, "unsubscribe") == 0)
+    {
+        ws_shape_put(pss);
+        rpc_reply(pss, jid, json_object_new_boolean(true));
+    }
+    else
+    {
+        rpc_error(pss, jid, "unknown cmd");
+    }
+    json_object_put(jroot);
+}
+
+/**
+ * Websocket protocol definition.
+ */
+static struct lws_protocols protocols[] = {
+    {"http", callback_raw, sizeof(struct http_pss), 0, 0, NULL, 0},
+    {"broadcast", callback_broadcast, sizeof(struct ws_pss), WSBUFFERSIZE, 0, NULL, 0},
+    {"serial", callback_serial, 0, 0, 0, NULL, 0},
+    {"control", callback_control, 0, 0, 0, NULL, 0},
+    {NULL, NULL, 0, 0, 0, NULL, 0} /* terminator */
+};
+
+/**
+ * Protocols offered by each listener, a subset of the above.
+ * Serial and control descriptors are adopted by the first listener only.
+ */
+static struct lws_protocols listener_protocols[LISTENERS_MAX][sizeof(protocols) / sizeof(protocols[0])];
+static char listener_names[LISTENERS_MAX][16];
+
+/**
+ * Listener a connection was accepted by.
+ */
+static const listener_t *wsi_listener(struct lws *wsi)
+{
+    return (const listener_t *)lws_vhost_user(lws_get_vhost(wsi));
+}
+
+/**
+ * Serve the Prometheus metrics generated by the metrics sink.
+ */
+static int serve_metrics(struct lws *wsi, struct http_pss *hpss)
+{
+    unsigned char headers[LWS_PRE + 256];
+    unsigned char *start = &headers[LWS_PRE];
+    unsigned char *p = start;
+    unsigned char *end = &headers[sizeof(headers) - 1];
+
+    hpss->dyn.data = (unsigned char *)metrics_get(&hpss->dyn.len);
+    if (hpss->dyn.data == NULL)
+    {
+        lws_return_http_status(wsi, HTTP_STATUS_SERVICE_UNAVAILABLE, NULL);
+        return lws_http_transaction_completed(wsi);
+    }
+    if (lws_add_http_common_headers(wsi, HTTP_STATUS_OK, "text/plain; version=0.0.4", hpss->dyn.len, &p, end) ||
+        lws_add_http_header_by_name(wsi, (unsigned char *)"cache-control:", (unsigned char *)"no-store", 8, &p, end) ||
+        lws_finalize_write_http_header(wsi, start, &p, end))
+    {
+        return 1;
+    }
+    hpss->body = &hpss->dyn;
+    hpss->sent = 0;
+    lws_callback_on_writable(wsi);
+    return 0;
+}
+
+/**
+ * Release a generated body.
+ */
+static void serve_dyn_free(struct http_pss *hpss)
+{
+    if (hpss->body == &hpss->dyn)
+    {
+        hpss->body = NULL;
+    }
+    free(hpss->dyn.data);
+    hpss->dyn.data = NULL;
+    hpss->dyn.len = 0;
+}
+
+/**
+ * Serve a web client file from the in-memory asset cache.
+ * Answers conditional requests with 304 and picks the precompressed variant.
+ */
+static int serve_asset(struct lws *wsi, struct http_pss *hpss, const char *uri)
+{
+    unsigned char headers[LWS_PRE + 512];
+    unsigned char *start = &headers[LWS_PRE];
+    unsigned char *p = start;
+    unsigned char *end = &headers[sizeof(headers) - 1];
+    char hdr[128];
+    char cache[64];
+    asset_encoding_t enc;
+
+    if (strcmp(uri, "/metrics") == 0)
+    {
+        return serve_metrics(wsi, hpss);
+    }
+    const asset_t *asset = assets_find(uri);
+    if (asset == NULL)
+    {
+        lws_return_http_status(wsi, HTTP_STATUS_NOT_FOUND, NULL);
+        return lws_http_transaction_completed(wsi);
+    }
+
+    hdr[0] = '\0';
+    if (lws_hdr_total_length(wsi, WSI_TOKEN_HTTP_ACCEPT_ENCODING) > 0)
+    {
+        lws_hdr_copy(wsi, hdr, sizeof hdr, WSI_TOKEN_HTTP_ACCEPT_ENCODING);
+    }
+    const asset_variant_t *v = assets_select(asset, hdr, &enc);
+
+    // Assets referenced with a version argument never change, all others are revalidated by ETag.
+    if (lws_get_urlarg_by_name(wsi, "v=", hdr, sizeof hdr) != NULL)
+    {
+        snprintf(cache, sizeof cache, "public, max-age=%d, immutable", ASSET_MAX_AGE_VERSIONED);
+    }
+    else
+    {
+        snprintf(cache, sizeof cache, "no-cache");
+    }
+
+    hdr[0] = '\0';
+    if (lws_hdr_total_length(wsi, WSI_TOKEN_HTTP_IF_NONE_MATCH) > 0)
+    {
+        lws_hdr_copy(wsi, hdr, sizeof hdr, WSI_TOKEN_HTTP_IF_NONE_MATCH);
+    }
+    if (hdr[0] != '\0' && (strstr(hdr, v->etag) != NULL || strcmp(hdr, "*") == 0))
+    {
+        // Client copy is still valid, no body
+        if (lws_add_http_header_status(wsi, HTTP_STATUS_NOT_MODIFIED, &p, end) ||
+            lws_add_http_header_by_name(wsi, (unsigned char *)"etag:", (unsigned char *)v->etag, strlen(v->etag), &p, end) ||
+            lws_add_http_header_by_name(wsi, (unsigned char *)"cache-control:", (unsigned char *)cache, strlen(cache), &p, end) ||
+            lws_add_http_header_by_name(wsi, (unsigned char *)"vary:", (unsigned char *)"accept-encoding", 15, &p, end) ||
+            lws_finalize_write_http_header(wsi, start, &p, end))
+        {
+            return 1;
+        }
+        return lws_http_transaction_completed(wsi);
+    }
+
+    if (lws_add_http_common_headers(wsi, HTTP_STATUS_OK, asset->mime, v->len, &p, end) ||
+        lws_add_http_header_by_name(wsi, (unsigned char *)"etag:", (unsigned char *)v->etag, strlen(v->etag), &p, end) ||
+        lws_add_http_header_by_name(wsi, (unsigned char *)"cache-control:", (unsigned char *)cache, strlen(cache), &p, end) ||
+        lws_add_http_header_by_name(wsi, (unsigned char *)"vary:", (unsigned char *)"accept-encoding", 15, &p, end))
+    {
+        return 1;
+    }
+    if (enc != ASSET_ENC_IDENTITY)
+    {
+        const char *name = assets_encoding_name(enc);
+        if (lws_add_http_header_by_name(wsi, (unsigned char *)"content-encoding:", (unsigned char *)name, strlen(name), &p, end))
+        {
+            return 1;
+        }
+    }
+    if (lws_finalize_write_http_header(wsi, start, &p, end))
+    {
+        return 1;
+    }
+    hpss->body = v;
+    hpss->sent = 0;
+    // Body is sent in chunks from writeable callback
+    lws_callback_on_writable(wsi);
+    return 0;
+}
+
+/**
+ * Send next chunk of a cached asset body.
+ */
+static int serve_asset_chunk(struct lws *wsi, struct http_pss *hpss)
+{
+    unsigned char buf[LWS_PRE + HTTP_CHUNK_SIZE];
+    if (hpss->body == NULL)
+    {
+        return 0;
+    }
+    size_t n = MIN(hpss->body->len - hpss->sent, (size_t)HTTP_CHUNK_SIZE);
+    bool final = (hpss->sent + n) >= hpss->body->len;
+    memcpy(&buf[LWS_PRE], hpss->body->data + hpss->sent, n);
+    if (lws_write(wsi, &buf[LWS_PRE], n, final ? LWS_WRITE_HTTP_FINAL : LWS_WRITE_HTTP) != (int)n)
+    {
+        return 1;
+    }
+    hpss->sent += n;
+    if (final)
+    {
+        serve_dyn_free(hpss);
+        hpss->body = NULL;
+        return lws_http_transaction_completed(wsi);
+    }
+    lws_callback_on_writable(wsi);
+    return 0;
+}
+
+/**
+ * Prepare next line of the APC status report for transmission.
+ * Lines are separated by ';' in the report. Returns false when there are no more lines.
+ */
+static bool nis_next_line(struct http_pss *hpss)
+{
+    while (hpss->apcpos < hpss->apclen)
+    {
+        const char *line = &hpss->apcstr[hpss->apcpos];
+        const char *end = memchr(line, ';', hpss->apclen - hpss->apcpos);
+        size_t n = end != NULL ? (size_t)(end - line) : hpss->apclen - hpss->apcpos;
+        hpss->apcpos += n + 1;
+        if (n == 0 || line[0] == '\0')
+        {
+            continue;
+        }
+        n = MIN(n, sizeof(hpss->line) - LWS_SEND_BUFFER_PRE_PADDING - 2);
+        // NIS protocol first two bytes (uint16_t) are the length of the following line.
+        hpss->line[LWS_SEND_BUFFER_PRE_PADDING] = 0;
+        hpss->line[LWS_SEND_BUFFER_PRE_PADDING + 1] = n; // Set line length
+        // Copy line content
+        memcpy(&hpss->line[LWS_SEND_BUFFER_PRE_PADDING + 2], line, n);
+        hpss->linelen = n + 2; // uint16_t + line length
+        return true;
+    }
+    return false;
+}
+
+/**
+ * Callback that is serving the APC status report with the raw fallback protocol.
+ * HTTP requests are served from the asset cache.
+ */
+static int callback_raw(struct lws *wsi, enum lws_callback_reasons reason, void *user, void *in, size_t len)
+{
+    struct http_pss *hpss = (struct http_pss *)user;
+    switch (reason)
+    {
+    case LWS_CALLBACK_HTTP:
+        if (!(wsi_listener(wsi)->protocols & LISTEN_HTTP))
+        {
+            lws_return_http_status(wsi, HTTP_STATUS_FORBIDDEN, NULL);
+            return -1;
+        }
+        return serve_asset(wsi, hpss, (const char *)in);
+
+    case LWS_CALLBACK_HTTP_WRITEABLE:
+        return serve_asset_chunk(wsi, hpss);
+
+    case LWS_CALLBACK_CLOSED_HTTP:
+        if (hpss != NULL)
+        {
+            serve_dyn_free(hpss);
+        }
+        break;
+
+    /*
+     * RAW protocol handler for APC status report
+     */
+    case LWS_CALLBACK_RAW_ADOPT:
+        if (!(wsi_listener(wsi)->protocols & LISTEN_NIS))
+        {
+            return -1;
+        }
+        lwsl_notice("Connecting raw socket.");
+        break;
+
+    case LWS_CALLBACK_RAW_CLOSE:
+        lwsl_notice("Closing raw socket.");
+        break;
+
+    case LWS_CALLBACK_RAW_RX:
+        // React only on apcaccess status request
+        if (len != 8 || memcmp(in, "\x00\x06status", 8) != 0)
+        {
+            return lws_raw_transaction_completed(wsi);
+        }
+        if (apc_dirty)
+        {
+            apc_render();
+            apc_dirty = false;
+        }
+        // Take a copy of the report per connection, it may be updated during transmission.
+        hpss->apclen = MIN(apcstr_size, sizeof(hpss->apcstr));
+        memcpy(hpss->apcstr, apcstr, hpss->apclen);
+        hpss->apcpos = 0;
+        // NIS protocol requires line by line transfer.
+        nis_next_line(hpss);
+        // Request first transmission callback
+        lws_callback_on_writable(wsi);
+        break;
+
+    case LWS_CALLBACK_RAW_WRITEABLE:
+        // Send APC status report line
+        if (lws_write(wsi, &hpss->line[LWS_SEND_BUFFER_PRE_PADDING], hpss->linelen, LWS_WRITE_RAW | LWS_WRITE_NO_FIN) == -1)
+        {
+            return lws_raw_transaction_completed(wsi);
+        }
+        // Get next APC report line
+        if (nis_next_line(hpss))
+        {
+            // Request next transmission callback
+            lws_callback_on_writable(wsi);
+        }
+        else
+        {
+            // No more lines in APC status report. Send zero length to close connection.
+            hpss->line[LWS_SEND_BUFFER_PRE_PADDING] = 0;
+            hpss->line[LWS_SEND_BUFFER_PRE_PADDING + 1] = 0;
+            hpss->linelen = 2;
+            // Request next transmission callback
+            lws_callback_on_writable(wsi);
+            // Close connection server side
+            return lws_raw_transaction_completed(wsi);
+        }
+        break;
+
+    default:
+        break;
+    }
+
+    return lws_callback_http_dummy(wsi, reason, user, in, len);
+}
+
+/**
+ * Callback that is serving the web socket protocol.
+ */
+static int callback_broadcast(struct lws *wsi, enum lws_callback_reasons reason,
+                              void *user, void *in, size_t len)
+{
+    struct ws_pss *pss = (struct ws_pss *)user;
+    int n;
+    switch (reason)
+    {
+    case LWS_CALLBACK_FILTER_NETWORK_CONNECTION:
+        if (num_clients > 10)
+        {
+            lwsl_warn("10 clients already connected. New connection rejected...");
+            return -1;
+        }
+        break;
+
+    case LWS_CALLBACK_ESTABLISHED:
+        ++num_clients;
+        lwsl_notice("Client connected.");
+        pss->wsi = wsi;
+        pss->shape = -1;
+        pss->read_only = wsi_listener(wsi)->read_only;
+        lws_ll_fwd_insert(pss, pss_list, ws_clients);
+        // All fields at every update unless the client subscribes otherwise
+        ws_subscribe(pss, NULL, 0.0, false);
+        // Reconnecting clients resume with "/?epoch=<epoch>&since=<seq>"
+        {
+            char ebuf[32], sbuf[32];
+            const char *epoch = lws_get_urlarg_by_name(wsi, "epoch=", ebuf, sizeof ebuf);
+            const char *since = lws_get_urlarg_by_name(wsi, "since=", sbuf, sizeof sbuf);
+            if (epoch != NULL && since != NULL)
+            {
+                ws_resume(pss, strtoull(epoch, NULL, 10), strtoull(since, NULL, 10));
+            }
+        }
+        break;
+
+    case LWS_CALLBACK_CLOSED:
+    case LWS_CALLBACK_WSI_DESTROY:
+        if (pss == NULL || pss->wsi == NULL)
+            break;
+        --num_clients;
+        lwsl_notice("Client disconnected.");
+        /* remove our closing pss from the list of live pss */
+        lws_ll_fwd_remove(struct ws_pss, pss_list, pss, ws_clients);
+        ws_shape_put(pss);
+        // UPS commands still in progress complete without caller
+        for (int i = 0; i < RPC_CMDS_MAX; i++)
+        {
+            if (rpc_cmds[i].pss == pss)
+                rpc_cmds[i].pss = NULL;
+        }
+        for (; pss->tx_count > 0; pss->tx_count--)
+        {
+            free(pss->tx[pss->tx_head]);
+            pss->tx_head = (pss->tx_head + 1) % RPC_QUEUE_SIZE;
+        }
+        pss->wsi = NULL;
+        break;
+
+    case LWS_CALLBACK_SERVER_WRITEABLE:
+        // One write per callback, replies and events first
+        if (pss->tx_count > 0)
+        {
+            unsigned char *buf = pss->tx[pss->tx_head];
+            size_t blen = pss->tx_len[pss->tx_head];
+            pss->tx_head = (pss->tx_head + 1) % RPC_QUEUE_SIZE;
+            pss->tx_count--;
+            n = lws_write(wsi, &buf[LWS_PRE], blen, LWS_WRITE_TEXT);
+            free(buf);
+            if (n < (int)blen)
+            {
+                lwsl_err("Error writing to websocket");
+                return -1;
+            }
+            if (pss->tx_count == 0 && pss->tx_dropped > 0)
+            {
+                lwsl_notice("Client queue drained, %u messages dropped.", pss->tx_dropped);
+                pss->tx_dropped = 0;
+            }
+        }
+        else if (pss->replay != 0 && pss->shape >= 0)
+        {
+            if (ws_replay_next(pss) < 0)
+            {
+                lwsl_err("Error writing to websocket");
+                return -1;
+            }
+        }
+        else if (ws_update_pending(pss))
+        {
+            long wait = (long)pss->min_interval - elapsed_ms(&pss->sent_time);
+            if (pss->min_interval > 0 && wait > 0)
+            {
+                // Rate limited, the latest update is sent when the timer expires
+                lws_set_timer_usec(wsi, (lws_usec_t)wait * LWS_US_PER_MS);
+                break;
+            }
+            const struct ws_shape *sh = &ws_shapes[pss->shape];
+            /* notice we allowed for LWS_PRE in the payload already */
+            n = lws_write(wsi, &sh->buf[LWS_PRE], sh->len, LWS_WRITE_TEXT);
+            if (n < (int)sh->len)
+            {
+                lwsl_err("Error writing to websocket");
+                return -1;
+            }
+            pss->sent = ws_update_id(pss);
+            clock_gettime(CLOCK_MONOTONIC, &pss->sent_time);
+        }
+        if (pss->tx_count > 0 || pss->replay != 0 || ws_update_pending(pss))
+        {
+            lws_callback_on_writable(wsi);
+        }
+        break;
+
+    case LWS_CALLBACK_TIMER:
+        lws_callback_on_writable(wsi);
+        break;
+
+    case LWS_CALLBACK_RECEIVE:
+        if (len == 0 || !lws_is_first_fragment(wsi))
+            break;
+        if (!lws_is_final_fragment(wsi) || len > RPC_REQUEST_MAX)
+        {
+            rpc_error(pss, NULL, "request too large");
+            break;
+        }
+        handle_client_request(pss, (const char *)in, len);
+        break;
+
+    default:
+        break;
+    }
+
+    return 0;
+}
+
+/**
+ * Watch the configuration file directory for changes.
+ * Editors usually replace the file, so the directory is watched instead of the file itself.
+ */
+static void config_watch_init(void)
+{
+    char dir[PATH_MAX];
+    strncpy(dir, config_file, sizeof dir);
+    dir[(sizeof dir) - 1] = '\0';
+    config_watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (config_watch_fd < 0 ||
+        inotify_add_watch(config_watch_fd, dirname(dir), IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+    {
+        lwsl_warn("Configuration file watch not available: %s", strerror(errno));
+        if (config_watch_fd >= 0)
+        {
+            close(config_watch_fd);
+        }
+        config_watch_fd = -1;
+    }
+}
+
+/**
+ * Check for pending inotify events on the configuration file. Non-blocking.
+ */
+static bool config_watch_changed(void)
+{
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    char name[PATH_MAX];
+    bool changed = false;
+    ssize_t len;
+
+    if (config_watch_fd < 0)
+    {
+        return false;
+    }
+    strncpy(name, config_file, sizeof name);
+    name[(sizeof name) - 1] = '\0';
+    const char *base = basename(name);
+    while ((len = read(config_watch_fd, buf, sizeof buf)) > 0)
+    {
+        for (char *ptr = buf; ptr < buf + len;)
+        {
+            const struct inotify_event *ev = (const struct inotify_event *)ptr;
+            if (ev->len > 0 && strcmp(ev->name, base) == 0)
+            {
+                changed = true;
+            }
+            ptr += sizeof(struct inotify_event) + ev->len;
+        }
+    }
+    return changed;
+}
+
+/**
+ * Adopt a local descriptor, signalfd or inotify, into the event loop.
+ */
+static int adopt_control_fd(struct lws_vhost *vhost, int fd)
+{
+    lws_sock_file_fd_type sfd;
+    sfd.filefd = fd;
+    if (lws_adopt_descriptor_vhost(vhost, LWS_ADOPT_RAW_FILE_DESC, sfd, "control", NULL) == NULL)
+    {
+        lwsl_err("Failed to adopt control descriptor.");
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Create one vhost per configured listener on the shared context.
+ * Sockets passed by systemd socket activation are used in listener order instead of binding.
+ * Returns the first vhost, or NULL when it can not listen. Other listeners are skipped on failure.
+ */
+static struct lws_vhost *create_listeners(const ups_settings_t *boot, int listen_fds)
+{
+    struct lws_vhost *primary = NULL;
+    for (int i = boot->listener_count; i < listen_fds; i++)
+    {
+        lwsl_warn("No listener configured for socket %d, closed.", i);
+        close(SYSTEMD_LISTEN_FDS_START + i);
+    }
+    for (int i = 0; i < boot->listener_count; i++)
+    {
+        const listener_t *l = &boot->listeners[i];
+        struct lws_context_creation_info vinfo = info;
+        struct lws_protocols *prot = listener_protocols[i];
+        int n = 0;
+
+        prot[n++] = protocols[0]; // HTTP is needed for the websocket upgrade too
+        if (l->protocols & LISTEN_WS)
+            prot[n++] = protocols[1];
+        if (i == 0)
+        {
+            prot[n++] = protocols[2];
+            prot[n++] = protocols[3];
+        }
+        memset(&prot[n], 0, sizeof(struct lws_protocols));
+        vinfo.protocols = prot;
+        vinfo.mounts = (l->protocols & LISTEN_HTTP) ? info.mounts : NULL;
+        vinfo.iface = l->iface;
+        vinfo.port = l->unix_socket ? 0 : l->port;
+        bool unix_socket = l->unix_socket;
+        if (i < listen_fds)
+        {
+            struct sockaddr sa;
+            socklen_t sa_len = sizeof sa;
+            vinfo.vh_listen_sockfd = SYSTEMD_LISTEN_FDS_START + i;
+            unix_socket = getsockname(vinfo.vh_listen_sockfd, &sa, &sa_len) == 0 && sa.sa_family == AF_UNIX;
+        }
+        if (unix_socket)
+            vinfo.options |= LWS_SERVER_OPTION_UNIX_SOCK;
+        vinfo.user = (void *)l;
+        if (i > 0)
+        {
+            snprintf(listener_names[i], sizeof listener_names[i], "listener%d", i);
+            vinfo.vhost_name = listener_names[i];
+        }
+
+        struct lws_vhost *vh = lws_create_vhost(context, &vinfo);
+        if (vh == NULL)
+        {
+            lwsl_err("Failed to listen on %s:%d.", l->iface, l->port);
+            if (i == 0)
+                return NULL;
+            continue;
+        }
+        if (l->unix_socket && i >= listen_fds && chmod(l->iface, l->mode) == -1)
+        {
+            lwsl_warn("Failed to set mode of %s: %s", l->iface, strerror(errno));
+        }
+        if (i == 0)
+            primary = vh;
+    }
+    return primary;
+}
+
+/**
+ * Callback for signals and configuration file changes, both delivered as descriptors.
+ * Termination and reload are handled in the event loop, never in signal context.
+ */
+static int callback_control(struct lws *wsi, enum lws_callback_reasons reason,
+                            void *user, void *in, size_t len)
+{
+    NOTUSED(user);
+    NOTUSED(in);
+    NOTUSED(len);
+    struct signalfd_siginfo si;
+
+    switch (reason)
+    {
+    case LWS_CALLBACK_RAW_RX_FILE:
+        if (lws_get_socket_fd(wsi) == config_watch_fd)
+        {
+            if (config_watch_changed())
+            {
+                settings_reload(config_file);
+            }
+            break;
+        }
+        while (read(signal_fd, &si, sizeof si) == (ssize_t)sizeof si)
+        {
+            if (si.ssi_signo == SIGHUP)
+            {
+                settings_reload(config_file);
+            }
+            else
+            {
+                lwsl_notice("Signal %u received, stopping.", si.ssi_signo);
+                server_exit = true;
+            }
+        }
+        break;
+
+    case LWS_CALLBACK_RAW_CLOSE_FILE:
+        if (lws_get_socket_fd(wsi) == config_watch_fd)
+        {
+            config_watch_fd = -1;
+        }
+        else
+        {
+            signal_fd = -1;
+        }
+        break;
+
+    default:
+        break;
+    }
+    return 0;
+}
+
+/**
+ * Close server nice and clean.
+ */
+static void server_cleanup(void)
+{
+    systemd_notify("STOPPING=1");
+    lws_sul_cancel(&sul_poll);
+    lws_sul_cancel(&sul_check);
+    lws_sul_cancel(&sul_shutdown);
+    recorder_stop();
+    close_serial();
+    // Closes all adopted descriptors as well
+    lws_context_destroy(context);
+    assets_free();
+    for (int i = 0; i < WS_SHAPES_MAX; i++)
+    {
+        free(ws_shapes[i].buf);
+        ws_shapes[i].buf = NULL;
+    }
+    // Remaining output is written before the settings are gone
+    event_log(EVENT_SERVICE_STOP);
+    sinks_stop();
+    mqtt_stop();
+    push_stop();
+    for (int i = 0; i < WS_REPLAY_SIZE; i++)
+    {
+        settings_release(ws_ring[i].cfg);
+    }
+    settings_release(apc_snap.cfg);
+    settings_destroy();
+    state_close();
+    systemd_notify_close();
+}
+
+/**
+ * Shutdown command started, stop this service once it returned.
+ * UPS status and clients are served meanwhile.
+ */
+static void shutdown_wait(lws_sorted_usec_list_t *sul)
+{
+    int status;
+    NOTUSED(sul);
+    pid_t pid = waitpid(shutdown_pid, &status, WNOHANG);
+    if (pid == 0)
+    {
+        lws_sul_schedule(context, 0, &sul_shutdown_wait, shutdown_wait, SHUTDOWN_WAIT_MS * LWS_US_PER_MS);
+        return;
+    }
+    if (pid < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    {
+        lwsl_err("Shutdown command failed.");
+    }
+    shutdown_pid = 0;
+    server_exit = true;
+}
+
+/**
+ * Timer to initiate system shutdown in case of input power fail.
+ * Will be cancelled when input power returns while delay is pending.
+ */
+static void shutdown_handler(lws_sorted_usec_list_t *sul)
+{
+    NOTUSED(sul);
+    event_log(EVENT_SHUTDOWN);
+    lwsl_warn("System shutdown...");
+    const ups_settings_t *cfg = settings_acquire();
+    shutdown_pid = spawn_command(cfg->shutdown_command, NULL);
+    settings_release(cfg);
+    // Get pending logs to disk while the system goes down, the rest is flushed on exit
+    if (!sinks_flush(SHUTDOWN_FLUSH_MS))
+    {
+        lwsl_warn("Output sinks not flushed.");
+    }
+    if (shutdown_pid == 0)
+    {
+        server_exit = true;
+        return;
+    }
+    lws_sul_schedule(context, 0, &sul_shutdown_wait, shutdown_wait, SHUTDOWN_WAIT_MS * LWS_US_PER_MS);
+}
+
+/**
+ * Schedule system shutdown, after delay or immediately when low on charge.
+ */
+static void shutdown_start(const ups_settings_t *cfg)
+{
+    lws_usec_t delay = 0;
+    lwsl_warn("Initiating shutdown.");
+    // Wait shutdown time but not when we are low on charge
+    if (cfg->shutdown_by_time == true)
+    {
+        if (shutdown_override == false)
+        {
+            delay = (lws_usec_t)cfg->shutdown_delay * LWS_US_PER_SEC;
+        }
+        else
+        {
+            lwsl_warn("Immediate low on charge shutdown.");
+        }
+    }
+    lws_sul_schedule(context, 0, &sul_shutdown, shutdown_handler, delay);
+}
+
+/**
+ * Websocket sink, runs in the event loop as lws is not thread safe.
+ */
+static void ws_sink_consume(const sink_item_t *item)
+{
+    // Kept for replay, rendered when a subscriber needs it
+    ups_snapshot_t *r = &ws_ring[item->snapshot.seq % WS_REPLAY_SIZE];
+    settings_release(r->cfg);
+    *r = item->snapshot;
+    settings_ref(r->cfg);
+    ws_ring_last = r->seq;
+    ws_publish();
+}
+
+/**
+ * APC report sink, keeps the latest update for the next NIS request.
+ */
+static void apc_store(const sink_item_t *item)
+{
+    settings_release(apc_snap.cfg);
+    apc_snap = item->snapshot;
+    settings_ref(apc_snap.cfg);
+    apc_dirty = true;
+}
+
+/**
+ * Append the APC report lines of the status fields first to last.
+ */
+static void apc_fields(text_buf_t *apcout, const bicker_ups_status_t *ups, int first, int last)
+{
+#define X(member, reg, kind, scale, json, apc, csv, tier)                       \
+    if (sizeof(apc) > 1 && REG_FIELD_##reg >= first && REG_FIELD_##reg <= last) \
+    {                                                                           \
+        text_printf(apcout, "%-9s: ", apc);                                     \
+        text_printf(apcout, REG_APC_##kind(ups->member, scale));                \
+        text_printf(apcout, "\n;");                                             \
+    }
+    BICKER_STATUS(X)
+#undef X
+}
+
+/**
+ * Create apcupsd compatible status report from the latest update.
+ * Lines keep the order of earlier versions, new ones are added before ENDAPC.
+ */
+static void apc_render(void)
+{
+    const bicker_ups_status_t *ups = &apc_snap.ups;
+    const energy_t *e = &apc_snap.energy;
+    const ups_settings_t *cfg = apc_snap.cfg;
+    text_buf_t apcout = {apcstr, sizeof apcstr, 0};
+    char hdr[32];
+
+    if (cfg == NULL)
+    {
+        return; // No update yet
+    }
+    char tstr[50];
+    struct tm t;
+    localtime_r(&apc_snap.time, &t);
+    strftime(tstr, sizeof tstr, "%F %T %z", &t);
+
+    /* ';' is a delimiter used in raw socket callback to separate lines.
+     * We send the line including the line break.
+     */
+    // Create dummy header, file size yet unknown.
+    text_printf(&apcout, "APC      : 001,%03u,0000\n;", APC_RECORD_COUNT);
+    text_printf(&apcout, "DATE     : %.50s\n;", tstr);
+    text_printf(&apcout, "HOSTNAME : %s\n;", hostname);
+    apc_fields(&apcout, ups, REG_FIELD_GET_SERIES, REG_FIELD_GET_FIRMWARE);
+    text_printf(&apcout, "CABLE    : Ethernet Link\n;");
+    text_printf(&apcout, "DRIVER   : NETWORKS UPS Driver\n;");
+    text_printf(&apcout, "STATUS   : ");
+    if (ups->device_status.reg.is_charging)
+    {
+        text_printf(&apcout, "ONLINE\n;");
+    }
+    else if (ups->device_status.reg.is_discharging)
+    {
+        text_printf(&apcout, "ONBATT\n;");
+    }
+    else
+    {
+        text_printf(&apcout, "OFFLINE\n;");
+    }
+    text_printf(&apcout, "LINEFAIL : ");
+    if (ups->device_status.reg.is_power_present)
+    {
+        text_printf(&apcout, "No\n;");
+    }
+    else
+    {
+        text_printf(&apcout, "Yes\n;");
+    }
+    apc_fields(&apcout, ups, REG_FIELD_GET_INPUT_VOLTAGE1, REG_FIELD_GET_OUTPUT_CURRENT1);
+    text_printf(&apcout, "LOADPCT  : %d Percent\n;", e->load_pct);
+    apc_fields(&apcout, ups, REG_FIELD_GET_BATTERY_VOLTAGE, REG_FIELD_GET_LTC3350_TEMPERATURE);
+    text_printf(&apcout, "DSHUTD   : %u Seconds\n;", cfg->shutdown_delay);
+    text_printf(&apcout, "DWAKE    : %u Seconds\n;", cfg->wakeup_delay);
+    text_printf(&apcout, "MAXTIME  : %u Seconds\n;", cfg->max_backup_time);
+    text_printf(&apcout, "RETPCT   : %u Percent\n;", cfg->power_return_percent);
+    apc_fields(&apcout, ups, REG_FIELD_GET_MONITOR_ALARM_REGISTER, REG_FIELD_GET_MONITOR_STATUS_REGISTER);
+    text_printf(&apcout, "NOMINV   : %.1f Volts\n;", cfg->nominal_input_voltage);
+    text_printf(&apcout, "NOMBATTV : %.1f Volts\n;", cfg->nominal_battery_voltage);
+    text_printf(&apcout, "NOMPOWER : %u Watts\n;", cfg->nominal_ouput_power);
+    text_printf(&apcout, "OUTWATTS : %.1f Watts\n;", e->output_w);
+    text_printf(&apcout, "CUMONBATT: %.0f Seconds\n;", e->on_battery_sec);
+    text_printf(&apcout, "INWH     : %.3f Wh\n;", e->input_wh);
+    text_printf(&apcout, "OUTWH    : %.3f Wh\n;", e->output_wh);
+    text_printf(&apcout, "BCHGWH   : %.3f Wh\n;", e->charge_wh);
+    text_printf(&apcout, "BDISWH   : %.3f Wh\n;", e->discharge_wh);
+    text_printf(&apcout, "ENDAPC   : %.50s\n;", tstr);
+    // Overwrite file header with current file size, same width as the dummy
+    int n = snprintf(hdr, sizeof hdr, "APC      : 001,%03u,%04zu\n;", APC_RECORD_COUNT, apcout.len);
+    if (n > 0 && (size_t)n <= apcout.len)
+    {
+        memcpy(apcstr, hdr, (size_t)n);
+    }
+    apcstr_size = apcout.len;
+}
+
+/**
+ * Append the CSV header columns of the status fields first to last.
+ */
+static void csv_header(text_buf_t *out, int first, int last)
+{
+#define X(member, reg, kind, scale, json, apc, csv, tier)                        \
+    if (sizeof(csv) > 1 && REG_FIELD_##reg >= first && REG_FIELD_##reg <= last) \
+        text_printf(out, ";" csv);
+    BICKER_STATUS(X)
+#undef X
+}
+
+/**
+ * Append the CSV cells of the status fields first to last.
+ */
+static void csv_cells(text_buf_t *out, const bicker_ups_status_t *ups, int first, int last)
+{
+#define X(member, reg, kind, scale, json, apc, csv, tier)                        \
+    if (sizeof(csv) > 1 && REG_FIELD_##reg >= first && REG_FIELD_##reg <= last) \
+    {                                                                           \
+        text_printf(out, ";");                                                  \
+        text_printf(out, REG_CSV_##kind(ups->member, scale));                   \
+    }
+    BICKER_STATUS(X)
+#undef X
+}
+
+/**
+ * Append a snapshot to the daily CSV log, csv sink thread.
+ * Columns keep the order of earlier versions, new ones are appended.
+ */
+static void log_to_file(const sink_item_t *item)
+{
+    static int fd = -1;      // Kept open for the day, csv sink thread only
+    static int fd_yday = -1; // Day of year the file belongs to
+    const bicker_ups_status_t *ups = &item->snapshot.ups;
+    const energy_t *e = &item->snapshot.energy;
+    const ups_settings_t *cfg = item->snapshot.cfg;
+    char path[FILENAME_MAX];
+    char line[CSV_LINE_MAX];
+    text_buf_t out = {line, sizeof line, 0};
+    struct stat st = {0};
+    time_t now = item->snapshot.time;
+    struct tm t;
 
-    while (!ups_thread_exit)
+    if (!cfg->log_file_enable)
     {
-        // Get UPS status for websocket service
-        pthread_mutex_lock(&lock_ups_status);
-        bicker_ups_status_t *bs = get_ups_status();
-        // Check if serial interface connection is still present and there is no R/W error
-        if (is_serial_error())
+        if (fd >= 0)
         {
-            lwsl_err("Serial interface not accessible.\n");
-            ups_thread_exit = true;
-            break;
+            close(fd);
+            fd = -1;
         }
-        // Create JSON object for websocket transfer
-        size_t len = 0;
-        json_object *jroot = json_object_new_object();
-        json_object_object_add(jroot, "inputVoltage", json_object_new_double((double)(bs->input_voltage / 1000.0)));
-        json_object_object_add(jroot, "outputVoltage", json_object_new_double((double)(bs->output_voltage / 1000.0)));
-        json_object_object_add(jroot, "batteryVoltage", json_object_new_double((double)(bs->battery_voltage / 1000.0)));
-        json_object_object_add(jroot, "vcap1Voltage", json_object_new_double((double)(bs->vcap_voltage.cap1 / 1000.0)));
-        json_object_object_add(jroot, "vcap2Voltage", json_object_new_double((double)(bs->vcap_voltage.cap2 / 1000.0)));
-        json_object_object_add(jroot, "vcap3Voltage", json_object_new_double((double)(bs->vcap_voltage.cap3 / 1000.0)));
-        json_object_object_add(jroot, "vcap4Voltage", json_object_new_double((double)(bs->vcap_voltage.cap4 / 1000.0)));
-        json_object_object_add(jroot, "inputCurrent", json_object_new_int((int)bs->input_current));
-        json_object_object_add(jroot, "outputCurrent", json_object_new_int((int)bs->output_current));
-        json_object_object_add(jroot, "batteryCurrent", json_object_new_int((int)bs->battery_current));
-        json_object_object_add(jroot, "outputLoad", json_object_new_int((int)(((double)bs->output_current / (double)max_amps) * 100.0)));
-        json_object_object_add(jroot, "ucTemperature", json_object_new_int((int)bs->uc_temperature));
-        json_object_object_add(jroot, "capacity", json_object_new_int((int)bs->capacity));
-        json_object_object_add(jroot, "esr", json_object_new_int((int)bs->esr));
-        json_object_object_add(jroot, "soc", json_object_new_int((int)bs->soc));
-        json_object_object_add(jroot, "remainTime", json_object_new_double(remain));
-        json_object_object_add(jroot, "chargeStatus", json_object_new_int((int)bs->charge_status.value));
-        json_object_object_add(jroot, "monitorStatus", json_object_new_int((int)bs->monitor_status.value));
-        json_object_object_add(jroot, "deviceStatus", json_object_new_int((int)bs->device_status.value));
-        json_object_object_add(jroot, "batteryType", json_object_new_string(bs->battery_type));
-        json_object_object_add(jroot, "series", json_object_new_string(bs->series));
-        json_object_object_add(jroot, "firmware", json_object_new_string(bs->firmware));
-        json_object_object_add(jroot, "hwRevision", json_object_new_string(bs->hw_revision));
-        json_object_object_add(jroot, "powerFailCount", json_object_new_int((int)power_fail_count));
-        if (sysinfo(&s_info) == 0)
-        {
-            uptime = (uint64_t)s_info.uptime;
-        }
-        else
+        return;
+    }
+    localtime_r(&now, &t);
+    if (fd >= 0 && fd_yday != t.tm_yday)
+    {
+        close(fd);
+        fd = -1;
+    }
+    if (fd < 0)
+    {
+        // Create file by flight and top number
+        snprintf(path, FILENAME_MAX, "/var/tmp/ups-server_%02u%02u%04u.csv",
+                 t.tm_mday,
+                 t.tm_mon + 1,
+                 1900 + t.tm_year);
+        fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+        if (fd < 0)
         {
-            uptime = 0;
+            lwsl_err("Error creating log file: %s\n", strerror(errno));
+            return;
         }
-        json_object_object_add(jroot, "uptime", json_object_new_uint64(uptime));
-        // Create JSON string and copy to websocket buffer
-        const char *p = json_object_to_json_string_length(jroot, JSON_C_TO_STRING_PLAIN, &len);
-        memcpy(&pwsbuffer[LWS_SEND_BUFFER_PRE_PADDING], (unsigned char *)p, len);
-        wsbuffer_len = len;
-        lws_callback_on_writable_all_protocol(context, &protocols[1]);
-        // Send immediately to web client
-        lws_service(context, 0);
+        fd_yday = t.tm_yday;
+        if (fstat(fd, &st) == 0 && st.st_size == 0)
+        { // Add header
+            text_printf(&out, "TIME");
+            csv_header(&out, REG_FIELD_GET_INPUT_VOLTAGE1, REG_FIELD_GET_INPUT_CURRENT1);
+            text_printf(&out, ";IN_W");
+            csv_header(&out, REG_FIELD_GET_OUTPUT_VOLTAGE1, REG_FIELD_GET_OUTPUT_CURRENT1);
+            text_printf(&out, ";OUT_W;LOAD");
+            csv_header(&out, REG_FIELD_GET_BATTERY_VOLTAGE, REG_FIELD_GET_LTC3350_TEMPERATURE);
+            csv_header(&out, REG_FIELD_GET_CHARGE_CURRENT, BICKER_STATUS_COUNT - 1);
+            text_printf(&out, ";IN_WH;OUT_WH;CHG_WH;DIS_WH;BATT_S\n");
+        }
+    }
+    text_printf(&out, "%lu", now);
+    csv_cells(&out, ups, REG_FIELD_GET_INPUT_VOLTAGE1, REG_FIELD_GET_INPUT_CURRENT1);
+    text_printf(&out, ";%0.1f", e->input_w);
+    csv_cells(&out, ups, REG_FIELD_GET_OUTPUT_VOLTAGE1, REG_FIELD_GET_OUTPUT_CURRENT1);
+    text_printf(&out, ";%0.1f;%d", e->output_w, e->load_pct);
+    csv_cells(&out, ups, REG_FIELD_GET_BATTERY_VOLTAGE, REG_FIELD_GET_LTC3350_TEMPERATURE);
+    csv_cells(&out, ups, REG_FIELD_GET_CHARGE_CURRENT, BICKER_STATUS_COUNT - 1);
+    text_printf(&out, ";%0.3f;%0.3f;%0.3f;%0.3f;%0.0f\n", e->input_wh, e->output_wh, e->charge_wh, e->discharge_wh,
+                e->on_battery_sec);
+    // One write per line, O_APPEND keeps lines whole
+    if (write(fd, line, out.len) != (ssize_t)out.len)
+    {
+        lwsl_err("Error writing log file: %s\n", strerror(errno));
+    }
+}
 
-        // Cleanup JSON allocated memory
-        json_object_put(jroot);
+/**
+ * Log event to file.
+ */
+static void event_log(event_t ev)
+{
+    event_log_detail(ev, NULL);
+}
+
+/**
+ * Log event with additional detail text to file.
+ * Written by the eventlog sink, the caller does not wait for the disk.
+ */
+static void event_log_detail(event_t ev, const char *detail)
+{
+    sinks_publish_event(ev, detail);
+}
+
+/**
+ * Human readable text of an event.
+ */
+static void event_text(int ev, const char *detail, char *buf, size_t size)
+{
+    if (detail == NULL || detail[0] == '\0')
+    {
+        detail = "unknown";
+    }
+    switch ((event_t)ev)
+    {
+    case EVENT_SERVICE_START:
+        snprintf(buf, size, "Service start.");
+        break;
+    case EVENT_SERVICE_STOP:
+        snprintf(buf, size, "Service stop.");
+        break;
+    case EVENT_POWER_FAIL:
+        snprintf(buf, size, "Power fail.");
+        break;
+    case EVENT_POWER_GOOD:
+        snprintf(buf, size, "Power good.");
+        break;
+    case EVENT_ALARM_SET:
+        snprintf(buf, size, "Alarm: %s.", detail);
+        break;
+    case EVENT_ALARM_CLEAR:
+        snprintf(buf, size, "Alarm cleared: %s.", detail);
+        break;
+    case EVENT_CAPTURE:
+        snprintf(buf, size, "Power event captured: %s.", detail);
+        break;
+    case EVENT_RULE:
+        snprintf(buf, size, "Rule %s.", detail);
+        break;
+    default:
+        snprintf(buf, size, "Unknown event.");
+        break;
+    }
+}
+
+/**
+ * Write an event to the event log file, eventlog sink thread.
+ */
+static void event_log_write(const sink_item_t *item)
+{
+    FILE *fp;
+    struct tm t;
+    char st[20];
+    char text[SINK_DETAIL_MAX + 32];
+    const ups_settings_t *cfg = settings_acquire();
+    fp = fopen(cfg->event_file, "a");
+    settings_release(cfg);
+    if (fp != NULL)
+    {
+        localtime_r(&item->event.time, &t);
+        strftime(st, sizeof(st), "%F %T", &t);
+        event_text(item->event.event, item->event.detail, text, sizeof text);
+        fprintf(fp, "%s\t%s\n", st, text);
+        fclose(fp);
+    }
+    else
+    {
+        lwsl_err("Error writing event log file: %s\n", strerror(errno));
+    }
+}
+
+/**
+ * Detect alarm register transitions, log them and push them to all subscribers immediately.
+ * Alarms not enabled in the device mask or excluded by configuration are ignored.
+ */
+static void alarm_check(bicker_ups_status_t *ups, int cfg_mask)
+{
+    signed int value = ups->alarm_status.value & 0xFFFF & ~cfg_mask;
+    if (ups->alarm_mask != 0)
+    {
+        value &= ups->alarm_mask;
+    }
+    signed int set = value & ~alarm_last;
+    signed int cleared = alarm_last & ~value;
+    if (set == 0 && cleared == 0)
+    {
+        return;
+    }
+    alarm_last = value;
 
-        // Start capacity/ers measurement on request if not running
-        if (cmd_cap_esr_measurement && !bs->monitor_status.reg.is_esr_measuring)
+    for (int i = 0; i < 16; i++)
+    {
+        if (set & (1 << i))
+        {
+            lwsl_warn("Alarm: %s", alarm_names[i]);
+            event_log_detail(EVENT_ALARM_SET, alarm_names[i]);
+        }
+        else if (cleared & (1 << i))
         {
-            start_cap_esr_measurement();
-            cmd_cap_esr_measurement = false;
+            lwsl_warn("Alarm cleared: %s", alarm_names[i]);
+            event_log_detail(EVENT_ALARM_CLEAR, alarm_names[i]);
         }
-        pthread_mutex_unlock(&lock_ups_status);
+    }
+
+    // Push transition without waiting for the next status update
+    json_object *jroot = json_object_new_object();
+    json_object *jalarm = json_object_new_object();
+    json_object_object_add(jalarm, "status", json_object_new_int((int)(ups->alarm_status.value & 0xFFFF)));
+    json_object_object_add(jalarm, "set", json_object_new_int((int)set));
+    json_object_object_add(jalarm, "cleared", json_object_new_int((int)cleared));
+    json_object_object_add(jroot, "alarm", jalarm);
+    ws_send_all(jroot);
+    json_object_put(jroot);
+}
+
+/**
+ * Select the update rate from the UPS state.
+ * Fast on any configured fast condition, slow after the state was steady for a while.
+ */
+static poll_rate_t poll_rate_select(const bicker_ups_status_t *ups, const ups_settings_t *cfg,
+                                    unsigned char *last_device_status, struct timespec *steady_since)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    bool on_battery = !ups->device_status.reg.is_power_present || ups->device_status.reg.is_discharging;
+    bool charging = ups->device_status.reg.is_power_present &&
+                    (ups->soc < 100 || ups->charge_status.reg.is_constant_current);
+    bool measuring = ups->monitor_status.reg.is_esr_measuring || ups->charge_status.reg.is_cap_measurement;
+
+    if ((cfg->poll_fast_on_battery && on_battery) ||
+        (cfg->poll_fast_on_charging && charging) ||
+        (cfg->poll_fast_on_measurement && measuring))
+    {
+        *steady_since = now;
+        *last_device_status = ups->device_status.value;
+        return POLL_FAST;
+    }
+    // Any device status change restarts the steady time
+    if (on_battery || charging || measuring || ups->device_status.value != *last_device_status)
+    {
+        *steady_since = now;
+        *last_device_status = ups->device_status.value;
+        return POLL_NORMAL;
+    }
+    if (elapsed_ms(steady_since) >= (long)cfg->poll_steady_sec * 1000)
+    {
+        return POLL_SLOW;
+    }
+    return POLL_NORMAL;
+}
+
+/**
+ * Full update interval of an update rate.
+ */
+static unsigned int poll_interval_ms(poll_rate_t rate, const ups_settings_t *cfg)
+{
+    switch (rate)
+    {
+    case POLL_FAST:
+        return cfg->poll_fast_ms;
+    case POLL_SLOW:
+        return cfg->poll_slow_ms;
+    default:
+        return cfg->poll_normal_ms;
+    }
+}
+
+static void ups_poll(lws_sorted_usec_list_t *sul);
+static void ups_check(lws_sorted_usec_list_t *sul);
+
+/**
+ * Schedule the next check if it is due before the next full poll.
+ */
+static void ups_check_schedule(void)
+{
+    long remaining = (long)poll_interval - elapsed_ms(&cycle_start);
+    if (remaining > (long)check_interval)
+    {
+        lws_sul_schedule(context, 0, &sul_check, ups_check, (lws_usec_t)check_interval * LWS_US_PER_MS);
+    }
+}
+
+/**
+ * Alarm register and device status are in.
+ * A device status change triggers a full poll at once, so a power event switches to fast polling.
+ */
+static void ups_check_done(bicker_ups_status_t *bs, bool ok)
+{
+    if (!ok)
+    {
+        return; // Serial error is handled by the full poll
+    }
+    alloc_check_begin();
+    alarm_check(bs, alarm_cfg_mask);
+    systemd_watchdog();
+    const ups_settings_t *cfg = settings_acquire();
+    recorder_check(bs, cfg);
+    settings_release(cfg);
+    if (bs->device_status.value != check_device_status)
+    {
+        lws_sul_cancel(&sul_check);
+        lws_sul_schedule(context, 0, &sul_poll, ups_poll, 1);
+    }
+    else
+    {
+        ups_check_schedule();
+    }
+    alloc_check_end("check");
+}
+
+/**
+ * Check timer, read alarm register and device status between full polls.
+ */
+static void ups_check(lws_sorted_usec_list_t *sul)
+{
+    NOTUSED(sul);
+    bicker_poll_check(ups_check_done);
+}
 
-        // Check for UPS power fail and shutdown request
-        if (bs->device_status.reg.is_power_present == false || bs->device_status.reg.is_shutdown_set == true)
+/**
+ * A rule became active or cleared, take its actions. The script is started by the rules engine.
+ */
+static void rule_action(const rule_t *rule, bool active)
+{
+    char detail[RULE_NAME_MAX + 16];
+    snprintf(detail, sizeof detail, "%s %s", rule->name, active ? "active" : "cleared");
+    if (rule->actions & RULE_ACTION_EVENT)
+    {
+        event_log_detail(EVENT_RULE, detail);
+    }
+    if (rule->actions & RULE_ACTION_NOTIFY)
+    {
+        json_object *jroot = json_object_new_object();
+        json_object *jrule = json_object_new_object();
+        json_object_object_add(jrule, "name", json_object_new_string(rule->name));
+        json_object_object_add(jrule, "active", json_object_new_boolean(active));
+        json_object_object_add(jroot, "rule", jrule);
+        ws_send_all(jroot);
+        json_object_put(jroot);
+    }
+    if (rule->actions & RULE_ACTION_SHUTDOWN)
+    {
+        if (active)
         {
-            // Raise warning independent of shutdown mode.
-            if (was_power_present == true)
+            lwsl_warn("Shutdown requested by rule %s.", rule->name);
+            shutdown_rules++;
+            if (shutdown_pending == false)
             {
-                lwsl_warn("Power fail detected!");
-                was_power_present = false;
-                t = time(NULL);
-                start_soc = bs->soc;
-                event_log(EVENT_POWER_FAIL);
-                power_fail_count += 1;
+                const ups_settings_t *cfg = settings_acquire();
+                shutdown_start(cfg);
+                settings_release(cfg);
+                shutdown_pending = true;
             }
-
-            // Proceed if we either shutdown by time or low state of charge
-            if (shutdown_by_time == true || (bs->soc < shutdown_soc_percent && shutdown_by_soc == true))
+        }
+        else if (shutdown_rules > 0)
+        {
+            // A power fail shutdown stays pending until power returns
+            shutdown_rules--;
+            if (shutdown_rules == 0 && shutdown_pending == true && was_power_present == true)
             {
-                // Override timed shutdown in case we are already low on charge
-                if (bs->soc < shutdown_soc_percent)
-                {
-                    shutdown_override = true;
-                }
-                if (shutdown_pending == false)
-                {
-                    // Initiate shutdown if not pending
-                    pthread_create(&shutdown_thread, NULL, shutdown_handler, NULL);
-                    shutdown_pending = true;
-                }
+                lws_sul_cancel(&sul_shutdown);
+                shutdown_pending = false;
+                lwsl_warn("Shutdown cancelled.");
             }
+        }
+    }
+}
 
-            if (bs->soc < 100 && bs->soc < old_soc)
-            {
-                double dt = difftime(time(NULL), t);
-                remain = ceilf((dt / (start_soc - (double)bs->soc)) * (double)bs->soc);
-                old_soc = bs->soc;
-            }
+/**
+ * Full UPS status is in. Publish it, run power fail handling and schedule the next poll.
+ */
+static void ups_update(bicker_ups_status_t *bs, bool ok)
+{
+    struct sysinfo s_info;
+    ups_snapshot_t snap;
+    double rule_values[STATUS_FIELD_COUNT];
+
+    // Check if serial interface connection is still present and there is no R/W error
+    if (!ok || is_serial_error())
+    {
+        lwsl_err("Serial interface not accessible.\n");
+        server_exit = true;
+        return;
+    }
+    alloc_check_begin();
+
+    // Settings stay constant for one cycle, reloads are picked up on the next one.
+    const ups_settings_t *cfg = settings_acquire();
+    poll_rate_t rate = poll_rate_select(bs, cfg, &last_device_status, &steady_since);
+    if (poll_interval != poll_interval_ms(rate, cfg))
+    {
+        lwsl_notice("Update rate %s, %u ms.", poll_rate_names[rate], poll_interval_ms(rate, cfg));
+    }
+    poll_interval = poll_interval_ms(rate, cfg);
+    check_interval = rate == POLL_SLOW ? cfg->poll_slow_check_ms : cfg->poll_check_ms;
+    // The state check feeds the watchdog while full polls are slow
+    if (systemd_watchdog_ms() > 0 && check_interval > systemd_watchdog_ms())
+    {
+        check_interval = systemd_watchdog_ms();
+    }
+    alarm_cfg_mask = cfg->alarm_mask;
+    check_device_status = bs->device_status.value;
+
+    history_add(bs, sample_time.tv_sec);
+    recorder_sample(bs, cfg);
+    if (health_update(bs, cfg, sample_time.tv_sec))
+    {
+        lwsl_notice("Starting scheduled capacitance/ESR measurement.");
+        queue_command(START_CAP_ESR_MEASUREMENT, CMD_PRIO_NORMAL);
+    }
+    // Check for UPS power fail and shutdown request
+    if (bs->device_status.reg.is_power_present == false || bs->device_status.reg.is_shutdown_set == true)
+    {
+        // Raise warning independent of shutdown mode.
+        if (was_power_present == true)
+        {
+            lwsl_warn("Power fail detected!");
+            was_power_present = false;
+            clock_gettime(CLOCK_MONOTONIC, &power_fail_time);
+            start_soc = bs->soc;
+            event_log(EVENT_POWER_FAIL);
+            power_fail_count += 1;
         }
-        // Check if power returned and there is no shutdown request from UPS
-        if (bs->device_status.reg.is_power_present == true && bs->device_status.reg.is_shutdown_set == false)
+
+        // Proceed if we either shutdown by time or low state of charge
+        if (cfg->shutdown_by_time == true || (bs->soc < cfg->shutdown_soc_percent && cfg->shutdown_by_soc == true))
         {
-            // Raise warning independent of shutdown mode.
-            if (was_power_present == false)
+            // Override timed shutdown in case we are already low on charge
+            if (bs->soc < cfg->shutdown_soc_percent && shutdown_override == false)
             {
-                lwsl_warn("Power good detected.");
-                was_power_present = true;
-                event_log(EVENT_POWER_GOOD);
+                shutdown_override = true;
+                if (shutdown_pending == true)
+                {
+                    // Do not wait for the remaining delay
+                    shutdown_start(cfg);
+                }
             }
-
-            if (shutdown_pending == true)
+            if (shutdown_pending == false)
             {
-                // Cancel a pending shutdown
-                pthread_cancel(shutdown_thread);
-                pthread_join(shutdown_thread, NULL);
-                shutdown_pending = false;
-                lwsl_warn("Shutdown cancelled.");
+                // Initiate shutdown if not pending
+                shutdown_start(cfg);
+                shutdown_pending = true;
             }
-            shutdown_override = false;
-            old_soc = bs->soc;
-            remain = 0.0;
         }
 
-        // Update APC status report
-        if (pthread_mutex_trylock(&lock_apc_status) == 0)
+        if (bs->soc < 100 && bs->soc < old_soc)
+        {
+            double dt = elapsed_ms(&power_fail_time) / 1000.0;
+            remain = ceilf((dt / (start_soc - (double)bs->soc)) * (double)bs->soc);
+            old_soc = bs->soc;
+        }
+    }
+    // Check if power returned and there is no shutdown request from UPS
+    if (bs->device_status.reg.is_power_present == true && bs->device_status.reg.is_shutdown_set == false)
+    {
+        // Raise warning independent of shutdown mode.
+        if (was_power_present == false)
         {
-            apc_update_status(bs);
-            pthread_mutex_unlock(&lock_apc_status);
+            lwsl_warn("Power good detected.");
+            was_power_present = true;
+            event_log(EVENT_POWER_GOOD);
         }
 
-        if (log_file_enable)
+        if (shutdown_pending == true && shutdown_rules == 0)
         {
-            log_to_file(bs);
+            // Cancel a pending shutdown
+            lws_sul_cancel(&sul_shutdown);
+            shutdown_pending = false;
+            lwsl_warn("Shutdown cancelled.");
         }
+        shutdown_override = false;
+        old_soc = bs->soc;
+        remain = 0.0;
+    }
 
-        // Websocket update delay
-        sleep(UPDATE_TIME_SEC);
+    // Hand over to websocket, APC report, CSV log and metrics
+    snap.ups = *bs;
+    snap.cfg = cfg;
+    snap.epoch = service_epoch;
+    snap.seq = ++snapshot_seq;
+    snap.time = sample_time.tv_sec;
+    snap.time_ns = (uint64_t)sample_time.tv_sec * 1000000000ULL + (uint64_t)sample_time.tv_nsec;
+    snap.mono_ns = (uint64_t)cycle_start.tv_sec * 1000000000ULL + (uint64_t)cycle_start.tv_nsec;
+    snap.remain = remain;
+    snap.power_fail_count = power_fail_count;
+    snap.poll_rate = poll_rate_names[rate];
+    snap.poll_interval = poll_interval;
+    snap.uptime = sysinfo(&s_info) == 0 ? (uint64_t)s_info.uptime : 0;
+    snap.stale = false;
+    energy_update(bs, cfg, snap.mono_ns, &snap.energy);
+    snap.health = *health_summary();
+    status_values(&snap, rule_values);
+    rules_evaluate(&cfg->rules, rule_values, snap.mono_ns, rule_action);
+    sinks_publish_snapshot(&snap);
+    state_checkpoint(&snap);
+    settings_release(cfg);
+    // Service is up once the first status is out, the watchdog catches a stalled serial path
+    if (!service_ready)
+    {
+        service_ready = true;
+        systemd_notify("READY=1");
     }
-    // Cleanup
-    close_serial();
-    if (apcstr != NULL)
+    systemd_watchdog();
+
+    // Next full poll is due one interval after this one started
+    long next = (long)poll_interval - elapsed_ms(&cycle_start);
+    lws_sul_schedule(context, 0, &sul_poll, ups_poll, next > 0 ? (lws_usec_t)next * LWS_US_PER_MS : 1);
+    ups_check_schedule();
+    alloc_check_end("status");
+}
+
+/**
+ * Poll timer, start reading the full UPS status.
+ */
+static void ups_poll(lws_sorted_usec_list_t *sul)
+{
+    NOTUSED(sul);
+    clock_gettime(CLOCK_MONOTONIC, &cycle_start);
+    clock_gettime(CLOCK_REALTIME, &sample_time);
+    if (!bicker_poll_status(ups_update))
+    {
+        // Previous poll still in progress, try again shortly
+        lws_sul_schedule(context, 0, &sul_poll, ups_poll, (lws_usec_t)check_interval * LWS_US_PER_MS);
+    }
+}
+
+/**
+ * Power event capture saved, tell the clients.
+ */
+static void capture_saved(const char *name)
+{
+    event_log_detail(EVENT_CAPTURE, name);
+    json_object *jroot = json_object_new_object();
+    json_object_object_add(jroot, "capture", json_object_new_string(name));
+    ws_send_all(jroot);
+    json_object_put(jroot);
+}
+
+/**
+ * Serve the state checkpointed by the previous run until the first poll is done.
+ */
+static void warm_start(const char *state_file)
+{
+    ups_snapshot_t snap;
+    if (!state_open(state_file, &snap))
     {
-        free(apcstr);
-        apcstr = NULL;
+        return;
     }
-    pthread_exit(NULL);
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    power_fail_count = snap.power_fail_count;
+    energy_restore(&snap.energy);
+    snap.cfg = settings_acquire();
+    snap.epoch = service_epoch;
+    snap.seq = ++snapshot_seq;
+    snap.mono_ns = (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+    snap.poll_rate = poll_rate_names[POLL_NORMAL];
+    snap.stale = true;
+    snap.health = *health_summary();
+    sinks_publish_snapshot(&snap);
+    settings_release(snap.cfg);
 }
 
+/**
+ * Output sinks fed by ups_update() and event_log_detail().
+ */
+static sink_t sink_ws = {.name = "websocket", .threaded = false, .snapshots = true, .stale = true, .consume = ws_sink_consume};
+static sink_t sink_nis = {.name = "nis", .threaded = false, .snapshots = true, .stale = true, .consume = apc_store};
+static sink_t sink_csv = {.name = "csv", .threaded = true, .snapshots = true, .consume = log_to_file};
+static sink_t sink_eventlog = {.name = "eventlog", .threaded = true, .events = true, .consume = event_log_write};
+
 /**
  * Well, it's main.
  */
@@ -816,7 +2325,7 @@ int main(int argc, char **argv)
     info.gid = -1;
     info.uid = -1;
     info.max_http_header_pool = 16;
-    info.options = LWS_SERVER_OPTION_FALLBACK_TO_RAW;
+    info.options = LWS_SERVER_OPTION_FALLBACK_TO_RAW | LWS_SERVER_OPTION_EXPLICIT_VHOSTS;
     info.mounts = &mount;
     info.extensions = NULL;
     info.timeout_secs = 4;
@@ -831,74 +2340,27 @@ int main(int argc, char **argv)
         exit(EXIT_SUCCESS);
     }
     /* Parse configuration file */
-    config_init(&cfg);
-    if (!config_read_file(&cfg, config_file))
+    if (settings_init(config_file) == EXIT_FAILURE)
     {
-        lwsl_err("Error reading configuration: %s:%d - %s", config_error_file(&cfg),
-                 config_error_line(&cfg), config_error_text(&cfg));
-        config_destroy(&cfg);
         return (EXIT_FAILURE);
     }
-
-    config_setting_t *setting = NULL;
-    setting = config_lookup(&cfg, "server");
-    if (setting != NULL)
-    {
-        config_lookup_string(&cfg, "server.ip", &info.iface);
-        config_lookup_int(&cfg, "server.port", &info.port);
-        config_lookup_int(&cfg, "server.user", &info.uid);
-        config_lookup_int(&cfg, "server.group", &info.gid);
-        config_lookup_bool(&cfg, "server.daemonize", &daemonize);
-        config_lookup_bool(&cfg, "server.logToFile", (int *)&log_file_enable);
-        config_lookup_int(&cfg, "server.shutdownDelay", (int *)&shutdown_delay);
-        config_lookup_int(&cfg, "server.shutdownSocPercent", (int *)&shutdown_soc_percent);
-        config_lookup_bool(&cfg, "server.shutdownByTime", (int *)&shutdown_by_time);
-        config_lookup_bool(&cfg, "server.shutdownBySoc", (int *)&shutdown_by_soc);
-        const char *ev_file = NULL;
-        config_lookup_string(&cfg, "server.eventLog", &ev_file);
-        const char *buf = NULL;
-        config_lookup_string(&cfg, "server.serial", &buf);
-        set_serial_interface(buf);
-        if (shutdown_soc_percent < 0)
-            shutdown_soc_percent = 25;
-        if (shutdown_soc_percent > 100)
-            shutdown_soc_percent = 100;
-        if (shutdown_by_time == false && shutdown_by_soc == false)
-        {
-            shutdown_by_time = true;
-            lwsl_err("Configuration mismatch. Shutdown by time enabled.");
-        }
-    }
-    else
-    {
-        lwsl_err("Server settings not found in configuration file.");
-    }
-
-    setting = config_lookup(&cfg, "ups");
-    if (setting != NULL)
-    {
-        config_lookup_float(&cfg, "ups.inputVoltage", &nominal_input_voltage);
-        config_lookup_float(&cfg, "ups.batteryVoltage", &nominal_battery_voltage);
-        config_lookup_int(&cfg, "ups.powerReturnPercent", &power_return_percent);
-        config_lookup_int(&cfg, "ups.maxBackupTime", &max_backup_time);
-        config_lookup_int(&cfg, "ups.wakeupDelay", &wakeup_delay);
-        config_lookup_int(&cfg, "ups.maxAmps", &max_amps);
-        nominal_ouput_power = nominal_input_voltage * max_amps;
-    }
-    else
-    {
-        lwsl_err("UPS settings not found in configuration file.");
-    }
-
-    if (max_amps < 1)
-    {
-        max_amps = 5000;
-        lwsl_warn("UPS maximum current rating not found. Set to 5 amps.");
-    }
-    else
-    {
-        max_amps *= 1000;
-    }
+    /* Startup settings are referenced by the context for the whole runtime */
+    const ups_settings_t *boot = settings_acquire();
+    info.iface = boot->iface;
+    info.port = boot->port;
+    info.uid = boot->uid;
+    info.gid = boot->gid;
+#ifndef LWS_NO_DAEMONIZE
+    daemonize = boot->daemonize;
+#endif
+    set_serial_interface(boot->serial);
+    sink_register(&sink_ws);
+    sink_register(&sink_nis);
+    sink_register(&sink_csv);
+    sink_register(&sink_eventlog);
+    metrics_init();
+    mqtt_init(boot, event_text);
+    push_init(boot);
 
 #if !defined(LWS_NO_DAEMONIZE)
     if (daemonize)
@@ -912,48 +2374,107 @@ int main(int argc, char **argv)
     if (daemonize && lws_daemonize("/tmp/.lwsts-lock"))
     {
         lwsl_err("Failed to daemonize.");
-        config_destroy(&cfg);
+        settings_destroy();
         return EXIT_FAILURE;
     }
 #endif
 
-    signal(SIGABRT, sighandler);
-    signal(SIGINT, sighandler);
-    signal(SIGTERM, sighandler);
-    signal(SIGQUIT, sighandler);
+    /* Listening sockets from systemd socket activation, bound before the daemon started */
+    int listen_fds = systemd_listen_fds();
+    if (listen_fds > 0)
+    {
+        lwsl_notice("%d listening sockets passed by systemd.", listen_fds);
+    }
+    systemd_notify_init();
+
+    /* Signals are read from a descriptor in the event loop */
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGQUIT);
+    sigaddset(&mask, SIGHUP);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (signal_fd < 0)
+    {
+        lwsl_err("Failed to create signal descriptor: %s", strerror(errno));
+        settings_destroy();
+        return EXIT_FAILURE;
+    }
 
     /* Only try to log things according to our debug_level */
     setlogmask(LOG_UPTO(LOG_DEBUG));
     openlog("UPS Server", syslog_options, LOG_DAEMON);
 
     /* Tell the library what debug level to emit and to send it to syslog */
-    lws_set_log_level(LLL_ERR | LLL_WARN | LLL_USER, lwsl_emit_syslog);
+    lws_set_log_level(LLL_ERR | LLL_WARN | LLL_USER, ALLOC_CHECK_LOG_EMIT);
+
+    /* Serve web client from memory, fall back to file mount if not possible */
+    if (assets_load(boot->client_path) == EXIT_SUCCESS)
+    {
+        info.mounts = NULL;
+    }
+    else
+    {
+        strcpy(mount_origin, boot->client_path);
+        lwsl_warn("Client files not cached, serving from %s.", mount.origin);
+    }
 
     /* Create libwebsocket context representing this server */
     context = lws_create_context(&info);
     if (context == NULL)
     {
         lwsl_err("libwebsocket init failed.");
-        config_destroy(&cfg);
+        settings_destroy();
+        return EXIT_FAILURE;
+    }
+
+    /* Listeners are bound before the user and group are dropped */
+    struct lws_vhost *vhost = create_listeners(boot, listen_fds);
+    if (vhost == NULL || lws_finalize_startup(context) != 0)
+    {
+        server_cleanup();
+        return EXIT_FAILURE;
+    }
+    config_watch_init();
+    if (adopt_control_fd(vhost, signal_fd) == EXIT_FAILURE)
+    {
+        server_cleanup();
         return EXIT_FAILURE;
     }
+    if (config_watch_fd >= 0 && adopt_control_fd(vhost, config_watch_fd) == EXIT_FAILURE)
+    {
+        close(config_watch_fd);
+        config_watch_fd = -1;
+    }
 
-    /* Start reading serial data from weather station */
-    pthread_create(&ups_thread, NULL, ups_read_handler, NULL);
+    /* Start reading serial data from UPS */
+    if (open_serial(vhost) == EXIT_FAILURE)
+    {
+        lwsl_err("Serial device init failed\n");
+        server_cleanup();
+        return EXIT_FAILURE;
+    }
+    gethostname(hostname, sizeof hostname);
+    clock_gettime(CLOCK_MONOTONIC, &steady_since);
+    service_epoch = (uint64_t)time(NULL);
+    // Alarms enabled in device
+    queue_command(GET_MASK_ALARMS, CMD_PRIO_NORMAL);
+    lws_sul_schedule(context, 0, &sul_poll, ups_poll, 1);
+    recorder_init(context, capture_saved);
+    health_init(boot);
+    sinks_start();
+    warm_start(boot->state_file);
     event_log(EVENT_SERVICE_START);
 
-    //  Infinite loop, to end this server send SIGTERM. (CTRL+C) */
-    for (;;)
+    /* Serial, timers, signals and configuration changes are all served from here.
+     * To end this server send SIGTERM. (CTRL+C) */
+    while (!server_exit)
     {
-        lws_service(context, 100);
-        // Check if UPS thread is running.
-        // Exit if not, e.g. serial interface connection loss.
-        if (ups_thread_exit)
-        {
-            break;
-        }
+        lws_service(context, 0);
     }
 
-    sighandler(0);
+    server_cleanup();
     return EXIT_SUCCESS;
 }
\ No newline at end of file
@@ -0,0 +1,97 @@
+// Part of UPS Server.
+// A websocket server reading data from a Bicker PSZ-1063 uExtension module
+// in combination with a Bicker UPS.
+//
+// Copyright (c) 2023 Michael Wolf <michael@mictronics.de>
+//
+// This file is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// any later version.
+//
+// This file is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include "../server/capture.h"
+
+/**
+ * Convert a power event capture of the flight recorder into CSV for plotting.
+ * Time in seconds relative to the trigger, voltages in volts, currents in amps.
+ */
+static int convert(const char *file, FILE *out)
+{
+    capture_header_t hdr;
+    capture_sample_t s;
+    char st[32];
+
+    FILE *fp = fopen(file, "rb");
+    if (fp == NULL)
+    {
+        fprintf(stderr, "%s: %s\n", file, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    if (fread(&hdr, sizeof hdr, 1, fp) != 1 || hdr.magic != CAPTURE_MAGIC)
+    {
+        fprintf(stderr, "%s: not a capture file\n", file);
+        fclose(fp);
+        return EXIT_FAILURE;
+    }
+    if (hdr.version != CAPTURE_VERSION || hdr.sample_size != sizeof(capture_sample_t))
+    {
+        fprintf(stderr, "%s: unsupported capture version %u\n", file, hdr.version);
+        fclose(fp);
+        return EXIT_FAILURE;
+    }
+
+    time_t t = (time_t)(hdr.trigger_time / 1000);
+    strftime(st, sizeof st, "%Y-%m-%d %H:%M:%S", localtime(&t));
+    fprintf(out, "# %s trigger %s.%03d, device status 0x%02X -> 0x%02X, power fail 0x%X, %u samples\n",
+            file, st, (int)(hdr.trigger_time % 1000), hdr.device_before, hdr.device_after,
+            hdr.power_fail, hdr.count);
+    fprintf(out, "time,input_voltage,output_voltage,battery_voltage,vcap1,vcap2,vcap3,vcap4,"
+                 "input_current,output_current,device_status,source\n");
+    for (uint32_t i = 0; i < hdr.count; i++)
+    {
+        if (fread(&s, sizeof s, 1, fp) != 1)
+        {
+            fprintf(stderr, "%s: truncated after %u samples\n", file, i);
+            break;
+        }
+        fprintf(out, "%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%u,%s\n",
+                s.time / 1000.0, s.input_voltage / 1000.0, s.output_voltage / 1000.0,
+                s.battery_voltage / 1000.0, s.vcap[0] / 1000.0, s.vcap[1] / 1000.0,
+                s.vcap[2] / 1000.0, s.vcap[3] / 1000.0, s.input_current / 1000.0,
+                s.output_current / 1000.0, s.device_status,
+                s.source == CAPTURE_SRC_BURST ? "burst" : "poll");
+    }
+    fclose(fp);
+    return EXIT_SUCCESS;
+}
+
+int main(int argc, char **argv)
+{
+    int rc = EXIT_SUCCESS;
+    if (argc < 2)
+    {
+        fprintf(stderr, "Usage: %s capture-file...\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    for (int i = 1; i < argc; i++)
+    {
+        if (convert(argv[i], stdout) == EXIT_FAILURE)
+        {
+            rc = EXIT_FAILURE;
+        }
+    }
+    return rc;
+}
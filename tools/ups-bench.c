@@ -0,0 +1,824 @@
+// Part of UPS Server.
+// A websocket server reading data from a Bicker PSZ-1063 uExtension module
+// in combination with a Bicker UPS.
+//
+// Copyright (c) 2023 Michael Wolf <michael@mictronics.de>
+//
+// This file is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// any later version.
+//
+// This file is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/**
+ * Load generator and fan-out latency benchmark against a running server.
+ *
+ * Opens websocket subscribers and apcaccess style NIS clients and reports
+ * update latency, dropped and torn frames and the server CPU time and RSS
+ * as JSON, to be compared across releases.
+ */
+
+#define RX_MAX 65536    // Received bytes not parsed yet
+#define MSG_MAX 65536   // Websocket message reassembled from fragments
+#define SEQ_RING 1024   // Updates tracked for the fan-out spread
+#define NIS_TIMEOUT 5   // seconds for one NIS request
+
+typedef enum
+{
+    C_IDLE,      // NIS client waiting for the next request
+    C_CONNECT,   // Connection in progress
+    C_HANDSHAKE, // Websocket upgrade sent
+    C_OPEN,      // Websocket open or NIS request sent
+    C_CLOSED     // Websocket rejected or closed
+} conn_state_t;
+
+struct conn
+{
+    int fd;
+    bool ws;
+    conn_state_t state;
+    unsigned char rx[RX_MAX];
+    size_t rx_len;
+    char msg[MSG_MAX];
+    size_t msg_len;
+    bool msg_torn;     // Fragment did not fit
+    uint64_t last_seq; // 0 before the first update
+    int64_t start_ns;  // NIS request start or next request time, monotonic
+    unsigned int lines;
+};
+
+/**
+ * Collected values, nanoseconds.
+ */
+struct samples
+{
+    int64_t *v;
+    size_t n;
+    size_t size;
+};
+
+static struct
+{
+    const char *host;
+    const char *port;
+    const char *unix_path;
+    int ws_clients;
+    int nis_clients;
+    int nis_interval_ms;
+    int duration;
+    int pid;
+    bool realtime; // Use sampleTime instead of monoTime
+    const char *output;
+} opt = {"127.0.0.1", "10024", NULL, 10, 0, 1000, 60, 0, false, NULL};
+
+static struct
+{
+    uint64_t connected;
+    uint64_t rejected;
+    uint64_t disconnected;
+    uint64_t updates;
+    uint64_t dropped;
+    uint64_t torn;
+    uint64_t other;
+    uint64_t nis_requests;
+    uint64_t nis_errors;
+    uint64_t nis_lines;
+} stats;
+
+static struct samples latency, spread, nis_latency;
+static struct
+{
+    uint64_t seq;
+    int64_t first;
+    int64_t last;
+} seq_ring[SEQ_RING];
+
+static struct sockaddr_storage server_addr;
+static socklen_t server_addr_len;
+static volatile sig_atomic_t stop = 0;
+
+static int64_t now_ns(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void on_signal(int sig)
+{
+    (void)sig;
+    stop = 1;
+}
+
+static void sample_add(struct samples *s, int64_t v)
+{
+    if (s->n == s->size)
+    {
+        size_t size = s->size ? s->size * 2 : 4096;
+        int64_t *p = realloc(s->v, size * sizeof(int64_t));
+        if (p == NULL)
+        {
+            return;
+        }
+        s->v = p;
+        s->size = size;
+    }
+    s->v[s->n++] = v;
+}
+
+static int cmp_int64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Resolve the server address once, TCP or Unix socket.
+ */
+static bool resolve(void)
+{
+    if (opt.unix_path != NULL)
+    {
+        struct sockaddr_un *sun = (struct sockaddr_un *)&server_addr;
+        if (strlen(opt.unix_path) >= sizeof sun->sun_path)
+        {
+            fprintf(stderr, "%s: socket path too long\n", opt.unix_path);
+            return false;
+        }
+        sun->sun_family = AF_UNIX;
+        strcpy(sun->sun_path, opt.unix_path);
+        server_addr_len = sizeof(struct sockaddr_un);
+        return true;
+    }
+    struct addrinfo hints = {.ai_socktype = SOCK_STREAM}, *ai = NULL;
+    int err = getaddrinfo(opt.host, opt.port, &hints, &ai);
+    if (err != 0)
+    {
+        fprintf(stderr, "%s: %s\n", opt.host, gai_strerror(err));
+        return false;
+    }
+    memcpy(&server_addr, ai->ai_addr, ai->ai_addrlen);
+    server_addr_len = ai->ai_addrlen;
+    freeaddrinfo(ai);
+    return true;
+}
+
+/**
+ * Start a non-blocking connection to the server.
+ */
+static bool conn_open(struct conn *c)
+{
+    c->fd = socket(server_addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (c->fd < 0)
+    {
+        return false;
+    }
+    if (connect(c->fd, (struct sockaddr *)&server_addr, server_addr_len) < 0 && errno != EINPROGRESS)
+    {
+        close(c->fd);
+        c->fd = -1;
+        return false;
+    }
+    c->state = C_CONNECT;
+    c->rx_len = 0;
+    c->msg_len = 0;
+    c->lines = 0;
+    return true;
+}
+
+static void conn_close(struct conn *c, conn_state_t state)
+{
+    if (c->fd >= 0)
+    {
+        close(c->fd);
+    }
+    c->fd = -1;
+    c->state = state;
+}
+
+/**
+ * Check that a message is one complete JSON object.
+ */
+static bool json_complete(const char *s, size_t len)
+{
+    int depth = 0;
+    bool str = false;
+    size_t i = 0;
+
+    while (i < len && (s[i] == ' ' || s[i] == '\n'))
+        i++;
+    if (i == len || s[i] != '{')
+        return false;
+    for (; i < len; i++)
+    {
+        if (str)
+        {
+            if (s[i] == '\\')
+                i++;
+            else if (s[i] == '"')
+                str = false;
+        }
+        else if (s[i] == '"')
+            str = true;
+        else if (s[i] == '{' || s[i] == '[')
+            depth++;
+        else if (s[i] == '}' || s[i] == ']')
+        {
+            if (--depth == 0)
+                return i + 1 == len;
+        }
+    }
+    return false;
+}
+
+/**
+ * Integer value of a key in a JSON object, false if not present.
+ */
+static bool json_number(const char *s, const char *key, int64_t *v)
+{
+    const char *p = strstr(s, key);
+    if (p == NULL)
+    {
+        return false;
+    }
+    *v = strtoll(p + strlen(key), NULL, 10);
+    return true;
+}
+
+/**
+ * Record when an update reached a client, the spread is first to last client.
+ */
+static void spread_add(uint64_t seq, int64_t t)
+{
+    int i = seq % SEQ_RING;
+    if (seq_ring[i].seq != seq)
+    {
+        if (seq_ring[i].seq != 0 && seq_ring[i].last > seq_ring[i].first)
+        {
+            sample_add(&spread, seq_ring[i].last - seq_ring[i].first);
+        }
+        seq_ring[i].seq = seq;
+        seq_ring[i].first = t;
+    }
+    seq_ring[i].last = t;
+}
+
+/**
+ * A complete websocket message. Status updates carry seq, sampleTime and monoTime.
+ */
+static void ws_message(struct conn *c, int64_t mono, int64_t real)
+{
+    int64_t seq, t;
+
+    c->msg[c->msg_len] = '\0';
+    if (c->msg_torn || !json_complete(c->msg, c->msg_len))
+    {
+        stats.torn++;
+        return;
+    }
+    if (!json_number(c->msg, "\"seq\":", &seq))
+    {
+        stats.other++; // Replies, alarms, captures, rules
+        return;
+    }
+    stats.updates++;
+    if (c->last_seq == 0)
+    {
+        // The first update is the latest one at connect time, not a fan-out
+        c->last_seq = (uint64_t)seq;
+        return;
+    }
+    if ((uint64_t)seq <= c->last_seq)
+    {
+        return;
+    }
+    stats.dropped += (uint64_t)seq - c->last_seq - 1;
+    c->last_seq = (uint64_t)seq;
+    if (opt.realtime ? json_number(c->msg, "\"sampleTime\":", &t) : json_number(c->msg, "\"monoTime\":", &t))
+    {
+        sample_add(&latency, opt.realtime ? real - t * 1000000LL : mono - t * 1000LL);
+    }
+    spread_add((uint64_t)seq, mono);
+}
+
+/**
+ * Send a frame from the client, masked with a zero key.
+ */
+static void ws_send(struct conn *c, int opcode, const unsigned char *data, size_t len)
+{
+    unsigned char frame[2 + 4 + 125];
+    if (len > 125)
+    {
+        return;
+    }
+    frame[0] = 0x80 | opcode;
+    frame[1] = 0x80 | len;
+    memset(&frame[2], 0, 4);
+    memcpy(&frame[6], data, len);
+    if (send(c->fd, frame, 6 + len, MSG_NOSIGNAL) < 0)
+    {
+        conn_close(c, C_CLOSED);
+        stats.disconnected++;
+    }
+}
+
+/**
+ * Parse the received websocket frames.
+ */
+static void ws_receive(struct conn *c, int64_t mono, int64_t real)
+{
+    size_t used = 0;
+    while (c->fd >= 0 && c->rx_len - used >= 2)
+    {
+        unsigned char *p = &c->rx[used];
+        size_t avail = c->rx_len - used;
+        int opcode = p[0] & 0x0F;
+        bool fin = p[0] & 0x80;
+        uint64_t len = p[1] & 0x7F;
+        size_t hdr = 2;
+
+        if (len == 126)
+        {
+            if (avail < 4)
+                break;
+            len = (uint64_t)p[2] << 8 | p[3];
+            hdr = 4;
+        }
+        else if (len == 127)
+        {
+            if (avail < 10)
+                break;
+            len = 0;
+            for (int i = 0; i < 8; i++)
+                len = len << 8 | p[2 + i];
+            hdr = 10;
+        }
+        if ((p[1] & 0x80) || len > RX_MAX - hdr)
+        {
+            // Masked or oversized server frame, stream can not be followed
+            stats.torn++;
+            conn_close(c, C_CLOSED);
+            stats.disconnected++;
+            return;
+        }
+        if (avail < hdr + len)
+            break;
+
+        switch (opcode)
+        {
+        case 0x0: // Continuation
+        case 0x1: // Text
+            if (opcode == 0x1)
+            {
+                c->msg_len = 0;
+                c->msg_torn = false;
+            }
+            if (c->msg_len + len < MSG_MAX)
+            {
+                memcpy(&c->msg[c->msg_len], &p[hdr], len);
+                c->msg_len += len;
+            }
+            else
+            {
+                c->msg_torn = true;
+            }
+            if (fin)
+            {
+                ws_message(c, mono, real);
+                c->msg_len = 0;
+            }
+            break;
+        case 0x8: // Close
+            conn_close(c, C_CLOSED);
+            stats.disconnected++;
+            return;
+        case 0x9: // Ping
+            ws_send(c, 0xA, &p[hdr], len);
+            break;
+        default:
+            break;
+        }
+        used += hdr + len;
+    }
+    memmove(c->rx, &c->rx[used], c->rx_len - used);
+    c->rx_len -= used;
+}
+
+/**
+ * Check the upgrade response, frames may follow in the same read.
+ */
+static void ws_handshake(struct conn *c, int64_t mono, int64_t real)
+{
+    unsigned char *end = memmem(c->rx, c->rx_len, "\r\n\r\n", 4);
+    if (end == NULL)
+    {
+        if (c->rx_len == RX_MAX)
+        {
+            conn_close(c, C_CLOSED);
+            stats.rejected++;
+        }
+        return;
+    }
+    if (c->rx_len < 12 || memcmp(c->rx, "HTTP/1.1 101", 12) != 0)
+    {
+        conn_close(c, C_CLOSED);
+        stats.rejected++;
+        return;
+    }
+    size_t hdr = (size_t)(end - c->rx) + 4;
+    memmove(c->rx, &c->rx[hdr], c->rx_len - hdr);
+    c->rx_len -= hdr;
+    c->state = C_OPEN;
+    stats.connected++;
+    ws_receive(c, mono, real);
+}
+
+/**
+ * NIS records are a 16 bit length and the line, a zero length ends the report.
+ */
+static void nis_receive(struct conn *c, int64_t mono)
+{
+    size_t used = 0;
+    while (c->rx_len - used >= 2)
+    {
+        size_t n = (size_t)c->rx[used] << 8 | c->rx[used + 1];
+        if (n == 0)
+        {
+            sample_add(&nis_latency, mono - c->start_ns);
+            stats.nis_requests++;
+            stats.nis_lines += c->lines;
+            conn_close(c, C_IDLE);
+            c->start_ns += (int64_t)opt.nis_interval_ms * 1000000LL;
+            return;
+        }
+        if (c->rx_len - used < 2 + n)
+            break;
+        c->lines++;
+        used += 2 + n;
+    }
+    memmove(c->rx, &c->rx[used], c->rx_len - used);
+    c->rx_len -= used;
+}
+
+static void nis_fail(struct conn *c)
+{
+    stats.nis_errors++;
+    conn_close(c, C_IDLE);
+    c->start_ns += (int64_t)opt.nis_interval_ms * 1000000LL;
+}
+
+/**
+ * Connection established, send the upgrade or the status request.
+ */
+static void conn_connected(struct conn *c)
+{
+    char req[512];
+    int err = 0;
+    socklen_t len = sizeof err;
+    getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+    if (err == 0)
+    {
+        if (c->ws)
+        {
+            len = snprintf(req, sizeof req,
+                           "GET / HTTP/1.1\r\nHost: %s:%s\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+                           "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\nSec-WebSocket-Version: 13\r\n"
+                           "Sec-WebSocket-Protocol: broadcast\r\n\r\n",
+                           opt.host, opt.port);
+            err = send(c->fd, req, len, MSG_NOSIGNAL) == (ssize_t)len ? 0 : -1;
+            c->state = C_HANDSHAKE;
+        }
+        else
+        {
+            err = send(c->fd, "\x00\x06status", 8, MSG_NOSIGNAL) == 8 ? 0 : -1;
+            c->state = C_OPEN;
+        }
+    }
+    if (err != 0)
+    {
+        if (c->ws)
+        {
+            conn_close(c, C_CLOSED);
+            stats.rejected++;
+        }
+        else
+        {
+            nis_fail(c);
+        }
+    }
+}
+
+/**
+ * Receive from a connection, timestamped when read.
+ */
+static void conn_readable(struct conn *c)
+{
+    ssize_t n = recv(c->fd, &c->rx[c->rx_len], RX_MAX - c->rx_len, 0);
+    int64_t mono = now_ns(CLOCK_MONOTONIC);
+    int64_t real = now_ns(CLOCK_REALTIME);
+    if (n <= 0)
+    {
+        if (n < 0 && (errno == EAGAIN || errno == EINTR))
+            return;
+        if (!c->ws)
+            nis_fail(c); // Closed before the end of the report
+        else if (c->state == C_HANDSHAKE)
+        {
+            conn_close(c, C_CLOSED);
+            stats.rejected++;
+        }
+        else
+        {
+            conn_close(c, C_CLOSED);
+            stats.disconnected++;
+        }
+        return;
+    }
+    c->rx_len += (size_t)n;
+    if (!c->ws)
+        nis_receive(c, mono);
+    else if (c->state == C_HANDSHAKE)
+        ws_handshake(c, mono, real);
+    else
+        ws_receive(c, mono, real);
+}
+
+/**
+ * CPU ticks and resident set of the server process.
+ */
+static bool proc_sample(int pid, uint64_t *ticks, long *rss_kib, long *hwm_kib)
+{
+    char path[64], buf[1024];
+    unsigned long utime = 0, stime = 0;
+
+    snprintf(path, sizeof path, "/proc/%d/stat", pid);
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL)
+        return false;
+    size_t n = fread(buf, 1, sizeof buf - 1, fp);
+    fclose(fp);
+    buf[n] = '\0';
+    // Fields after the command name, which may contain spaces
+    char *p = strrchr(buf, ')');
+    if (p == NULL || sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2)
+        return false;
+    *ticks = utime + stime;
+
+    snprintf(path, sizeof path, "/proc/%d/status", pid);
+    if ((fp = fopen(path, "r")) == NULL)
+        return false;
+    while (fgets(buf, sizeof buf, fp) != NULL)
+    {
+        sscanf(buf, "VmRSS: %ld", rss_kib);
+        sscanf(buf, "VmHWM: %ld", hwm_kib);
+    }
+    fclose(fp);
+    return true;
+}
+
+/**
+ * Percentiles of a sample set in milliseconds as JSON object.
+ */
+static void report_samples(FILE *out, const char *name, struct samples *s)
+{
+    fprintf(out, "\"%s\":{\"count\":%zu", name, s->n);
+    if (s->n > 0)
+    {
+        qsort(s->v, s->n, sizeof(int64_t), cmp_int64);
+        fprintf(out, ",\"p50\":%.3f,\"p99\":%.3f,\"max\":%.3f",
+                s->v[(s->n * 50 + 99) / 100 - 1] / 1e6,
+                s->v[(s->n * 99 + 99) / 100 - 1] / 1e6,
+                s->v[s->n - 1] / 1e6);
+    }
+    fprintf(out, "}");
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -h host      Server address, default 127.0.0.1\n"
+            "  -p port      Server port, default 10024\n"
+            "  -u path      Unix socket listener instead of host and port\n"
+            "  -w count     Websocket subscribers, default 10\n"
+            "  -n count     NIS clients, default 0\n"
+            "  -i ms        Time between requests of one NIS client, default 1000\n"
+            "  -d seconds   Test duration, default 60\n"
+            "  -P pid       Server process for CPU and RSS, same host only\n"
+            "  -r           Latency from sampleTime, for a server on another host\n"
+            "  -o file      Write the JSON report to file instead of stdout\n",
+            name);
+}
+
+int main(int argc, char **argv)
+{
+    int c;
+    while ((c = getopt(argc, argv, "h:p:u:w:n:i:d:P:ro:")) != -1)
+    {
+        switch (c)
+        {
+        case 'h':
+            opt.host = optarg;
+            break;
+        case 'p':
+            opt.port = optarg;
+            break;
+        case 'u':
+            opt.unix_path = optarg;
+            break;
+        case 'w':
+            opt.ws_clients = atoi(optarg);
+            break;
+        case 'n':
+            opt.nis_clients = atoi(optarg);
+            break;
+        case 'i':
+            opt.nis_interval_ms = atoi(optarg);
+            break;
+        case 'd':
+            opt.duration = atoi(optarg);
+            break;
+        case 'P':
+            opt.pid = atoi(optarg);
+            break;
+        case 'r':
+            opt.realtime = true;
+            break;
+        case 'o':
+            opt.output = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (opt.ws_clients < 0 || opt.nis_clients < 0 || opt.ws_clients + opt.nis_clients == 0 ||
+        opt.duration <= 0 || opt.nis_interval_ms < 0)
+    {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (!resolve())
+    {
+        return EXIT_FAILURE;
+    }
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+
+    int count = opt.ws_clients + opt.nis_clients;
+    struct conn *conns = calloc(count, sizeof(struct conn));
+    struct pollfd *pfd = calloc(count, sizeof(struct pollfd));
+    int *index = calloc(count, sizeof(int));
+    if (conns == NULL || pfd == NULL || index == NULL)
+    {
+        fprintf(stderr, "Out of memory\n");
+        return EXIT_FAILURE;
+    }
+
+    uint64_t ticks_start = 0, ticks_end = 0;
+    long rss = 0, rss_max = 0, hwm = 0;
+    bool proc_ok = opt.pid > 0 && proc_sample(opt.pid, &ticks_start, &rss, &hwm);
+    rss_max = rss;
+
+    int64_t start = now_ns(CLOCK_MONOTONIC);
+    int64_t end = start + (int64_t)opt.duration * 1000000000LL;
+    int64_t next_proc = start + 1000000000LL;
+    for (int i = 0; i < count; i++)
+    {
+        conns[i].ws = i < opt.ws_clients;
+        conns[i].fd = -1;
+        // NIS requests spread over the interval
+        conns[i].start_ns = start + (conns[i].ws ? 0 : (int64_t)opt.nis_interval_ms * 1000000LL * (i - opt.ws_clients) / opt.nis_clients);
+        if (conns[i].ws && !conn_open(&conns[i]))
+        {
+            conns[i].state = C_CLOSED;
+            stats.rejected++;
+        }
+    }
+
+    int64_t mono = start;
+    while (!stop && mono < end)
+    {
+        int n = 0;
+        int timeout = 100;
+        for (int i = 0; i < count; i++)
+        {
+            struct conn *cn = &conns[i];
+            if (cn->state == C_IDLE)
+            {
+                if (cn->start_ns <= mono)
+                {
+                    cn->start_ns = mono;
+                    if (!conn_open(cn))
+                        nis_fail(cn);
+                }
+                else if ((cn->start_ns - mono) / 1000000 < timeout)
+                {
+                    timeout = (int)((cn->start_ns - mono) / 1000000);
+                }
+            }
+            else if (!cn->ws && cn->fd >= 0 && mono - cn->start_ns > NIS_TIMEOUT * 1000000000LL)
+            {
+                nis_fail(cn);
+            }
+            if (cn->fd >= 0)
+            {
+                pfd[n].fd = cn->fd;
+                pfd[n].events = cn->state == C_CONNECT ? POLLOUT : POLLIN;
+                pfd[n].revents = 0;
+                index[n++] = i;
+            }
+        }
+        if (poll(pfd, n, timeout) < 0 && errno != EINTR)
+        {
+            perror("poll");
+            break;
+        }
+        mono = now_ns(CLOCK_MONOTONIC);
+        for (int k = 0; k < n; k++)
+        {
+            struct conn *cn = &conns[index[k]];
+            if (pfd[k].revents == 0 || cn->fd != pfd[k].fd)
+                continue;
+            if (cn->state == C_CONNECT)
+                conn_connected(cn);
+            else
+                conn_readable(cn);
+        }
+        if (proc_ok && mono >= next_proc)
+        {
+            uint64_t ticks;
+            if (proc_sample(opt.pid, &ticks, &rss, &hwm) && rss > rss_max)
+                rss_max = rss;
+            next_proc += 1000000000LL;
+        }
+    }
+    double seconds = (now_ns(CLOCK_MONOTONIC) - start) / 1e9;
+    if (proc_ok)
+    {
+        proc_ok = proc_sample(opt.pid, &ticks_end, &rss, &hwm);
+    }
+    for (int i = 0; i < SEQ_RING; i++)
+    {
+        if (seq_ring[i].seq != 0 && seq_ring[i].last > seq_ring[i].first)
+            sample_add(&spread, seq_ring[i].last - seq_ring[i].first);
+    }
+
+    FILE *out = stdout;
+    if (opt.output != NULL && (out = fopen(opt.output, "w")) == NULL)
+    {
+        fprintf(stderr, "%s: %s\n", opt.output, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    fprintf(out, "{\"target\":\"%s%s%s\",\"duration\":%.3f,\"clock\":\"%s\",",
+            opt.unix_path ? opt.unix_path : opt.host, opt.unix_path ? "" : ":", opt.unix_path ? "" : opt.port,
+            seconds, opt.realtime ? "sampleTime" : "monoTime");
+    fprintf(out, "\"websocket\":{\"clients\":%d,\"connected\":%" PRIu64 ",\"rejected\":%" PRIu64
+                 ",\"disconnected\":%" PRIu64 ",\"updates\":%" PRIu64 ",\"dropped\":%" PRIu64
+                 ",\"torn\":%" PRIu64 ",\"other\":%" PRIu64 ",",
+            opt.ws_clients, stats.connected, stats.rejected, stats.disconnected, stats.updates,
+            stats.dropped, stats.torn, stats.other);
+    report_samples(out, "latencyMs", &latency);
+    fprintf(out, ",");
+    report_samples(out, "spreadMs", &spread);
+    fprintf(out, "},\"nis\":{\"clients\":%d,\"requests\":%" PRIu64 ",\"errors\":%" PRIu64 ",\"lines\":%.1f,",
+            opt.nis_clients, stats.nis_requests, stats.nis_errors,
+            stats.nis_requests ? (double)stats.nis_lines / stats.nis_requests : 0.0);
+    report_samples(out, "latencyMs", &nis_latency);
+    fprintf(out, "}");
+    if (proc_ok)
+    {
+        fprintf(out, ",\"server\":{\"pid\":%d,\"cpuPercent\":%.2f,\"rssKiB\":%ld,\"rssMaxKiB\":%ld,\"rssPeakKiB\":%ld}",
+                opt.pid, (double)(ticks_end - ticks_start) / sysconf(_SC_CLK_TCK) / seconds * 100.0,
+                rss, rss_max, hwm);
+    }
+    fprintf(out, "}\n");
+    if (out != stdout)
+    {
+        fclose(out);
+    }
+    return stats.torn == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,764 @@
+// Part of UPS Server.
+// A websocket server reading data from a Bicker PSZ-1063 uExtension module
+// in combination with a Bicker UPS.
+//
+// Copyright (c) 2023 Michael Wolf <michael@mictronics.de>
+//
+// This file is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// any later version.
+//
+// This file is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <getopt.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <termios.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "../server/registers.h"
+
+/**
+ * End-to-end power fail to shutdown latency harness.
+ *
+ * Runs the server against a simulated UPS on a pty, drops line power at a
+ * random point of the poll cycle and timestamps what follows: the UPS
+ * reporting the power fail, the server detecting it and deciding to shut
+ * down from its log, and the shutdownCommand hook, which writes to a FIFO
+ * instead of powering off. Cancel runs restore power during shutdownDelay
+ * and expect the shutdown to be cancelled without the hook running.
+ *
+ * With -a the server built with ALLOC_CHECK=1 is polled at its fastest rate
+ * instead and must not abort on a heap allocation in the update path.
+ */
+
+#define BICKER_SOH 0x01
+#define BICKER_EOT 0x04
+#define PHASE_TIMEOUT 10000 // ms for each expected step
+
+enum
+{
+    BICKER_SHORT,
+    BICKER_BYTE,
+    BICKER_LONG,
+    BICKER_STRING
+};
+
+typedef enum
+{
+#define X(name, code, index, type) name = code,
+    BICKER_REGISTERS(X)
+#undef X
+} cmd_list_t;
+
+typedef enum
+{
+    EV_SERIAL, // UPS answered a device status read with the power fail
+    EV_DETECT, // "Power fail detected"
+    EV_DECIDE, // "Initiating shutdown"
+    EV_ACTION, // shutdownCommand hook ran
+    EV_GOOD,   // "Power good detected"
+    EV_CANCEL, // "Shutdown cancelled"
+    EV_EXIT,   // Server process ended
+    EV_COUNT
+} event_t;
+
+/**
+ * Collected latencies, nanoseconds.
+ */
+struct samples
+{
+    int64_t v[1024];
+    size_t n;
+};
+
+static struct
+{
+    const char *server;
+    int runs;
+    int port;
+    int delay;     // shutdownDelay, seconds
+    int cancel_ms; // Power returns this long after the shutdown decision
+    double max_ms; // Fail when the total exceeds this, 0 for no limit
+    bool verbose;
+    const char *output;
+    int alloc_polls; // Steady state polls of the allocation check, 0 for latency runs
+} opt = {"server/ups-server", 10, 10124, 2, 500, 0.0, false, NULL, 0};
+
+static struct
+{
+    char dir[64];
+    char config[128];
+    char hook[128];
+    char pts[64];
+    int master;
+    int slave; // Kept open, the master reads EIO while no one has the slave open
+    int hook_fd;
+    int hook_wfd; // Keeps the FIFO from reporting hangup after each hook
+    pid_t pid;
+    int status; // Wait status of the ended server
+    bool alloc_abort; // Server logged an allocation check failure
+    int err_fd;
+    char err[4096];
+    size_t err_len;
+    unsigned char rx[256];
+    size_t rx_len;
+    bool power;
+    unsigned long soc_reads; // Full polls read the state of charge
+} sim = {.master = -1, .slave = -1, .hook_fd = -1, .hook_wfd = -1, .err_fd = -1};
+
+static int64_t ev_time[EV_COUNT]; // Monotonic ns, 0 while not seen in this run
+static struct samples serial, detect, decide, action, total, cancel;
+static int failures = 0;
+
+static int64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void sample_add(struct samples *s, int64_t v)
+{
+    if (s->n < sizeof s->v / sizeof s->v[0])
+    {
+        s->v[s->n++] = v;
+    }
+}
+
+static int cmp_int64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Response type of a register.
+ */
+static int register_type(int cmd)
+{
+    switch (cmd)
+    {
+#define X(name, code, index, type) \
+    case code:                     \
+        return type;
+        BICKER_REGISTERS(X)
+#undef X
+    }
+    return BICKER_SHORT;
+}
+
+/**
+ * Register value of the simulated UPS, strings in *str.
+ */
+static int register_value(int cmd, const char **str)
+{
+    bool p = sim.power;
+    *str = "";
+    switch (cmd)
+    {
+    case GET_DEVICE_STATUS:
+        return p ? 0x0C : 0x0A; // Power and battery present, or discharging
+    case GET_MONITOR_STATUS_REGISTER:
+        return p ? 0x0020 : 0x0800; // Power good or power fail
+    case GET_INPUT_VOLTAGE1:
+        return p ? 24000 : 0;
+    case GET_INPUT_CURRENT1:
+        return p ? 500 : 0;
+    case GET_OUTPUT_VOLTAGE1:
+        return 24000;
+    case GET_OUTPUT_CURRENT1:
+        return 400;
+    case GET_BATTERY_VOLTAGE:
+        return 12000;
+    case GET_BATTERY_CURRENT:
+        return p ? 0 : -800;
+    case GET_SOC:
+        return 100;
+    case GET_VCAP1_VOLTAGE:
+    case GET_VCAP2_VOLTAGE:
+    case GET_VCAP3_VOLTAGE:
+    case GET_VCAP4_VOLTAGE:
+        return 2500;
+    case GET_CAP_STACK_VOLTAGE:
+        return 10000;
+    case GET_LTC3350_TEMPERATURE:
+        return 30;
+    case GET_BATTERY_TEMPERATURE:
+        return 25;
+    case GET_CAPACITY:
+        return 3000;
+    case GET_ESR:
+        return 50;
+    case GET_SERIES:
+        *str = "UPSIC-1205";
+        return 0;
+    case GET_BATTERY_TYPE:
+        *str = "DS-CAP";
+        return 0;
+    case GET_FIRMWARE:
+        *str = "SIM";
+        return 0;
+    case GET_MANUFACTURER:
+        *str = "Bicker";
+        return 0;
+    case GET_HARDWARE_REVISION:
+        *str = "1";
+        return 0;
+    default:
+        return 0;
+    }
+}
+
+/**
+ * Answer one request frame {SOH, 3, index, cmd, EOT}.
+ */
+static void serial_answer(int index, int cmd)
+{
+    unsigned char f[64];
+    const char *str;
+    int v = register_value(cmd, &str);
+    size_t n = 0;
+
+    f[n++] = BICKER_SOH;
+    f[n++] = 0; // Size, counts the bytes after it
+    f[n++] = (unsigned char)index;
+    f[n++] = (unsigned char)cmd;
+    switch (register_type(cmd))
+    {
+    case BICKER_BYTE:
+        f[n++] = (unsigned char)v;
+        break;
+    case BICKER_LONG:
+        for (int i = 0; i < 4; i++)
+            f[n++] = (unsigned char)(v >> (8 * i));
+        break;
+    case BICKER_STRING:
+        memcpy(&f[n], str, strlen(str));
+        n += strlen(str);
+        break;
+    default:
+        f[n++] = (unsigned char)v;
+        f[n++] = (unsigned char)(v >> 8);
+        break;
+    }
+    f[n++] = BICKER_EOT;
+    f[1] = (unsigned char)(n - 2);
+    if (write(sim.master, f, n) != (ssize_t)n)
+    {
+        fprintf(stderr, "pty write: %s\n", strerror(errno));
+    }
+    if (cmd == GET_DEVICE_STATUS && !sim.power && ev_time[EV_SERIAL] == 0)
+    {
+        ev_time[EV_SERIAL] = now_ns();
+    }
+    if (cmd == GET_SOC)
+    {
+        sim.soc_reads++;
+    }
+}
+
+static void serial_receive(void)
+{
+    ssize_t len = read(sim.master, &sim.rx[sim.rx_len], sizeof sim.rx - sim.rx_len);
+    if (len <= 0)
+    {
+        return;
+    }
+    sim.rx_len += (size_t)len;
+    size_t used = 0;
+    while (sim.rx_len - used >= 5)
+    {
+        unsigned char *p = &sim.rx[used];
+        if (p[0] != BICKER_SOH || p[1] != 3 || p[4] != BICKER_EOT)
+        {
+            used++; // Resync
+            continue;
+        }
+        serial_answer(p[2], p[3]);
+        used += 5;
+    }
+    memmove(sim.rx, &sim.rx[used], sim.rx_len - used);
+    sim.rx_len -= used;
+}
+
+/**
+ * Timestamp the server log lines the harness waits for.
+ */
+static void log_receive(void)
+{
+    static const struct
+    {
+        const char *text;
+        event_t ev;
+    } marks[] = {
+        {"Power fail detected", EV_DETECT},
+        {"Initiating shutdown", EV_DECIDE},
+        {"Power good detected", EV_GOOD},
+        {"Shutdown cancelled", EV_CANCEL}};
+
+    ssize_t len = read(sim.err_fd, &sim.err[sim.err_len], sizeof sim.err - sim.err_len - 1);
+    if (len <= 0)
+    {
+        close(sim.err_fd);
+        sim.err_fd = -1;
+        return;
+    }
+    int64_t t = now_ns();
+    sim.err_len += (size_t)len;
+    sim.err[sim.err_len] = '\0';
+    char *line = sim.err, *end;
+    while ((end = strchr(line, '\n')) != NULL)
+    {
+        *end = '\0';
+        if (opt.verbose)
+            fprintf(stderr, "server: %s\n", line);
+        if (strstr(line, "Allocation check") != NULL)
+        {
+            fprintf(stderr, "server: %s\n", line);
+            sim.alloc_abort = true;
+        }
+        for (size_t i = 0; i < sizeof marks / sizeof marks[0]; i++)
+        {
+            if (strstr(line, marks[i].text) != NULL && ev_time[marks[i].ev] == 0)
+                ev_time[marks[i].ev] = t;
+        }
+        line = end + 1;
+    }
+    sim.err_len -= (size_t)(line - sim.err);
+    memmove(sim.err, line, sim.err_len);
+    if (sim.err_len == sizeof sim.err - 1)
+        sim.err_len = 0; // Overlong line
+}
+
+/**
+ * Serve the UPS, read the server log and the hook for up to timeout_ms.
+ * Returns early once ev has been seen, EV_COUNT to wait the full time.
+ */
+static bool pump(event_t ev, int timeout_ms)
+{
+    int64_t end = now_ns() + (int64_t)timeout_ms * 1000000LL;
+    for (;;)
+    {
+        if (ev < EV_COUNT && ev_time[ev] != 0)
+            return true;
+        int64_t left = (end - now_ns()) / 1000000LL;
+        if (left < 0)
+            return false;
+        struct pollfd pfd[3] = {{sim.master, POLLIN, 0}, {sim.hook_fd, POLLIN, 0}, {sim.err_fd, POLLIN, 0}};
+        int n = poll(pfd, sim.err_fd >= 0 ? 3 : 2, left > 10 ? 10 : (int)left);
+        if (n < 0 && errno != EINTR)
+            return false;
+        if (pfd[0].revents & POLLIN)
+            serial_receive();
+        if (pfd[1].revents & POLLIN)
+        {
+            char buf[64];
+            if (read(sim.hook_fd, buf, sizeof buf) > 0 && ev_time[EV_ACTION] == 0)
+                ev_time[EV_ACTION] = now_ns();
+        }
+        if (sim.err_fd >= 0 && (pfd[2].revents & (POLLIN | POLLHUP)))
+            log_receive();
+        if (sim.pid > 0 && waitpid(sim.pid, &sim.status, WNOHANG) == sim.pid)
+        {
+            sim.pid = 0;
+            ev_time[EV_EXIT] = now_ns();
+        }
+    }
+}
+
+/**
+ * Simulated UPS on a pty, hook FIFO and server configuration in a temporary directory.
+ */
+static bool sim_setup(void)
+{
+    struct termios tios;
+
+    strcpy(sim.dir, "/tmp/ups-powerfail.XXXXXX");
+    if (mkdtemp(sim.dir) == NULL)
+    {
+        perror("mkdtemp");
+        return false;
+    }
+    sim.master = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (sim.master < 0 || grantpt(sim.master) < 0 || unlockpt(sim.master) < 0 ||
+        ptsname_r(sim.master, sim.pts, sizeof sim.pts) != 0)
+    {
+        perror("pty");
+        return false;
+    }
+    sim.slave = open(sim.pts, O_RDWR | O_NOCTTY);
+    if (sim.slave < 0 || tcgetattr(sim.slave, &tios) < 0)
+    {
+        perror(sim.pts);
+        return false;
+    }
+    cfmakeraw(&tios);
+    tcsetattr(sim.slave, TCSANOW, &tios);
+
+    snprintf(sim.hook, sizeof sim.hook, "%s/hook", sim.dir);
+    if (mkfifo(sim.hook, 0600) < 0 || (sim.hook_fd = open(sim.hook, O_RDONLY | O_NONBLOCK)) < 0 ||
+        (sim.hook_wfd = open(sim.hook, O_WRONLY)) < 0)
+    {
+        perror(sim.hook);
+        return false;
+    }
+
+    snprintf(sim.config, sizeof sim.config, "%s/ups-server.cfg", sim.dir);
+    FILE *fp = fopen(sim.config, "w");
+    if (fp == NULL)
+    {
+        perror(sim.config);
+        return false;
+    }
+    fprintf(fp,
+            "server = {\n"
+            "    ip = \"127.0.0.1\"; port = %d; serial = \"%s\"; daemonize = false;\n"
+            "    shutdownByTime = true; shutdownDelay = %d; shutdownCommand = \"echo >%s\";\n"
+            "    eventLog = \"%s/event.log\"; stateFile = \"\"; clientPath = \"%s\";\n"
+            "};\n"
+            "ups = { inputVoltage = 24.0; batteryVoltage = 12.0; maxAmps = 5; };\n"
+            "recorder = { enable = false; };\n"
+            "health = { schedule = false; path = \"\"; };\n",
+            opt.port, sim.pts, opt.delay, sim.hook, sim.dir, sim.dir);
+    if (opt.alloc_polls > 0)
+    {
+        fprintf(fp, "poll = { fastInterval = 50; normalInterval = 50; slowInterval = 50; checkInterval = 20; slowCheckInterval = 20; };\n");
+    }
+    fclose(fp);
+    sim.power = true;
+    return true;
+}
+
+static void sim_cleanup(void)
+{
+    char path[160];
+    if (sim.pid > 0)
+    {
+        kill(sim.pid, SIGTERM);
+        waitpid(sim.pid, NULL, 0);
+    }
+    unlink(sim.config);
+    unlink(sim.hook);
+    snprintf(path, sizeof path, "%s/event.log", sim.dir);
+    unlink(path);
+    rmdir(sim.dir);
+}
+
+/**
+ * Start the server and wait for two full polls.
+ */
+static bool server_start(void)
+{
+    int fds[2];
+    char arg[160];
+
+    if (pipe2(fds, O_CLOEXEC) < 0)
+        return false;
+    snprintf(arg, sizeof arg, "--config=%s", sim.config);
+    sim.pid = fork();
+    if (sim.pid == 0)
+    {
+        int null = open("/dev/null", O_RDWR);
+        dup2(null, STDIN_FILENO);
+        dup2(null, STDOUT_FILENO);
+        dup2(fds[1], STDERR_FILENO);
+        execl(opt.server, opt.server, arg, (char *)NULL);
+        _exit(127);
+    }
+    close(fds[1]);
+    if (sim.pid < 0)
+    {
+        close(fds[0]);
+        return false;
+    }
+    if (sim.err_fd >= 0)
+        close(sim.err_fd);
+    sim.err_fd = fds[0];
+    sim.err_len = 0;
+    fcntl(sim.err_fd, F_SETFL, O_NONBLOCK);
+    return true;
+}
+
+static bool server_ready(void)
+{
+    unsigned long polls = sim.soc_reads + 2;
+    int64_t end = now_ns() + PHASE_TIMEOUT * 1000000LL;
+    while (sim.soc_reads < polls && sim.pid > 0 && now_ns() < end)
+    {
+        pump(EV_COUNT, 10);
+    }
+    return sim.soc_reads >= polls;
+}
+
+static void run_failed(const char *scenario, int run, const char *what)
+{
+    fprintf(stderr, "%s run %d: %s\n", scenario, run + 1, what);
+    failures++;
+}
+
+/**
+ * Power fails and stays off until the hook ran and the server exited.
+ */
+static void run_poweroff(int run)
+{
+    if (sim.pid == 0 && !server_start())
+    {
+        run_failed("poweroff", run, "server not started");
+        return;
+    }
+    if (!server_ready())
+    {
+        run_failed("poweroff", run, "server not polling");
+        return;
+    }
+    pump(EV_COUNT, rand() % 1000); // Random phase against the poll cycle
+    memset(ev_time, 0, sizeof ev_time);
+    int64_t t0 = now_ns();
+    sim.power = false;
+    bool ok = pump(EV_ACTION, opt.delay * 1000 + PHASE_TIMEOUT);
+    int64_t delay = (int64_t)opt.delay * 1000000000LL;
+    if (!ok || ev_time[EV_SERIAL] == 0 || ev_time[EV_DETECT] == 0 || ev_time[EV_DECIDE] == 0)
+    {
+        run_failed("poweroff", run, ev_time[EV_DECIDE] ? "hook not run" : ev_time[EV_DETECT] ? "no shutdown" : "power fail not detected");
+    }
+    else
+    {
+        sample_add(&serial, ev_time[EV_SERIAL] - t0);
+        sample_add(&detect, ev_time[EV_DETECT] - t0);
+        sample_add(&decide, ev_time[EV_DECIDE] - ev_time[EV_DETECT]);
+        sample_add(&action, ev_time[EV_ACTION] - ev_time[EV_DECIDE] - delay);
+        sample_add(&total, ev_time[EV_ACTION] - t0 - delay);
+    }
+    if (!pump(EV_EXIT, PHASE_TIMEOUT) && sim.pid > 0)
+    {
+        run_failed("poweroff", run, "server did not exit");
+        kill(sim.pid, SIGKILL);
+        waitpid(sim.pid, NULL, 0);
+        sim.pid = 0;
+    }
+    sim.power = true;
+}
+
+/**
+ * Power returns during the shutdown delay, the hook must not run.
+ */
+static void run_cancel(int run)
+{
+    if (sim.pid == 0 && !server_start())
+    {
+        run_failed("cancel", run, "server not started");
+        return;
+    }
+    if (!server_ready())
+    {
+        run_failed("cancel", run, "server not polling");
+        return;
+    }
+    pump(EV_COUNT, rand() % 1000);
+    memset(ev_time, 0, sizeof ev_time);
+    sim.power = false;
+    if (!pump(EV_DECIDE, PHASE_TIMEOUT))
+    {
+        run_failed("cancel", run, "no shutdown");
+        sim.power = true;
+        return;
+    }
+    pump(EV_ACTION, opt.cancel_ms);
+    int64_t t1 = now_ns();
+    sim.power = true;
+    if (!pump(EV_CANCEL, PHASE_TIMEOUT))
+    {
+        run_failed("cancel", run, "shutdown not cancelled");
+    }
+    else
+    {
+        sample_add(&cancel, ev_time[EV_CANCEL] - t1);
+    }
+    // The hook would have run by now
+    pump(EV_ACTION, opt.delay * 1000 + 500);
+    if (ev_time[EV_ACTION] != 0)
+    {
+        run_failed("cancel", run, "hook ran after power returned");
+    }
+}
+
+/**
+ * Poll the allocation checking server in steady state, it aborts on any
+ * allocation after its warmup.
+ */
+static void run_alloc(void)
+{
+    if (!server_start())
+    {
+        run_failed("alloccheck", 0, "server not started");
+        return;
+    }
+    unsigned long polls = sim.soc_reads + (unsigned long)opt.alloc_polls;
+    int64_t end = now_ns() + ((int64_t)opt.alloc_polls * 1000 + PHASE_TIMEOUT) * 1000000LL;
+    while (sim.soc_reads < polls && sim.pid > 0 && now_ns() < end)
+    {
+        pump(EV_COUNT, 10);
+    }
+    if (sim.pid == 0)
+    {
+        run_failed("alloccheck", 0, WIFSIGNALED(sim.status) && WTERMSIG(sim.status) == SIGABRT
+                                        ? "server aborted on a heap allocation"
+                                        : "server ended");
+        return;
+    }
+    if (sim.soc_reads < polls)
+    {
+        run_failed("alloccheck", 0, "server not polling");
+    }
+    kill(sim.pid, SIGTERM);
+    waitpid(sim.pid, &sim.status, 0);
+    sim.pid = 0;
+    if (sim.alloc_abort)
+    {
+        run_failed("alloccheck", 0, "heap allocation in the update path");
+    }
+}
+
+static void report_samples(FILE *out, const char *name, struct samples *s, bool last)
+{
+    fprintf(out, "\"%s\":{\"count\":%zu", name, s->n);
+    if (s->n > 0)
+    {
+        qsort(s->v, s->n, sizeof(int64_t), cmp_int64);
+        fprintf(out, ",\"p50\":%.3f,\"p99\":%.3f,\"max\":%.3f",
+                s->v[(s->n * 50 + 99) / 100 - 1] / 1e6,
+                s->v[(s->n * 99 + 99) / 100 - 1] / 1e6,
+                s->v[s->n - 1] / 1e6);
+    }
+    fprintf(out, "}%s", last ? "" : ",");
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -s path      Server binary, default server/ups-server\n"
+            "  -r runs      Runs of each scenario, default 10\n"
+            "  -p port      Server port, default 10124\n"
+            "  -d seconds   shutdownDelay, default 2\n"
+            "  -c ms        Power returns this long after the shutdown decision, default 500\n"
+            "  -m ms        Fail when a power fail to hook time exceeds this\n"
+            "  -o file      Write the JSON report to file instead of stdout\n"
+            "  -a polls     Allocation check of an ALLOC_CHECK=1 server over polls\n"
+            "  -v           Show the server log\n",
+            name);
+}
+
+int main(int argc, char **argv)
+{
+    int c;
+    while ((c = getopt(argc, argv, "s:r:p:d:c:m:o:a:v")) != -1)
+    {
+        switch (c)
+        {
+        case 's':
+            opt.server = optarg;
+            break;
+        case 'r':
+            opt.runs = atoi(optarg);
+            break;
+        case 'p':
+            opt.port = atoi(optarg);
+            break;
+        case 'd':
+            opt.delay = atoi(optarg);
+            break;
+        case 'c':
+            opt.cancel_ms = atoi(optarg);
+            break;
+        case 'm':
+            opt.max_ms = atof(optarg);
+            break;
+        case 'o':
+            opt.output = optarg;
+            break;
+        case 'a':
+            opt.alloc_polls = atoi(optarg);
+            break;
+        case 'v':
+            opt.verbose = true;
+            break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (opt.alloc_polls < 0 || opt.runs < 0 || opt.runs > 1024 || opt.delay < 1 || opt.cancel_ms < 0 || opt.cancel_ms >= opt.delay * 1000)
+    {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    srand((unsigned int)now_ns());
+    if (!sim_setup())
+    {
+        sim_cleanup();
+        return EXIT_FAILURE;
+    }
+
+    if (opt.alloc_polls > 0)
+    {
+        run_alloc();
+        sim_cleanup();
+        printf("{\"polls\":%d,\"failures\":%d}\n", opt.alloc_polls, failures);
+        return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    // Cancel runs share one server, every poweroff run ends it
+    for (int i = 0; i < opt.runs; i++)
+    {
+        run_cancel(i);
+    }
+    for (int i = 0; i < opt.runs; i++)
+    {
+        run_poweroff(i);
+    }
+    sim_cleanup();
+
+    FILE *out = stdout;
+    if (opt.output != NULL && (out = fopen(opt.output, "w")) == NULL)
+    {
+        fprintf(stderr, "%s: %s\n", opt.output, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    fprintf(out, "{\"runs\":%d,\"shutdownDelay\":%d,\"failures\":%d,", opt.runs, opt.delay, failures);
+    report_samples(out, "serialMs", &serial, false);
+    report_samples(out, "detectMs", &detect, false);
+    report_samples(out, "decideMs", &decide, false);
+    report_samples(out, "actionMs", &action, false);
+    report_samples(out, "totalMs", &total, false);
+    report_samples(out, "cancelMs", &cancel, true);
+    fprintf(out, "}\n");
+    if (out != stdout)
+    {
+        fclose(out);
+    }
+    if (opt.max_ms > 0 && total.n > 0 && total.v[total.n - 1] / 1e6 > opt.max_ms)
+    {
+        fprintf(stderr, "Power fail to hook %.3f ms exceeds %.3f ms\n", total.v[total.n - 1] / 1e6, opt.max_ms);
+        failures++;
+    }
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}